@@ -0,0 +1,589 @@
+/*
+ * Вспомогательная утилита для make bench (см. bench/run.sh)
+ *
+ *	pitbench gen [-l lineLength][-n lines][-r linesPerSecond]
+ *		пишет в stdout строки вида "<16 цифр - время в мкс> xxx...\n"
+ *	pitbench sink statsFile
+ *		читает stdin, считает байты, строки и задержку от gen до sink
+ *	pitbench wrap statsFile command [args...]
+ *		запускает команду и сохраняет её read/write-вызовы (/proc/<pid>/io) и время CPU
+ *	pitbench now
+ *		текущее время в мкс, по тем же часам что и gen
+ *	pitbench report -S startMicro statsFiles...
+ *		сводит файлы статистики в одну строку TSV
+ *	pitbench api [-s chunkSize][-l lineLength][-n lines][-b] dir
+ *		гоняет WStream/RStream внутри процесса, без пайпов и pit
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "WStream.h"
+#include "RStream.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define STAMP_LENGTH 16
+
+/* минимальная строка: метка, пробел и '\n' */
+#define MIN_LINE_LENGTH (STAMP_LENGTH + 2)
+
+#define IO_BUFFER_SIZE (256 * 1024)
+
+/*
+ * гистограмма задержек: первые 16 корзин по 1 мкс,
+ * дальше на каждую степень двойки по 16 корзин
+ */
+#define HIST_SUB_BUCKETS 16
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct Stats {
+	uint64_t bytes;
+	uint64_t lines;
+	uint64_t samples;
+	uint64_t firstMicro;
+	uint64_t lastMicro;
+
+	uint64_t syscalls;
+	uint64_t cpuMicro;
+
+	uint64_t hist[HIST_BUCKETS];
+};
+
+static char IO_BUFFER[IO_BUFFER_SIZE];
+
+static uint64_t nowMicro() {
+	struct timespec ts;
+
+	/* CLOCK_MONOTONIC общий для всех процессов, в отличии от gettimeofday() не прыгает */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static unsigned histBucket(uint64_t v) {
+	unsigned msb;
+
+	if(v < HIST_SUB_BUCKETS)
+		return (unsigned)v;
+
+	msb = 63 - (unsigned)__builtin_clzll(v);
+
+	return (msb - 3) * HIST_SUB_BUCKETS + (unsigned)((v >> (msb - 4)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * @return нижняя граница корзины
+ */
+static uint64_t histBucketValue(unsigned bucket) {
+	unsigned msb;
+
+	if(bucket < HIST_SUB_BUCKETS)
+		return bucket;
+
+	msb = bucket / HIST_SUB_BUCKETS + 3;
+
+	return ((uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS)) << (msb - 4);
+}
+
+static uint64_t histPercentile(const struct Stats *st, double q) {
+	uint64_t need = (uint64_t)((double)st->samples * q);
+	uint64_t seen = 0;
+	unsigned i;
+
+	if(!st->samples)
+		return 0;
+
+	if(need >= st->samples)
+		need = st->samples - 1;
+
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		seen += st->hist[i];
+
+		if(seen > need)
+			return histBucketValue(i);
+	}
+
+	return histBucketValue(HIST_BUCKETS - 1);
+}
+
+static void writeAll(int fd, const char *buf, size_t len) {
+	while(len) {
+		ssize_t wr = write(fd, buf, len);
+
+		if(wr <= 0) {
+			if(wr == -1 && errno == EINTR)
+				continue;
+
+			error("write(#%d)", fd);
+		}
+
+		buf += wr;
+		len -= (size_t)wr;
+	}
+}
+
+/**
+ * Заполняет буфер строками с текущим временем
+ * @return сколько строк поместилось
+ */
+static size_t fillLines(char *buf, size_t bufSize, size_t lineLength, uint64_t maxLines) {
+	uint64_t now = nowMicro();
+	char stamp[STAMP_LENGTH + 2];
+	size_t n;
+
+	snprintf(stamp, sizeof(stamp), "%016" PRIu64 " ", now);
+
+	for(n = 0; n < maxLines && (n + 1) * lineLength <= bufSize; n++) {
+		char *line = buf + n * lineLength;
+
+		memcpy(line, stamp, STAMP_LENGTH + 1);
+		line[lineLength - 1] = '\n';
+	}
+
+	return n;
+}
+
+static void prepareLines(char *buf, size_t bufSize) {
+	memset(buf, 'x', bufSize);
+}
+
+static void genMode(size_t lineLength, uint64_t lines, uint64_t rate) {
+	uint64_t sent = 0;
+	uint64_t start = nowMicro();
+
+	prepareLines(IO_BUFFER, sizeof(IO_BUFFER));
+
+	while(sent < lines) {
+		uint64_t toSend = lines - sent;
+		size_t n;
+
+		if(rate) {
+			uint64_t due = (nowMicro() - start) * rate / 1000000 + 1;
+
+			if(due <= sent) {
+				usleep((useconds_t)(1000000 / rate ? 1000000 / rate : 1));
+				continue;
+			}
+
+			if(due - sent < toSend)
+				toSend = due - sent;
+		}
+
+		n = fillLines(IO_BUFFER, sizeof(IO_BUFFER), lineLength, toSend);
+		writeAll(STDOUT_FILENO, IO_BUFFER, n * lineLength);
+
+		sent += n;
+	}
+}
+
+/**
+ * Разбирает метку в начале строки, если строка начинается с неё.
+ * В бинарном режиме строки режутся где угодно, обрывки просто пропускаем
+ */
+static char parseStamp(const char *line, uint64_t *stamp) {
+	uint64_t v = 0;
+	int i;
+
+	for(i = 0; i < STAMP_LENGTH; i++) {
+		if(line[i] < '0' || line[i] > '9')
+			return 0;
+
+		v = v * 10 + (uint64_t)(line[i] - '0');
+	}
+
+	if(line[STAMP_LENGTH] != ' ')
+		return 0;
+
+	*stamp = v;
+
+	return 1;
+}
+
+static void writeStats(const char *path, const struct Stats *st) {
+	FILE *f = fopen(path, "w");
+	unsigned i;
+
+	if(!f)
+		error("fopen('%s')", path);
+
+	fprintf(f, "bytes %" PRIu64 "\n", st->bytes);
+	fprintf(f, "lines %" PRIu64 "\n", st->lines);
+	fprintf(f, "samples %" PRIu64 "\n", st->samples);
+	fprintf(f, "first %" PRIu64 "\n", st->firstMicro);
+	fprintf(f, "last %" PRIu64 "\n", st->lastMicro);
+	fprintf(f, "syscalls %" PRIu64 "\n", st->syscalls);
+	fprintf(f, "cpu %" PRIu64 "\n", st->cpuMicro);
+
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		if(st->hist[i])
+			fprintf(f, "hist %u %" PRIu64 "\n", i, st->hist[i]);
+	}
+
+	if(fclose(f) != 0)
+		error("fclose('%s')", path);
+}
+
+/**
+ * Добавляет файл статистики к st
+ */
+static void readStats(const char *path, struct Stats *st) {
+	FILE *f = fopen(path, "r");
+	char key[32];
+	uint64_t v;
+
+	if(!f)
+		error("fopen('%s')", path);
+
+	while(fscanf(f, "%31s %" SCNu64, key, &v) == 2) {
+		if(!strcmp(key, "bytes")) {
+			st->bytes += v;
+		} else if(!strcmp(key, "lines")) {
+			st->lines += v;
+		} else if(!strcmp(key, "samples")) {
+			st->samples += v;
+		} else if(!strcmp(key, "first")) {
+			if(v && (!st->firstMicro || v < st->firstMicro))
+				st->firstMicro = v;
+		} else if(!strcmp(key, "last")) {
+			if(v > st->lastMicro)
+				st->lastMicro = v;
+		} else if(!strcmp(key, "syscalls")) {
+			st->syscalls += v;
+		} else if(!strcmp(key, "cpu")) {
+			st->cpuMicro += v;
+		} else if(!strcmp(key, "hist")) {
+			uint64_t count;
+
+			if(fscanf(f, "%" SCNu64, &count) != 1 || v >= HIST_BUCKETS)
+				error("malformed histogram in '%s'", path);
+
+			st->hist[v] += count;
+		}
+	}
+
+	fclose(f);
+}
+
+static void sinkMode(const char *statsPath) {
+	static struct Stats st;
+	/* начало текущей строки, может быть разрезано между двумя read() */
+	char head[STAMP_LENGTH + 1];
+	size_t headLen = 0;
+	char collecting = 1;
+
+	for(;;) {
+		ssize_t rd = read(STDIN_FILENO, IO_BUFFER, sizeof(IO_BUFFER));
+		uint64_t now;
+		char *p;
+		char *end;
+
+		if(rd == -1) {
+			if(errno == EINTR)
+				continue;
+
+			error("read(STDIN)");
+		}
+
+		if(rd == 0)
+			break;
+
+		now = nowMicro();
+
+		if(!st.firstMicro)
+			st.firstMicro = now;
+
+		st.lastMicro = now;
+		st.bytes += (uint64_t)rd;
+
+		p = IO_BUFFER;
+		end = IO_BUFFER + rd;
+
+		while(p < end) {
+			char *lineEnd;
+
+			if(collecting) {
+				size_t n = sizeof(head) - headLen;
+				char *nl;
+
+				if(n > (size_t)(end - p))
+					n = (size_t)(end - p);
+
+				nl = memchr(p, '\n', n);
+				if(nl)
+					n = (size_t)(nl - p);
+
+				memcpy(head + headLen, p, n);
+				headLen += n;
+				p += n;
+
+				if(headLen == sizeof(head)) {
+					uint64_t stamp;
+
+					if(parseStamp(head, &stamp)) {
+						st.hist[histBucket(now > stamp ? now - stamp : 0)]++;
+						st.samples++;
+					}
+
+					collecting = 0;
+				} else if(nl) {
+					collecting = 0;
+				}
+			}
+
+			lineEnd = memchr(p, '\n', (size_t)(end - p));
+			if(!lineEnd)
+				break;
+
+			st.lines++;
+			headLen = 0;
+			collecting = 1;
+			p = lineEnd + 1;
+		}
+	}
+
+	writeStats(statsPath, &st);
+}
+
+static uint64_t procIoSyscalls(pid_t pid) {
+	char path[64];
+	char key[32];
+	uint64_t v;
+	uint64_t total = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%ld/io", (long)pid);
+
+	f = fopen(path, "r");
+	if(!f) {
+		warning("fopen('%s'): %s", path, strerror(errno));
+		return 0;
+	}
+
+	while(fscanf(f, "%31s %" SCNu64, key, &v) == 2) {
+		if(!strcmp(key, "syscr:") || !strcmp(key, "syscw:"))
+			total += v;
+	}
+
+	fclose(f);
+
+	return total;
+}
+
+static int wrapMode(const char *statsPath, char **argv) {
+	static struct Stats st;
+	struct rusage ru;
+	siginfo_t info;
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if(pid == -1)
+		error("fork()");
+
+	if(pid == 0) {
+		execvp(argv[0], argv);
+		error("execvp('%s')", argv[0]);
+	}
+
+	/* процесс остаётся зомби, пока мы читаем его /proc/<pid>/io */
+	while(waitid(P_PID, (id_t)pid, &info, WEXITED | WNOWAIT) == -1) {
+		if(errno != EINTR)
+			error("waitid(%ld)", (long)pid);
+	}
+
+	st.syscalls = procIoSyscalls(pid);
+
+	while(wait4(pid, &status, 0, &ru) == -1) {
+		if(errno != EINTR)
+			error("wait4(%ld)", (long)pid);
+	}
+
+	st.cpuMicro =
+		(uint64_t)ru.ru_utime.tv_sec * 1000000 + (uint64_t)ru.ru_utime.tv_usec
+		+ (uint64_t)ru.ru_stime.tv_sec * 1000000 + (uint64_t)ru.ru_stime.tv_usec
+	;
+
+	writeStats(statsPath, &st);
+
+	if(WIFEXITED(status))
+		return WEXITSTATUS(status);
+
+	return 128 + WTERMSIG(status);
+}
+
+static void reportMode(uint64_t start, int numFiles, char **files) {
+	static struct Stats st;
+	double seconds;
+	double mb;
+	int i;
+
+	for(i = 0; i < numFiles; i++)
+		readStats(files[i], &st);
+
+	seconds = st.lastMicro > start ? (double)(st.lastMicro - start) / 1e6 : 0;
+	mb = (double)st.bytes / (1024 * 1024);
+
+	printf(
+		"%.1f\t%.0f\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%.1f\t%.2f\n",
+		seconds > 0 ? mb / seconds : 0,
+		seconds > 0 ? (double)st.lines / seconds : 0,
+		histPercentile(&st, 0.5),
+		histPercentile(&st, 0.99),
+		histPercentile(&st, 0.999),
+		mb > 0 ? (double)st.syscalls / mb : 0,
+		mb > 0 ? (double)st.cpuMicro / 1000 / mb : 0
+	);
+}
+
+/**
+ * Пишет и читает поток через WStream/RStream в одном процессе:
+ * скорость самой библиотеки без пайпов и второго процесса
+ */
+static void apiMode(const char *dir, ssize_t chunkSize, size_t lineLength, uint64_t lines, char binaryMode) {
+	struct WStream ws;
+	struct RStream rs;
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t writeStart, readStart, end;
+	ssize_t rd;
+
+	prepareLines(IO_BUFFER, sizeof(IO_BUFFER));
+
+	writeStart = nowMicro();
+
+	WStream_init(&ws, dir, chunkSize);
+
+	while(sent < lines) {
+		size_t n = fillLines(IO_BUFFER, sizeof(IO_BUFFER), lineLength, lines - sent);
+
+		if(binaryMode)
+			WStream_write(&ws, IO_BUFFER, (ssize_t)(n * lineLength));
+		else
+			WStream_writeLines(&ws, IO_BUFFER, (ssize_t)(n * lineLength));
+
+		sent += n;
+	}
+
+	WStream_flush(&ws);
+	WStream_destroy(&ws);
+
+	readStart = nowMicro();
+
+	RStream_init(&rs, dir, 0, 0);
+
+	while((rd = RStream_read(&rs, IO_BUFFER, sizeof(IO_BUFFER))) > 0)
+		received += (uint64_t)rd;
+
+	RStream_destroy(&rs);
+
+	end = nowMicro();
+
+	if(received != sent * lineLength)
+		error("api: %" PRIu64 " bytes written, but %" PRIu64 " read", sent * lineLength, received);
+
+	printf(
+		"%.1f\t%.1f\n",
+		(double)received / (1024 * 1024) / ((double)(readStart - writeStart) / 1e6),
+		(double)received / (1024 * 1024) / ((double)(end - readStart) / 1e6)
+	);
+}
+
+static void printUsage(const char *cmd) {
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "\t%s gen [-l lineLength][-n lines][-r linesPerSecond]\n", cmd);
+	fprintf(stderr, "\t%s sink statsFile\n", cmd);
+	fprintf(stderr, "\t%s wrap statsFile command [args...]\n", cmd);
+	fprintf(stderr, "\t%s now\n", cmd);
+	fprintf(stderr, "\t%s report -S startMicro statsFiles...\n", cmd);
+	fprintf(stderr, "\t%s api [-s chunkSize][-l lineLength][-n lines][-b] dir\n", cmd);
+}
+
+int main(int argc, char *argv[]) {
+	const char *cmd = argv[0];
+	const char *mode;
+	unsigned long lineLength = 100;
+	unsigned long long lines = 100000;
+	unsigned long long rate = 0;
+	unsigned long long start = 0;
+	unsigned long chunkSize = 1024 * 1024;
+	char binaryMode = 0;
+	int opt;
+
+	if(argc < 2) {
+		printUsage(cmd);
+		return 255;
+	}
+
+	mode = argv[1];
+	argc--;
+	argv++;
+
+	if(!strcmp(mode, "wrap")) {
+		if(argc < 3) {
+			printUsage(cmd);
+			return 255;
+		}
+
+		return wrapMode(argv[1], argv + 2);
+	}
+
+	while((opt = getopt(argc, argv, "l:n:r:S:s:b")) != -1) {
+		switch(opt) {
+			case 'l':
+				lineLength = strtoul(optarg, NULL, 10);
+				if(lineLength < MIN_LINE_LENGTH || lineLength > IO_BUFFER_SIZE)
+					error("line length must be between %d and %d", MIN_LINE_LENGTH, IO_BUFFER_SIZE);
+			break;
+			case 'n':
+				lines = strtoull(optarg, NULL, 10);
+			break;
+			case 'r':
+				rate = strtoull(optarg, NULL, 10);
+			break;
+			case 'S':
+				start = strtoull(optarg, NULL, 10);
+			break;
+			case 's':
+				chunkSize = strtoul(optarg, NULL, 10);
+				if(!chunkSize || chunkSize >= SSIZE_MAX)
+					error("invalid chunk size");
+			break;
+			case 'b':
+				binaryMode = 1;
+			break;
+			default:
+				printUsage(cmd);
+				return 255;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if(!strcmp(mode, "gen")) {
+		genMode(lineLength, lines, rate);
+	} else if(!strcmp(mode, "sink") && argc == 1) {
+		sinkMode(argv[0]);
+	} else if(!strcmp(mode, "now")) {
+		printf("%" PRIu64 "\n", nowMicro());
+	} else if(!strcmp(mode, "report") && start && argc > 0) {
+		reportMode(start, argc, argv);
+	} else if(!strcmp(mode, "api") && argc == 1) {
+		apiMode(argv[0], (ssize_t)chunkSize, lineLength, lines, binaryMode);
+	} else {
+		printUsage(cmd);
+		return 255;
+	}
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+#!/bin/sh
+
+# Нагрузочный прогон pit по матрице параметров, запускается через make bench.
+# Результат - TSV в stdout, одна строка на набор параметров.
+#
+# Матрицу можно переопределить переменными окружения (значения через пробел):
+#	BENCH_WRITERS        количество писателей
+#	BENCH_READERS        количество читателей
+#	BENCH_CHUNK_SIZES    -s, байт
+#	BENCH_TIMEOUTS       -t, секунд
+#	BENCH_MODES          line, bin (-b), shm (-m, без -s и -t)
+#	BENCH_LINE_LENGTHS   длина строки, байт
+#	BENCH_RATES          строк в секунду на писателя, 0 - без ограничения
+# и одиночными значениями:
+#	BENCH_BYTES          сколько данных отдаёт каждый писатель без ограничения скорости (по умолчанию 32MiB)
+#	BENCH_SECONDS        сколько длится прогон с ограничением скорости (по умолчанию 2)
+#	BENCH_DIR            где создавать каталог потока (по умолчанию /tmp)
+#
+# Колонки:
+#	mb_per_s, lines_per_s     то, что получили читатели, от старта писателей до последнего read()
+#	p50_us, p99_us, p999_us   задержка от gen до sink, точность корзин гистограммы ~6%
+#	rw_syscalls_per_mb        read/write-вызовы всех pit (syscr + syscw из /proc/<pid>/io),
+#	                          splice() и io_uring туда не попадают
+#	cpu_ms_per_mb             user + system время всех pit
+#
+# В конце выводятся скорости записи и чтения через WStream/RStream внутри одного процесса
+
+cd "$(dirname "$0")/.."
+
+PIT=./pit
+BENCH=./bench/pitbench
+
+WRITERS=${BENCH_WRITERS:-"1 4"}
+READERS=${BENCH_READERS:-"1 4"}
+CHUNK_SIZES=${BENCH_CHUNK_SIZES:-"65536 1048576"}
+TIMEOUTS=${BENCH_TIMEOUTS:-"1"}
+MODES=${BENCH_MODES:-"line bin"}
+LINE_LENGTHS=${BENCH_LINE_LENGTHS:-"100"}
+RATES=${BENCH_RATES:-"0 20000"}
+BYTES=${BENCH_BYTES:-33554432}
+DURATION=${BENCH_SECONDS:-2}
+DIR=${BENCH_DIR:-/tmp}
+
+root="$DIR/___pitBench"
+tmp="$DIR/___pitBench.tmp"
+
+# $1 - файл, появление которого означает, что писатель уже держит лок
+waitFor() {
+	while [ ! -e "$1" ]; do
+		sleep 0.01
+	done
+}
+
+# writers readers chunkSize timeout mode lineLength rate
+runCell() {
+	w=$1
+	r=$2
+	size=$3
+	timeout=$4
+	mode=$5
+	lineLength=$6
+	rate=$7
+
+	case "$mode" in
+		line)
+			wopts="-s $size -t $timeout"
+			ropts=""
+			ready="$root/.index"
+		;;
+		bin)
+			wopts="-b -s $size -t $timeout"
+			ropts=""
+			ready="$root/.index"
+		;;
+		shm)
+			wopts="-m"
+			ropts="-m"
+			ready="$root/.shmring"
+		;;
+		*)
+			echo "unknown mode '$mode'" >&2
+			exit 1
+		;;
+	esac
+
+	if [ "$rate" = "0" ]; then
+		genOpts="-l $lineLength -n $(($BYTES / $lineLength))"
+	else
+		genOpts="-l $lineLength -n $(($rate * $DURATION)) -r $rate"
+	fi
+
+	rm -rf "$root" "$tmp"
+	mkdir "$tmp"
+	mkfifo "$tmp/hold"
+
+	# пустой писатель держит поток, пока не закончат настоящие,
+	# иначе читатель может застать поток без писателей и выйти раньше времени
+	$PIT $wopts -w "$root" < "$tmp/hold" &
+	exec 3> "$tmp/hold"
+
+	waitFor "$ready"
+
+	i=0
+	while [ $i -lt $r ]; do
+		$BENCH wrap "$tmp/reader.$i" $PIT $ropts -r "$root" 3>&- | $BENCH sink "$tmp/sink.$i" 3>&- &
+		i=$(($i + 1))
+	done
+
+	start=$($BENCH now)
+
+	writerPids=""
+	i=0
+	while [ $i -lt $w ]; do
+		$BENCH gen $genOpts 3>&- | $BENCH wrap "$tmp/writer.$i" $PIT $wopts -w "$root" 3>&- &
+		writerPids="$writerPids $!"
+		i=$(($i + 1))
+	done
+
+	wait $writerPids
+
+	exec 3>&-
+	wait
+
+	printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t" $w $r $size $timeout $mode $lineLength $rate
+	$BENCH report -S "$start" "$tmp"/sink.* "$tmp"/reader.* "$tmp"/writer.*
+
+	rm -rf "$root" "$tmp"
+}
+
+printf "writers\treaders\tchunk_size\ttimeout\tmode\tline_length\trate\tmb_per_s\tlines_per_s\tp50_us\tp99_us\tp999_us\trw_syscalls_per_mb\tcpu_ms_per_mb\n"
+
+for mode in $MODES; do
+	for lineLength in $LINE_LENGTHS; do
+		for w in $WRITERS; do
+			for r in $READERS; do
+				for rate in $RATES; do
+					if [ "$mode" = "shm" ]; then
+						runCell $w $r - - $mode $lineLength $rate
+						continue
+					fi
+
+					for size in $CHUNK_SIZES; do
+						for timeout in $TIMEOUTS; do
+							runCell $w $r $size $timeout $mode $lineLength $rate
+						done
+					done
+				done
+			done
+		done
+	done
+done
+
+echo
+printf "api_chunk_size\tapi_mode\tapi_line_length\tapi_write_mb_per_s\tapi_read_mb_per_s\n"
+
+for size in $CHUNK_SIZES; do
+	for mode in $MODES; do
+		case "$mode" in
+			line) apiOpts="" ;;
+			bin) apiOpts="-b" ;;
+			*) continue ;;
+		esac
+
+		for lineLength in $LINE_LENGTHS; do
+			rm -rf "$root"
+			printf "%s\t%s\t%s\t" $size $mode $lineLength
+			$BENCH api $apiOpts -s $size -l $lineLength -n $(($BYTES / $lineLength)) "$root"
+		done
+	done
+done
@@ -0,0 +1,255 @@
+#include "Backlog.h"
+#include "common.h"
+#include "Stripe.h"
+#include "Bucket.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+static void Backlog__scan(struct Backlog *bl, int ownChunkFd);
+static void Backlog__chunkPath(struct Backlog *bl, size_t dirNumber, const char *suffix, char *buf, size_t size);
+static uint64_t Backlog__scanDir(struct Backlog *bl, const char *dir, const char *bucket, const struct stat *own);
+static char Backlog__isOlder(const char *name, const char *than);
+
+void Backlog_init(struct Backlog *bl, const char *rootDir, const struct BacklogLimits *limits, struct ConsumerGroupList *groups) {
+	bl->rootDir = rootDir;
+	bl->limits = *limits;
+	bl->groups = groups;
+	bl->bytes = 0;
+	bl->chunks = 0;
+	bl->lastScanTimemicro = 0;
+	bl->oldest[0] = 0;
+}
+
+void Backlog_addChunk(struct Backlog *bl, uint64_t maxBytes) {
+	bl->bytes += maxBytes;
+	bl->chunks++;
+}
+
+static char Backlog__estimateIsExceeded(struct Backlog *bl) {
+	if(bl->limits.maxBytes && bl->bytes >= bl->limits.maxBytes)
+		return 1;
+
+	if(bl->limits.maxChunks && bl->chunks >= bl->limits.maxChunks)
+		return 1;
+
+	return 0;
+}
+
+static char Backlog__diskIsFull(struct Backlog *bl) {
+	struct statvfs st;
+
+	if(!bl->limits.minFreeBytes)
+		return 0;
+
+	if(statvfs(bl->rootDir, &st) == -1) {
+		warning("statvfs('%s'): %s", bl->rootDir, strerror(errno));
+		return 0;
+	}
+
+	return (uint64_t)st.f_bavail * st.f_frsize < bl->limits.minFreeBytes;
+}
+
+char Backlog_isExceeded(struct Backlog *bl, int ownChunkFd) {
+	uint64_t age = timemicro() - bl->lastScanTimemicro;
+	char exceeded = Backlog__estimateIsExceeded(bl);
+
+	if(age >= BACKLOG_SCAN_INTERVAL_MS * 1000 || (exceeded && age >= BACKLOG_RESCAN_INTERVAL_MS * 1000)) {
+		Backlog__scan(bl, ownChunkFd);
+		exceeded = Backlog__estimateIsExceeded(bl);
+	}
+
+	return exceeded || Backlog__diskIsFull(bl);
+}
+
+/**
+ * Самый старый чанк - по времени в имени, а не по бакету
+ */
+static char Backlog__isOlder(const char *name, const char *than) {
+	const char *a = strrchr(name, '/');
+	const char *b = strrchr(than, '/');
+
+	return strcmp(a ? a + 1 : name, b ? b + 1 : than) < 0;
+}
+
+/**
+ * Считает чанки в каталоге, байты добавляет в bl->bytes
+ * @param bl
+ * @param dir
+ * @param bucket если dir - бакет, его имя, иначе NULL
+ * @param own чанк писателя
+ * @return количество чанков
+ */
+static uint64_t Backlog__scanDir(struct Backlog *bl, const char *dir, const char *bucket, const struct stat *own) {
+	char path[PATH_MAX + 160];
+	struct dirent *e;
+	struct stat st;
+	struct stat lst;
+	uint64_t chunks = 0;
+	DIR *d;
+
+	d = opendir(dir);
+	if(!d) {
+		/* группу могли только что удалить */
+		if(errno != ENOENT)
+			warning("opendir('%s'): %s", dir, strerror(errno));
+
+		return 0;
+	}
+
+	while((e = readdir(d))) {
+		if(!bucket && Bucket_isName(e->d_name)) {
+			snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+			chunks += Backlog__scanDir(bl, path, e->d_name, own);
+			continue;
+		}
+
+		if(e->d_name[0] == '.' || strstr(e->d_name, ".chunk") != e->d_name + (strlen(e->d_name) - 6))
+			continue;
+
+		/* уже дочитан */
+		if(fstatat(dirfd(d), e->d_name, &st, 0) == -1)
+			continue;
+
+		if(st.st_ino == own->st_ino && st.st_dev == own->st_dev)
+			continue;
+
+		/* у чанка в страйпе группы ссылаются на симлинк, а не на сам файл */
+		if(fstatat(dirfd(d), e->d_name, &lst, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISLNK(lst.st_mode))
+			lst.st_nlink = st.st_nlink;
+
+		/* чанк из нескольких групп занимает место один раз */
+		bl->bytes += (uint64_t)st.st_size / (lst.st_nlink ? lst.st_nlink : 1);
+		chunks++;
+
+		if(!bl->oldest[0] || Backlog__isOlder(e->d_name, bl->oldest)) {
+			if(bucket)
+				snprintf(bl->oldest, sizeof(bl->oldest), "%s/%s", bucket, e->d_name);
+			else
+				snprintf(bl->oldest, sizeof(bl->oldest), "%s", e->d_name);
+		}
+	}
+
+	closedir(d);
+
+	return chunks;
+}
+
+static void Backlog__scan(struct Backlog *bl, int ownChunkFd) {
+	char dir[PATH_MAX + 160];
+	struct stat own;
+	size_t i;
+
+	own.st_ino = 0;
+	own.st_dev = 0;
+
+	if(ownChunkFd >= 0 && fstat(ownChunkFd, &own) == -1)
+		error("fstat(#%d)", ownChunkFd);
+
+	bl->bytes = 0;
+	bl->oldest[0] = 0;
+	bl->chunks = Backlog__scanDir(bl, bl->rootDir, NULL, &own);
+
+	ConsumerGroup_refreshList(bl->groups);
+
+	for(i = 0; i < bl->groups->count; i++) {
+		uint64_t chunks;
+
+		snprintf(dir, sizeof(dir), "%s/%s", bl->groups->dir, bl->groups->names[i]);
+
+		chunks = Backlog__scanDir(bl, dir, NULL, &own);
+		if(chunks > bl->chunks)
+			bl->chunks = chunks;
+	}
+
+	bl->lastScanTimemicro = timemicro();
+
+	debug("backlog of '%s': %llu bytes, %llu chunks", bl->rootDir, (unsigned long long)bl->bytes, (unsigned long long)bl->chunks);
+}
+
+/**
+ * Путь к самому старому чанку в корне (dirNumber 0) или в группе dirNumber - 1
+ */
+static void Backlog__chunkPath(struct Backlog *bl, size_t dirNumber, const char *suffix, char *buf, size_t size) {
+	if(!dirNumber)
+		snprintf(buf, size, "%s/%s%s", bl->rootDir, bl->oldest, suffix);
+	else
+		snprintf(buf, size, "%s/%s/%s%s", bl->groups->dir, bl->groups->names[dirNumber - 1], bl->oldest, suffix);
+}
+
+int Backlog_dropOldest(struct Backlog *bl, int ownChunkFd) {
+	char path[PATH_MAX + 160 + NAME_MAX];
+	struct stat own;
+	struct stat st;
+	size_t i;
+	int fd = -1;
+
+	if(!bl->oldest[0])
+		Backlog__scan(bl, ownChunkFd);
+
+	if(!bl->oldest[0])
+		return -1;
+
+	/* чанк мог остаться только в части групп */
+	for(i = 0; i <= bl->groups->count; i++) {
+		Backlog__chunkPath(bl, i, "", path, sizeof(path));
+
+		if(stat(path, &st) == 0)
+			break;
+	}
+
+	if(i > bl->groups->count) {
+		/* пока выбирали, его дочитали */
+		bl->oldest[0] = 0;
+		return 0;
+	}
+
+	/* закрытие любого дескриптора файла снимает наши локи на нём, свой чанк не открываем */
+	if(ownChunkFd >= 0 && fstat(ownChunkFd, &own) == 0 && own.st_ino == st.st_ino && own.st_dev == st.st_dev)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		bl->oldest[0] = 0;
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	/* в чанк ещё пишут: писатель держит F_WRLCK на байте 1 */
+	if(!flockRangeNB(fd, 1, 1, F_RDLCK)) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	warning("backlog of '%s' exceeds limits, dropping chunk '%s'", bl->rootDir, bl->oldest);
+
+	for(i = 0; i <= bl->groups->count; i++) {
+		Backlog__chunkPath(bl, i, "", path, sizeof(path));
+		if(Stripe_unlinkChunk(path) == -1 && errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+
+		Backlog__chunkPath(bl, i, ".offset", path, sizeof(path));
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+
+		Backlog__chunkPath(bl, i, ".segments", path, sizeof(path));
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+	}
+
+	bl->bytes -= (uint64_t)st.st_size < bl->bytes ? (uint64_t)st.st_size : bl->bytes;
+
+	if(bl->chunks)
+		bl->chunks--;
+
+	bl->oldest[0] = 0;
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+#ifndef BACKLOG_H
+#define	BACKLOG_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "Bucket.h"
+#include "ConsumerGroup.h"
+
+/**
+ * Ограничение непрочитанного в потоке для писателя.
+ *
+ * Бэклог - непрочитанные чанки в корне потока и в каталогах групп:
+ * байты считаются по месту на диске (чанк, общий для нескольких групп,
+ * один раз), чанки - у самой отставшей группы. Свой открытый чанк писатель
+ * не считает: его всё равно никто не дочитает, пока писатель его не закроет.
+ *
+ * Каталог сканируется не на каждую запись: между сканированиями оценка только
+ * растёт на каждый созданный писателем чанк (на его максимальный размер), а
+ * освобождённое читателями видно при следующем сканировании. Сканирование -
+ * раз в BACKLOG_SCAN_INTERVAL_MS, а пока оценка за пределом - не чаще
+ * раза в BACKLOG_RESCAN_INTERVAL_MS
+ */
+
+#define BACKLOG_SCAN_INTERVAL_MS 1000
+#define BACKLOG_RESCAN_INTERVAL_MS 100
+
+/* что делать писателю, когда бэклог за пределом */
+#define BACKLOG_BLOCK 0
+#define BACKLOG_DROP 1
+#define BACKLOG_SPILL 2
+
+struct BacklogLimits {
+	/**
+	 * 0 - без ограничения
+	 */
+	uint64_t maxBytes;
+	uint64_t maxChunks;
+
+	/**
+	 * сколько места должно оставаться свободным на ФС потока
+	 */
+	uint64_t minFreeBytes;
+
+	int policy;
+
+	/**
+	 * BACKLOG_SPILL: новые чанки пишутся сюда, это отдельный поток
+	 */
+	const char *spillDir;
+};
+
+struct Backlog {
+	const char *rootDir;
+	struct BacklogLimits limits;
+
+	/**
+	 * каталоги групп берутся из списка писателя
+	 */
+	struct ConsumerGroupList *groups;
+
+	uint64_t bytes;
+	uint64_t chunks;
+	uint64_t lastScanTimemicro;
+
+	/**
+	 * самый старый чанк на момент сканирования (с бакетом, если он есть),
+	 * пустая строка - неизвестен
+	 */
+	char oldest[BUCKET_NAME_LENGTH + NAME_MAX + 2];
+};
+
+void Backlog_init(struct Backlog *bl, const char *rootDir, const struct BacklogLimits *limits, struct ConsumerGroupList *groups);
+
+/**
+ * Писатель создал чанк в потоке, максимум maxBytes
+ * @param bl
+ * @param maxBytes
+ */
+void Backlog_addChunk(struct Backlog *bl, uint64_t maxBytes);
+
+/**
+ * За пределом ли бэклог. Сканирует каталог, если оценка устарела
+ * или говорит, что за пределом
+ * @param bl
+ * @param ownChunkFd открытый чанк писателя, в бэклог не входит. -1 если нет
+ * @return 1 если за пределом
+ */
+char Backlog_isExceeded(struct Backlog *bl, int ownChunkFd);
+
+/**
+ * Удаляет самый старый чанк изо всех групп вместе с его .offset и .segments.
+ * Чанк, в который ещё пишут, не трогается
+ * @param bl
+ * @param ownChunkFd
+ * @return 0 если чанк удалён, -1 если удалять нечего
+ */
+int Backlog_dropOldest(struct Backlog *bl, int ownChunkFd);
+
+#endif	/* BACKLOG_H */
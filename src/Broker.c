@@ -0,0 +1,694 @@
+#include "Broker.h"
+#include "common.h"
+#include "Stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+	#include <sys/inotify.h>
+	#define BROKER_USE_INOTIFY
+#endif
+
+/* пока ждём данных в чанке без inotify */
+#define BROKER_POLL_INTERVAL_MS 100
+
+static char BROKER_READ_BUFFER[64 * 1024];
+
+static char Broker__chunkIsLeased(struct RStream *rs, const char *path);
+static int Broker__send(int sock, uint32_t type, uint32_t flags, uint64_t offset, int fd);
+static void Broker__onMarker(struct Markers *m, uint64_t ingestTimemicro);
+static void Broker__accept(struct Broker *b);
+static void Broker__receive(struct Broker *b, struct BrokerConnection *c);
+static void Broker__dispatch(struct Broker *b);
+static void Broker__end(struct Broker *b);
+static void Broker__close(struct Broker *b, struct BrokerConnection *c);
+static void Broker__freeLease(struct Broker *b, struct BrokerLease *l);
+static char Broker__request(struct Broker *b);
+static void Broker__report(struct Broker *b, uint32_t type);
+static void Broker__closeChunk(struct Broker *b);
+static void Broker__waitForUpdate(struct Broker *b);
+
+void Broker_initServer(struct Broker *b, const char *path, const char *rootDir, const char *group, char persistentMode, char waitRootMode) {
+	struct epoll_event ev;
+
+	b->path = path;
+	b->connections = NULL;
+	b->waitingHead = NULL;
+	b->waitingTail = NULL;
+	b->leases = NULL;
+	b->ended = 0;
+	b->chunkFd = -1;
+	b->inotifyFd = -1;
+	b->chunkWatch = -1;
+	b->stopRequested = 0;
+
+	/* с -W каталога может ещё не быть: читатели пока подождут в очереди listen() */
+	b->fd = listenUnix(path, SOCK_SEQPACKET);
+
+	RStream_initGroup(&b->rs, rootDir, group, persistentMode, waitRootMode);
+	b->rs.chunkIsLeased = Broker__chunkIsLeased;
+
+	b->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if(b->epollFd == -1)
+		error("epoll_create1()");
+
+	/* data.ptr: NULL - слушающий сокет, &b->rs - inotify потока, иначе соединение */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if(epoll_ctl(b->epollFd, EPOLL_CTL_ADD, b->fd, &ev) == -1)
+		error("epoll_ctl('%s')", path);
+
+	if(b->rs.inotifyFd >= 0) {
+		ev.data.ptr = &b->rs;
+
+		if(epoll_ctl(b->epollFd, EPOLL_CTL_ADD, b->rs.inotifyFd, &ev) == -1)
+			error("epoll_ctl(inotify)");
+	}
+
+	debug("broker of '%s' is listening on '%s'", rootDir, path);
+}
+
+static char Broker__chunkIsLeased(struct RStream *rs, const char *path) {
+	struct Broker *b = (struct Broker *)((char *)rs - offsetof(struct Broker, rs));
+	struct BrokerLease *l;
+
+	for(l = b->leases; l; l = l->next) {
+		if(strcmp(l->lease.path, path) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * @param sock
+ * @param type BROKER_*
+ * @param flags BROKER_CHUNK_*
+ * @param offset
+ * @param fd дескриптор для передачи или -1
+ * @return 0 или -1 если получателя уже нет
+ */
+static int Broker__send(int sock, uint32_t type, uint32_t flags, uint64_t offset, int fd) {
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct BrokerMessage msg;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.flags = flags;
+	msg.offset = offset;
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if(fd >= 0) {
+		struct cmsghdr *cmsg;
+
+		memset(&control, 0, sizeof(control));
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	do {
+		r = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while(r == -1 && errno == EINTR);
+
+	return r == sizeof(msg) ? 0 : -1;
+}
+
+void Broker_run(struct Broker *b) {
+	struct epoll_event events[BROKER_EVENTS];
+
+	while(!b->stopRequested && !b->ended) {
+		int i;
+		int n;
+
+		Broker__dispatch(b);
+		if(b->ended)
+			break;
+
+		/* пока читатели ждут, перепроверяем каталог и без событий: на сетевых ФС их может не быть */
+		n = epoll_wait(b->epollFd, events, BROKER_EVENTS, b->waitingHead ? BROKER_POLL_INTERVAL_MS : 1000);
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+
+			error("epoll_wait()");
+		}
+
+		for(i = 0; i < n; i++) {
+			if(!events[i].data.ptr)
+				Broker__accept(b);
+			else if(events[i].data.ptr == &b->rs)
+				RStream_drainNotifications(&b->rs);
+			else
+				Broker__receive(b, events[i].data.ptr);
+		}
+	}
+}
+
+static void Broker__accept(struct Broker *b) {
+	for(;;) {
+		struct BrokerConnection *c;
+		struct epoll_event ev;
+		int fd;
+
+		fd = accept4(b->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd == -1) {
+			if(errno == ECONNABORTED)
+				continue;
+
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+
+			/* читатели подождут в очереди listen() */
+			if(errno == EMFILE || errno == ENFILE) {
+				warning("unable to accept reader on '%s': %s", b->path, strerror(errno));
+				return;
+			}
+
+			error("accept('%s')", b->path);
+		}
+
+		c = malloc(sizeof(*c));
+		if(!c)
+			error("malloc(%lu)", (unsigned long)sizeof(*c));
+
+		c->fd = fd;
+		c->waiting = 0;
+		c->nextWaiting = NULL;
+		c->lease = NULL;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+
+		if(epoll_ctl(b->epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+			error("epoll_ctl(#%d)", fd);
+
+		c->prev = NULL;
+		c->next = b->connections;
+
+		if(b->connections)
+			b->connections->prev = c;
+
+		b->connections = c;
+
+		debug("reader #%d connected", fd);
+	}
+}
+
+static void Broker__receive(struct Broker *b, struct BrokerConnection *c) {
+	struct BrokerMessage msg;
+	ssize_t rd;
+
+	rd = recv(c->fd, &msg, sizeof(msg), 0);
+	if(rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	if(rd == 0) {
+		Broker__close(b, c);
+		return;
+	}
+
+	if(rd != sizeof(msg)) {
+		warning("reader #%d: bad message", c->fd);
+		Broker__close(b, c);
+
+		return;
+	}
+
+	switch(msg.type) {
+		case BROKER_NEXT:
+			if(c->waiting || c->lease)
+				break;
+
+			c->waiting = 1;
+
+			if(b->waitingTail)
+				b->waitingTail->nextWaiting = c;
+			else
+				b->waitingHead = c;
+
+			b->waitingTail = c;
+
+			return;
+		case BROKER_PROGRESS:
+			if(!c->lease)
+				break;
+
+			RStream_checkpointLease(&b->rs, &c->lease->lease, (off_t)msg.offset);
+
+			return;
+		case BROKER_DONE:
+			if(!c->lease)
+				break;
+
+			debug("reader #%d is done with '%s'", c->fd, c->lease->lease.path);
+
+			RStream_completeLease(&b->rs, &c->lease->lease);
+			Broker__freeLease(b, c->lease);
+			c->lease = NULL;
+
+			return;
+	}
+
+	warning("reader #%d: unexpected message %u", c->fd, (unsigned)msg.type);
+	Broker__close(b, c);
+}
+
+/**
+ * Отдаёт чанки ждущим читателям: сначала брошенные умершими, потом новые
+ */
+static void Broker__dispatch(struct Broker *b) {
+	while(b->waitingHead) {
+		struct BrokerConnection *c = b->waitingHead;
+		struct BrokerLease *l;
+
+		for(l = b->leases; l && l->owner; l = l->next)
+			;
+
+		if(!l) {
+			int r;
+
+			l = malloc(sizeof(*l));
+			if(!l)
+				error("malloc(%lu)", (unsigned long)sizeof(*l));
+
+			r = RStream_lease(&b->rs, &l->lease);
+			if(r <= 0) {
+				free(l);
+
+				if(r < 0)
+					Broker__end(b);
+
+				return;
+			}
+
+			l->owner = NULL;
+			l->prev = NULL;
+			l->next = b->leases;
+
+			if(b->leases)
+				b->leases->prev = l;
+
+			b->leases = l;
+		}
+
+		b->waitingHead = c->nextWaiting;
+		if(!b->waitingHead)
+			b->waitingTail = NULL;
+
+		c->waiting = 0;
+		c->nextWaiting = NULL;
+
+		/* метки в чанках читатели вырезают сами, а про .markers знает только брокер */
+		if(Broker__send(c->fd, BROKER_CHUNK, b->rs.stripMarkers ? BROKER_CHUNK_MARKERS : 0, (uint64_t)l->lease.offset, l->lease.fd) == -1) {
+			Broker__close(b, c);
+			continue;
+		}
+
+		debug("'%s' from %llu leased to reader #%d", l->lease.path, (unsigned long long)l->lease.offset, c->fd);
+
+		l->owner = c;
+		c->lease = l;
+	}
+}
+
+/**
+ * Поток кончился: читатели узнают об этом, когда попросят чанк
+ */
+static void Broker__end(struct Broker *b) {
+	struct BrokerConnection *c;
+
+	debug("end of stream, %s", "notifying readers");
+
+	b->ended = 1;
+
+	/* новых читателей не пускаем, а ждущие в очереди listen() тоже узнают о конце */
+	if(unlink(b->path) == -1 && errno != ENOENT)
+		warning("unable to unlink() '%s': %s", b->path, strerror(errno));
+
+	Broker__accept(b);
+
+	for(c = b->connections; c; c = c->next)
+		Broker__send(c->fd, BROKER_END, 0, 0, -1);
+}
+
+static void Broker__close(struct Broker *b, struct BrokerConnection *c) {
+	debug("reader #%d disconnected", c->fd);
+
+	/* с сохранённого места чанк достанется следующему */
+	if(c->lease) {
+		c->lease->owner = NULL;
+		c->lease->lease.offset = c->lease->lease.savedOffset;
+	}
+
+	if(c->waiting) {
+		struct BrokerConnection **p;
+
+		for(p = &b->waitingHead; *p != c; p = &(*p)->nextWaiting)
+			;
+
+		*p = c->nextWaiting;
+
+		if(b->waitingTail == c) {
+			struct BrokerConnection *t;
+
+			for(t = b->waitingHead; t && t->nextWaiting; t = t->nextWaiting)
+				;
+
+			b->waitingTail = t;
+		}
+	}
+
+	close(c->fd);
+
+	if(c->prev)
+		c->prev->next = c->next;
+	else
+		b->connections = c->next;
+
+	if(c->next)
+		c->next->prev = c->prev;
+
+	free(c);
+}
+
+static void Broker__freeLease(struct Broker *b, struct BrokerLease *l) {
+	if(l->prev)
+		l->prev->next = l->next;
+	else
+		b->leases = l->next;
+
+	if(l->next)
+		l->next->prev = l->prev;
+
+	free(l);
+}
+
+void Broker_initReader(struct Broker *b, const char *path) {
+	struct sockaddr_un addr;
+
+	b->path = path;
+	b->epollFd = -1;
+	b->connections = NULL;
+	b->leases = NULL;
+	b->chunkFd = -1;
+	b->chunkWatch = -1;
+	b->stopRequested = 0;
+	b->stripMarkers = 0;
+	Markers_init(&b->markers, Broker__onMarker);
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		error("socket path '%s'", path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	b->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(b->fd == -1)
+		error("socket(AF_UNIX)");
+
+	if(connect(b->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		error("connect('%s')", path);
+
+	b->inotifyFd = -1;
+#ifdef BROKER_USE_INOTIFY
+	b->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(b->inotifyFd == -1)
+		debug("inotify_init1(): %s", strerror(errno));
+#endif
+}
+
+/**
+ * Просит у брокера следующий чанк
+ * @param b
+ * @return 1 если чанк получен, 0 - конец потока
+ */
+static char Broker__request(struct Broker *b) {
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct BrokerMessage msg;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	char resetSeen = 0;
+	ssize_t rd;
+
+	/* не отправилось - возможно, брокер закрылся, прислав END: он ещё в сокете */
+	Broker__send(b->fd, BROKER_NEXT, 0, 0, -1);
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+
+	/* брокер, закрывшись с непрочитанным NEXT, оставляет ECONNRESET, а END - за ним в очереди */
+	do {
+		rd = recvmsg(b->fd, &mh, MSG_CMSG_CLOEXEC);
+	} while(rd == -1 && (errno == EINTR || (errno == ECONNRESET && !resetSeen++)));
+
+	if(rd == 0)
+		errno = ECONNRESET;
+
+	if(rd <= 0)
+		error("broker '%s' has gone", b->path);
+
+	if(rd != sizeof(msg))
+		error("bad message from broker '%s'", b->path);
+
+	if(msg.type == BROKER_END)
+		return 0;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if(msg.type != BROKER_CHUNK || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		errno = EPROTO;
+		error("bad message from broker '%s'", b->path);
+	}
+
+	memcpy(&b->chunkFd, CMSG_DATA(cmsg), sizeof(int));
+
+	if(msg.flags & BROKER_CHUNK_MARKERS)
+		b->stripMarkers = 1;
+
+	Markers_reset(&b->markers);
+
+	b->chunkOffset = (off_t)msg.offset;
+	b->reportedOffset = b->chunkOffset;
+	b->reportTime = timemicro() + (uint64_t)RSTREAM_CHECKPOINT_INTERVAL_MS * 1000;
+
+#ifdef BROKER_USE_INOTIFY
+	if(b->inotifyFd >= 0) {
+		char path[64];
+
+		/* путь к чанку читателю не нужен: смотрим на сам файл через /proc */
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", b->chunkFd);
+
+		b->chunkWatch = inotify_add_watch(b->inotifyFd, path, IN_MODIFY | IN_CLOSE_WRITE);
+		if(b->chunkWatch == -1)
+			debug("inotify_add_watch('%s'): %s", path, strerror(errno));
+	}
+#endif
+
+	Stats_inc(STATS_CHUNKS_READ);
+
+	return 1;
+}
+
+static void Broker__report(struct Broker *b, uint32_t type) {
+	if(Broker__send(b->fd, type, 0, (uint64_t)b->chunkOffset, -1) == -1)
+		error("broker '%s' has gone", b->path);
+
+	b->reportedOffset = b->chunkOffset;
+	b->reportTime = timemicro() + (uint64_t)RSTREAM_CHECKPOINT_INTERVAL_MS * 1000;
+}
+
+static void Broker__closeChunk(struct Broker *b) {
+#ifdef BROKER_USE_INOTIFY
+	if(b->chunkWatch >= 0) {
+		inotify_rm_watch(b->inotifyFd, b->chunkWatch);
+		b->chunkWatch = -1;
+	}
+#endif
+
+	close(b->chunkFd);
+	b->chunkFd = -1;
+}
+
+/**
+ * Ждёт, пока в чанк допишут, или писатель его закроет
+ */
+static void Broker__waitForUpdate(struct Broker *b) {
+#ifdef BROKER_USE_INOTIFY
+	if(b->chunkWatch >= 0) {
+		struct pollfd pfd;
+
+		pfd.fd = b->inotifyFd;
+		pfd.events = POLLIN;
+
+		if(poll(&pfd, 1, 1000) > 0) {
+			while(read(b->inotifyFd, BROKER_READ_BUFFER, sizeof(BROKER_READ_BUFFER)) > 0)
+				;
+		}
+
+		return;
+	}
+#endif
+
+	usleep(BROKER_POLL_INTERVAL_MS * 1000);
+}
+
+ssize_t Broker_read(struct Broker *b, int outFd) {
+	for(;;) {
+		struct stat st;
+		ssize_t rd;
+
+		if(b->chunkFd == -1 && !Broker__request(b))
+			return 0;
+
+		/* файл открыт брокером, и позиция в нём общая с ним, поэтому только pread() */
+		rd = pread(b->chunkFd, BROKER_READ_BUFFER, sizeof(BROKER_READ_BUFFER), b->chunkOffset);
+		if(rd > 0) {
+			ssize_t out = b->stripMarkers ? Markers_strip(&b->markers, BROKER_READ_BUFFER, rd) : rd;
+			ssize_t written = 0;
+
+			while(written < out) {
+				ssize_t wr = write(outFd, BROKER_READ_BUFFER + written, (size_t)(out - written));
+
+				if(wr == -1) {
+					if(errno == EINTR)
+						continue;
+
+					error("write(#%d)", outFd);
+				}
+
+				written += wr;
+			}
+
+			b->chunkOffset += rd;
+			Stats_add(STATS_BYTES_READ, rd);
+
+			if(b->chunkOffset - b->reportedOffset >= RSTREAM_CHECKPOINT_BYTES || timemicro() >= b->reportTime)
+				Broker__report(b, BROKER_PROGRESS);
+
+			/* прочитались одни метки */
+			if(!out)
+				continue;
+
+			return out;
+		}
+
+		if(rd == -1) {
+			if(errno == EINTR)
+				continue;
+
+			error("pread(chunk)");
+		}
+
+		/* писатель держит F_WRLCK на байте 1, пока пишет; после него могли дописать */
+		if(flockRangeNB(b->chunkFd, 1, 1, F_RDLCK)) {
+			if(fstat(b->chunkFd, &st) == 0 && st.st_size > b->chunkOffset)
+				continue;
+
+			Broker__report(b, BROKER_DONE);
+			Broker__closeChunk(b);
+
+			continue;
+		}
+
+		if(b->chunkOffset != b->reportedOffset)
+			Broker__report(b, BROKER_PROGRESS);
+
+		Broker__waitForUpdate(b);
+	}
+}
+
+static void Broker__onMarker(struct Markers *m, uint64_t ingestTimemicro) {
+	uint64_t now = timemicro();
+
+	Stats_record(STATS_HIST_RECORD_LATENCY_US, now > ingestTimemicro ? now - ingestTimemicro : 0);
+}
+
+void Broker_destroy(struct Broker *b) {
+	if(b->epollFd >= 0) {
+		/* захваты отпускаются с дескрипторами, а прочитанное уже в .offset */
+		while(b->connections)
+			Broker__close(b, b->connections);
+
+		while(b->leases) {
+			close(b->leases->lease.fd);
+			Broker__freeLease(b, b->leases);
+		}
+
+		RStream_destroy(&b->rs);
+
+		close(b->epollFd);
+		b->epollFd = -1;
+
+		if(b->fd >= 0) {
+			close(b->fd);
+			b->fd = -1;
+
+			if(unlink(b->path) == -1 && errno != ENOENT)
+				warning("unable to unlink() '%s': %s", b->path, strerror(errno));
+		}
+
+		return;
+	}
+
+	if(b->chunkFd >= 0) {
+		/* выданное сохранится, остальное брокер отдаст следующему; брокера может уже не быть */
+		if(b->chunkOffset != b->reportedOffset)
+			Broker__send(b->fd, BROKER_PROGRESS, 0, (uint64_t)b->chunkOffset, -1);
+
+		Broker__closeChunk(b);
+	}
+
+	if(b->inotifyFd >= 0) {
+		close(b->inotifyFd);
+		b->inotifyFd = -1;
+	}
+
+	if(b->fd >= 0) {
+		close(b->fd);
+		b->fd = -1;
+	}
+}
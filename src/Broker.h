@@ -0,0 +1,153 @@
+#ifndef BROKER_H
+#define	BROKER_H
+
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "Markers.h"
+#include "RStream.h"
+
+/**
+ * Брокер (-D): каталогом потока владеет один процесс. Он сканирует каталог,
+ * захватывает чанки, держит их локи и удаляет дочитанные, а читателям
+ * (pit -r -D) отдаёт дескрипторы чанков через unix-сокет (SCM_RIGHTS).
+ * Читатели в каталог не ходят вовсе, так что толкотни на голове очереди
+ * нет при любом их количестве.
+ *
+ * Читатель просит чанк (BROKER_NEXT), получает дескриптор и оффсет
+ * (BROKER_CHUNK), сообщает, сколько выдал (BROKER_PROGRESS), и в конце -
+ * что дочитал (BROKER_DONE). По BROKER_PROGRESS брокер сохраняет .offset,
+ * и чанк умершего читателя (соединение закрылось) отдаётся следующему
+ * с сохранённого места. Когда поток кончился, ждущие получают BROKER_END.
+ *
+ * Читать поток через брокер и напрямую одновременно нельзя: брокер
+ * не знает про сегменты, на которые читатели режут большие чанки
+ */
+
+#define BROKER_NEXT 1
+#define BROKER_PROGRESS 2
+#define BROKER_DONE 3
+#define BROKER_CHUNK 4
+#define BROKER_END 5
+
+/* BrokerMessage.flags у BROKER_CHUNK: поток помечен, см. Markers.h */
+#define BROKER_CHUNK_MARKERS 1
+
+#define BROKER_EVENTS 256
+
+/**
+ * сообщение в обе стороны, сокет SOCK_SEQPACKET
+ */
+struct BrokerMessage {
+	uint32_t type;
+	uint32_t flags;
+	uint64_t offset;
+};
+
+struct BrokerLease;
+
+struct BrokerConnection {
+	int fd;
+
+	/**
+	 * прислал BROKER_NEXT и ждёт чанка, в очереди waiting
+	 */
+	char waiting;
+	struct BrokerConnection *nextWaiting;
+
+	/**
+	 * чанк, который сейчас читает, или NULL
+	 */
+	struct BrokerLease *lease;
+
+	struct BrokerConnection *prev;
+	struct BrokerConnection *next;
+};
+
+struct BrokerLease {
+	struct RStreamLease lease;
+
+	/**
+	 * NULL - читатель умер, чанк ждёт следующего
+	 */
+	struct BrokerConnection *owner;
+
+	struct BrokerLease *prev;
+	struct BrokerLease *next;
+};
+
+struct Broker {
+	const char *path;
+	int fd;
+	int epollFd;
+
+	/**
+	 * брокер: поток, соединения, очередь ждущих читателей и розданные чанки
+	 */
+	struct RStream rs;
+	struct BrokerConnection *connections;
+	struct BrokerConnection *waitingHead;
+	struct BrokerConnection *waitingTail;
+	struct BrokerLease *leases;
+	char ended;
+
+	/**
+	 * читатель: текущий чанк, сколько выдано и когда сообщать о выданном
+	 */
+	int chunkFd;
+	off_t chunkOffset;
+	off_t reportedOffset;
+	uint64_t reportTime;
+	int inotifyFd;
+	int chunkWatch;
+
+	/**
+	 * читатель: брокер сообщил, что поток помечен, метки вырезаются
+	 */
+	char stripMarkers;
+	struct Markers markers;
+
+	volatile sig_atomic_t stopRequested;
+};
+
+/**
+ * Брокер потока rootDir на сокете path
+ * @param b
+ * @param path
+ * @param rootDir
+ * @param group группа читателей или NULL
+ * @param persistentMode
+ * @param waitRootMode
+ */
+void Broker_initServer(struct Broker *b, const char *path, const char *rootDir, const char *group, char persistentMode, char waitRootMode);
+
+/**
+ * Раздаёт чанки, пока поток не кончится или не выставлен stopRequested
+ * @param b
+ */
+void Broker_run(struct Broker *b);
+
+/**
+ * Подключается к брокеру на сокете path
+ * @param b
+ * @param path
+ */
+void Broker_initReader(struct Broker *b, const char *path);
+
+/**
+ * Выдаёт в outFd следующую порцию потока, ожидая, если её пока нет
+ * @param b
+ * @param outFd
+ * @return сколько выдано, 0 - конец потока
+ */
+ssize_t Broker_read(struct Broker *b, int outFd);
+
+/**
+ * Брокер закрывает соединения и удаляет сокет, читатель сообщает, сколько выдал
+ * @param b
+ */
+void Broker_destroy(struct Broker *b);
+
+#endif	/* BROKER_H */
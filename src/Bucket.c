@@ -0,0 +1,76 @@
+#include "Bucket.h"
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+uint64_t Bucket_of(uint64_t timemicro) {
+	return timemicro / BUCKET_SPAN_MICRO;
+}
+
+char Bucket_isName(const char *name) {
+	size_t i;
+
+	for(i = 0; i < BUCKET_NAME_LENGTH; i++) {
+		if(name[i] < '0' || name[i] > '9')
+			return 0;
+	}
+
+	return name[i] == 0;
+}
+
+void Bucket_prune(const char *path) {
+	const char *name = strrchr(path, '/');
+	uint64_t bucket;
+
+	name = name ? name + 1 : path;
+
+	if(!Bucket_isName(name))
+		return;
+
+	bucket = strtoull(name, NULL, 10);
+
+	/* писатель мог взять время для имени чуть раньше, чем дошёл до создания чанка */
+	if((bucket + 2) * BUCKET_SPAN_MICRO > timemicro())
+		return;
+
+	if(rmdir(path) == 0) {
+		debug("bucket '%s' pruned", path);
+		return;
+	}
+
+	if(errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST)
+		warning("rmdir('%s'): %s", path, strerror(errno));
+}
+
+void Bucket_removeAll(const char *dir) {
+	char path[PATH_MAX + NAME_MAX + 2];
+	struct dirent *e;
+	DIR *d;
+
+	d = opendir(dir);
+	if(!d) {
+		if(errno != ENOENT)
+			warning("opendir('%s'): %s", dir, strerror(errno));
+
+		return;
+	}
+
+	while((e = readdir(d))) {
+		if(!Bucket_isName(e->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+
+		/* непустой бакет - ещё не дочитанный чанк, его удалит тот, кто дочитает */
+		if(rmdir(path) == -1 && errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST)
+			warning("rmdir('%s'): %s", path, strerror(errno));
+	}
+
+	closedir(d);
+}
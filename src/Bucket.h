@@ -0,0 +1,46 @@
+#ifndef BUCKET_H
+#define	BUCKET_H
+
+#include <stdint.h>
+
+/**
+ * Бакеты: с -H писатель кладёт чанки не в корень потока, а в подкаталоги
+ * по первым BUCKET_NAME_LENGTH цифрам метки времени в имени чанка, так что
+ * в одном бакете оказываются чанки за BUCKET_SPAN_MICRO микросекунд.
+ * В индексе и в каталогах групп чанк называется "бакет/имя".
+ *
+ * Читатели перебирают бакеты по порядку и сканируют только до первого
+ * чанка, который удалось захватить, то есть обычно только самый старый
+ * непустой бакет. Опустевшие бакеты удаляют читатели, но не раньше, чем
+ * через BUCKET_SPAN_MICRO после конца интервала бакета: в такой бакет
+ * писатели уже ничего не создадут
+ */
+
+#define BUCKET_NAME_LENGTH 8
+#define BUCKET_SPAN_MICRO 100000000ULL
+
+/**
+ * @param timemicro метка времени чанка
+ * @return номер бакета, имя бакета - он же в BUCKET_NAME_LENGTH цифр
+ */
+uint64_t Bucket_of(uint64_t timemicro);
+
+/**
+ * @param name имя в каталоге потока
+ * @return 1 если это бакет
+ */
+char Bucket_isName(const char *name);
+
+/**
+ * Удаляет бакет, если он пуст и в него больше не будут писать
+ * @param path путь к бакету
+ */
+void Bucket_prune(const char *path);
+
+/**
+ * Удаляет все пустые бакеты в каталоге, вызывается при удалении каталога потока
+ * @param dir корень потока или каталог группы
+ */
+void Bucket_removeAll(const char *dir);
+
+#endif	/* BUCKET_H */
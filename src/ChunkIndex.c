@@ -0,0 +1,406 @@
+#include "ChunkIndex.h"
+#include "common.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define CHUNKINDEX_MAGIC "PITIDX1\n"
+
+/* сколько записей читаем за один pread() */
+#define CHUNKINDEX_BATCH 64
+
+/**
+ * меньше этого количества прочитанных записей в начале файла
+ * компактить индекс не имеет смысла
+ */
+#define CHUNKINDEX_COMPACT_MIN_RECORDS 1024
+
+struct ChunkIndex__header {
+	char magic[8];
+
+	/**
+	 * увеличивается при каждом компакте, чтобы читатель со старым
+	 * представлением об индексе не мог сдвинуть курсор
+	 */
+	uint64_t generation;
+
+	/**
+	 * номер первой записи, чанк которой, возможно, ещё существует
+	 */
+	uint64_t cursor;
+
+	char reserved[CHUNKINDEX_HEADER_SIZE - 24];
+};
+
+static int ChunkIndex__create(struct ChunkIndex *ci);
+static char ChunkIndex__readHeader(struct ChunkIndex *ci, struct ChunkIndex__header *h);
+static char ChunkIndex__recordIsValid(const char *rec);
+static void ChunkIndex__advanceCursor(struct ChunkIndex *ci, uint64_t generation, uint64_t cursor);
+static void ChunkIndex__compact(struct ChunkIndex *ci, struct ChunkIndex__header *h);
+static void ChunkIndex__lockHeader(struct ChunkIndex *ci, short int type);
+
+void ChunkIndex_init(struct ChunkIndex *ci) {
+	ci->fd = -1;
+	ci->path[0] = 0;
+}
+
+/**
+ * @param ci
+ * @param dir
+ * @param create режим писателя: создать индекс если его нет и открыть на дозапись
+ * @return
+ */
+int ChunkIndex_open(struct ChunkIndex *ci, const char *dir, char create) {
+	int flags = create ? O_RDWR | O_APPEND : O_RDWR;
+
+	snprintf(ci->path, sizeof(ci->path), "%s/%s", dir, CHUNKINDEX_FILENAME);
+
+	ci->fd = open(ci->path, flags | O_CLOEXEC);
+	if(ci->fd == -1 && errno == ENOENT && create) {
+		if(ChunkIndex__create(ci) == 0)
+			ci->fd = open(ci->path, flags | O_CLOEXEC);
+	}
+
+	if(ci->fd == -1) {
+		if(errno != ENOENT)
+			warning("unable to open chunk index '%s': %s", ci->path, strerror(errno));
+
+		return -1;
+	}
+
+	return 0;
+}
+
+void ChunkIndex_close(struct ChunkIndex *ci) {
+	if(ci->fd >= 0)
+		close(ci->fd);
+
+	ci->fd = -1;
+}
+
+void ChunkIndex_append(struct ChunkIndex *ci, const char *name) {
+	char rec[CHUNKINDEX_RECORD_SIZE];
+	size_t len = strlen(name);
+	ssize_t wr;
+
+	if(ci->fd == -1)
+		return;
+
+	if(len >= CHUNKINDEX_RECORD_SIZE - 1) {
+		warning("chunk name '%s' is too long for index", name);
+		return;
+	}
+
+	memset(rec, 0, sizeof(rec));
+	memcpy(rec, name, len);
+	rec[CHUNKINDEX_RECORD_SIZE - 1] = '\n';
+
+	/* компакт берёт LOCK_EX, так что пока мы дописываем, он не начнётся */
+	while(flock(ci->fd, LOCK_SH) == -1) {
+		if(errno != EINTR)
+			error("flock('%s', LOCK_SH)", ci->path);
+	}
+
+	do {
+		wr = write(ci->fd, rec, sizeof(rec));
+	} while(wr == -1 && errno == EINTR);
+
+	flock(ci->fd, LOCK_UN);
+
+	if(wr != (ssize_t)sizeof(rec)) {
+		/*
+		 * читатели переживут и битую запись, и отсутствие записи:
+		 * чанк будет найден сканированием каталога
+		 */
+		warning("unable to append to chunk index '%s', index disabled: %s", ci->path, strerror(errno));
+		ChunkIndex_close(ci);
+	}
+}
+
+int ChunkIndex_claim(struct ChunkIndex *ci, int (*tryClaim)(void *ctx, const char *name), void *ctx) {
+	struct ChunkIndex__header h;
+	struct stat st;
+	char batch[CHUNKINDEX_RECORD_SIZE * CHUNKINDEX_BATCH];
+	uint64_t pos;
+	uint64_t end;
+	uint64_t newCursor;
+	char allGone = 1;
+	int fd = -1;
+
+	if(ci->fd == -1)
+		return -1;
+
+	if(!ChunkIndex__readHeader(ci, &h))
+		return -1;
+
+	if(fstat(ci->fd, &st) == -1)
+		error("fstat('%s')", ci->path);
+
+	if(st.st_size < CHUNKINDEX_HEADER_SIZE)
+		return -1;
+
+	end = (uint64_t)(st.st_size - CHUNKINDEX_HEADER_SIZE) / CHUNKINDEX_RECORD_SIZE;
+	pos = newCursor = h.cursor;
+
+	debug("index '%s': cursor %" PRIu64 ", records %" PRIu64, ci->path, h.cursor, end);
+
+	while(pos < end && fd < 0) {
+		uint64_t n = end - pos < CHUNKINDEX_BATCH ? end - pos : CHUNKINDEX_BATCH;
+		ssize_t rd;
+		ssize_t i;
+
+		rd = pread(
+			ci->fd,
+			batch,
+			(size_t)n * CHUNKINDEX_RECORD_SIZE,
+			(off_t)(CHUNKINDEX_HEADER_SIZE + pos * CHUNKINDEX_RECORD_SIZE)
+		);
+
+		if(rd == -1) {
+			if(errno == EINTR)
+				continue;
+
+			error("pread('%s')", ci->path);
+		}
+
+		if(rd < CHUNKINDEX_RECORD_SIZE)
+			break; /* индекс успели скомпактить */
+
+		for(i = 0; i < rd / CHUNKINDEX_RECORD_SIZE; i++) {
+			char *rec = batch + i * CHUNKINDEX_RECORD_SIZE;
+			int r = CHUNKINDEX_CLAIM_GONE;
+
+			pos++;
+
+			if(ChunkIndex__recordIsValid(rec)) {
+				rec[CHUNKINDEX_RECORD_SIZE - 1] = 0;
+				r = tryClaim(ctx, rec);
+			}
+
+			if(r >= 0) {
+				fd = r;
+				break;
+			}
+
+			if(r == CHUNKINDEX_CLAIM_GONE && allGone)
+				newCursor = pos;
+			else
+				allGone = 0;
+		}
+	}
+
+	if(newCursor > h.cursor)
+		ChunkIndex__advanceCursor(ci, h.generation, newCursor);
+
+	return fd;
+}
+
+static int ChunkIndex__create(struct ChunkIndex *ci) {
+	char tmpPath[PATH_MAX + 96];
+	struct ChunkIndex__header h;
+	int fd;
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%lu.tmp", ci->path, (unsigned long)getpid());
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHUNKINDEX_MAGIC, sizeof(h.magic));
+
+	fd = open(tmpPath, O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if(fd == -1) {
+		warning("unable to create chunk index '%s': %s", tmpPath, strerror(errno));
+		return -1;
+	}
+
+	if(write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+		warning("unable to write chunk index header '%s': %s", tmpPath, strerror(errno));
+		close(fd);
+		unlink(tmpPath);
+		return -1;
+	}
+
+	close(fd);
+
+	/* link() а не rename(), чтобы не затереть индекс, созданный параллельно */
+	if(link(tmpPath, ci->path) == -1 && errno != EEXIST) {
+		warning("link('%s', '%s'): %s", tmpPath, ci->path, strerror(errno));
+		unlink(tmpPath);
+		return -1;
+	}
+
+	unlink(tmpPath);
+
+	return 0;
+}
+
+uint64_t ChunkIndex_pending(struct ChunkIndex *ci) {
+	struct ChunkIndex__header h;
+	struct stat st;
+	uint64_t end;
+
+	if(ci->fd == -1)
+		return 0;
+
+	if(fstat(ci->fd, &st) == -1 || st.st_size < CHUNKINDEX_HEADER_SIZE)
+		return 0;
+
+	/* ChunkIndex__readHeader() ругается на битый заголовок, а тут нам это не важно */
+	if(pread(ci->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+		return 0;
+
+	end = (uint64_t)(st.st_size - CHUNKINDEX_HEADER_SIZE) / CHUNKINDEX_RECORD_SIZE;
+
+	return end > h.cursor ? end - h.cursor : 0;
+}
+
+int ChunkIndex_last(struct ChunkIndex *ci, char *name) {
+	struct stat st;
+	off_t records;
+
+	if(ci->fd == -1)
+		return -1;
+
+	if(fstat(ci->fd, &st) == -1 || st.st_size < CHUNKINDEX_HEADER_SIZE + CHUNKINDEX_RECORD_SIZE)
+		return -1;
+
+	records = (st.st_size - CHUNKINDEX_HEADER_SIZE) / CHUNKINDEX_RECORD_SIZE;
+
+	if(pread(ci->fd, name, CHUNKINDEX_RECORD_SIZE, CHUNKINDEX_HEADER_SIZE + (records - 1) * CHUNKINDEX_RECORD_SIZE) != CHUNKINDEX_RECORD_SIZE)
+		return -1;
+
+	if(!ChunkIndex__recordIsValid(name))
+		return -1;
+
+	name[CHUNKINDEX_RECORD_SIZE - 1] = 0;
+
+	return 0;
+}
+
+static char ChunkIndex__readHeader(struct ChunkIndex *ci, struct ChunkIndex__header *h) {
+	ssize_t rd;
+
+	do {
+		rd = pread(ci->fd, h, sizeof(*h), 0);
+	} while(rd == -1 && errno == EINTR);
+
+	if(rd != (ssize_t)sizeof(*h) || memcmp(h->magic, CHUNKINDEX_MAGIC, sizeof(h->magic)) != 0) {
+		warning("chunk index '%s' is corrupted", ci->path);
+		return 0;
+	}
+
+	return 1;
+}
+
+static char ChunkIndex__recordIsValid(const char *rec) {
+	const char *end = memchr(rec, 0, CHUNKINDEX_RECORD_SIZE - 1);
+	size_t len;
+
+	if(!end || rec[CHUNKINDEX_RECORD_SIZE - 1] != '\n')
+		return 0;
+
+	len = (size_t)(end - rec);
+
+	return len > 6 && rec[0] != '.' && memcmp(end - 6, ".chunk", 6) == 0;
+}
+
+static void ChunkIndex__lockHeader(struct ChunkIndex *ci, short int type) {
+	struct flock l;
+
+	l.l_start = 0;
+	l.l_len = CHUNKINDEX_HEADER_SIZE;
+	l.l_type = type;
+	l.l_whence = SEEK_SET;
+
+	while(fcntl(ci->fd, F_SETLKW, &l) == -1) {
+		if(errno != EINTR)
+			error("unable to lock header of '%s'", ci->path);
+	}
+}
+
+static void ChunkIndex__advanceCursor(struct ChunkIndex *ci, uint64_t generation, uint64_t cursor) {
+	struct ChunkIndex__header h;
+
+	ChunkIndex__lockHeader(ci, F_WRLCK);
+
+	if(ChunkIndex__readHeader(ci, &h) && h.generation == generation && h.cursor < cursor) {
+		h.cursor = cursor;
+
+		if(pwrite(ci->fd, &h.cursor, sizeof(h.cursor), offsetof(struct ChunkIndex__header, cursor)) != (ssize_t)sizeof(h.cursor))
+			warning("unable to update cursor of '%s': %s", ci->path, strerror(errno));
+		else
+			ChunkIndex__compact(ci, &h);
+	}
+
+	ChunkIndex__lockHeader(ci, F_UNLCK);
+}
+
+/**
+ * Выкидывает из начала индекса записи до курсора. Вызывается под локом заголовка.
+ * Если кто-то из писателей прямо сейчас дописывает - пропускаем, успеем в другой раз
+ * @param ci
+ * @param h
+ */
+static void ChunkIndex__compact(struct ChunkIndex *ci, struct ChunkIndex__header *h) {
+	struct stat st;
+	uint64_t end;
+	uint64_t live;
+	char *buf = NULL;
+
+	if(fstat(ci->fd, &st) == -1)
+		error("fstat('%s')", ci->path);
+
+	end = (uint64_t)(st.st_size - CHUNKINDEX_HEADER_SIZE) / CHUNKINDEX_RECORD_SIZE;
+	live = end > h->cursor ? end - h->cursor : 0;
+
+	if(live && (h->cursor < CHUNKINDEX_COMPACT_MIN_RECORDS || live > h->cursor))
+		return;
+
+	if(flock(ci->fd, LOCK_EX | LOCK_NB) == -1)
+		return;
+
+	/* пока ждали лок, могли что-то дописать */
+	if(fstat(ci->fd, &st) == -1)
+		error("fstat('%s')", ci->path);
+
+	end = (uint64_t)(st.st_size - CHUNKINDEX_HEADER_SIZE) / CHUNKINDEX_RECORD_SIZE;
+	live = end > h->cursor ? end - h->cursor : 0;
+
+	debug("compacting index '%s': %" PRIu64 " of %" PRIu64 " records are alive", ci->path, live, end);
+
+	if(live) {
+		size_t size = (size_t)live * CHUNKINDEX_RECORD_SIZE;
+
+		buf = malloc(size);
+		if(!buf)
+			error("malloc(%llu)", (unsigned long long)size);
+
+		if(pread(ci->fd, buf, size, (off_t)(CHUNKINDEX_HEADER_SIZE + h->cursor * CHUNKINDEX_RECORD_SIZE)) != (ssize_t)size
+			|| pwrite(ci->fd, buf, size, CHUNKINDEX_HEADER_SIZE) != (ssize_t)size
+		) {
+			warning("unable to compact '%s': %s", ci->path, strerror(errno));
+			free(buf);
+			flock(ci->fd, LOCK_UN);
+			return;
+		}
+
+		free(buf);
+	}
+
+	if(ftruncate(ci->fd, (off_t)(CHUNKINDEX_HEADER_SIZE + live * CHUNKINDEX_RECORD_SIZE)) == -1)
+		error("ftruncate('%s')", ci->path);
+
+	h->generation++;
+	h->cursor = 0;
+
+	if(pwrite(ci->fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h))
+		error("pwrite('%s')", ci->path);
+
+	flock(ci->fd, LOCK_UN);
+}
@@ -0,0 +1,67 @@
+#ifndef CHUNKINDEX_H
+#define	CHUNKINDEX_H
+
+#include <limits.h>
+#include <stdint.h>
+
+/**
+ * Индекс чанков: файл .index в корне потока. Писатели дописывают в него
+ * имена созданных чанков (O_APPEND), читатели идут по нему от курсора,
+ * который указывает на первую запись, чанк которой может быть ещё не прочитан.
+ *
+ * Всё, что лежит в индексе - только подсказка: захват чанка всё равно
+ * делается через локи, а чанки, которых нет в индексе, находятся
+ * обычным сканированием каталога
+ */
+
+#define CHUNKINDEX_FILENAME ".index"
+
+/* размер заголовка и записи фиксированные */
+#define CHUNKINDEX_HEADER_SIZE 64
+#define CHUNKINDEX_RECORD_SIZE 64
+
+/* коды возврата колбэка захвата чанка */
+#define CHUNKINDEX_CLAIM_GONE -1
+#define CHUNKINDEX_CLAIM_BUSY -2
+
+struct ChunkIndex {
+	int fd;
+	char path[PATH_MAX + 64];
+};
+
+void ChunkIndex_init(struct ChunkIndex *ci);
+
+/**
+ * @return 0 если индекс открыт, -1 если индекса нет (или create и не удалось создать)
+ */
+int ChunkIndex_open(struct ChunkIndex *ci, const char *dir, char create);
+void ChunkIndex_close(struct ChunkIndex *ci);
+
+void ChunkIndex_append(struct ChunkIndex *ci, const char *name);
+
+/**
+ * Идёт по индексу от курсора и пытается захватить чанки через tryClaim().
+ * tryClaim возвращает дескриптор захваченного чанка, CHUNKINDEX_CLAIM_GONE
+ * если чанка уже нет и CHUNKINDEX_CLAIM_BUSY если он кем-то занят.
+ *
+ * Курсор сдвигается за непрерывную последовательность исчезнувших чанков.
+ *
+ * @return дескриптор или -1 если в индексе нечего захватить
+ */
+int ChunkIndex_claim(struct ChunkIndex *ci, int (*tryClaim)(void *ctx, const char *name), void *ctx);
+
+/**
+ * Сколько записей в индексе после курсора - оценка сверху количества
+ * ещё не дочитанных чанков. Локов не берёт, можно звать из обработчика сигнала
+ */
+uint64_t ChunkIndex_pending(struct ChunkIndex *ci);
+
+/**
+ * Имя из последней записи индекса
+ * @param ci
+ * @param name буфер не меньше CHUNKINDEX_RECORD_SIZE
+ * @return 0 или -1 если индекс пуст или последняя запись битая
+ */
+int ChunkIndex_last(struct ChunkIndex *ci, char *name);
+
+#endif	/* CHUNKINDEX_H */
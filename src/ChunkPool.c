@@ -0,0 +1,238 @@
+#include "ChunkPool.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static char ChunkPool__open(struct ChunkPool *cp);
+static int ChunkPool__parseSlot(const char *name);
+static int ChunkPool__moveNoReplace(int fromDirFd, const char *from, int toDirFd, const char *to);
+static void ChunkPool__truncateMoved(struct ChunkPool *cp, const char *slotName, int fd);
+
+void ChunkPool_init(struct ChunkPool *cp, const char *rootDir, char create) {
+	snprintf(cp->dir, sizeof(cp->dir), "%s/%s", rootDir, CHUNKPOOL_DIRNAME);
+
+	cp->d = NULL;
+
+	/* разные процессы начинают с разных слотов, чтобы меньше толкаться */
+	cp->cursor = (unsigned long)getpid();
+
+	if(create && mkdir(cp->dir, 0755) == -1) {
+		if(errno != EEXIST)
+			warning("unable to create chunk pool '%s': %s", cp->dir, strerror(errno));
+	}
+}
+
+void ChunkPool_close(struct ChunkPool *cp) {
+	if(cp->d)
+		closedir(cp->d);
+
+	cp->d = NULL;
+}
+
+int ChunkPool_take(struct ChunkPool *cp, const char *path) {
+	struct dirent *e;
+
+	if(!ChunkPool__open(cp))
+		return -1;
+
+	rewinddir(cp->d);
+
+	while((e = readdir(cp->d))) {
+		if(ChunkPool__parseSlot(e->d_name) < 0)
+			continue;
+
+		/* если за слот борются двое, rename() достанется только одному */
+		if(renameat(dirfd(cp->d), e->d_name, AT_FDCWD, path) == 0) {
+			debug("chunk file taken from pool: %s/%s", cp->dir, e->d_name);
+			return 0;
+		}
+
+		if(errno != ENOENT)
+			warning("rename('%s/%s', '%s'): %s", cp->dir, e->d_name, path, strerror(errno));
+	}
+
+	return -1;
+}
+
+int ChunkPool_put(struct ChunkPool *cp, const char *path, int fd) {
+	char slotName[32];
+	struct dirent *e;
+	uint32_t busy = 0;
+	unsigned long i;
+
+	if(!ChunkPool__open(cp)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	rewinddir(cp->d);
+
+	while((e = readdir(cp->d))) {
+		int slot = ChunkPool__parseSlot(e->d_name);
+
+		if(slot >= 0)
+			busy |= (uint32_t)1 << slot;
+	}
+
+	if(busy == (uint32_t)((1ull << CHUNKPOOL_SLOTS) - 1)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	/*
+	 * После переноса файл может сразу забрать писатель, но пока мы держим
+	 * F_RDLCK на байте 1, он его не возьмёт (см. WStream__createChunk()).
+	 * Так что обрезаем только после переноса: дочитать чанк могут сразу
+	 * несколько читателей сегментов, а перенести его удастся только одному
+	 */
+	if(!flockRangeNB(fd, 1, 1, F_RDLCK)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	for(i = 0; i < CHUNKPOOL_SLOTS; i++) {
+		unsigned long slot = cp->cursor++ % CHUNKPOOL_SLOTS;
+
+		if(busy & ((uint32_t)1 << slot))
+			continue;
+
+		snprintf(slotName, sizeof(slotName), "slot%lu", slot);
+
+		if(ChunkPool__moveNoReplace(AT_FDCWD, path, dirfd(cp->d), slotName) == 0) {
+			debug("chunk file returned to pool: %s/%s", cp->dir, slotName);
+
+			ChunkPool__truncateMoved(cp, slotName, fd);
+			flockRangeNB(fd, 1, 0, F_UNLCK);
+
+			return 0;
+		}
+
+		/* слот только что занял кто-то другой, иначе (ENOENT) чанк убрал другой читатель */
+		if(errno != EEXIST)
+			break;
+	}
+
+	if(i == CHUNKPOOL_SLOTS)
+		errno = EEXIST;
+
+	return -1;
+}
+
+/**
+ * Обрезает перенесённый в слот файл, если там всё ещё он: писатель,
+ * не сумевший взять наш лок, мог уже забрать его оттуда и удалить
+ */
+static void ChunkPool__truncateMoved(struct ChunkPool *cp, const char *slotName, int fd) {
+	struct stat moved;
+	struct stat st;
+
+	if(fstat(fd, &st) == -1 || fstatat(dirfd(cp->d), slotName, &moved, AT_SYMLINK_NOFOLLOW) == -1)
+		return;
+
+	if(st.st_ino != moved.st_ino || st.st_dev != moved.st_dev)
+		return;
+
+	/* не страшно: писатель всё равно обрезает файл из пула */
+	if(ftruncate(fd, 0) == -1)
+		warning("ftruncate('%s/%s'): %s", cp->dir, slotName, strerror(errno));
+}
+
+void ChunkPool_remove(const char *rootDir) {
+	char dirPath[PATH_MAX + 64];
+	char path[PATH_MAX + 64 + 256];
+	DIR *d;
+	struct dirent *e;
+
+	snprintf(dirPath, sizeof(dirPath), "%s/%s", rootDir, CHUNKPOOL_DIRNAME);
+
+	d = opendir(dirPath);
+	if(!d) {
+		if(errno != ENOENT)
+			warning("opendir('%s'): %s", dirPath, strerror(errno));
+
+		return;
+	}
+
+	while((e = readdir(d))) {
+		if(e->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dirPath, e->d_name);
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink() pooled chunk '%s': %s", path, strerror(errno));
+	}
+
+	closedir(d);
+
+	if(rmdir(dirPath) == -1 && errno != ENOENT)
+		warning("rmdir('%s'): %s", dirPath, strerror(errno));
+}
+
+/**
+ * @return 1 если каталог пула открыт
+ */
+static char ChunkPool__open(struct ChunkPool *cp) {
+	if(cp->d)
+		return 1;
+
+	/* у читателя каталога может ещё не быть, попробуем в следующий раз */
+	cp->d = opendir(cp->dir);
+	if(!cp->d && errno != ENOENT)
+		warning("opendir('%s'): %s", cp->dir, strerror(errno));
+
+	return cp->d != NULL;
+}
+
+/**
+ * @return номер слота или -1 если это не слот
+ */
+static int ChunkPool__parseSlot(const char *name) {
+	char *end;
+	unsigned long slot;
+
+	if(strncmp(name, "slot", 4) != 0)
+		return -1;
+
+	slot = strtoul(name + 4, &end, 10);
+	if(end == name + 4 || *end || slot >= CHUNKPOOL_SLOTS)
+		return -1;
+
+	return (int)slot;
+}
+
+/**
+ * rename() без перезаписи существующего файла
+ * @return 0 или -1 (EEXIST если to уже есть)
+ */
+static int ChunkPool__moveNoReplace(int fromDirFd, const char *from, int toDirFd, const char *to) {
+#ifdef RENAME_NOREPLACE
+	if(renameat2(fromDirFd, from, toDirFd, to, RENAME_NOREPLACE) == 0)
+		return 0;
+
+	if(errno != EINVAL && errno != ENOSYS)
+		return -1;
+#endif
+
+	/* ФС без renameat2(): link() тоже не перезаписывает */
+	if(linkat(fromDirFd, from, toDirFd, to, 0) == -1)
+		return -1;
+
+	/* ссылки могли успеть сделать двое, но удалить from удастся только одному */
+	if(unlinkat(fromDirFd, from, 0) == -1) {
+		int err = errno;
+
+		unlinkat(toDirFd, to, 0);
+		errno = err;
+
+		return -1;
+	}
+
+	return 0;
+}
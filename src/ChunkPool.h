@@ -0,0 +1,60 @@
+#ifndef CHUNKPOOL_H
+#define	CHUNKPOOL_H
+
+#include <dirent.h>
+#include <limits.h>
+
+/**
+ * Пул пустых файлов чанков: каталог .pool в корне потока.
+ * Читатель вместо unlink() дочитанного чанка переносит его в пул и обрезает,
+ * писатель забирает файл из пула вместо создания нового. Так в установившемся
+ * режиме не создаются и не удаляются inode.
+ *
+ * Файлы в пуле лежат в слотах slotN, занимаются и освобождаются они
+ * через rename(), поэтому никаких локов не нужно: какие слоты заняты,
+ * видно по содержимому каталога. Пул ограничен: если свободного слота
+ * не нашлось, чанк просто удаляется
+ */
+
+#define CHUNKPOOL_DIRNAME ".pool"
+
+/* не больше 32, занятые слоты хранятся битовой маской */
+#define CHUNKPOOL_SLOTS 32
+
+struct ChunkPool {
+	char dir[PATH_MAX + 64];
+
+	/**
+	 * каталог пула открывается при первом обращении, NULL - ещё не открыт
+	 */
+	DIR *d;
+
+	unsigned long cursor;
+};
+
+/**
+ * @param create режим писателя: создать каталог пула если его нет
+ */
+void ChunkPool_init(struct ChunkPool *cp, const char *rootDir, char create);
+void ChunkPool_close(struct ChunkPool *cp);
+
+/**
+ * Переносит файл из пула в path
+ * @return 0 если файл теперь лежит в path, -1 если пул пуст
+ */
+int ChunkPool_take(struct ChunkPool *cp, const char *path);
+
+/**
+ * Переносит дочитанный чанк в пул и обрезает его
+ * @param fd открытый на запись дескриптор чанка
+ * @return 0 если чанк в пуле, -1 если нет (errno от rename()), тогда чанк надо удалить.
+ * ENOENT - чанк уже перенёс или удалил кто-то другой
+ */
+int ChunkPool_put(struct ChunkPool *cp, const char *path, int fd);
+
+/**
+ * Удаляет пул вместе с файлами, вызывается при удалении каталога потока
+ */
+void ChunkPool_remove(const char *rootDir);
+
+#endif	/* CHUNKPOOL_H */
@@ -0,0 +1,288 @@
+#include "ConsumerGroup.h"
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int ConsumerGroup__findSlot(const char *groupsDir, const char *name);
+static char ConsumerGroup__exists(struct ConsumerGroupList *gl, size_t i);
+
+void ConsumerGroup_initList(struct ConsumerGroupList *gl, const char *rootDir) {
+	snprintf(gl->dir, sizeof(gl->dir), "%s/%s", rootDir, CONSUMERGROUP_DIRNAME);
+
+	gl->mtime.tv_sec = 0;
+	gl->mtime.tv_nsec = 0;
+	gl->names = NULL;
+	gl->count = 0;
+}
+
+void ConsumerGroup_freeList(struct ConsumerGroupList *gl) {
+	free(gl->names);
+
+	gl->names = NULL;
+	gl->count = 0;
+}
+
+void ConsumerGroup_refreshList(struct ConsumerGroupList *gl) {
+	struct stat st;
+	struct dirent *e;
+	size_t size = 0;
+	DIR *d;
+
+	if(stat(gl->dir, &st) == -1) {
+		if(errno != ENOENT)
+			warning("stat('%s'): %s", gl->dir, strerror(errno));
+
+		gl->mtime.tv_sec = 0;
+		gl->mtime.tv_nsec = 0;
+		gl->count = 0;
+
+		return;
+	}
+
+	if(st.st_mtim.tv_sec == gl->mtime.tv_sec && st.st_mtim.tv_nsec == gl->mtime.tv_nsec)
+		return;
+
+	d = opendir(gl->dir);
+	if(!d) {
+		warning("opendir('%s'): %s", gl->dir, strerror(errno));
+		return;
+	}
+
+	gl->count = 0;
+
+	while((e = readdir(d))) {
+		if(e->d_name[0] == '.' || strlen(e->d_name) > CONSUMERGROUP_NAME_MAX)
+			continue;
+
+		if(gl->count == size) {
+			char (*names)[CONSUMERGROUP_NAME_MAX + 1];
+
+			size = size ? size * 2 : 8;
+			names = realloc(gl->names, size * sizeof(*gl->names));
+			if(!names) {
+				/* список неполный, перечитаем в следующий раз */
+				closedir(d);
+				gl->count = 0;
+				error("realloc()");
+			}
+
+			gl->names = names;
+		}
+
+		strcpy(gl->names[gl->count++], e->d_name);
+	}
+
+	closedir(d);
+
+	gl->mtime = st.st_mtim;
+
+	debug("%lu consumer groups in '%s'", (unsigned long)gl->count, gl->dir);
+}
+
+void ConsumerGroup_linkChunk(struct ConsumerGroupList *gl, const char *path, const char *name) {
+	char linkPath[PATH_MAX + 160];
+	size_t i;
+
+	ConsumerGroup_refreshList(gl);
+
+	for(i = 0; i < gl->count; i++) {
+		snprintf(linkPath, sizeof(linkPath), "%s/%s/%s", gl->dir, gl->names[i], name);
+
+		if(link(path, linkPath) == 0)
+			continue;
+
+		/* чанк в бакете: бакета в группе ещё нет */
+		if(errno == ENOENT && strchr(name, '/')) {
+			char bucketPath[PATH_MAX + 160];
+
+			snprintf(bucketPath, sizeof(bucketPath), "%.*s", (int)(strrchr(linkPath, '/') - linkPath), linkPath);
+
+			if((mkdir(bucketPath, 0755) == 0 || errno == EEXIST) && link(path, linkPath) == 0)
+				continue;
+		}
+
+		/* группу могли только что удалить, а вот пропавший чанк - уже потеря данных */
+		if(errno == ENOENT && !ConsumerGroup__exists(gl, i))
+			continue;
+
+		warning("link('%s', '%s'): %s", path, linkPath, strerror(errno));
+	}
+}
+
+/**
+ * @return 1 если каталог i-й группы на месте. errno не меняется
+ */
+static char ConsumerGroup__exists(struct ConsumerGroupList *gl, size_t i) {
+	char groupDir[PATH_MAX + 96];
+	struct stat st;
+	int err = errno;
+	char exists;
+
+	snprintf(groupDir, sizeof(groupDir), "%s/%s", gl->dir, gl->names[i]);
+	exists = stat(groupDir, &st) == 0;
+
+	errno = err;
+
+	return exists;
+}
+
+unsigned long ConsumerGroup_register(const char *rootDir, const char *name, char *groupDir, size_t groupDirSize) {
+	char groupsDir[PATH_MAX + 64];
+	char slotPath[PATH_MAX + 96];
+	char target[CONSUMERGROUP_NAME_MAX + 2];
+	unsigned long slot;
+	int found;
+
+	if(!*name || *name == '.' || strchr(name, '/') || strlen(name) > CONSUMERGROUP_NAME_MAX)
+		error("invalid consumer group name: '%s'", name);
+
+	snprintf(groupsDir, sizeof(groupsDir), "%s/%s", rootDir, CONSUMERGROUP_DIRNAME);
+	snprintf(groupDir, groupDirSize, "%s/%s", groupsDir, name);
+
+	if(mkdir(groupsDir, 0755) == -1 && errno != EEXIST)
+		error("mkdir('%s')", groupsDir);
+
+	if(mkdir(groupDir, 0755) == -1 && errno != EEXIST)
+		error("mkdir('%s')", groupDir);
+
+	found = ConsumerGroup__findSlot(groupsDir, name);
+	if(found >= 0)
+		return (unsigned long)found;
+
+	/* занимаем первый свободный слот, одновременно регистрирующие ту же группу сойдутся на одном */
+	for(slot = 0;; slot++) {
+		ssize_t len;
+
+		snprintf(slotPath, sizeof(slotPath), "%s/" CONSUMERGROUP_SLOT_PREFIX "%lu", groupsDir, slot);
+
+		if(symlink(name, slotPath) == 0)
+			break;
+
+		if(errno != EEXIST)
+			error("symlink('%s', '%s')", name, slotPath);
+
+		len = readlink(slotPath, target, sizeof(target) - 1);
+		if(len == -1)
+			continue;
+
+		target[len] = 0;
+
+		if(strcmp(target, name) == 0)
+			break;
+	}
+
+	debug("consumer group '%s' registered in slot %lu", name, slot);
+
+	return slot;
+}
+
+int ConsumerGroup_unregister(const char *rootDir, const char *name) {
+	char groupsDir[PATH_MAX + 64];
+	char path[PATH_MAX + 96];
+	int slot;
+
+	snprintf(groupsDir, sizeof(groupsDir), "%s/%s", rootDir, CONSUMERGROUP_DIRNAME);
+	snprintf(path, sizeof(path), "%s/%s", groupsDir, name);
+
+	if(rmdir(path) == -1 && errno != ENOENT) {
+		if(errno != ENOTEMPTY && errno != EEXIST)
+			warning("rmdir('%s'): %s", path, strerror(errno));
+
+		return -1;
+	}
+
+	slot = ConsumerGroup__findSlot(groupsDir, name);
+	if(slot >= 0) {
+		snprintf(path, sizeof(path), "%s/" CONSUMERGROUP_SLOT_PREFIX "%d", groupsDir, slot);
+
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+	}
+
+	debug("consumer group '%s' unregistered", name);
+
+	return 0;
+}
+
+int ConsumerGroup_removeDir(const char *rootDir) {
+	char path[PATH_MAX + 64];
+	struct dirent *e;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%s", rootDir, CONSUMERGROUP_DIRNAME);
+
+	d = opendir(path);
+	if(!d) {
+		if(errno == ENOENT)
+			return 0;
+
+		error("opendir('%s')", path);
+	}
+
+	/* слоты удалённых без ConsumerGroup_unregister() групп ни на что не указывают */
+	while((e = readdir(d))) {
+		char slotPath[PATH_MAX + 64 + NAME_MAX + 2];
+		struct stat st;
+
+		if(strncmp(e->d_name, CONSUMERGROUP_SLOT_PREFIX, strlen(CONSUMERGROUP_SLOT_PREFIX)) != 0)
+			continue;
+
+		snprintf(slotPath, sizeof(slotPath), "%s/%s", path, e->d_name);
+
+		if(stat(slotPath, &st) == -1 && errno == ENOENT)
+			unlink(slotPath);
+	}
+
+	closedir(d);
+
+	if(rmdir(path) == 0 || errno == ENOENT)
+		return 0;
+
+	if(errno != ENOTEMPTY && errno != EEXIST)
+		error("rmdir('%s')", path);
+
+	return -1;
+}
+
+/**
+ * @return номер слота группы или -1
+ */
+static int ConsumerGroup__findSlot(const char *groupsDir, const char *name) {
+	char path[PATH_MAX + 64 + NAME_MAX + 2];
+	char target[CONSUMERGROUP_NAME_MAX + 2];
+	struct dirent *e;
+	int slot = -1;
+	DIR *d;
+
+	d = opendir(groupsDir);
+	if(!d)
+		return -1;
+
+	while(slot < 0 && (e = readdir(d))) {
+		ssize_t len;
+
+		if(strncmp(e->d_name, CONSUMERGROUP_SLOT_PREFIX, strlen(CONSUMERGROUP_SLOT_PREFIX)) != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", groupsDir, e->d_name);
+
+		len = readlink(path, target, sizeof(target) - 1);
+		if(len == -1)
+			continue;
+
+		target[len] = 0;
+
+		if(strcmp(target, name) == 0)
+			slot = atoi(e->d_name + strlen(CONSUMERGROUP_SLOT_PREFIX));
+	}
+
+	closedir(d);
+
+	return slot;
+}
@@ -0,0 +1,81 @@
+#ifndef CONSUMERGROUP_H
+#define	CONSUMERGROUP_H
+
+#include <limits.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Группы читателей: каждая группа читает поток целиком и независимо от других.
+ *
+ * Группа - каталог .groups/<имя> в корне потока. Писатель создаёт каждый
+ * новый чанк в корне, как обычно, и делает на него жёсткие ссылки во все
+ * каталоги групп. Дальше каждая группа читает свои ссылки обычным образом
+ * (со своими .offset и .segments) и удаляет их, а данные лежат на диске
+ * один раз и освобождаются, когда чанк дочитают все группы.
+ * Корень потока - группа по умолчанию, читатели без группы работают как раньше.
+ *
+ * Файл чанка у всех групп общий, а fcntl-локи привязаны к файлу, поэтому
+ * каждая группа лочит свой диапазон: ConsumerGroup_lockBase(slot).
+ * Номер слота группы хранится симлинком .groups/.slot.N -> имя
+ */
+
+#define CONSUMERGROUP_DIRNAME ".groups"
+#define CONSUMERGROUP_SLOT_PREFIX ".slot."
+#define CONSUMERGROUP_NAME_MAX 64
+
+#define ConsumerGroup_lockBase(slot) ((off_t)((slot) + 1) << 32)
+
+/**
+ * Список групп для писателя, перечитывается при изменении каталога групп
+ */
+struct ConsumerGroupList {
+	char dir[PATH_MAX + 64];
+	struct timespec mtime;
+
+	char (*names)[CONSUMERGROUP_NAME_MAX + 1];
+	size_t count;
+};
+
+void ConsumerGroup_initList(struct ConsumerGroupList *gl, const char *rootDir);
+void ConsumerGroup_freeList(struct ConsumerGroupList *gl);
+
+/**
+ * Перечитывает список групп, если каталог групп менялся
+ * @param gl
+ */
+void ConsumerGroup_refreshList(struct ConsumerGroupList *gl);
+
+/**
+ * Делает ссылки на только что созданный чанк во всех группах.
+ * Зовётся до переноса чанка в корень, пока его не может забрать читатель
+ * @param gl
+ * @param path путь к временному файлу чанка
+ * @param name имя чанка относительно корня, с бакетом, если он есть
+ */
+void ConsumerGroup_linkChunk(struct ConsumerGroupList *gl, const char *path, const char *name);
+
+/**
+ * Регистрирует группу, если её ещё нет. Группа получает только чанки,
+ * созданные после регистрации
+ * @param rootDir
+ * @param name
+ * @param groupDir сюда пишется путь к каталогу группы
+ * @param groupDirSize
+ * @return номер слота группы
+ */
+unsigned long ConsumerGroup_register(const char *rootDir, const char *name, char *groupDir, size_t groupDirSize);
+
+/**
+ * Удаляет дочитанную группу. Если в её каталоге что-то появилось, группа остаётся
+ * @return 0 если группа удалена
+ */
+int ConsumerGroup_unregister(const char *rootDir, const char *name);
+
+/**
+ * Удаляет каталог групп, если групп не осталось
+ * @return 0 если каталога групп больше нет, -1 если есть группы
+ */
+int ConsumerGroup_removeDir(const char *rootDir);
+
+#endif	/* CONSUMERGROUP_H */
@@ -0,0 +1,363 @@
+#include "Framing.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* varint длиннее уже не влезает в uint64_t */
+#define FRAMING_VARINT_MAX_LENGTH 10
+
+static size_t Framing__nextDelimited(const struct Framing *f, struct FramingState *st, const char *buf, size_t len);
+static size_t Framing__nextPrefixed(const struct Framing *f, struct FramingState *st, const char *buf, size_t len);
+static void Framing__format(const struct Framing *f, char *buf, size_t size);
+
+void Framing_init(struct Framing *f) {
+	f->type = FRAMING_LINES;
+	f->delimiter[0] = '\n';
+	f->delimiterLength = 1;
+}
+
+int Framing_setType(struct Framing *f, const char *name) {
+	Framing_init(f);
+
+	if(strcmp(name, "lines") == 0)
+		return 0;
+
+	if(strcmp(name, "nul") == 0) {
+		f->type = FRAMING_DELIMITER;
+		f->delimiter[0] = 0;
+
+		return 0;
+	}
+
+	if(strcmp(name, "u32") == 0) {
+		f->type = FRAMING_U32;
+		f->delimiterLength = 0;
+
+		return 0;
+	}
+
+	if(strcmp(name, "varint") == 0) {
+		f->type = FRAMING_VARINT;
+		f->delimiterLength = 0;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+int Framing_setDelimiter(struct Framing *f, const char *spec) {
+	size_t len = 0;
+
+	Framing_init(f);
+
+	while(*spec) {
+		char c = *spec++;
+
+		if(len == sizeof(f->delimiter))
+			return -1;
+
+		if(c == '\\') {
+			switch(*spec++) {
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case '0': c = 0; break;
+				case '\\': c = '\\'; break;
+				case 'x': {
+					char hex[3] = {0, 0, 0};
+					char *end;
+
+					if(!spec[0] || !spec[1])
+						return -1;
+
+					hex[0] = spec[0];
+					hex[1] = spec[1];
+
+					c = (char)strtoul(hex, &end, 16);
+					if(*end)
+						return -1;
+
+					spec += 2;
+				}
+				break;
+				default:
+					return -1;
+			}
+		}
+
+		f->delimiter[len++] = c;
+	}
+
+	if(!len)
+		return -1;
+
+	f->delimiterLength = len;
+	f->type = len == 1 && f->delimiter[0] == '\n' ? FRAMING_LINES : FRAMING_DELIMITER;
+
+	return 0;
+}
+
+void Framing_resetState(struct FramingState *st) {
+	st->matched = 0;
+	st->headerLength = 0;
+	st->length = 0;
+	st->lengthIsKnown = 0;
+	st->remaining = 0;
+}
+
+size_t Framing_next(const struct Framing *f, struct FramingState *st, const char *buf, size_t len) {
+	if(Framing_isSelfSynchronizing(f))
+		return Framing__nextDelimited(f, st, buf, len);
+
+	return Framing__nextPrefixed(f, st, buf, len);
+}
+
+size_t Framing_last(const struct Framing *f, struct FramingState *st, const char *buf, size_t len) {
+	size_t last = 0;
+
+	/* самый частый случай: один байт ищется с конца и состояния не требует */
+	if(Framing_isSelfSynchronizing(f) && f->delimiterLength == 1) {
+		const char *end = memrchr(buf, f->delimiter[0], len);
+
+		return end ? (size_t)(end - buf) + 1 : 0;
+	}
+
+	while(last < len) {
+		size_t next = Framing_next(f, st, buf + last, len - last);
+
+		if(!next)
+			break;
+
+		last += next;
+	}
+
+	return last;
+}
+
+const char *Framing_findDelimiter(const struct Framing *f, const char *buf, size_t len) {
+	if(f->delimiterLength == 1)
+		return memchr(buf, f->delimiter[0], len);
+
+	return memmem(buf, len, f->delimiter, f->delimiterLength);
+}
+
+/**
+ * Разделители не должны перекрываться сами с собой (как "aa"),
+ * иначе граница зависит от того, откуда начат поиск
+ */
+static size_t Framing__nextDelimited(const struct Framing *f, struct FramingState *st, const char *buf, size_t len) {
+	const char *end;
+	size_t k;
+
+	if(st->matched) {
+		/* продолжение разделителя, начатого в конце прошлого буфера */
+		size_t need = f->delimiterLength - st->matched;
+		size_t have = len < need ? len : need;
+
+		if(memcmp(buf, f->delimiter + st->matched, have) == 0) {
+			if(have == need) {
+				st->matched = 0;
+				return need;
+			}
+
+			st->matched += have;
+			return 0;
+		}
+
+		st->matched = 0;
+	}
+
+	end = Framing_findDelimiter(f, buf, len);
+	if(end)
+		return (size_t)(end - buf) + f->delimiterLength;
+
+	/* начало разделителя в конце буфера */
+	for(k = f->delimiterLength - 1 < len ? f->delimiterLength - 1 : len; k > 0; k--) {
+		if(memcmp(buf + len - k, f->delimiter, k) == 0) {
+			st->matched = k;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static size_t Framing__nextPrefixed(const struct Framing *f, struct FramingState *st, const char *buf, size_t len) {
+	size_t pos = 0;
+
+	while(!st->lengthIsKnown) {
+		unsigned char c;
+
+		if(pos == len)
+			return 0;
+
+		c = (unsigned char)buf[pos++];
+
+		if(f->type == FRAMING_U32) {
+			st->length = (st->length << 8) | c;
+
+			if(++st->headerLength == 4)
+				st->lengthIsKnown = 1;
+		} else {
+			st->length |= (uint64_t)(c & 0x7f) << (7 * st->headerLength);
+
+			if(!(c & 0x80))
+				st->lengthIsKnown = 1;
+			else if(++st->headerLength == FRAMING_VARINT_MAX_LENGTH)
+				error("invalid varint record length");
+		}
+
+		if(st->lengthIsKnown)
+			st->remaining = st->length;
+	}
+
+	if(len - pos < st->remaining) {
+		st->remaining -= len - pos;
+		return 0;
+	}
+
+	pos += (size_t)st->remaining;
+	Framing_resetState(st);
+
+	return pos;
+}
+
+static void Framing__format(const struct Framing *f, char *buf, size_t size) {
+	size_t i;
+	size_t len;
+
+	switch(f->type) {
+		case FRAMING_LINES:
+			snprintf(buf, size, "lines\n");
+			return;
+		case FRAMING_U32:
+			snprintf(buf, size, "u32\n");
+			return;
+		case FRAMING_VARINT:
+			snprintf(buf, size, "varint\n");
+			return;
+	}
+
+	len = (size_t)snprintf(buf, size, "delimiter ");
+
+	for(i = 0; i < f->delimiterLength && len + 3 < size; i++)
+		len += (size_t)snprintf(buf + len, size - len, "%02x", (unsigned char)f->delimiter[i]);
+
+	snprintf(buf + len, size - len, "\n");
+}
+
+void Framing_register(const struct Framing *f, const char *rootDir) {
+	char path[PATH_MAX + 64];
+	char tmpPath[PATH_MAX + 96];
+	char wanted[64];
+	char existing[64] = "unknown";
+	struct Framing stored;
+	int fd;
+
+	Framing__format(f, wanted, sizeof(wanted));
+
+	snprintf(path, sizeof(path), "%s/" FRAMING_FILENAME, rootDir);
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%lu", path, (unsigned long)getpid());
+
+	/* через link(), чтобы другой писатель не увидел файл недописанным */
+	fd = open(tmpPath, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if(fd == -1)
+		error("open('%s')", tmpPath);
+
+	if(write(fd, wanted, strlen(wanted)) != (ssize_t)strlen(wanted)) {
+		int err = errno;
+
+		close(fd);
+		unlink(tmpPath);
+		errno = err;
+		error("write('%s')", tmpPath);
+	}
+
+	close(fd);
+
+	if(link(tmpPath, path) == -1 && errno != EEXIST) {
+		int err = errno;
+
+		unlink(tmpPath);
+		errno = err;
+		error("link('%s', '%s')", tmpPath, path);
+	}
+
+	if(unlink(tmpPath) == -1)
+		warning("unable to unlink() '%s': %s", tmpPath, strerror(errno));
+
+	if(Framing_load(&stored, rootDir) == 0) {
+		Framing__format(&stored, existing, sizeof(existing));
+
+		if(strcmp(existing, wanted) == 0)
+			return;
+	}
+
+	existing[strcspn(existing, "\n")] = 0;
+	wanted[strcspn(wanted, "\n")] = 0;
+
+	errno = 0;
+	error("stream '%s' uses framing '%s', not '%s'", rootDir, existing, wanted);
+}
+
+int Framing_load(struct Framing *f, const char *rootDir) {
+	char path[PATH_MAX + 64];
+	char buf[64];
+	ssize_t rd;
+	int fd;
+
+	Framing_init(f);
+
+	snprintf(path, sizeof(path), "%s/" FRAMING_FILENAME, rootDir);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		/* поток без разбивки - строки, как раньше */
+		if(errno == ENOENT)
+			return 0;
+
+		warning("unable to open '%s': %s", path, strerror(errno));
+		return -1;
+	}
+
+	rd = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if(rd <= 0)
+		return -1;
+
+	buf[rd] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+
+	if(strncmp(buf, "delimiter ", 10) == 0) {
+		const char *hex = buf + 10;
+		size_t len = strlen(hex) / 2;
+		size_t i;
+
+		if(!len || len > sizeof(f->delimiter) || strlen(hex) % 2)
+			return -1;
+
+		for(i = 0; i < len; i++) {
+			char byte[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+			char *end;
+
+			f->delimiter[i] = (char)strtoul(byte, &end, 16);
+			if(*end)
+				return -1;
+		}
+
+		f->type = FRAMING_DELIMITER;
+		f->delimiterLength = len;
+
+		return 0;
+	}
+
+	return Framing_setType(f, buf);
+}
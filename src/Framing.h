@@ -0,0 +1,115 @@
+#ifndef FRAMING_H
+#define	FRAMING_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/**
+ * Как поток режется на записи. Запись никогда не разрывается между чанками,
+ * так что читатель всегда получает записи целиком.
+ *
+ * Поиск разделителя - memchr()/memrchr()/memmem() из libc, они уже
+ * векторизованы. Для префикса длины сканировать ничего не нужно:
+ * записи перебираются по заголовкам
+ */
+
+#define FRAMING_LINES 0
+#define FRAMING_DELIMITER 1
+/* длина - 4 байта big endian */
+#define FRAMING_U32 2
+/* длина - varint как в protobuf */
+#define FRAMING_VARINT 3
+
+#define FRAMING_DELIMITER_MAX_LENGTH 16
+
+/**
+ * Писатель записывает сюда свою разбивку, читатели по ней ищут
+ * границы сегментов, а другие писатели проверяют, что пишут так же
+ */
+#define FRAMING_FILENAME ".framing"
+
+struct Framing {
+	int type;
+
+	char delimiter[FRAMING_DELIMITER_MAX_LENGTH];
+	size_t delimiterLength;
+};
+
+/**
+ * Где мы внутри записи, которая не закончилась в предыдущем буфере
+ */
+struct FramingState {
+	/**
+	 * сколько байт разделителя совпало в конце предыдущего буфера
+	 */
+	size_t matched;
+
+	/**
+	 * префикс длины: сколько байт заголовка уже прочитано, длина
+	 * и сколько байт записи осталось, когда заголовок прочитан целиком
+	 */
+	size_t headerLength;
+	uint64_t length;
+	char lengthIsKnown;
+	uint64_t remaining;
+};
+
+void Framing_init(struct Framing *f);
+
+/**
+ * @param f
+ * @param name lines, nul, u32 или varint
+ * @return 0 или -1 если имя неизвестно
+ */
+int Framing_setType(struct Framing *f, const char *name);
+
+/**
+ * Разделитель с экранированием как в C: \n, \r, \t, \0, \\ и \xHH
+ * @param f
+ * @param spec
+ * @return 0 или -1 если разделитель пустой или слишком длинный
+ */
+int Framing_setDelimiter(struct Framing *f, const char *spec);
+
+/**
+ * Можно ли найти границу записи с произвольного места
+ */
+#define Framing_isSelfSynchronizing(f) ((f)->type == FRAMING_LINES || (f)->type == FRAMING_DELIMITER)
+
+void Framing_resetState(struct FramingState *st);
+
+/**
+ * Ищет конец первой записи в buf, продолжая разбор с состояния st
+ * @return оффсет сразу после конца записи или 0 если запись в buf не закончилась
+ */
+size_t Framing_next(const struct Framing *f, struct FramingState *st, const char *buf, size_t len);
+
+/**
+ * То же, но ищет конец последней записи. st после вызова описывает хвост за ней
+ * @return оффсет сразу после конца последней записи или 0
+ */
+size_t Framing_last(const struct Framing *f, struct FramingState *st, const char *buf, size_t len);
+
+/**
+ * Ищет разделитель без учёта состояния, для сегментов читателя
+ * @return указатель на начало разделителя или NULL
+ */
+const char *Framing_findDelimiter(const struct Framing *f, const char *buf, size_t len);
+
+/**
+ * Сверяет разбивку с FRAMING_FILENAME в каталоге потока, создавая его, если нет.
+ * При расхождении - error()
+ * @param f
+ * @param rootDir
+ */
+void Framing_register(const struct Framing *f, const char *rootDir);
+
+/**
+ * Читает разбивку потока из FRAMING_FILENAME, если его нет - FRAMING_LINES
+ * @param f
+ * @param rootDir
+ * @return 0 или -1 если файл не прочитать или разбивка неизвестна
+ */
+int Framing_load(struct Framing *f, const char *rootDir);
+
+#endif	/* FRAMING_H */
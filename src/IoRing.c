@@ -0,0 +1,287 @@
+#include "IoRing.h"
+#include "common.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if PIT_IO_URING && defined(__linux__)
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#define IORING_ENABLED
+#endif
+
+#ifdef IORING_ENABLED
+
+static void IoRing__reap(struct IoRing *r);
+static void IoRing__finish(struct IoRing__request *req, size_t done);
+
+static int IoRing__setup(unsigned entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int IoRing__enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+int IoRing_init(struct IoRing *r, unsigned entries) {
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = IoRing__setup(entries, &p);
+	if(r->fd == -1)
+		return -1;
+
+	r->entries = p.sq_entries;
+
+	r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(r->cqRingSize > r->sqRingSize)
+			r->sqRingSize = r->cqRingSize;
+
+		r->cqRingSize = r->sqRingSize;
+	}
+
+	r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sqRing == MAP_FAILED)
+		error("mmap(IORING_OFF_SQ_RING)");
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cqRing = r->sqRing;
+	} else {
+		r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cqRing == MAP_FAILED)
+			error("mmap(IORING_OFF_CQ_RING)");
+	}
+
+	r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED)
+		error("mmap(IORING_OFF_SQES)");
+
+	r->sqHead = (unsigned *)((char *)r->sqRing + p.sq_off.head);
+	r->sqTail = (unsigned *)((char *)r->sqRing + p.sq_off.tail);
+	r->sqMask = (unsigned *)((char *)r->sqRing + p.sq_off.ring_mask);
+	r->sqArray = (unsigned *)((char *)r->sqRing + p.sq_off.array);
+
+	r->cqHead = (unsigned *)((char *)r->cqRing + p.cq_off.head);
+	r->cqTail = (unsigned *)((char *)r->cqRing + p.cq_off.tail);
+	r->cqMask = (unsigned *)((char *)r->cqRing + p.cq_off.ring_mask);
+	r->cqes = (char *)r->cqRing + p.cq_off.cqes;
+
+	r->requests = calloc(r->entries, sizeof(*r->requests));
+	if(!r->requests)
+		error("calloc(%u)", r->entries);
+
+	debug("io_uring initialized: %u entries", r->entries);
+
+	return 0;
+}
+
+void IoRing_destroy(struct IoRing *r) {
+	if(r->fd < 0)
+		return;
+
+	IoRing_waitAll(r);
+
+	munmap(r->sqes, r->sqesSize);
+
+	if(r->cqRing != r->sqRing)
+		munmap(r->cqRing, r->cqRingSize);
+
+	munmap(r->sqRing, r->sqRingSize);
+
+	free(r->requests);
+	r->requests = NULL;
+
+	close(r->fd);
+	r->fd = -1;
+}
+
+uint64_t IoRing_write(struct IoRing *r, int fd, const char *buf, size_t len, off_t offset) {
+	struct io_uring_sqe *sqe;
+	struct IoRing__request *req;
+	unsigned tail;
+	unsigned idx;
+
+	if(len > UINT32_MAX)
+		error("io_uring write of %llu bytes is too big", (unsigned long long)len);
+
+	/* в ядре не должно быть больше запросов, чем записей в SQ */
+	while(IoRing_pending(r) >= r->entries)
+		IoRing_wait(r, r->completedSeq + 1);
+
+	/*
+	 * запись в пайп может завершиться частично, а хвост дописывается
+	 * уже синхронно. Чтобы он не оказался после следующего запроса,
+	 * в текущую позицию пишем не более чем одним запросом за раз
+	 */
+	if(offset == -1 && r->streamSeq > r->completedSeq)
+		IoRing_wait(r, r->streamSeq);
+
+	tail = *r->sqTail;
+	idx = tail & *r->sqMask;
+
+	sqe = (struct io_uring_sqe *)r->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->flags = IOSQE_IO_DRAIN;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->off = (uint64_t)offset;
+	sqe->user_data = ++r->queuedSeq;
+
+	req = &r->requests[r->queuedSeq % r->entries];
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->offset = offset;
+
+	r->sqArray[idx] = idx;
+	__atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	r->toSubmit++;
+
+	if(offset == -1)
+		r->streamSeq = r->queuedSeq;
+
+	return r->queuedSeq;
+}
+
+void IoRing_submit(struct IoRing *r) {
+	while(r->toSubmit) {
+		int ret = IoRing__enter(r->fd, r->toSubmit, 0, 0);
+
+		if(ret == -1) {
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				IoRing__reap(r);
+				continue;
+			}
+
+			error("io_uring_enter()");
+		}
+
+		r->toSubmit -= (unsigned)ret;
+	}
+}
+
+void IoRing_wait(struct IoRing *r, uint64_t seq) {
+	if(seq > r->queuedSeq)
+		seq = r->queuedSeq;
+
+	for(;;) {
+		int ret;
+
+		IoRing__reap(r);
+
+		if(r->completedSeq >= seq)
+			break;
+
+		ret = IoRing__enter(r->fd, r->toSubmit, 1, IORING_ENTER_GETEVENTS);
+		if(ret == -1) {
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+
+			error("io_uring_enter()");
+		}
+
+		r->toSubmit -= (unsigned)ret;
+	}
+}
+
+void IoRing_waitAll(struct IoRing *r) {
+	IoRing_wait(r, r->queuedSeq);
+}
+
+static void IoRing__reap(struct IoRing *r) {
+	unsigned head = *r->cqHead;
+	unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+
+	while(head != tail) {
+		struct io_uring_cqe *cqe = (struct io_uring_cqe *)r->cqes + (head & *r->cqMask);
+		struct IoRing__request *req = &r->requests[cqe->user_data % r->entries];
+
+		if(cqe->res < 0) {
+			errno = -cqe->res;
+
+			/* как и обычный write(), даём сработать обработчику SIGPIPE */
+			if(errno == EPIPE)
+				raise(SIGPIPE);
+
+			error("io_uring write(#%d)", req->fd);
+		}
+
+		if((size_t)cqe->res < req->len)
+			IoRing__finish(req, (size_t)cqe->res);
+
+		if(cqe->user_data > r->completedSeq)
+			r->completedSeq = cqe->user_data;
+
+		head++;
+	}
+
+	__atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Дописывает хвост недописанного запроса синхронно
+ * @param req
+ * @param done сколько уже записано
+ */
+static void IoRing__finish(struct IoRing__request *req, size_t done) {
+	while(done < req->len) {
+		ssize_t wr;
+
+		if(req->offset == -1)
+			wr = write(req->fd, req->buf + done, req->len - done);
+		else
+			wr = pwrite(req->fd, req->buf + done, req->len - done, req->offset + (off_t)done);
+
+		if(wr <= 0) {
+			if(wr == -1 && errno == EINTR)
+				continue;
+
+			error("write(#%d)", req->fd);
+		}
+
+		done += (size_t)wr;
+	}
+}
+
+#else
+
+int IoRing_init(struct IoRing *r, unsigned entries) {
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+void IoRing_destroy(struct IoRing *r) {
+}
+
+uint64_t IoRing_write(struct IoRing *r, int fd, const char *buf, size_t len, off_t offset) {
+	error("io_uring support is not compiled in");
+	return 0;
+}
+
+void IoRing_submit(struct IoRing *r) {
+}
+
+void IoRing_wait(struct IoRing *r, uint64_t seq) {
+}
+
+void IoRing_waitAll(struct IoRing *r) {
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef IORING_H
+#define	IORING_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/**
+ * Минимальная обёртка над io_uring без liburing: только асинхронная запись.
+ *
+ * Все запросы ставятся с IOSQE_IO_DRAIN, то есть ядро выполняет их строго
+ * по очереди. Это важно: читатель чанка не должен увидеть "дырку",
+ * если более поздняя запись завершится раньше более ранней.
+ * Выигрыш не в параллельности записей между собой, а в том, что процесс
+ * не ждёт их и в это время читает следующую порцию данных.
+ *
+ * Собирается только при PIT_IO_URING=1 (по умолчанию), иначе IoRing_init()
+ * всегда возвращает -1 с errno = ENOSYS
+ */
+
+struct IoRing__request {
+	int fd;
+	const char *buf;
+	size_t len;
+	off_t offset;
+};
+
+struct IoRing {
+	int fd;
+	unsigned entries;
+
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	void *sqes;
+
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	void *cqes;
+
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	size_t sqesSize;
+
+	/**
+	 * поставлено в SQ, но ещё не отправлено в ядро
+	 */
+	unsigned toSubmit;
+
+	/**
+	 * последовательные номера последнего поставленного и последнего завершённого запроса
+	 */
+	uint64_t queuedSeq;
+	uint64_t completedSeq;
+
+	/**
+	 * номер последнего запроса с записью в текущую позицию (offset = -1)
+	 */
+	uint64_t streamSeq;
+
+	struct IoRing__request *requests;
+};
+
+int IoRing_init(struct IoRing *r, unsigned entries);
+void IoRing_destroy(struct IoRing *r);
+
+/**
+ * Ставит запись в очередь. buf должен оставаться валидным, пока запрос не завершится.
+ * @param offset смещение в файле, -1 - писать в текущую позицию (пайпы, сокеты)
+ * @return номер запроса, который можно передать в IoRing_wait()
+ */
+uint64_t IoRing_write(struct IoRing *r, int fd, const char *buf, size_t len, off_t offset);
+
+void IoRing_submit(struct IoRing *r);
+void IoRing_wait(struct IoRing *r, uint64_t seq);
+void IoRing_waitAll(struct IoRing *r);
+
+/**
+ * сколько запросов ещё не завершено
+ */
+#define IoRing_pending(r) ((r)->queuedSeq - (r)->completedSeq)
+
+#endif	/* IORING_H */
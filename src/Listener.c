@@ -0,0 +1,307 @@
+#include "Listener.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+static char LISTENER_READ_BUFFER[LISTENER_READ_SIZE];
+
+static void Listener__watch(struct Listener *l, int op);
+static void Listener__accept(struct Listener *l);
+static void Listener__read(struct Listener *l, struct WStream *ws, struct ListenerConnection *c);
+static int Listener__appendTail(struct Listener *l, struct ListenerConnection *c, const char *buf, size_t len);
+static void Listener__emit(struct Listener *l, struct WStream *ws, const char *buf, size_t len);
+static void Listener__flush(struct Listener *l, struct WStream *ws);
+static void Listener__close(struct Listener *l, struct ListenerConnection *c);
+
+void Listener_init(struct Listener *l, const char *path, const struct Framing *framing, ssize_t recordMaxLength) {
+	l->path = path;
+	l->framing = *framing;
+	l->recordMaxLength = (size_t)recordMaxLength;
+	l->connections = NULL;
+	l->connectionsCount = 0;
+	l->acceptPaused = 0;
+	l->batchLength = 0;
+	l->stopRequested = 0;
+
+	l->batch = malloc(LISTENER_BATCH_SIZE);
+	if(!l->batch)
+		error("malloc(%d)", LISTENER_BATCH_SIZE);
+
+	l->fd = listenUnix(path, SOCK_STREAM);
+
+	l->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if(l->epollFd == -1)
+		error("epoll_create1()");
+
+	Listener__watch(l, EPOLL_CTL_ADD);
+
+	debug("listening on '%s'", path);
+}
+
+/**
+ * Слушающий сокет в epoll помечен data.ptr == NULL
+ */
+static void Listener__watch(struct Listener *l, int op) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if(epoll_ctl(l->epollFd, op, l->fd, &ev) == -1)
+		error("epoll_ctl('%s')", l->path);
+}
+
+void Listener_run(struct Listener *l, struct WStream *ws) {
+	struct epoll_event events[LISTENER_EVENTS];
+
+	while(!l->stopRequested) {
+		int i;
+		/* таймаут - на случай сигнала между проверкой флага и epoll_wait() */
+		int n = epoll_wait(l->epollFd, events, LISTENER_EVENTS, 1000);
+
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+
+			error("epoll_wait()");
+		}
+
+		for(i = 0; i < n; i++) {
+			if(events[i].data.ptr)
+				Listener__read(l, ws, events[i].data.ptr);
+			else
+				Listener__accept(l);
+		}
+
+		/* всё, что пришло за проход, уходит в поток одной записью */
+		Listener__flush(l, ws);
+	}
+}
+
+static void Listener__accept(struct Listener *l) {
+	for(;;) {
+		struct ListenerConnection *c;
+		struct epoll_event ev;
+		int fd;
+
+		fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd == -1) {
+			if(errno == ECONNABORTED)
+				continue;
+
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+
+			if(errno == EMFILE || errno == ENFILE) {
+				warning("unable to accept connection on '%s' (%lu open): %s", l->path, l->connectionsCount, strerror(errno));
+
+				Listener__watch(l, EPOLL_CTL_DEL);
+				l->acceptPaused = 1;
+
+				return;
+			}
+
+			error("accept('%s')", l->path);
+		}
+
+		c = malloc(sizeof(*c));
+		if(!c)
+			error("malloc(%lu)", (unsigned long)sizeof(*c));
+
+		c->fd = fd;
+		c->tail = NULL;
+		c->tailLength = 0;
+		c->tailSize = 0;
+		Framing_resetState(&c->state);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+
+		if(epoll_ctl(l->epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+			error("epoll_ctl(#%d)", fd);
+
+		c->prev = NULL;
+		c->next = l->connections;
+
+		if(l->connections)
+			l->connections->prev = c;
+
+		l->connections = c;
+		l->connectionsCount++;
+
+		debug("connection #%d accepted, %lu open", fd, l->connectionsCount);
+	}
+}
+
+/**
+ * Один read() из соединения: целые записи - в общий буфер, хвост - в буфер соединения
+ */
+static void Listener__read(struct Listener *l, struct WStream *ws, struct ListenerConnection *c) {
+	size_t start = 0;
+	size_t last;
+	size_t len;
+	ssize_t rd;
+
+	rd = read(c->fd, LISTENER_READ_BUFFER, sizeof(LISTENER_READ_BUFFER));
+	if(rd == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+
+		warning("read(connection #%d): %s", c->fd, strerror(errno));
+		Listener__close(l, c);
+
+		return;
+	}
+
+	if(rd == 0) {
+		if(c->tailLength)
+			warning("connection #%d closed in the middle of a record, %lu bytes dropped", c->fd, (unsigned long)c->tailLength);
+
+		Listener__close(l, c);
+
+		return;
+	}
+
+	len = (size_t)rd;
+
+	if(c->tailLength) {
+		start = Framing_next(&l->framing, &c->state, LISTENER_READ_BUFFER, len);
+
+		if(Listener__appendTail(l, c, LISTENER_READ_BUFFER, start ? start : len) == -1) {
+			Listener__close(l, c);
+			return;
+		}
+
+		if(!start)
+			return;
+
+		Listener__emit(l, ws, c->tail, c->tailLength);
+		c->tailLength = 0;
+	}
+
+	last = start + Framing_last(&l->framing, &c->state, LISTENER_READ_BUFFER + start, len - start);
+
+	if(last > start)
+		Listener__emit(l, ws, LISTENER_READ_BUFFER + start, last - start);
+
+	if(last < len && Listener__appendTail(l, c, LISTENER_READ_BUFFER + last, len - last) == -1) {
+		Listener__close(l, c);
+		return;
+	}
+
+	/* буфер держим, только пока есть незаконченная запись */
+	if(!c->tailLength && c->tail) {
+		free(c->tail);
+		c->tail = NULL;
+		c->tailSize = 0;
+	}
+}
+
+/**
+ * @return 0 или -1 если запись длиннее recordMaxLength
+ */
+static int Listener__appendTail(struct Listener *l, struct ListenerConnection *c, const char *buf, size_t len) {
+	if(c->tailLength + len > l->recordMaxLength) {
+		warning("record from connection #%d is longer than %lu bytes, closing connection", c->fd, (unsigned long)l->recordMaxLength);
+		return -1;
+	}
+
+	if(c->tailLength + len > c->tailSize) {
+		size_t size = c->tailSize ? c->tailSize : 4096;
+		char *tail;
+
+		while(size < c->tailLength + len)
+			size *= 2;
+
+		tail = realloc(c->tail, size);
+		if(!tail)
+			error("realloc(%lu)", (unsigned long)size);
+
+		c->tail = tail;
+		c->tailSize = size;
+	}
+
+	memcpy(c->tail + c->tailLength, buf, len);
+	c->tailLength += len;
+
+	return 0;
+}
+
+static void Listener__emit(struct Listener *l, struct WStream *ws, const char *buf, size_t len) {
+	if(l->batchLength + len > LISTENER_BATCH_SIZE)
+		Listener__flush(l, ws);
+
+	if(len >= LISTENER_BATCH_SIZE) {
+		WStream_writeLines(ws, buf, (ssize_t)len);
+		return;
+	}
+
+	memcpy(l->batch + l->batchLength, buf, len);
+	l->batchLength += len;
+}
+
+static void Listener__flush(struct Listener *l, struct WStream *ws) {
+	if(!l->batchLength)
+		return;
+
+	WStream_writeLines(ws, l->batch, (ssize_t)l->batchLength);
+	l->batchLength = 0;
+}
+
+static void Listener__close(struct Listener *l, struct ListenerConnection *c) {
+	debug("connection #%d closed", c->fd);
+
+	/* из epoll дескриптор уходит сам при close() */
+	close(c->fd);
+
+	if(c->prev)
+		c->prev->next = c->next;
+	else
+		l->connections = c->next;
+
+	if(c->next)
+		c->next->prev = c->prev;
+
+	free(c->tail);
+	free(c);
+
+	l->connectionsCount--;
+
+	if(l->acceptPaused) {
+		Listener__watch(l, EPOLL_CTL_ADD);
+		l->acceptPaused = 0;
+	}
+}
+
+void Listener_destroy(struct Listener *l) {
+	while(l->connections) {
+		if(l->connections->tailLength)
+			warning("connection #%d is closed in the middle of a record, %lu bytes dropped", l->connections->fd, (unsigned long)l->connections->tailLength);
+
+		Listener__close(l, l->connections);
+	}
+
+	if(l->epollFd >= 0) {
+		close(l->epollFd);
+		l->epollFd = -1;
+	}
+
+	if(l->fd >= 0) {
+		close(l->fd);
+		l->fd = -1;
+
+		if(unlink(l->path) == -1 && errno != ENOENT)
+			warning("unable to unlink() '%s': %s", l->path, strerror(errno));
+	}
+
+	free(l->batch);
+	l->batch = NULL;
+}
@@ -0,0 +1,91 @@
+#ifndef LISTENER_H
+#define	LISTENER_H
+
+#include <signal.h>
+#include <sys/types.h>
+
+#include "Framing.h"
+#include "WStream.h"
+
+/**
+ * Приём записей по unix-сокету (-l): один писатель, много производителей.
+ *
+ * Каждое соединение разбирается на записи по разбивке потока. Целые записи
+ * изо всех соединений, готовых за один проход epoll, складываются в общий
+ * буфер и пишутся в поток одним WStream_writeLines(), так что производители
+ * делят чанки писателя. Незаконченная запись соединения ждёт продолжения в
+ * его буфере, который выделяется, только пока такая запись есть: соединение
+ * без хвоста стоит сокет и несколько байт.
+ *
+ * Пока писатель заблокирован (например, бэклогом), сокеты не читаются и
+ * производители упираются в их буферы
+ */
+
+/* сколько читается из соединения за раз, соединения обслуживаются по очереди */
+#define LISTENER_READ_SIZE (64 * 1024)
+#define LISTENER_BATCH_SIZE (256 * 1024)
+#define LISTENER_EVENTS 256
+
+struct ListenerConnection {
+	int fd;
+
+	/**
+	 * незаконченная запись и состояние её разбора
+	 */
+	char *tail;
+	size_t tailLength;
+	size_t tailSize;
+	struct FramingState state;
+
+	struct ListenerConnection *prev;
+	struct ListenerConnection *next;
+};
+
+struct Listener {
+	const char *path;
+	int fd;
+	int epollFd;
+
+	struct Framing framing;
+	size_t recordMaxLength;
+
+	struct ListenerConnection *connections;
+	unsigned long connectionsCount;
+
+	/**
+	 * кончились дескрипторы: сокет не слушаем, пока не закроется соединение
+	 */
+	char acceptPaused;
+
+	char *batch;
+	size_t batchLength;
+
+	/**
+	 * выставляется из обработчика сигнала, Listener_run() выходит
+	 */
+	volatile sig_atomic_t stopRequested;
+};
+
+/**
+ * Слушает path. Оставшийся от прошлого запуска сокет удаляется
+ * @param l
+ * @param path
+ * @param framing
+ * @param recordMaxLength запись длиннее обрывает соединение
+ */
+void Listener_init(struct Listener *l, const char *path, const struct Framing *framing, ssize_t recordMaxLength);
+
+/**
+ * Принимает соединения и пишет записи в ws, пока не выставлен stopRequested
+ * @param l
+ * @param ws
+ */
+void Listener_run(struct Listener *l, struct WStream *ws);
+
+/**
+ * Закрывает соединения (их незаконченные записи теряются) и удаляет сокет
+ * @param l
+ */
+void Listener_destroy(struct Listener *l);
+
+#endif	/* LISTENER_H */
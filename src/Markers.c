@@ -0,0 +1,163 @@
+#include "Markers.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void Markers_register(const char *rootDir) {
+	char path[PATH_MAX + 64];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/" MARKERS_FILENAME, rootDir);
+
+	/* содержимого нет, так что и дописывать нечего */
+	fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+	if(fd == -1)
+		error("open('%s')", path);
+
+	close(fd);
+}
+
+char Markers_areUsed(const char *rootDir) {
+	char path[PATH_MAX + 64];
+
+	snprintf(path, sizeof(path), "%s/" MARKERS_FILENAME, rootDir);
+
+	if(access(path, F_OK) == 0)
+		return 1;
+
+	if(errno != ENOENT)
+		warning("access('%s'): %s", path, strerror(errno));
+
+	return 0;
+}
+
+void Markers_init(struct Markers *m, void (*onMarker)(struct Markers *m, uint64_t ingestTimemicro)) {
+	m->onMarker = onMarker;
+
+	Markers_reset(m);
+}
+
+void Markers_reset(struct Markers *m) {
+	m->state = MARKERS_LINE_START;
+	m->length = 0;
+}
+
+ssize_t Markers_strip(struct Markers *m, char *buf, ssize_t len) {
+	char *in = buf;
+	char *out = buf;
+	char *end = buf + len;
+
+	while(in < end) {
+		if(m->state == MARKERS_LINE_START) {
+			if(*in == MARKERS_CHAR) {
+				m->state = MARKERS_AFTER_CHAR;
+				in++;
+
+				continue;
+			}
+
+			m->state = MARKERS_IN_LINE;
+		}
+
+		if(m->state == MARKERS_AFTER_CHAR) {
+			/* удвоенный - строка писателя, второй символ уходит в выдачу вместе с ней */
+			if(*in == MARKERS_CHAR) {
+				m->state = MARKERS_IN_LINE;
+			} else {
+				m->state = MARKERS_IN_MARKER;
+				m->length = 0;
+			}
+		}
+
+		if(m->state == MARKERS_IN_LINE) {
+			char *lineEnd = memchr(in, '\n', (size_t)(end - in));
+
+			if(lineEnd) {
+				lineEnd++;
+				m->state = MARKERS_LINE_START;
+			} else {
+				lineEnd = end;
+			}
+
+			/* пока меток не было, ничего не двигаем */
+			if(out != in)
+				memmove(out, in, (size_t)(lineEnd - in));
+
+			out += lineEnd - in;
+			in = lineEnd;
+
+			continue;
+		}
+
+		/* MARKERS_IN_MARKER */
+		if(*in == '\n') {
+			char *digitsEnd = NULL;
+			uint64_t timestamp = 0;
+
+			if(m->length == sizeof(m->buf) - 1) {
+				m->buf[m->length] = 0;
+				timestamp = strtoull(m->buf, &digitsEnd, 10);
+			}
+
+			if(digitsEnd && !*digitsEnd) {
+				if(m->onMarker)
+					m->onMarker(m, timestamp);
+			} else {
+				debug("malformed marker of length %lu skipped", (unsigned long)m->length);
+			}
+
+			m->state = MARKERS_LINE_START;
+		} else if(m->length < sizeof(m->buf)) {
+			m->buf[m->length++] = *in;
+		}
+
+		in++;
+	}
+
+	return out - buf;
+}
+
+size_t Markers_countEscapes(const char *buf, size_t len, char atLineStart) {
+	const char *end = buf + len;
+	const char *p = buf;
+	size_t count = 0;
+
+	/* символ редкий, так что memchr() почти всегда проходит буфер за раз */
+	while((p = memchr(p, MARKERS_CHAR, (size_t)(end - p)))) {
+		if(p == buf ? atLineStart : p[-1] == '\n')
+			count++;
+
+		p++;
+	}
+
+	return count;
+}
+
+size_t Markers_escape(char *out, const char *buf, size_t len, char atLineStart) {
+	const char *end = buf + len;
+	const char *from = buf;
+	const char *p = buf;
+	char *o = out;
+
+	while((p = memchr(p, MARKERS_CHAR, (size_t)(end - p)))) {
+		if(p == buf ? atLineStart : p[-1] == '\n') {
+			memcpy(o, from, (size_t)(p - from));
+			o += p - from;
+			*o++ = MARKERS_CHAR;
+			from = p;
+		}
+
+		p++;
+	}
+
+	memcpy(o, from, (size_t)(end - from));
+	o += end - from;
+
+	return (size_t)(o - out);
+}
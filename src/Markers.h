@@ -0,0 +1,102 @@
+#ifndef MARKERS_H
+#define	MARKERS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Метки времени, которые писатель с -M вставляет между строками:
+ * MARKERS_CHAR, timemicro() в 16 цифр и '\n'. По ним читатели считают
+ * задержку доставки, а из выдачи метки вырезаются.
+ *
+ * Писатель с -M создаёт в корне MARKERS_FILENAME, и дальше поток помечен
+ * целиком: все его читатели (pit -r, брокер и его читатели, libpit)
+ * вырезают метки сами, а все писатели экранируют свои строки, которые
+ * начинаются с MARKERS_CHAR, удваивая его. Читатель убирает лишний
+ * символ, так что такие строки доходят как были.
+ *
+ * Писатели и читатели смотрят на файл при каждом новом чанке, поэтому
+ * строки, записанные до появления первого писателя с -M в уже открытый
+ * чанк, экранированы не будут
+ */
+
+#define MARKERS_CHAR '\x1e'
+#define MARKERS_LENGTH 18
+
+#define MARKERS_FILENAME ".markers"
+
+#define MARKERS_LINE_START 0
+#define MARKERS_IN_LINE 1
+#define MARKERS_IN_MARKER 2
+/* MARKERS_CHAR в начале строки, ещё не ясно - метка это или экранирование */
+#define MARKERS_AFTER_CHAR 3
+
+/**
+ * Где мы относительно строк и меток: чтение может разрезать метку
+ */
+struct Markers {
+	char state;
+
+	/* цифры метки и завершающий 0 */
+	char buf[MARKERS_LENGTH - 1];
+	size_t length;
+
+	/**
+	 * вызывается на каждую целую метку с её временем
+	 */
+	void (*onMarker)(struct Markers *m, uint64_t ingestTimemicro);
+};
+
+/**
+ * Помечает поток rootDir: в нём есть метки
+ * @param rootDir
+ */
+void Markers_register(const char *rootDir);
+
+/**
+ * @param rootDir
+ * @return 1 если поток помечен
+ */
+char Markers_areUsed(const char *rootDir);
+
+/**
+ * @param m
+ * @param onMarker может быть NULL
+ */
+void Markers_init(struct Markers *m, void (*onMarker)(struct Markers *m, uint64_t ingestTimemicro));
+
+/**
+ * Новый чанк начинается со строки
+ * @param m
+ */
+void Markers_reset(struct Markers *m);
+
+/**
+ * Вырезает метки из очередной порции потока и снимает экранирование
+ * @param m
+ * @param buf
+ * @param len
+ * @return сколько осталось в buf
+ */
+ssize_t Markers_strip(struct Markers *m, char *buf, ssize_t len);
+
+/**
+ * Сколько MARKERS_CHAR в начале строк нужно удвоить
+ * @param buf
+ * @param len
+ * @param atLineStart buf начинается со строки
+ * @return 0 - экранировать нечего
+ */
+size_t Markers_countEscapes(const char *buf, size_t len, char atLineStart);
+
+/**
+ * Копирует buf в out, удваивая MARKERS_CHAR в начале строк
+ * @param out не меньше len + Markers_countEscapes()
+ * @param buf
+ * @param len
+ * @param atLineStart
+ * @return сколько записано в out
+ */
+size_t Markers_escape(char *out, const char *buf, size_t len, char atLineStart);
+
+#endif	/* MARKERS_H */
@@ -0,0 +1,490 @@
+#include "Pit.h"
+#include "common.h"
+#include "Framing.h"
+#include "RStream.h"
+#include "WStream.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Модули pit при ошибке зовут error(), а та завершает процесс. Здесь
+ * на время вызова ставится hook, который возвращается по longjmp() в
+ * начало вызова. Состояние модуля после этого неизвестно, поэтому
+ * хендл помечается сломанным, а при закрытии у него только отпускаются
+ * дескрипторы и локи (RStream_abandon(), WStream_abandon()).
+ * jmp_buf и hook у каждого потока свои
+ */
+#define PIT_TRY(handle, failed) \
+	if(setjmp(PIT_ERROR_JMP)) { \
+		setErrorHook(NULL); \
+		(handle)->broken = 1; \
+		errno = PIT_ERROR_ERRNO; \
+		return failed; \
+	} \
+	setErrorHook(Pit__onError)
+
+#define PIT_END() setErrorHook(NULL)
+
+struct PitWriter {
+	char *dir;
+	struct WStream ws;
+	struct Framing framing;
+	char broken;
+};
+
+struct PitReader {
+	char *dir;
+	char *group;
+	struct RStream rs;
+	struct Framing framing;
+	char broken;
+
+	/**
+	 * отображение, отданное прошлым вызовом, снимается в начале следующего
+	 */
+	void *map;
+	size_t mapLength;
+
+	/**
+	 * Запись, которая не закончилась в прошлых данных: в carry сначала
+	 * выданная прошлым вызовом (carryDelivered байт), за ней начало
+	 * следующей. state - разбор этого начала
+	 */
+	char *carry;
+	size_t carryLength;
+	size_t carryDelivered;
+	size_t carrySize;
+	struct FramingState state;
+
+	/**
+	 * пачка из помеченного потока (см. Markers.h), собранная без меток
+	 */
+	char *plain;
+	size_t plainSize;
+};
+
+static __thread jmp_buf PIT_ERROR_JMP;
+static __thread int PIT_ERROR_ERRNO;
+static __thread char PIT_LAST_ERROR[1024];
+
+static void Pit__onError(int err, const char *message);
+static void Pit__setError(int err, const char *message);
+static void Pit__ignoreSignal(int sig);
+static void Pit__release(struct PitReader *r);
+static void Pit__appendCarry(struct PitReader *r, const char *buf, size_t len);
+static void Pit__removeMarkers(struct PitReader *r, struct PitBatch *batch);
+static void Pit__freeReader(struct PitReader *r);
+
+static void Pit__onError(int err, const char *message) {
+	Pit__setError(err ? err : EIO, message);
+
+	longjmp(PIT_ERROR_JMP, 1);
+}
+
+static void Pit__setError(int err, const char *message) {
+	PIT_ERROR_ERRNO = err;
+	snprintf(PIT_LAST_ERROR, sizeof(PIT_LAST_ERROR), "%s", message);
+}
+
+const char *Pit_lastError(void) {
+	return PIT_LAST_ERROR;
+}
+
+static void Pit__ignoreSignal(int sig) {
+}
+
+struct PitWriter *PitWriter_open(const char *dir, size_t chunkSize) {
+	struct PitWriter *w;
+	volatile char started = 0;
+
+	if(chunkSize == 0)
+		chunkSize = 1 * 1024 * 1024;
+
+	if(chunkSize >= SSIZE_MAX) {
+		Pit__setError(EINVAL, "chunk size is too big");
+		errno = EINVAL;
+		return NULL;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if(!w)
+		return NULL;
+
+	w->dir = strdup(dir);
+	if(!w->dir) {
+		free(w);
+		return NULL;
+	}
+
+	if(setjmp(PIT_ERROR_JMP)) {
+		setErrorHook(NULL);
+
+		/* лок писателя мог быть уже взят */
+		if(started)
+			WStream_abandon(&w->ws);
+
+		free(w->dir);
+		free(w);
+		errno = PIT_ERROR_ERRNO;
+		return NULL;
+	}
+
+	setErrorHook(Pit__onError);
+
+	/* WStream_init() первым делом сбрасывает дескрипторы, так что закрыть их можно сразу */
+	started = 1;
+	WStream_init(&w->ws, w->dir, (ssize_t)chunkSize);
+
+	/* разбивку задал тот, кто создал поток, по умолчанию строки */
+	if(Framing_load(&w->framing, w->dir) == -1)
+		error("unknown framing of stream '%s'", w->dir);
+
+	WStream_useFraming(&w->ws, &w->framing, WSTREAM_LINE_MAX_LENGTH);
+
+	PIT_END();
+
+	return w;
+}
+
+int PitWriter_write(struct PitWriter *w, const void *buf, size_t len) {
+	if(w->broken) {
+		errno = EIO;
+		return -1;
+	}
+
+	PIT_TRY(w, -1);
+
+	WStream_writeLines(&w->ws, buf, (ssize_t)len);
+
+	PIT_END();
+
+	return 0;
+}
+
+int PitWriter_flush(struct PitWriter *w) {
+	if(w->broken) {
+		errno = EIO;
+		return -1;
+	}
+
+	PIT_TRY(w, -1);
+
+	/* незаконченную запись писатель допишет в этот же чанк и тогда закроет его */
+	WStream_scheduleCloseChunk(&w->ws);
+
+	PIT_END();
+
+	return 0;
+}
+
+int PitWriter_close(struct PitWriter *w) {
+	volatile int r = -1;
+
+	errno = EIO;
+
+	/* у сломанного писателя чанк закрывается как есть, как при падении */
+	if(w->broken) {
+		WStream_abandon(&w->ws);
+	} else {
+		if(setjmp(PIT_ERROR_JMP)) {
+			setErrorHook(NULL);
+			WStream_abandon(&w->ws);
+			errno = PIT_ERROR_ERRNO;
+		} else {
+			setErrorHook(Pit__onError);
+
+			WStream_flush(&w->ws);
+			WStream_destroy(&w->ws);
+
+			r = 0;
+		}
+
+		PIT_END();
+	}
+
+	free(w->dir);
+	free(w);
+
+	return r;
+}
+
+struct PitReader *PitReader_open(const char *dir, const char *group, int flags) {
+	struct PitReader *r;
+	struct sigaction sa;
+	volatile char started = 0;
+
+	r = calloc(1, sizeof(*r));
+	if(!r)
+		return NULL;
+
+	r->dir = strdup(dir);
+	r->group = group ? strdup(group) : NULL;
+
+	if(!r->dir || (group && !r->group)) {
+		Pit__freeReader(r);
+		return NULL;
+	}
+
+	/* без inotify читатель ждёт изменений каталога по SIGIO, который по умолчанию убивает */
+	if(sigaction(SIGIO, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL)
+		signal(SIGIO, Pit__ignoreSignal);
+
+	if(setjmp(PIT_ERROR_JMP)) {
+		setErrorHook(NULL);
+
+		if(started)
+			RStream_abandon(&r->rs);
+
+		Pit__freeReader(r);
+		errno = PIT_ERROR_ERRNO;
+		return NULL;
+	}
+
+	setErrorHook(Pit__onError);
+
+	if(Framing_load(&r->framing, r->dir) == -1)
+		error("unknown framing of stream '%s'", r->dir);
+
+	started = 1;
+	RStream_initGroup(&r->rs, r->dir, r->group, (flags & PIT_PERSISTENT) ? 1 : 0, 0);
+
+	if(flags & PIT_RENAME_CLAIMS)
+		RStream_claimByRename(&r->rs);
+
+	RStream_checkpointEvery(&r->rs, RSTREAM_CHECKPOINT_BYTES, (uint64_t)RSTREAM_CHECKPOINT_INTERVAL_MS * 1000);
+
+	PIT_END();
+
+	Framing_resetState(&r->state);
+
+	return r;
+}
+
+/**
+ * Отпускает пачку, выданную прошлым вызовом
+ */
+static void Pit__release(struct PitReader *r) {
+	if(r->map) {
+		munmap(r->map, r->mapLength);
+		r->map = NULL;
+		r->mapLength = 0;
+	}
+
+	if(r->carryDelivered) {
+		memmove(r->carry, r->carry + r->carryDelivered, r->carryLength - r->carryDelivered);
+		r->carryLength -= r->carryDelivered;
+		r->carryDelivered = 0;
+	}
+}
+
+static void Pit__appendCarry(struct PitReader *r, const char *buf, size_t len) {
+	if(r->carryLength + len > r->carrySize) {
+		size_t size = r->carrySize ? r->carrySize : 64 * 1024;
+		char *carry;
+
+		while(size < r->carryLength + len)
+			size *= 2;
+
+		carry = realloc(r->carry, size);
+		if(!carry)
+			error("realloc(%llu)", (unsigned long long)size);
+
+		r->carry = carry;
+		r->carrySize = size;
+	}
+
+	memcpy(r->carry + r->carryLength, buf, len);
+	r->carryLength += len;
+}
+
+/**
+ * Собирает пачку в plain без меток: в отображении чанка их не вырезать.
+ * Пачка из одних меток становится пустой
+ */
+static void Pit__removeMarkers(struct PitReader *r, struct PitBatch *batch) {
+	size_t length = 0;
+	int i;
+
+	if(batch->length > r->plainSize) {
+		char *plain = realloc(r->plain, batch->length);
+
+		if(!plain)
+			error("realloc(%llu)", (unsigned long long)batch->length);
+
+		r->plain = plain;
+		r->plainSize = batch->length;
+	}
+
+	for(i = 0; i < batch->iovcnt; i++) {
+		memcpy(r->plain + length, batch->iov[i].iov_base, batch->iov[i].iov_len);
+		length += batch->iov[i].iov_len;
+	}
+
+	/* всё скопировано: отображение и выданный carry больше не нужны */
+	Pit__release(r);
+
+	length = (size_t)RStream_removeMarkers(&r->rs, r->plain, (ssize_t)length);
+
+	batch->iov[0].iov_base = r->plain;
+	batch->iov[0].iov_len = length;
+	batch->iovcnt = length ? 1 : 0;
+	batch->length = length;
+}
+
+int PitReader_next(struct PitReader *r, struct PitBatch *batch, size_t maxBytes) {
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+	if(r->broken) {
+		errno = EIO;
+		return -1;
+	}
+
+	if(maxBytes < pageSize)
+		maxBytes = pageSize;
+
+	if(maxBytes >= SSIZE_MAX)
+		maxBytes = SSIZE_MAX;
+
+	PIT_TRY(r, -1);
+
+	Pit__release(r);
+
+	batch->iovcnt = 0;
+	batch->length = 0;
+
+	while(!batch->iovcnt) {
+		const char *data;
+		size_t start = 0;
+		size_t last;
+		size_t carried = 0;
+		off_t mapOffset;
+		off_t offset;
+		ssize_t len;
+		int fd;
+
+		len = RStream_map(&r->rs, (ssize_t)maxBytes, &fd, &offset);
+		if(len == 0) {
+			if(r->carryLength)
+				warning("stream '%s' ends with an incomplete record, %llu bytes dropped", r->dir, (unsigned long long)r->carryLength);
+
+			r->carryLength = 0;
+
+			PIT_END();
+
+			return 0;
+		}
+
+		if(len < 0)
+			error("RStream_map('%s')", r->dir);
+
+		/*
+		 * Сегменты и чанки pit -w начинаются с записи, так что carry тут пуст.
+		 * Только у потока от pit -w -b запись может продолжиться в следующем чанке
+		 */
+		mapOffset = offset & ~(off_t)(pageSize - 1);
+
+		r->mapLength = (size_t)(offset - mapOffset) + (size_t)len;
+		r->map = mmap(NULL, r->mapLength, PROT_READ, MAP_SHARED, fd, mapOffset);
+		if(r->map == MAP_FAILED) {
+			r->map = NULL;
+			error("mmap('%s', %llu)", r->rs.chunkPath, (unsigned long long)offset);
+		}
+
+		data = (const char *)r->map + (offset - mapOffset);
+
+		if(r->carryLength) {
+			start = Framing_next(&r->framing, &r->state, data, (size_t)len);
+			if(!start) {
+				Pit__appendCarry(r, data, (size_t)len);
+				Pit__release(r);
+				continue;
+			}
+
+			Pit__appendCarry(r, data, start);
+
+			carried = r->carryLength;
+		}
+
+		last = start + Framing_last(&r->framing, &r->state, data + start, (size_t)len - start);
+
+		/* хвост копируется за собранной записью, carry при этом может переехать */
+		if(last < (size_t)len)
+			Pit__appendCarry(r, data + last, (size_t)len - last);
+
+		if(carried) {
+			r->carryDelivered = carried;
+
+			batch->iov[batch->iovcnt].iov_base = r->carry;
+			batch->iov[batch->iovcnt].iov_len = carried;
+			batch->iovcnt++;
+		}
+
+		if(last > start) {
+			batch->iov[batch->iovcnt].iov_base = (void *)(data + start);
+			batch->iov[batch->iovcnt].iov_len = last - start;
+			batch->iovcnt++;
+		} else {
+			/* из чанка в пачку ничего не попало, отображение не нужно */
+			munmap(r->map, r->mapLength);
+			r->map = NULL;
+			r->mapLength = 0;
+		}
+
+		batch->length = carried + (last - start);
+
+		if(r->rs.stripMarkers && batch->iovcnt)
+			Pit__removeMarkers(r, batch);
+	}
+
+	PIT_END();
+
+	return 1;
+}
+
+int PitReader_close(struct PitReader *r) {
+	volatile int ret = -1;
+
+	errno = EIO;
+
+	/* прочитанное сломанным читателем не сохраняем, его перечитает следующий */
+	if(r->broken) {
+		RStream_abandon(&r->rs);
+	} else {
+		if(setjmp(PIT_ERROR_JMP)) {
+			setErrorHook(NULL);
+			RStream_abandon(&r->rs);
+			errno = PIT_ERROR_ERRNO;
+		} else {
+			setErrorHook(Pit__onError);
+
+			Pit__release(r);
+			RStream_destroy(&r->rs);
+
+			ret = 0;
+		}
+
+		PIT_END();
+	}
+
+	Pit__freeReader(r);
+
+	return ret;
+}
+
+static void Pit__freeReader(struct PitReader *r) {
+	if(r->map)
+		munmap(r->map, r->mapLength);
+
+	free(r->carry);
+	free(r->plain);
+	free(r->group);
+	free(r->dir);
+	free(r);
+}
@@ -0,0 +1,108 @@
+#ifndef PIT_H
+#define	PIT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * libpit: потоки pit изнутри своего процесса, без pit -w/-r и пайпов.
+ * Собирается в libpit.a и libpit.so (make lib), нужен только этот заголовок.
+ *
+ * Ошибки не завершают процесс: функции возвращают -1 (или NULL) с errno,
+ * текст - в Pit_lastError(). После ошибки от хендла можно только закрыть его:
+ * его дескрипторы и локи отпускаются, а прочитанное после последнего
+ * сохранения выдаст следующий читатель.
+ *
+ * Библиотека не потокобезопасна: ошибка и Pit_lastError() у каждого потока
+ * свои, но остальное состояние общее, так что с потоками pit работают из
+ * одного потока процесса (или под общим мьютексом)
+ */
+
+/* PitReader_open(): не удалять поток и не выходить, когда он закончился */
+#define PIT_PERSISTENT 1
+/* захват чанков переименованием, как pit -r -R */
+#define PIT_RENAME_CLAIMS 2
+
+/* в libpit.so наружу видны только эти функции */
+#define PIT_API __attribute__((visibility("default")))
+
+struct PitWriter;
+struct PitReader;
+
+/**
+ * Пачка целых записей. Данные не копируются: iov указывают прямо
+ * в mmap() чанка. Только запись, начатую в одном вызове и законченную
+ * в другом, приходится собирать в буфере, она всегда первая.
+ * Из потока с метками времени (pit -w -M) пачка целиком собирается
+ * в буфере: метки из неё вырезаны, iovcnt всегда 1.
+ *
+ * Действительна до следующего PitReader_next() или PitReader_close().
+ * Прочитанное сохраняется в начале следующего вызова, так что после
+ * падения пачка будет выдана снова
+ */
+struct PitBatch {
+	struct iovec iov[2];
+	int iovcnt;
+
+	/**
+	 * сумма длин iov
+	 */
+	size_t length;
+};
+
+/**
+ * @param dir каталог потока
+ * @param chunkSize максимальный размер чанка, 0 - как у pit по умолчанию
+ * @return NULL при ошибке
+ */
+PIT_API struct PitWriter *PitWriter_open(const char *dir, size_t chunkSize);
+
+/**
+ * Записывает len байт. Записи (строки или как задано в .framing потока)
+ * не разрываются между чанками, незаконченная запись ждёт продолжения
+ * @return 0 или -1
+ */
+PIT_API int PitWriter_write(struct PitWriter *w, const void *buf, size_t len);
+
+/**
+ * Закрывает текущий чанк: всё записанное становится доступно читателям
+ * @return 0 или -1
+ */
+PIT_API int PitWriter_flush(struct PitWriter *w);
+
+/**
+ * Закрывает чанк и освобождает хендл
+ * @return 0 или -1, хендл освобождается в любом случае
+ */
+PIT_API int PitWriter_close(struct PitWriter *w);
+
+/**
+ * @param dir каталог потока
+ * @param group группа читателей, NULL - группа по умолчанию
+ * @param flags PIT_*
+ * @return NULL при ошибке
+ */
+PIT_API struct PitReader *PitReader_open(const char *dir, const char *group, int flags);
+
+/**
+ * Ждёт и выдаёт следующую пачку записей
+ * @param r
+ * @param batch
+ * @param maxBytes примерно столько байт, не меньше размера страницы
+ * @return 1 - пачка есть, 0 - конец потока, -1 - ошибка
+ */
+PIT_API int PitReader_next(struct PitReader *r, struct PitBatch *batch, size_t maxBytes);
+
+/**
+ * Сохраняет прочитанное и освобождает хендл
+ * @return 0 или -1, хендл освобождается в любом случае
+ */
+PIT_API int PitReader_close(struct PitReader *r);
+
+/**
+ * Текст последней ошибки
+ */
+PIT_API const char *Pit_lastError(void);
+
+#endif	/* PIT_H */
@@ -7,44 +7,168 @@
 #include <string.h>
 #include <dirent.h>
 #include <limits.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+	#include <sys/inotify.h>
+	#include <sys/sendfile.h>
+	#define RSTREAM_USE_INOTIFY
+	#define RSTREAM_USE_SPLICE
+#endif
 
 #include "common.h"
 #include "RStream.h"
 #include "WStream.h"
+#include "ChunkIndex.h"
+#include "ConsumerGroup.h"
+#include "Framing.h"
+#include "Stats.h"
+#include "Stripe.h"
+#include "Bucket.h"
 
 #define RSTREAM_DIR_IS_EMPTY -1
 #define RSTREAM_NO_MORE_NOT_ACQUIRED_FILES -2
 #define RSTREAM_ROOT_DELETED -3
 
+
+/* проходы сканирования каталога, см. RStream__openNotAcquiredChunk() */
+#define RSTREAM_SCAN_CLAIM 0
+#define RSTREAM_SCAN_RECOVER 1
+#define RSTREAM_SCAN_STEAL 2
+
+/**
+ * даже с inotify раз в секунду просыпаемся и перепроверяем всё руками:
+ * на сетевых ФС события могут не приходить вообще
+ */
+#define RSTREAM_INOTIFY_SAFETY_TIMEOUT_MS 1000
+
 static int RStream__chunkIsCompleted(struct RStream *ws);
+static ssize_t RStream__pump(struct RStream *rs, char *buf, int outFd, ssize_t size, int method);
 static int RStream__openNextChunk(struct RStream *ws);
-static void RStream__scheduleUpdateNotification(struct RStream *ws, useconds_t sleepUsec);
+static void RStream__waitForUpdate(struct RStream *rs, useconds_t sleepUsec);
+static void RStream__initNotifications(struct RStream *rs);
+static void RStream__watchChunk(struct RStream *rs);
 static void RStream__removeRootDir(struct RStream *ws);
 static int RStream__openNotAcquiredChunk(struct RStream *rs);
-static char RStream__rootHasChunks(struct RStream *rs);
+static char RStream__dirHasChunks(const char *dir);
+static int RStream__findChunks(const char *dir);
+static void RStream__freeScan(struct RStreamScan *scan);
+static void RStream__discardSplit(int fd, const char *tmpPath);
 static char RStream__writersIsHere(struct RStream *rs);
+static int RStream__attachSegments(struct RStream *rs, char fromTail);
+static void RStream__detachSegments(struct RStream *rs);
+static char RStream__nextSegment(struct RStream *rs);
+static void RStream__maySplitChunk(struct RStream *rs);
+static void RStream__setSegmentState(struct RStream *rs, unsigned long k, uint64_t state);
+static void RStream__detectMarkers(struct RStream *rs);
+static void RStream__onMarker(struct Markers *m, uint64_t ingestTimemicro);
+static void RStream__recordLatency(struct RStream *rs, int histogram, uint64_t ingestTimemicro);
+static void RStream__setWaiting(struct RStream *rs, char waiting);
+static int RStream__recycleChunk(struct RStream *rs);
+static char RStream__removeChunk(struct RStream *rs);
+static char RStream__framingIsSeekable(struct RStream *rs);
+static void RStream__resetCheckpoint(struct RStream *rs);
+static void RStream__mayCheckpoint(struct RStream *rs);
+static off_t RStream__alignOffset(struct RStream *rs, off_t offset);
+static void RStream__saveOffset(struct RStream *rs, off_t offset);
+static void RStream__closeOffsetFile(struct RStream *rs);
+static int RStream__scanBucket(struct RStream *rs, const char *bucket, int pass, int *fd);
+static char RStream__scanEntry(struct RStream *rs, const char *name, int pass, int *fd);
+static int RStream__claimChunk(void *ctx, const char *name);
+static char RStream__hasSuffix(const char *name, size_t len, const char *suffix);
+static int RStream__renameNoReplace(const char *from, const char *to);
+static void RStream__pruneBucket(struct RStream *rs);
+static void RStream__finishChunk(struct RStream *rs);
+static void RStream__restoreOffset(struct RStream *rs);
+static void RStream__enterLease(struct RStream *rs, struct RStreamLease *lease);
+static void RStream__leaveLease(struct RStream *rs);
+static void RStream__drainNotifications(struct RStream *rs);
 
 void RStream_init(struct RStream *rs, const char *rootDir, char persistentMode, char waitRootMode) {
+	RStream_initGroup(rs, rootDir, NULL, persistentMode, waitRootMode);
+}
+
+/**
+ * Читать поток в составе группы group (регистрирует её при необходимости).
+ * Группа получает только чанки, созданные после регистрации
+ * @param rs
+ * @param rootDir
+ * @param group NULL - группа по умолчанию
+ * @param persistentMode
+ * @param waitRootMode
+ */
+void RStream_initGroup(struct RStream *rs, const char *rootDir, const char *group, char persistentMode, char waitRootMode) {
 	rs->chunkNumber = 0;
 	rs->chunkFd = -1;
+	rs->offsetFd = -1;
+	rs->chunkOffset = 0;
+	rs->segmentsFd = -1;
+	rs->nextSplitCheck = -1;
 	rs->rootDirFd = -1;
+	Framing_init(&rs->framing);
+	rs->framingLoaded = 0;
+	rs->checkpointBytes = RSTREAM_CHECKPOINT_BYTES;
+	rs->checkpointInterval = RSTREAM_CHECKPOINT_INTERVAL_MS * 1000;
+	rs->lastCheckpointOffset = 0;
+	rs->nextCheckpointOffset = 0;
+	rs->nextCheckpointTime = 0;
 	rs->rootDir = rootDir;
+	rs->streamDir = rootDir;
+	rs->group = group;
+	rs->lockBase = 0;
 	rs->persistentMode = persistentMode;
+	rs->inotifyFd = -1;
+	rs->rootWatch = -1;
+	rs->chunkWatch = -1;
+	rs->chunkMayBeCompleted = 1;
+	rs->unflushedBytes = 0;
+	rs->flushOutput = NULL;
+	rs->chunkIsLeased = NULL;
+	rs->stripMarkers = 0;
+	Markers_init(&rs->markers, RStream__onMarker);
+	rs->lastReadLength = 0;
+	rs->renameClaims = 0;
+	rs->latencyAlert = 0;
+	rs->lastLatencyAlert = 0;
+	rs->waitingFd = -1;
+	rs->waiting = 0;
+	rs->rootScan.list = NULL;
+	rs->rootScan.length = 0;
+	rs->bucketScan.list = NULL;
+	rs->bucketScan.length = 0;
+
+	ChunkIndex_init(&rs->index);
+	ChunkPool_init(&rs->pool, rootDir, 0);
+
+	if(group) {
+		/* группа регистрируется в уже созданном потоке */
+		while(waitRootMode && access(rootDir, F_OK) == -1 && errno == ENOENT)
+			usleep(100000);
+
+		rs->lockBase = ConsumerGroup_lockBase(ConsumerGroup_register(rootDir, group, rs->groupDir, sizeof(rs->groupDir)));
+		rs->rootDir = rs->groupDir;
+	}
 
 	do {
-		if(rs->rootDirFd == -1)
-			rs->rootDirFd = open(rootDir, O_RDONLY | O_DIRECTORY);
+		if(rs->rootDirFd == -1) {
+			rs->rootDirFd = open(rs->rootDir, O_RDONLY | O_DIRECTORY);
+
+			if(rs->rootDirFd != -1)
+				RStream__initNotifications(rs);
+		}
 
 		if(rs->rootDirFd == -1) {
 			if(waitRootMode && errno == ENOENT) {
 				usleep(100000);
 				continue;
 			}
-			error("open('%s')", rootDir);
+			error("open('%s')", rs->rootDir);
 		} else if(waitRootMode)  {
 			/* тут нужно дополнительно проверить появился ли хоть один чанк */
-			if(!RStream__rootHasChunks(rs)) {
-				RStream__scheduleUpdateNotification(rs, 1000000);
+			if(!RStream__dirHasChunks(rs->rootDir)) {
+				RStream__waitForUpdate(rs, 1000000);
 				continue;
 			}
 
@@ -55,7 +179,7 @@ void RStream_init(struct RStream *rs, const char *rootDir, char persistentMode,
 	} while(waitRootMode);
 
 	if(flock(rs->rootDirFd, LOCK_SH | LOCK_NB) == -1)
-		error("Unable to lock %s\n", rootDir);
+		error("Unable to lock %s\n", rs->rootDir);
 
 	debug("Start reading from chunk #%lu", rs->chunkNumber + 1);
 }
@@ -65,10 +189,18 @@ void RStream_init(struct RStream *rs, const char *rootDir, char persistentMode,
  * @param rs
  */
 void RStream_destroy(struct RStream *rs) {
+	if(rs->segmentsFd >= 0) {
+		/* в сегменте оффсет пишется в его состояние, .offset - только для целого чанка */
+		off_t offset = RStream__alignOffset(rs, rs->chunkOffset - rs->unflushedBytes);
+
+		RStream__setSegmentState(rs, rs->segment, (uint64_t)offset);
+		RStream__detachSegments(rs);
+
+		close(rs->chunkFd);
+		rs->chunkFd = -1;
+	}
+
 	while(rs->chunkFd >= 0) {
-		int offsetFileFd;
-		char offsetStringBuf[64];
-		int offsetStringLen;
 		off_t offset = lseek(rs->chunkFd, 0, SEEK_CUR);
 
 		if(offset == (off_t)-1) {
@@ -76,328 +208,1824 @@ void RStream_destroy(struct RStream *rs) {
 			break;
 		}
 
+		/* недоотправленное перечитает следующий читатель */
+		offset -= rs->unflushedBytes < offset ? rs->unflushedBytes : offset;
+		offset = RStream__alignOffset(rs, offset);
+
 		if(offset >= ULONG_MAX) {
 			warning("offset is too big: %llu", (unsigned long long)offset);
 			break;
 		}
 
-		offsetFileFd = open(rs->chunkOffsetPath, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-		if(offsetFileFd == -1) {
-			warning("Unable to open offset file '%s': %s", rs->chunkOffsetPath, strerror(errno));
-			break;
-		}
+		RStream__saveOffset(rs, offset);
 
-		offsetStringLen = snprintf(offsetStringBuf, sizeof(offsetStringBuf), "%lu\n", (unsigned long)offset);
+		close(rs->chunkFd);
+		rs->chunkFd = -1;
+	}
 
-		if(write(offsetFileFd, offsetStringBuf, (size_t)offsetStringLen) == -1) {
-			warning("Unable to write to offset file '%s': %s", rs->chunkOffsetPath, strerror(errno));
-		}
+	RStream__closeOffsetFile(rs);
 
-		close(offsetFileFd);
+	if(rs->inotifyFd >= 0) {
+		close(rs->inotifyFd);
+		rs->inotifyFd = -1;
+	}
 
-		close(rs->chunkFd);
-		rs->chunkFd = -1;
+	if(rs->waitingFd >= 0) {
+		close(rs->waitingFd);
+		rs->waitingFd = -1;
 	}
 
+	ChunkIndex_close(&rs->index);
+	ChunkPool_close(&rs->pool);
+
+	RStream__freeScan(&rs->bucketScan);
+	RStream__freeScan(&rs->rootScan);
+
 	if(rs->rootDirFd >= 0) {
 		close(rs->rootDirFd);
 		rs->rootDirFd = -1;
 	}
 }
 
-ssize_t RStream_read(struct RStream *rs, char *buf, ssize_t size) {
-	ssize_t r;
+/**
+ * Закрыть дескрипторы, ничего не сохраняя: после ошибки посреди чтения
+ * позиция неизвестна, чанк с последнего сохранённого места перечитает
+ * следующий читатель. Локи на чанке уходят вместе с дескриптором
+ * @param rs
+ */
+void RStream_abandon(struct RStream *rs) {
+	if(rs->segmentsFd >= 0) {
+		close(rs->segmentsFd);
+		rs->segmentsFd = -1;
+	}
 
-	if(rs->chunkFd == -1) {
-		if(RStream__openNextChunk(rs) < 0) {
-			debug("end of stream detected");
-			RStream__removeRootDir(rs);
-			return 0; /* end of stream */
-		}
+	if(rs->chunkFd >= 0) {
+		close(rs->chunkFd);
+		rs->chunkFd = -1;
 	}
 
-	while(1) {
-		r = read(rs->chunkFd, buf, (size_t)size);
-		if(r == -1 || r == 0) {
-			if(r == 0 || errno == EAGAIN || errno == EINTR) {
-				/*
-				 * нечего было читать, значит надо проверить, не закончился ли чанк
-				 */
-				if(RStream__chunkIsCompleted(rs)) {
-					if(RStream__openNextChunk(rs) < 0) {
-						debug("end of stream detected");
-						RStream__removeRootDir(rs);
-						return 0; /* end of stream */
-					}
+	RStream_destroy(rs);
+}
 
-					continue;
-				}
+/**
+ * Захватывать чанки переименованием, см. RSTREAM_CLAIMED_SUFFIX.
+ * Все читатели группы должны захватывать чанки одинаково
+ * @param rs
+ */
+void RStream_claimByRename(struct RStream *rs) {
+	rs->renameClaims = 1;
+}
 
-				RStream__scheduleUpdateNotification(rs, 100000);
-				continue;
+/**
+ * Ругаться в stderr, если чанк или метка дошли до читателя позже, чем через usec
+ * @param rs
+ * @param usec
+ */
+void RStream_alertLatency(struct RStream *rs, uint64_t usec) {
+	rs->latencyAlert = usec;
+}
 
-			} else if(r == -1) {
-				error("read('%s')", rs->chunkPath);
-			}
-		}
-		break;
-	}
+/**
+ * Сохранять прочитанное по границе записи каждые bytes байт или usec мкс,
+ * смотря что наступит раньше. 0 - не сохранять по этому признаку
+ * @param rs
+ * @param bytes
+ * @param usec
+ */
+void RStream_checkpointEvery(struct RStream *rs, uint64_t bytes, uint64_t usec) {
+	rs->checkpointBytes = bytes;
+	rs->checkpointInterval = usec;
+}
+
+ssize_t RStream_read(struct RStream *rs, char *buf, ssize_t size) {
+	ssize_t r;
+
+	/* прочитанное могло целиком состоять из меток, их выдавать не нужно */
+	do {
+		r = RStream__pump(rs, buf, -1, size, RSTREAM_TRANSFER_READ);
+		if(r <= 0)
+			return r;
+
+		rs->lastReadLength = r;
+
+		if(rs->stripMarkers)
+			r = Markers_strip(&rs->markers, buf, r);
+	} while(!r);
 
 	return r;
 }
 
-static void RStream__removeRootDir(struct RStream *rs) {
-	char path[PATH_MAX + 64];
+/**
+ * То же, что и RStream_read(), только данные из чанка перекладываются
+ * в outFd ядром, минуя буфер в юзерспейсе.
+ *
+ * @param rs
+ * @param outFd
+ * @param size
+ * @param method RSTREAM_TRANSFER_SPLICE если outFd - пайп, RSTREAM_TRANSFER_SENDFILE для сокетов и файлов
+ * @return количество переданных байт, 0 - конец потока,
+ *	-1 если outFd не поддерживает выбранный способ (errno сохраняется)
+ *	или поток помечен (EOPNOTSUPP): метки вырезаются только из буфера.
+ *	В этом случае можно продолжать через RStream_read()
+ */
+ssize_t RStream_transfer(struct RStream *rs, int outFd, ssize_t size, int method) {
+	return RStream__pump(rs, NULL, outFd, size, method);
+}
 
-	debug("removing root dir: %s", rs->rootDir);
+/**
+ * Ничего не читает, а только говорит, где в чанке лежат следующие данные,
+ * и считает их прочитанными. Дальше их можно mmap()-нуть.
+ *
+ * Область действительна до следующего вызова: дочитанный чанк
+ * удаляется или уходит в пул, где писатель его обрежет
+ *
+ * @param rs
+ * @param size не больше стольких байт
+ * @param fd сюда пишется дескриптор чанка
+ * @param offset а сюда - оффсет данных в нём
+ * @return количество байт, 0 - конец потока
+ */
+ssize_t RStream_map(struct RStream *rs, ssize_t size, int *fd, off_t *offset) {
+	ssize_t r = RStream__pump(rs, NULL, -1, size, RSTREAM_TRANSFER_MAP);
 
-	snprintf(path, sizeof(path), "%s/.writer.lock", rs->rootDir);
-	if(unlink(path) == -1) {
-		if(errno != ENOENT)
-			warning("unable to unlink() write lock-file '%s'", path);
+	if(r > 0) {
+		*fd = rs->chunkFd;
+		*offset = rs->chunkOffset - r;
 	}
 
-	if(rmdir(rs->rootDir) == -1) {
-		if(errno != ENOENT)
-			error("rmdir('%s')", rs->rootDir);
-	}
+	return r;
 }
 
 /**
- * Сканирует каталог с чанками на предмет первого незахваченного.
- * Используется для выбора чанка в мультирид режиме, когда возможно
- * несколько читателей на поток
+ * Вырезает метки из данных, полученных через RStream_map() и скопированных
+ * в buf. Нужно, только если выставлен RStream.stripMarkers
  * @param rs
- * @return
+ * @param buf
+ * @param len
+ * @return сколько осталось в buf
  */
-static int RStream__openNotAcquiredChunk(struct RStream *rs) {
-	int numFiles;
-	int i;
-	int numChunks = 0;
-	int fd = RSTREAM_DIR_IS_EMPTY;
-	struct dirent **list;
+ssize_t RStream_removeMarkers(struct RStream *rs, char *buf, ssize_t len) {
+	return Markers_strip(&rs->markers, buf, len);
+}
 
-	debug("staring scandir() on '%s'", rs->rootDir);
+/**
+ * Брокер: захватывает следующий чанк, не читая его, и отдаёт его целиком.
+ * Ждать нового чанка, если сейчас нет свободных, должен вызывающий
+ * (по RStream.inotifyFd или по таймеру)
+ * @param rs
+ * @param lease
+ * @return 1 - чанк захвачен, 0 - свободных нет, -1 - конец потока (каталог уже удалён)
+ */
+int RStream_lease(struct RStream *rs, struct RStreamLease *lease) {
+	int fd = RStream__openNotAcquiredChunk(rs);
 
-	numFiles = scandir(rs->rootDir, &list, NULL, alphasort);
-	if(numFiles == -1) {
-		if(errno == ENOENT)
-			return RSTREAM_ROOT_DELETED;
+	if(fd < 0) {
+		if(fd == RSTREAM_ROOT_DELETED)
+			return -1;
 
-		error("unable to fetch directory listing of '%s'", rs->rootDir);
+		if(fd == RSTREAM_DIR_IS_EMPTY && !rs->persistentMode && !RStream__writersIsHere(rs)) {
+			debug("end of stream detected");
+			RStream__removeRootDir(rs);
+
+			return -1;
+		}
+
+		RStream__setWaiting(rs, 1);
+
+		return 0;
 	}
 
-	for(i=0; i<numFiles; i++) {
-		if(list[i]->d_name[0] == '.' || strstr(list[i]->d_name, ".chunk") != list[i]->d_name + (strlen(list[i]->d_name) - 6))
-			continue;
+	RStream__setWaiting(rs, 0);
+	RStream__detectMarkers(rs);
 
-		numChunks++;
+	rs->chunkFd = fd;
+	snprintf(rs->chunkOffsetPath, sizeof(rs->chunkOffsetPath), "%s.offset", rs->chunkPath);
 
-		debug("  chunk '%s'", list[i]->d_name);
+	RStream__recordLatency(rs, STATS_HIST_CHUNK_LATENCY_US, strtoull(strrchr(rs->chunkPath, '/') + 1, NULL, 10));
+	RStream__restoreOffset(rs);
 
-		/*
-		 * тут наша задача - попытаться понять, занят ли этот чанк кем-то.
-		 * Из за того, что невозможно атомарно открыть файл и залочить его
-		 * приходится открывать и локать отдельно, а после этого проверять
-		 * не был лифайл удалён и анлокнут другим читателем в промежутке
-		 * между открытием и локом
-		 */
-		snprintf(rs->chunkPath, sizeof(rs->chunkPath), "%s/%s", rs->rootDir, list[i]->d_name);
+	lease->fd = fd;
+	lease->offset = rs->chunkOffset;
+	lease->savedOffset = rs->chunkOffset;
+	snprintf(lease->path, sizeof(lease->path), "%s", rs->chunkPath);
 
-		/* обазательно нужно право на запись для lockf() */
-		fd = open(rs->chunkPath, O_RDWR);
-		if(fd == -1) {
-			if(errno == ENOENT) {
-				/* ничего страшного, просто файл удалили пока мы сканили */
-				debug("    - deleted before lock");
+	/* дальше чанк живёт в lease, rs свободен для следующего */
+	rs->chunkFd = -1;
 
-				continue;
-			}
+	return 1;
+}
 
-			error("opening chunk file '%s'", rs->chunkPath);
-		}
+/**
+ * Подставляет чанк lease как текущий, чтобы работали оффсеты и удаление
+ */
+static void RStream__enterLease(struct RStream *rs, struct RStreamLease *lease) {
+	rs->chunkFd = lease->fd;
+	rs->offsetFd = -1;
+	rs->lastCheckpointOffset = lease->savedOffset;
 
-		/*
-		 * просто локаем первый байт, потому что flock() изпользовать
-		 * нельзя чтобы не смешивать типы локов
-		 */
-		if(!flockRangeNB(fd, 0, 1, F_WRLCK)) {
-			debug("    - locked");
+	snprintf(rs->chunkPath, sizeof(rs->chunkPath), "%s", lease->path);
+	snprintf(rs->chunkOffsetPath, sizeof(rs->chunkOffsetPath), "%s.offset", lease->path);
+}
 
-			close(fd);
-			fd = -1;
-			continue;
-		}
+static void RStream__leaveLease(struct RStream *rs) {
+	RStream__closeOffsetFile(rs);
+	rs->chunkFd = -1;
+}
 
-		/* проверяем не удалили ли файл до лока */
-		if(access(rs->chunkPath, R_OK) == -1) {
-			if(errno == ENOENT) {
-				debug("    - deleted after lock");
+/**
+ * Читатель выдал delivered байт чанка: сохраняем по границе записи,
+ * с этого места чанк получит следующий читатель, если этот умрёт
+ * @param rs
+ * @param lease
+ * @param delivered
+ */
+void RStream_checkpointLease(struct RStream *rs, struct RStreamLease *lease, off_t delivered) {
+	off_t aligned;
 
-				close(fd);
-				fd = -1;
-				continue;
-			}
+	if(delivered <= lease->savedOffset)
+		return;
 
-			error("checking access on '%s'", rs->chunkPath);
-		}
+	RStream__enterLease(rs, lease);
 
-		/* если до сюда дошли, то файл наш */
-		break;
+	aligned = RStream__alignOffset(rs, delivered);
+	if(aligned > lease->savedOffset) {
+		RStream__saveOffset(rs, aligned);
+
+		lease->savedOffset = aligned;
+		Stats_inc(STATS_CHECKPOINTS);
 	}
 
-	for(i=0; i<numFiles; i++)
-		free(list[i]);
+	lease->offset = lease->savedOffset;
 
-	free(list);
+	RStream__leaveLease(rs);
+}
 
-	if(!numChunks) {
-		debug("no more chunks in '%s'", rs->rootDir);
-		return RSTREAM_DIR_IS_EMPTY;
-	}
+/**
+ * Чанк дочитан: удаляет его, как читатель, и закрывает lease->fd
+ * @param rs
+ * @param lease
+ */
+void RStream_completeLease(struct RStream *rs, struct RStreamLease *lease) {
+	RStream__enterLease(rs, lease);
+	RStream__finishChunk(rs);
+	RStream__leaveLease(rs);
 
-	if(fd < 0)
-		return RSTREAM_NO_MORE_NOT_ACQUIRED_FILES;
+	lease->fd = -1;
+}
 
-	return fd;
+/**
+ * Вычитывает накопившиеся события inotify, если ждём по RStream.inotifyFd сами
+ * @param rs
+ */
+void RStream_drainNotifications(struct RStream *rs) {
+	RStream__drainNotifications(rs);
 }
 
-static char RStream__writersIsHere(struct RStream *rs) {
-	char path[PATH_MAX + 64];
-	int fd;
+static ssize_t RStream__readChunk(struct RStream *rs, char *buf, int outFd, ssize_t size, int method) {
+#ifdef RSTREAM_USE_SPLICE
+	uint64_t startTime;
+	ssize_t r;
+#endif
+	struct stat st;
+
+	switch(method) {
+#ifdef RSTREAM_USE_SPLICE
+		/* тут же ждём, пока вывод примет данные, это время и меряем */
+		case RSTREAM_TRANSFER_SPLICE:
+			startTime = timemicro();
+			r = splice(rs->chunkFd, NULL, outFd, NULL, (size_t)size, SPLICE_F_MOVE | SPLICE_F_MORE);
+			Stats_record(STATS_HIST_OUTPUT_WRITE_US, timemicro() - startTime);
+			return r;
+		case RSTREAM_TRANSFER_SENDFILE:
+			startTime = timemicro();
+			r = sendfile(outFd, rs->chunkFd, NULL, (size_t)size);
+			Stats_record(STATS_HIST_OUTPUT_WRITE_US, timemicro() - startTime);
+			return r;
+#endif
+		case RSTREAM_TRANSFER_READ:
+			return read(rs->chunkFd, buf, (size_t)size);
 
-	snprintf(path, sizeof(path), "%s/.writer.lock", rs->rootDir);
-	fd = open(path, O_RDONLY);
-	if(fd == -1)
-		return 0;
+		/* позицию файла двигаем как read(), на неё опираются сегменты и .offset */
+		case RSTREAM_TRANSFER_MAP:
+			if(fstat(rs->chunkFd, &st) == -1)
+				return -1;
 
-	if(flock(fd, LOCK_EX | LOCK_NB) == -1) {
-		close(fd);
-		return errno == EWOULDBLOCK;
-	}
+			if(st.st_size <= rs->chunkOffset)
+				return 0;
 
-	close(fd);
+			if(size > st.st_size - rs->chunkOffset)
+				size = (ssize_t)(st.st_size - rs->chunkOffset);
 
-	return 0;
+			if(lseek(rs->chunkFd, rs->chunkOffset + size, SEEK_SET) == -1)
+				return -1;
+
+			return size;
+	}
+
+	errno = ENOSYS;
+	return -1;
 }
 
-static int RStream__openNextChunk(struct RStream *rs) {
-	if(rs->chunkFd >= 0) {
-		if(unlink(rs->chunkPath) == -1) {
-			error("unlink('%s')", rs->chunkPath);
-		}
+static ssize_t RStream__pump(struct RStream *rs, char *buf, int outFd, ssize_t size, int method) {
+	ssize_t r;
 
-		if(unlink(rs->chunkOffsetPath) == -1) {
-			if(errno != ENOENT)
-				warning("unable to unlink offset file '%s': %s", rs->chunkOffsetPath, strerror(errno));
+	if(rs->chunkFd == -1) {
+		if(RStream__openNextChunk(rs) < 0) {
+			debug("end of stream detected");
+			RStream__removeRootDir(rs);
+			return 0; /* end of stream */
 		}
-
-		close(rs->chunkFd);
-		rs->chunkFd = -1;
 	}
 
-	for(;;) {
-		rs->chunkFd = RStream__openNotAcquiredChunk(rs);
-		if(rs->chunkFd >= 0)
-			break;
+	/* всё прочитанное прошлым вызовом к этому моменту уже выдано */
+	RStream__mayCheckpoint(rs);
 
-		if(rs->chunkFd == RSTREAM_ROOT_DELETED)
-			break;
+	while(1) {
+		ssize_t toRead = size;
 
-		if(rs->chunkFd == RSTREAM_DIR_IS_EMPTY) {
-			if(!rs->persistentMode && !RStream__writersIsHere(rs)) {
-				/* писателей не осталось */
-				break;
-			}
+		/* новый чанк мог оказаться помеченным, а из него ещё ничего не выдано */
+		if(rs->stripMarkers && (method == RSTREAM_TRANSFER_SPLICE || method == RSTREAM_TRANSFER_SENDFILE)) {
+			errno = EOPNOTSUPP;
+			return -1;
 		}
 
-		RStream__scheduleUpdateNotification(rs, 100000);
-	}
+		if(rs->segmentsFd >= 0) {
+			if(rs->chunkOffset >= rs->segmentEnd) {
+				if(!RStream__nextSegment(rs) && RStream__openNextChunk(rs) < 0) {
+					debug("end of stream detected");
+					RStream__removeRootDir(rs);
+					return 0; /* end of stream */
+				}
 
-	/* проверяем нет ли информации о уже прочитанных из чанка данных */
-	if(rs->chunkFd >= 0) {
-		int offsetFileFd;
+				continue;
+			}
 
-		snprintf(rs->chunkOffsetPath, sizeof(rs->chunkOffsetPath), "%s.offset", rs->chunkPath);
+			if(toRead > rs->segmentEnd - rs->chunkOffset)
+				toRead = (ssize_t)(rs->segmentEnd - rs->chunkOffset);
+		} else if(rs->nextSplitCheck >= 0 && rs->chunkOffset >= rs->nextSplitCheck) {
+			RStream__maySplitChunk(rs);
+			continue;
+		}
 
-		offsetFileFd = open(rs->chunkOffsetPath, O_RDONLY);
-		if(offsetFileFd >= 0) {
-			char buf[64];
-			ssize_t bufLen;
-			unsigned long offset;
+		r = RStream__readChunk(rs, buf, outFd, toRead, method);
+		if(r == 0 && rs->segmentsFd >= 0) {
+			/* сегменты бывают только у дописанных чанков, так что это странно */
+			warning("chunk '%s' is shorter than expected", rs->chunkPath);
+			rs->chunkOffset = rs->segmentEnd;
+			continue;
+		}
 
-			debug("Found offset-file '%s'", rs->chunkOffsetPath);
+		if(r == -1 || r == 0) {
+			if(r == 0 || errno == EAGAIN || errno == EINTR) {
+				/*
+				 * нечего было читать, значит надо проверить, не закончился ли чанк.
+				 * С inotify лок проверяем только если писатель мог закрыть файл
+				 */
+				if(rs->chunkMayBeCompleted && RStream__chunkIsCompleted(rs)) {
+					if(RStream__openNextChunk(rs) < 0) {
+						debug("end of stream detected");
+						RStream__removeRootDir(rs);
+						return 0; /* end of stream */
+					}
 
-			if((bufLen = read(offsetFileFd, buf, sizeof(buf) - 1)) == -1) {
-				warning("Error reading offset-file '%s': %s", rs->chunkOffsetPath, strerror(errno));
-			} else {
-				buf[bufLen] = 0;
-
-				offset = strtoul(buf, NULL, 10);
-				if(offset == ULONG_MAX) {
-					warning("unable to parse offset from '%s': invalid string '%s'", rs->chunkOffsetPath, buf);
-				} else {
-					if(lseek(rs->chunkFd, (off_t)offset, SEEK_SET) == (off_t)-1)
-						warning("unable to seek to offset %lu on file '%s'", offset, rs->chunkOffsetPath);
+					continue;
 				}
 
-				debug("	offset: strtoul('%s') = %lu", buf, offset);
-			}
+				if(rs->inotifyFd >= 0)
+					rs->chunkMayBeCompleted = 0;
 
-			close(offsetFileFd);
-		} else {
-			if(errno != ENOENT)
-				warning("Error opening offset-file '%s': %s", rs->chunkOffsetPath, strerror(errno));
+				RStream__waitForUpdate(rs, 100000);
+				continue;
+
+			} else if(r == -1) {
+				if(method != RSTREAM_TRANSFER_READ && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+					return -1;
+
+				error("read('%s')", rs->chunkPath);
+			}
 		}
+		break;
 	}
 
-	return rs->chunkFd;
+	rs->chunkOffset += r;
+
+	Stats_add(STATS_BYTES_READ, r);
+	Stats_maybePublish();
+
+	return r;
 }
 
 /**
- * Проверяет, ведётся ли запись в текущий чанк
- * @param ws
- * @return 1 or 0
+ * С новым чанком проверяет, не помечен ли поток, и начинает разбор меток
+ * заново: чанк всегда начинается со строки
+ * @param rs
  */
-static int RStream__chunkIsCompleted(struct RStream *rs) {
-	while(1) {
-		if(!flockRangeNB(rs->chunkFd, 1, 1, F_WRLCK)) {
-			/* файл залочен, значит писатель ещё пишет */
-			return 0;
-		}
-
-		break;
+static void RStream__detectMarkers(struct RStream *rs) {
+	if(!rs->stripMarkers && Markers_areUsed(rs->streamDir)) {
+		debug("stream '%s' has markers, stripping them", rs->streamDir);
+		rs->stripMarkers = 1;
+	}
+
+	Markers_reset(&rs->markers);
+}
+
+static void RStream__onMarker(struct Markers *m, uint64_t ingestTimemicro) {
+	struct RStream *rs = (struct RStream *)((char *)m - offsetof(struct RStream, markers));
+
+	RStream__recordLatency(rs, STATS_HIST_RECORD_LATENCY_US, ingestTimemicro);
+}
+
+static void RStream__recordLatency(struct RStream *rs, int histogram, uint64_t ingestTimemicro) {
+	uint64_t now = timemicro();
+	uint64_t latency = now > ingestTimemicro ? now - ingestTimemicro : 0;
+
+	Stats_record(histogram, latency);
+
+	if(rs->latencyAlert && latency > rs->latencyAlert && now - rs->lastLatencyAlert >= 1000000) {
+		rs->lastLatencyAlert = now;
+
+		warning(
+			"%s latency %llu ms exceeds %llu ms",
+			histogram == STATS_HIST_CHUNK_LATENCY_US ? "chunk" : "record",
+			(unsigned long long)(latency / 1000),
+			(unsigned long long)(rs->latencyAlert / 1000)
+		);
+	}
+}
+
+static void RStream__setWaiting(struct RStream *rs, char waiting) {
+	if(waiting == rs->waiting)
+		return;
+
+	if(rs->waitingFd == -1) {
+		char path[PATH_MAX + 64];
+
+		snprintf(path, sizeof(path), "%s/" WSTREAM_WAITING_FILENAME, rs->streamDir);
+
+		/* каталог могли уже удалить, тогда и ждать некого */
+		rs->waitingFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if(rs->waitingFd == -1) {
+			debug("open('%s'): %s", path, strerror(errno));
+			return;
+		}
+	}
+
+	if(flockRangeNB(rs->waitingFd, 0, 1, waiting ? F_RDLCK : F_UNLCK))
+		rs->waiting = waiting;
+}
+
+static void RStream__removeRootDir(struct RStream *rs) {
+	char path[PATH_MAX + 64];
+	int attempt;
+
+	/* дочитанные бакеты, которые ещё не старые, чтобы их удалили при сканировании */
+	Bucket_removeAll(rs->rootDir);
+
+	if(rs->group) {
+		if(ConsumerGroup_unregister(rs->streamDir, rs->group) == -1)
+			return;
+
+		/* последняя дочитавшая группа убирает и поток, если в корне тоже всё прочитано */
+		if(ConsumerGroup_removeDir(rs->streamDir) == -1 || RStream__dirHasChunks(rs->streamDir))
+			return;
+	} else if(ConsumerGroup_removeDir(rs->streamDir) == -1) {
+		debug("other consumer groups are still reading '%s'", rs->streamDir);
+		return;
+	}
+
+	debug("removing root dir: %s", rs->streamDir);
+
+	snprintf(path, sizeof(path), "%s/.writer.lock", rs->streamDir);
+	if(unlink(path) == -1) {
+		if(errno != ENOENT)
+			warning("unable to unlink() write lock-file '%s'", path);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", rs->streamDir, CHUNKINDEX_FILENAME);
+	if(unlink(path) == -1) {
+		if(errno != ENOENT)
+			warning("unable to unlink() chunk index '%s'", path);
+	}
+
+	ChunkPool_remove(rs->streamDir);
+
+	snprintf(path, sizeof(path), "%s/" WSTREAM_HWM_FILENAME, rs->streamDir);
+	if(unlink(path) == -1) {
+		if(errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+	}
+
+	snprintf(path, sizeof(path), "%s/" FRAMING_FILENAME, rs->streamDir);
+	if(unlink(path) == -1) {
+		if(errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+	}
+
+	snprintf(path, sizeof(path), "%s/" MARKERS_FILENAME, rs->streamDir);
+	if(unlink(path) == -1) {
+		if(errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+	}
+
+	Stripe_removeAll(rs->streamDir);
+
+	if(rs->group)
+		Bucket_removeAll(rs->streamDir);
+
+	snprintf(path, sizeof(path), "%s/" WSTREAM_WAITING_FILENAME, rs->streamDir);
+
+	/* другой читатель мог успеть ещё раз опубликовать статистику или начать ждать */
+	for(attempt = 0;; attempt++) {
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+
+		Stats_removePublished(rs->streamDir);
+
+		if(rmdir(rs->streamDir) == 0 || errno == ENOENT)
+			break;
+
+		if(errno != ENOTEMPTY || attempt == 9)
+			error("rmdir('%s')", rs->streamDir);
+
+		/* дочитавший последний чанк убирает его .offset уже после переноса чанка в пул */
+		usleep(10000);
+	}
+}
+
+/**
+ * Пытается захватить чанк name в корне потока.
+ * В случае успеха rs->chunkPath указывает на захваченный чанк
+ * @param ctx struct RStream
+ * @param name
+ * @return дескриптор, CHUNKINDEX_CLAIM_GONE или CHUNKINDEX_CLAIM_BUSY
+ */
+static int RStream__tryAcquireChunk(void *ctx, const char *name) {
+	struct RStream *rs = ctx;
+	int fd;
+	int segmented;
+
+	debug("  chunk '%s'", name);
+
+	/*
+	 * тут наша задача - попытаться понять, занят ли этот чанк кем-то.
+	 * Из за того, что невозможно атомарно открыть файл и залочить его
+	 * приходится открывать и локать отдельно, а после этого проверять
+	 * не был лифайл удалён и анлокнут другим читателем в промежутке
+	 * между открытием и локом
+	 */
+	snprintf(rs->chunkPath, sizeof(rs->chunkPath), "%s/%s", rs->rootDir, name);
+
+	/* свой лок брокеру не помеха, так что розданные чанки он пропускает сам */
+	if(rs->chunkIsLeased && rs->chunkIsLeased(rs, rs->chunkPath)) {
+		debug("    - leased");
+		return CHUNKINDEX_CLAIM_BUSY;
+	}
+
+	/* обазательно нужно право на запись для lockf() */
+	fd = open(rs->chunkPath, O_RDWR);
+	if(fd == -1) {
+		if(errno == ENOENT) {
+			/* ничего страшного, просто файл удалили пока мы сканили */
+			debug("    - deleted before lock");
+			Stats_inc(STATS_CHUNKS_GONE);
+
+			return CHUNKINDEX_CLAIM_GONE;
+		}
+
+		error("opening chunk file '%s'", rs->chunkPath);
+	}
+
+	/*
+	 * просто локаем первый байт, потому что flock() изпользовать
+	 * нельзя чтобы не смешивать типы локов
+	 */
+	if(!flockRangeNB(fd, rs->lockBase, 1, F_WRLCK)) {
+		debug("    - locked");
+		Stats_inc(STATS_LOCK_BUSY);
+
+		close(fd);
+		return CHUNKINDEX_CLAIM_BUSY;
+	}
+
+	/*
+	 * если чанк уже разбит на сегменты, берём свободный сегмент.
+	 * Делаем это до проверки на удаление: дочитавший последний сегмент
+	 * удаляет сначала чанк и только потом .segments
+	 */
+	rs->chunkFd = fd;
+	segmented = rs->chunkIsLeased ? 0 : RStream__attachSegments(rs, 0);
+
+	/* проверяем не удалили ли файл до лока */
+	if(access(rs->chunkPath, R_OK) == -1) {
+		if(errno == ENOENT) {
+			debug("    - deleted after lock");
+			Stats_inc(STATS_CHUNKS_GONE);
+
+			RStream__detachSegments(rs);
+			close(fd);
+			rs->chunkFd = -1;
+
+			return CHUNKINDEX_CLAIM_GONE;
+		}
+
+		error("checking access on '%s'", rs->chunkPath);
+	}
+
+	if(segmented < 0) {
+		debug("    - all segments are busy");
+		Stats_inc(STATS_LOCK_BUSY);
+
+		close(fd);
+		rs->chunkFd = -1;
+
+		return CHUNKINDEX_CLAIM_BUSY;
+	}
+
+	/* если до сюда дошли, то файл наш */
+	return fd;
+}
+
+/**
+ * Ищет первый незахваченный чанк: сначала по индексу, а если там ничего
+ * нет - сканированием каталога (так же подбираются чанки, не попавшие в индекс).
+ * Используется для выбора чанка в мультирид режиме, когда возможно
+ * несколько читателей на поток
+ * @param rs
+ * @return
+ */
+/**
+ * Пытается взять сегмент с конца уже разбитого чанка, который читает кто-то другой
+ * @param rs
+ * @param name имя файла .segments
+ * @param chunkNameLen длина имени чанка в нём
+ * @return дескриптор чанка или -1
+ */
+static int RStream__stealSegment(struct RStream *rs, const char *name, size_t chunkNameLen) {
+	int fd;
+
+	snprintf(rs->chunkPath, sizeof(rs->chunkPath), "%s/%.*s", rs->rootDir, (int)chunkNameLen, name);
+
+	fd = open(rs->chunkPath, O_RDWR);
+	if(fd == -1) {
+		char path[PATH_MAX + 64];
+
+		if(errno != ENOENT)
+			error("opening chunk file '%s'", rs->chunkPath);
+
+		/* чанк уже удалён, а .segments остался от упавшего читателя */
+		snprintf(path, sizeof(path), "%s/%s", rs->rootDir, name);
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink orphaned '%s': %s", path, strerror(errno));
+
+		return -1;
+	}
+
+	rs->chunkFd = fd;
+
+	if(RStream__attachSegments(rs, 1) <= 0) {
+		close(fd);
+		rs->chunkFd = -1;
+
+		return -1;
+	}
+
+	debug("stealing segment %lu of '%s'", rs->segment, rs->chunkPath);
+	Stats_inc(STATS_SEGMENTS_STOLEN);
+
+	return fd;
+}
+
+static int RStream__openNotAcquiredChunk(struct RStream *rs) {
+	int numFiles;
+	int i;
+	int pass;
+	int numChunks = 0;
+	int fd;
+	struct dirent **list;
+
+	if(rs->index.fd == -1)
+		ChunkIndex_open(&rs->index, rs->rootDir, 0);
+
+	fd = ChunkIndex_claim(&rs->index, RStream__claimChunk, rs);
+	if(fd >= 0) {
+		Stats_inc(STATS_INDEX_CLAIMS);
+		return fd;
+	}
+
+	debug("staring scandir() on '%s'", rs->rootDir);
+
+	Stats_inc(STATS_SCANS);
+
+	numFiles = scandir(rs->rootDir, &list, NULL, alphasort);
+	if(numFiles == -1) {
+		if(errno == ENOENT)
+			return RSTREAM_ROOT_DELETED;
+
+		error("unable to fetch directory listing of '%s'", rs->rootDir);
+	}
+
+	rs->rootScan.list = list;
+	rs->rootScan.length = numFiles;
+
+	Stats_add(STATS_SCAN_ENTRIES, numFiles);
+
+	/*
+	 * сначала свободные чанки, потом брошенные захваты -R,
+	 * и если ничего нет - помогаем дочитать чужие большие чанки
+	 */
+	for(pass = RSTREAM_SCAN_CLAIM; fd < 0 && pass <= RSTREAM_SCAN_STEAL; pass++) {
+		if(pass == RSTREAM_SCAN_RECOVER && !rs->renameClaims)
+			continue;
+
+		/* брокер раздаёт чанки целиком */
+		if(pass == RSTREAM_SCAN_STEAL && rs->chunkIsLeased)
+			continue;
+
+		for(i=0; fd < 0 && i<numFiles; i++) {
+			if(!Bucket_isName(list[i]->d_name))
+				numChunks += RStream__scanEntry(rs, list[i]->d_name, pass, &fd);
+		}
+
+		/* бакеты по порядку: обычно сканировать приходится только самый старый непустой */
+		for(i=0; fd < 0 && i<numFiles; i++) {
+			if(Bucket_isName(list[i]->d_name))
+				numChunks += RStream__scanBucket(rs, list[i]->d_name, pass, &fd);
+		}
+	}
+
+	RStream__freeScan(&rs->rootScan);
+
+	if(!numChunks) {
+		debug("no more chunks in '%s'", rs->rootDir);
+		return RSTREAM_DIR_IS_EMPTY;
+	}
+
+	if(fd < 0)
+		return RSTREAM_NO_MORE_NOT_ACQUIRED_FILES;
+
+	return fd;
+}
+
+static char RStream__hasSuffix(const char *name, size_t len, const char *suffix) {
+	size_t suffixLen = strlen(suffix);
+
+	return len > suffixLen && strcmp(name + len - suffixLen, suffix) == 0;
+}
+
+/**
+ * @return как у renameat2(RENAME_NOREPLACE), ENOSYS - если его нет в libc
+ */
+static int RStream__renameNoReplace(const char *from, const char *to) {
+#ifdef RENAME_NOREPLACE
+	return renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * Захват чанка с -R: переименование в RSTREAM_CLAIMED_SUFFIX и лок читателя.
+ * Без -R - только лок, см. RStream__tryAcquireChunk()
+ * @param ctx struct RStream
+ * @param name
+ * @return дескриптор, CHUNKINDEX_CLAIM_GONE или CHUNKINDEX_CLAIM_BUSY
+ */
+static int RStream__claimChunk(void *ctx, const char *name) {
+	struct RStream *rs = ctx;
+	char claimed[BUCKET_NAME_LENGTH + NAME_MAX + 16];
+	char path[PATH_MAX + 64];
+	char claimedPath[PATH_MAX + 64];
+	size_t nameLen = strlen(name);
+
+	if(!rs->renameClaims)
+		return RStream__tryAcquireChunk(rs, name);
+
+	/* захват другого читателя; если тот умер, чанк подберёт RSTREAM_SCAN_RECOVER */
+	if(RStream__hasSuffix(name, nameLen, RSTREAM_CLAIMED_SUFFIX))
+		return CHUNKINDEX_CLAIM_BUSY;
+
+	snprintf(claimed, sizeof(claimed), "%.*s" RSTREAM_CLAIMED_SUFFIX, (int)(nameLen - strlen(".chunk")), name);
+	snprintf(path, sizeof(path), "%s/%s", rs->rootDir, name);
+	snprintf(claimedPath, sizeof(claimedPath), "%s/%s", rs->rootDir, claimed);
+
+	debug("  chunk '%s'", name);
+
+	if(RStream__renameNoReplace(path, claimedPath) == -1) {
+		if(errno == ENOENT) {
+			debug("    - claimed by other reader");
+			Stats_inc(STATS_CHUNKS_GONE);
+
+			return CHUNKINDEX_CLAIM_GONE;
+		}
+
+		if(errno == EINVAL || errno == ENOSYS) {
+			warning("renameat2() is not supported on '%s', falling back to lock-based claims", rs->rootDir);
+			rs->renameClaims = 0;
+
+			return RStream__tryAcquireChunk(rs, name);
+		}
+
+		error("renameat2('%s', '%s')", path, claimedPath);
+	}
+
+	Stats_inc(STATS_RENAME_CLAIMS);
+
+	/*
+	 * Лок всё равно нужен: только по нему видно, что захват жив, а не брошен
+	 * умершим читателем. А между переименованием и локом чанк мог подобрать
+	 * и даже дочитать RSTREAM_SCAN_RECOVER другого читателя, это ловит
+	 * проверка на удаление после лока
+	 */
+	return RStream__tryAcquireChunk(rs, claimed);
+}
+
+/**
+ * Пробует захватить по имени из каталога то, что нужно проходу pass
+ * @param rs
+ * @param name имя относительно rs->rootDir
+ * @param pass RSTREAM_SCAN_*
+ * @param fd сюда пишется дескриптор захваченного чанка
+ * @return 1 если name - чанк
+ */
+static char RStream__scanEntry(struct RStream *rs, const char *name, int pass, int *fd) {
+	const char *base = strrchr(name, '/');
+	size_t nameLen = strlen(name);
+
+	if((base ? base[1] : name[0]) == '.')
+		return 0;
+
+	if(pass == RSTREAM_SCAN_STEAL) {
+		if(RStream__hasSuffix(name, nameLen, ".chunk" RSTREAM_SEGMENTS_SUFFIX))
+			*fd = RStream__stealSegment(rs, name, nameLen - strlen(RSTREAM_SEGMENTS_SUFFIX));
+
+		return 0;
+	}
+
+	if(!RStream__hasSuffix(name, nameLen, ".chunk"))
+		return 0;
+
+	if(pass == RSTREAM_SCAN_CLAIM) {
+		*fd = RStream__claimChunk(rs, name);
+	} else if(RStream__hasSuffix(name, nameLen, RSTREAM_CLAIMED_SUFFIX)) {
+		/* захват держится локом читателя: лок свободен - захвативший умер */
+		*fd = RStream__tryAcquireChunk(rs, name);
+
+		if(*fd >= 0) {
+			debug("    - recovered claim of dead reader");
+			Stats_inc(STATS_CLAIMS_RECOVERED);
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Проход pass по бакету, см. RStream__openNotAcquiredChunk()
+ * @param rs
+ * @param bucket
+ * @param pass RSTREAM_SCAN_*
+ * @param fd сюда пишется дескриптор захваченного чанка
+ * @return количество чанков в бакете, пока не нашёлся свободный
+ */
+static int RStream__scanBucket(struct RStream *rs, const char *bucket, int pass, int *fd) {
+	char path[PATH_MAX + 64];
+	char name[BUCKET_NAME_LENGTH + NAME_MAX + 2];
+	struct dirent **list;
+	int numFiles;
+	int numChunks = 0;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s", rs->rootDir, bucket);
+
+	Stats_inc(STATS_SCANS);
+
+	numFiles = scandir(path, &list, NULL, alphasort);
+	if(numFiles == -1) {
+		/* опустевший бакет удалил другой читатель */
+		if(errno == ENOENT)
+			return 0;
+
+		error("unable to fetch directory listing of '%s'", path);
+	}
+
+	rs->bucketScan.list = list;
+	rs->bucketScan.length = numFiles;
+
+	Stats_add(STATS_SCAN_ENTRIES, numFiles);
+
+	for(i=0; *fd < 0 && i<numFiles; i++) {
+		snprintf(name, sizeof(name), "%s/%s", bucket, list[i]->d_name);
+		numChunks += RStream__scanEntry(rs, name, pass, fd);
+	}
+
+	RStream__freeScan(&rs->bucketScan);
+
+	if(pass == RSTREAM_SCAN_CLAIM && !numChunks)
+		Bucket_prune(path);
+
+	return numChunks;
+}
+
+static void RStream__freeScan(struct RStreamScan *scan) {
+	int i;
+
+	if(!scan->list)
+		return;
+
+	for(i=0; i<scan->length; i++)
+		free(scan->list[i]);
+
+	free(scan->list);
+
+	scan->list = NULL;
+	scan->length = 0;
+}
+
+/**
+ * Удаляет бакет только что дочитанного чанка, если тот был в нём последним
+ * @param rs
+ */
+static void RStream__pruneBucket(struct RStream *rs) {
+	char path[PATH_MAX + 64];
+	char *slash;
+
+	snprintf(path, sizeof(path), "%s", rs->chunkPath);
+
+	slash = strrchr(path, '/');
+	if(!slash || (size_t)(slash - path) == strlen(rs->rootDir))
+		return;
+
+	*slash = 0;
+	Bucket_prune(path);
+}
+
+static char RStream__writersIsHere(struct RStream *rs) {
+	char path[PATH_MAX + 64];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/.writer.lock", rs->streamDir);
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return 0;
+
+	if(flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		return errno == EWOULDBLOCK;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+/**
+ * Дочитанный чанк уходит в пул, если его больше никто не держит:
+ * ссылки на него из других групп значат, что его ещё читают
+ * @param rs
+ * @return 0 если чанк в пуле, иначе его надо удалить
+ */
+static int RStream__recycleChunk(struct RStream *rs) {
+	struct stat st;
+
+	/* ChunkPool_put() снимает все локи, кроме байта 0, а у группы лок читателя не там */
+	if(rs->group)
+		return -1;
+
+	if(fstat(rs->chunkFd, &st) == -1 || st.st_nlink > 1)
+		return -1;
+
+	/* файл в страйпе: в пул корня его не переложить */
+	if(lstat(rs->chunkPath, &st) == -1 || S_ISLNK(st.st_mode))
+		return -1;
+
+	return ChunkPool_put(&rs->pool, rs->chunkPath, rs->chunkFd);
+}
+
+/**
+ * Убирает дочитанный чанк: в пул или unlink(). Дочитать чанк могут сразу
+ * несколько читателей сегментов, но перенести или удалить его удаётся одному
+ * @param rs
+ * @return 1 если чанк убрал этот читатель, 0 если его уже нет
+ */
+static char RStream__removeChunk(struct RStream *rs) {
+	if(RStream__recycleChunk(rs) == 0 || Stripe_unlinkChunk(rs->chunkPath) == 0)
+		return 1;
+
+	if(errno != ENOENT)
+		error("unlink('%s')", rs->chunkPath);
+
+	return 0;
+}
+
+/**
+ * Дочитанный чанк удаляется (или уходит в пул) вместе с .offset
+ * @param rs
+ */
+static void RStream__finishChunk(struct RStream *rs) {
+	if(rs->flushOutput)
+		rs->flushOutput(rs);
+
+	/* чанк мог удалить писатель с -o drop */
+	RStream__removeChunk(rs);
+
+	Stats_inc(STATS_CHUNKS_READ);
+
+	RStream__closeOffsetFile(rs);
+
+	if(unlink(rs->chunkOffsetPath) == -1) {
+		if(errno != ENOENT)
+			warning("unable to unlink offset file '%s': %s", rs->chunkOffsetPath, strerror(errno));
+	}
+
+	RStream__pruneBucket(rs);
+
+	close(rs->chunkFd);
+	rs->chunkFd = -1;
+}
+
+static int RStream__openNextChunk(struct RStream *rs) {
+	if(rs->chunkFd >= 0)
+		RStream__finishChunk(rs);
+
+	for(;;) {
+		uint64_t scanStartTime = timemicro();
+
+		rs->chunkFd = RStream__openNotAcquiredChunk(rs);
+		Stats_record(STATS_HIST_SCAN_US, timemicro() - scanStartTime);
+
+		if(rs->chunkFd >= 0)
+			break;
+
+		if(rs->chunkFd == RSTREAM_ROOT_DELETED)
+			break;
+
+		if(rs->chunkFd == RSTREAM_DIR_IS_EMPTY) {
+			if(!rs->persistentMode && !RStream__writersIsHere(rs)) {
+				/* писателей не осталось */
+				break;
+			}
+		}
+
+		RStream__setWaiting(rs, 1);
+		RStream__waitForUpdate(rs, 100000);
+	}
+
+	RStream__setWaiting(rs, 0);
+
+	/* проверяем нет ли информации о уже прочитанных из чанка данных */
+	if(rs->chunkFd >= 0) {
+		RStream__watchChunk(rs);
+
+		/* имя чанка начинается с timemicro() его создания, т.е. прихода первой записи */
+		RStream__recordLatency(rs, STATS_HIST_CHUNK_LATENCY_US, strtoull(strrchr(rs->chunkPath, '/') + 1, NULL, 10));
+		RStream__detectMarkers(rs);
+
+		snprintf(rs->chunkOffsetPath, sizeof(rs->chunkOffsetPath), "%s.offset", rs->chunkPath);
+
+		/* позиция в сегменте уже выставлена */
+		if(rs->segmentsFd >= 0)
+			return rs->chunkFd;
+
+		RStream__restoreOffset(rs);
+	}
+
+	return rs->chunkFd;
+}
+
+/**
+ * Продолжаем с сохранённого в .offset, если он есть
+ * @param rs
+ */
+static void RStream__restoreOffset(struct RStream *rs) {
+	int offsetFileFd;
+
+	rs->chunkOffset = 0;
+	rs->nextSplitCheck = 0;
+
+	offsetFileFd = open(rs->chunkOffsetPath, O_RDONLY);
+	if(offsetFileFd >= 0) {
+		char buf[64];
+		ssize_t bufLen;
+		unsigned long offset;
+
+		debug("Found offset-file '%s'", rs->chunkOffsetPath);
+
+		if((bufLen = read(offsetFileFd, buf, sizeof(buf) - 1)) == -1) {
+			warning("Error reading offset-file '%s': %s", rs->chunkOffsetPath, strerror(errno));
+		} else {
+			buf[bufLen] = 0;
+
+			offset = strtoul(buf, NULL, 10);
+			if(offset == ULONG_MAX) {
+				warning("unable to parse offset from '%s': invalid string '%s'", rs->chunkOffsetPath, buf);
+			} else {
+				if(lseek(rs->chunkFd, (off_t)offset, SEEK_SET) == (off_t)-1)
+					warning("unable to seek to offset %lu on file '%s'", offset, rs->chunkOffsetPath);
+				else
+					rs->chunkOffset = (off_t)offset;
+			}
+
+			debug("	offset: strtoul('%s') = %lu", buf, offset);
+		}
+
+		close(offsetFileFd);
+	} else {
+		if(errno != ENOENT)
+			warning("Error opening offset-file '%s': %s", rs->chunkOffsetPath, strerror(errno));
+	}
+
+	RStream__resetCheckpoint(rs);
+}
+
+static uint64_t RStream__getSegmentState(struct RStream *rs, unsigned long k) {
+	uint64_t state;
+	ssize_t rd;
+
+	do {
+		rd = pread(rs->segmentsFd, &state, sizeof(state), (off_t)(k * sizeof(state)));
+	} while(rd == -1 && errno == EINTR);
+
+	if(rd != sizeof(state))
+		error("unable to read state of segment %lu of '%s'", k, rs->chunkPath);
+
+	return state;
+}
+
+static void RStream__setSegmentState(struct RStream *rs, unsigned long k, uint64_t state) {
+	ssize_t wr;
+
+	do {
+		wr = pwrite(rs->segmentsFd, &state, sizeof(state), (off_t)(k * sizeof(state)));
+	} while(wr == -1 && errno == EINTR);
+
+	if(wr != sizeof(state))
+		warning("unable to save state of segment %lu of '%s': %s", k, rs->chunkPath, strerror(errno));
+}
+
+/**
+ * Сегмент k начинается сразу за первым разделителем записей,
+ * который заканчивается в [k * RSTREAM_SEGMENT_SIZE, (k + 1) * RSTREAM_SEGMENT_SIZE)
+ * @param rs
+ * @param k
+ * @return начало сегмента k или -1 если в его окне нет разделителя
+ */
+static off_t RStream__findSegmentStart(struct RStream *rs, unsigned long k) {
+	char buf[64 * 1024];
+	off_t delimiterLength = (off_t)rs->framing.delimiterLength;
+	off_t pos = (off_t)k * RSTREAM_SEGMENT_SIZE - delimiterLength;
+	off_t windowEnd = (off_t)(k + 1) * RSTREAM_SEGMENT_SIZE - 1;
+
+	if(windowEnd > rs->chunkSize)
+		windowEnd = rs->chunkSize;
+
+	while(pos < windowEnd) {
+		size_t toRead = windowEnd - pos > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)(windowEnd - pos);
+		ssize_t rd = pread(rs->chunkFd, buf, toRead, pos);
+		const char *lineEnd;
+
+		if(rd == -1) {
+			if(errno == EINTR)
+				continue;
+
+			error("pread('%s')", rs->chunkPath);
+		}
+
+		if(rd == 0)
+			break;
+
+		lineEnd = Framing_findDelimiter(&rs->framing, buf, (size_t)rd);
+		if(lineEnd)
+			return pos + (lineEnd - buf) + delimiterLength;
+
+		/* разделитель может оказаться на стыке двух кусков */
+		if(rd < delimiterLength || pos + rd == windowEnd)
+			break;
+
+		pos += rd - (delimiterLength - 1);
+	}
+
+	return -1;
+}
+
+/**
+ * Конец сегмента k - начало следующего непустого сегмента
+ * @param rs
+ * @param k
+ * @return
+ */
+static off_t RStream__findSegmentEnd(struct RStream *rs, unsigned long k) {
+	unsigned long i;
+
+	for(i = k + 1; i < rs->numSegments; i++) {
+		off_t start = RStream__findSegmentStart(rs, i);
+
+		if(start >= 0)
+			return start;
+	}
+
+	return rs->chunkSize;
+}
+
+/**
+ * Пытается взять сегмент k: лочит его и выставляет позицию в чанке
+ * @param rs
+ * @param k
+ * @return 1 если сегмент наш
+ */
+static char RStream__takeSegment(struct RStream *rs, unsigned long k) {
+	uint64_t state;
+	off_t start;
+
+	if(!flockRangeNB(rs->chunkFd, rs->lockBase + RSTREAM_SEGMENT_LOCK_BASE + (off_t)k, 1, F_WRLCK))
+		return 0;
+
+	state = RStream__getSegmentState(rs, k);
+
+	if(state != RSTREAM_SEGMENT_DONE) {
+		if(state)
+			start = (off_t)state;
+		else if(k == 0)
+			start = 0;
+		else
+			start = RStream__findSegmentStart(rs, k);
+
+		if(start >= 0) {
+			rs->segmentEnd = RStream__findSegmentEnd(rs, k);
+
+			if(start < rs->segmentEnd) {
+				if(lseek(rs->chunkFd, start, SEEK_SET) == (off_t)-1)
+					error("lseek('%s', %llu)", rs->chunkPath, (unsigned long long)start);
+
+				rs->segment = k;
+				rs->chunkOffset = start;
+				RStream__resetCheckpoint(rs);
+
+				debug("segment %lu of '%s': %llu - %llu", k, rs->chunkPath, (unsigned long long)start, (unsigned long long)rs->segmentEnd);
+
+				return 1;
+			}
+		}
+
+		/* пустой сегмент */
+		RStream__setSegmentState(rs, k, RSTREAM_SEGMENT_DONE);
+	}
+
+	flockRangeNB(rs->chunkFd, rs->lockBase + RSTREAM_SEGMENT_LOCK_BASE + (off_t)k, 1, F_UNLCK);
+
+	return 0;
+}
+
+static char RStream__pickSegment(struct RStream *rs) {
+	unsigned long i;
+
+	for(i = 0; i < rs->numSegments; i++) {
+		unsigned long k = rs->segmentFromTail ? rs->numSegments - 1 - i : i;
+
+		if(RStream__takeSegment(rs, k))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Подхватывает разбиение rs->chunkFd на сегменты, если оно есть, и берёт свободный сегмент
+ * @param rs
+ * @param fromTail
+ * @return 1 - сегмент взят, 0 - чанк не разбит, -1 - свободных сегментов нет
+ */
+static int RStream__attachSegments(struct RStream *rs, char fromTail) {
+	char path[RSTREAM_SIDECAR_PATH_SIZE];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s" RSTREAM_SEGMENTS_SUFFIX, rs->chunkPath);
+
+	rs->segmentsFd = open(path, O_RDWR);
+	if(rs->segmentsFd == -1) {
+		if(errno != ENOENT)
+			error("open('%s')", path);
+
+		return 0;
+	}
+
+	/* раз чанк разбит, разбивка у потока подходящая */
+	RStream__framingIsSeekable(rs);
+
+	if(fstat(rs->segmentsFd, &st) == -1)
+		error("fstat('%s')", path);
+
+	rs->numSegments = (unsigned long)st.st_size / sizeof(uint64_t);
+
+	if(fstat(rs->chunkFd, &st) == -1)
+		error("fstat('%s')", rs->chunkPath);
+
+	rs->chunkSize = st.st_size;
+	rs->segmentFromTail = fromTail;
+	rs->nextSplitCheck = -1;
+
+	if(RStream__pickSegment(rs))
+		return 1;
+
+	RStream__detachSegments(rs);
+
+	return -1;
+}
+
+static void RStream__detachSegments(struct RStream *rs) {
+	if(rs->segmentsFd >= 0) {
+		close(rs->segmentsFd);
+		rs->segmentsFd = -1;
+	}
+}
+
+/**
+ * Сегмент дочитан: отмечаем его и берём следующий свободный.
+ * Если свободных нет - отпускаем чанк, а если прочитаны все сегменты - удаляем его
+ * @param rs
+ * @return 1 если взят следующий сегмент
+ */
+static char RStream__nextSegment(struct RStream *rs) {
+	unsigned long i;
+
+	if(rs->flushOutput)
+		rs->flushOutput(rs);
+
+	RStream__setSegmentState(rs, rs->segment, RSTREAM_SEGMENT_DONE);
+	flockRangeNB(rs->chunkFd, rs->lockBase + RSTREAM_SEGMENT_LOCK_BASE + (off_t)rs->segment, 1, F_UNLCK);
+
+	if(RStream__pickSegment(rs))
+		return 1;
+
+	for(i = 0; i < rs->numSegments; i++) {
+		if(RStream__getSegmentState(rs, i) != RSTREAM_SEGMENT_DONE)
+			break;
+	}
+
+	if(i == rs->numSegments) {
+		char path[RSTREAM_SIDECAR_PATH_SIZE];
+
+		debug("all segments of '%s' are done", rs->chunkPath);
+
+		/* порядок важен, см. RStream__tryAcquireChunk(); служебные файлы может удалить и проигравший */
+		if(RStream__removeChunk(rs))
+			Stats_inc(STATS_CHUNKS_READ);
+
+		snprintf(path, sizeof(path), "%s" RSTREAM_SEGMENTS_SUFFIX, rs->chunkPath);
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink segments file '%s': %s", path, strerror(errno));
+
+		RStream__closeOffsetFile(rs);
+
+		snprintf(path, sizeof(path), "%s.offset", rs->chunkPath);
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink offset file '%s': %s", path, strerror(errno));
+
+		RStream__pruneBucket(rs);
+	}
+
+	RStream__closeOffsetFile(rs);
+	RStream__detachSegments(rs);
+
+	close(rs->chunkFd);
+	rs->chunkFd = -1;
+
+	return 0;
+}
+
+/**
+ * Если чанк уже дописан и осталось больше сегмента, разбивает его на сегменты,
+ * чтобы помочь дочитать его могли другие читатели. Мы продолжаем с того же места,
+ * все сегменты до текущего считаются прочитанными
+ * @param rs
+ */
+static void RStream__maySplitChunk(struct RStream *rs) {
+	char path[RSTREAM_SIDECAR_PATH_SIZE];
+	char tmpPath[RSTREAM_SIDECAR_PATH_SIZE + 8];
+	struct stat st;
+	uint64_t *states;
+	unsigned long k;
+	unsigned long i;
+	size_t statesSize;
+	int fd;
+
+	rs->nextSplitCheck = (rs->chunkOffset / RSTREAM_SEGMENT_SIZE + 1) * RSTREAM_SEGMENT_SIZE;
+
+	if(!RStream__chunkIsCompleted(rs))
+		return;
+
+	/* дописанный чанк больше не растёт */
+	rs->nextSplitCheck = -1;
+
+	if(fstat(rs->chunkFd, &st) == -1)
+		error("fstat('%s')", rs->chunkPath);
+
+	if(st.st_size - rs->chunkOffset <= RSTREAM_SEGMENT_SIZE)
+		return;
+
+	/* границу записи с префиксом длины с середины чанка не найти */
+	if(!RStream__framingIsSeekable(rs))
+		return;
+
+	rs->chunkSize = st.st_size;
+	rs->numSegments = (unsigned long)((st.st_size + RSTREAM_SEGMENT_SIZE - 1) / RSTREAM_SEGMENT_SIZE);
+	k = (unsigned long)(rs->chunkOffset / RSTREAM_SEGMENT_SIZE);
+
+	/* о разбиении ещё никто не знает, так что лок на сегмент наш */
+	if(!flockRangeNB(rs->chunkFd, rs->lockBase + RSTREAM_SEGMENT_LOCK_BASE + (off_t)k, 1, F_WRLCK))
+		error("segment %lu of '%s' is unexpectedly locked", k, rs->chunkPath);
+
+	statesSize = rs->numSegments * sizeof(*states);
+	states = calloc(rs->numSegments, sizeof(*states));
+	if(!states)
+		error("calloc(%lu)", rs->numSegments);
+
+	for(i = 0; i < k; i++)
+		states[i] = RSTREAM_SEGMENT_DONE;
+
+	states[k] = (uint64_t)rs->chunkOffset;
+
+	snprintf(path, sizeof(path), "%s" RSTREAM_SEGMENTS_SUFFIX, rs->chunkPath);
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+	fd = open(tmpPath, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if(fd == -1) {
+		free(states);
+		error("open('%s')", tmpPath);
+	}
+
+	if(write(fd, states, statesSize) != (ssize_t)statesSize) {
+		free(states);
+		RStream__discardSplit(fd, tmpPath);
+		error("write('%s')", tmpPath);
+	}
+
+	free(states);
+
+	if(rename(tmpPath, path) == -1) {
+		RStream__discardSplit(fd, tmpPath);
+		error("rename('%s', '%s')", tmpPath, path);
+	}
+
+	/* дальше прочитанное сохраняется в состояние сегмента */
+	RStream__closeOffsetFile(rs);
+
+	rs->segmentsFd = fd;
+	rs->segment = k;
+	rs->segmentFromTail = 0;
+	rs->segmentEnd = RStream__findSegmentEnd(rs, k);
+
+	debug("chunk '%s' split into %lu segments, reading segment %lu", rs->chunkPath, rs->numSegments, k);
+}
+
+/**
+ * Убирает недописанный файл состояний перед error(), errno сохраняется
+ */
+static void RStream__discardSplit(int fd, const char *tmpPath) {
+	int err = errno;
+
+	close(fd);
+	unlink(tmpPath);
+
+	errno = err;
+}
+
+/**
+ * @return 1 если границы записей можно искать с любого места (см. Framing_isSelfSynchronizing())
+ */
+static char RStream__framingIsSeekable(struct RStream *rs) {
+	if(!rs->framingLoaded) {
+		if(Framing_load(&rs->framing, rs->streamDir) == -1)
+			return 0;
+
+		rs->framingLoaded = 1;
+	}
+
+	return Framing_isSelfSynchronizing(&rs->framing);
+}
+
+static void RStream__resetCheckpoint(struct RStream *rs) {
+	rs->lastCheckpointOffset = rs->chunkOffset;
+	rs->nextCheckpointOffset = rs->chunkOffset + (off_t)rs->checkpointBytes;
+	rs->nextCheckpointTime = timemicro() + rs->checkpointInterval;
+}
+
+/**
+ * Конец последней целой записи в [from, to) или -1. Смотрим только
+ * хвост окна: запись длиннее буфера просто откладывает сохранение
+ * @param rs
+ * @param from
+ * @param to
+ * @return
+ */
+static off_t RStream__lastRecordEnd(struct RStream *rs, off_t from, off_t to) {
+	char buf[64 * 1024];
+	struct FramingState st;
+	off_t pos = to - from > (off_t)sizeof(buf) ? to - (off_t)sizeof(buf) : from;
+	ssize_t rd;
+	size_t last;
+
+	do {
+		rd = pread(rs->chunkFd, buf, (size_t)(to - pos), pos);
+	} while(rd == -1 && errno == EINTR);
+
+	if(rd <= 0) {
+		if(rd == -1)
+			warning("pread('%s'): %s", rs->chunkPath, strerror(errno));
+
+		return -1;
+	}
+
+	Framing_resetState(&st);
+	last = Framing_last(&rs->framing, &st, buf, (size_t)rd);
+
+	return last ? pos + (off_t)last : -1;
+}
+
+/**
+ * Сохраняет выданное по границу последней целой записи, если пора.
+ * Упавший читатель оставит оффсет не дальше чем на checkpointBytes /
+ * checkpointInterval позади, и следующий начнёт с начала записи
+ * @param rs
+ */
+static void RStream__mayCheckpoint(struct RStream *rs) {
+	off_t delivered;
+	off_t aligned;
+	uint64_t now;
+
+	if(rs->chunkFd == -1 || (!rs->checkpointBytes && !rs->checkpointInterval))
+		return;
+
+	delivered = rs->chunkOffset - rs->unflushedBytes;
+	if(delivered <= rs->lastCheckpointOffset)
+		return;
+
+	if(!rs->checkpointBytes || delivered < rs->nextCheckpointOffset) {
+		if(!rs->checkpointInterval)
+			return;
+
+		now = timemicro();
+		if(now < rs->nextCheckpointTime)
+			return;
+	} else {
+		now = timemicro();
+	}
+
+	rs->nextCheckpointOffset = delivered + (off_t)rs->checkpointBytes;
+	rs->nextCheckpointTime = now + rs->checkpointInterval;
+
+	if(!RStream__framingIsSeekable(rs)) {
+		debug("checkpoints are disabled for this framing");
+		rs->checkpointBytes = 0;
+		rs->checkpointInterval = 0;
+		return;
+	}
+
+	aligned = RStream__lastRecordEnd(rs, rs->lastCheckpointOffset, delivered);
+	if(aligned <= rs->lastCheckpointOffset)
+		return;
+
+	rs->lastCheckpointOffset = aligned;
+
+	if(rs->segmentsFd >= 0)
+		RStream__setSegmentState(rs, rs->segment, (uint64_t)aligned);
+	else
+		RStream__saveOffset(rs, aligned);
+
+	Stats_inc(STATS_CHECKPOINTS);
+}
+
+/**
+ * Оффсет для сохранения при выходе: откатываемся к концу последней целой записи,
+ * недописанную в выдачу запись следующий читатель отдаст целиком
+ * @param rs
+ * @param offset сколько выдано
+ * @return
+ */
+static off_t RStream__alignOffset(struct RStream *rs, off_t offset) {
+	off_t aligned;
+
+	if(offset <= rs->lastCheckpointOffset || !RStream__framingIsSeekable(rs))
+		return offset;
+
+	aligned = RStream__lastRecordEnd(rs, rs->lastCheckpointOffset, offset);
+
+	return aligned >= 0 ? aligned : rs->lastCheckpointOffset;
+}
+
+/**
+ * Пишет оффсет в .offset текущего чанка. Запись фиксированной длины поверх
+ * старой, так что файл всегда содержит один из сохранённых оффсетов
+ * @param rs
+ * @param offset
+ */
+static void RStream__saveOffset(struct RStream *rs, off_t offset) {
+	char buf[32];
+	int len;
+
+	if(rs->offsetFd == -1) {
+		rs->offsetFd = open(rs->chunkOffsetPath, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+		if(rs->offsetFd == -1) {
+			warning("Unable to open offset file '%s': %s", rs->chunkOffsetPath, strerror(errno));
+			return;
+		}
+	}
+
+	len = snprintf(buf, sizeof(buf), "%020lu\n", (unsigned long)offset);
+
+	if(pwrite(rs->offsetFd, buf, (size_t)len, 0) != len)
+		warning("Unable to write to offset file '%s': %s", rs->chunkOffsetPath, strerror(errno));
+}
+
+static void RStream__closeOffsetFile(struct RStream *rs) {
+	if(rs->offsetFd >= 0) {
+		close(rs->offsetFd);
+		rs->offsetFd = -1;
+	}
+}
+
+/**
+ * Проверяет, ведётся ли запись в текущий чанк
+ * @param ws
+ * @return 1 or 0
+ */
+static int RStream__chunkIsCompleted(struct RStream *rs) {
+	while(1) {
+		/* F_RDLCK, чтобы не мешать такой же проверке из других групп */
+		if(!flockRangeNB(rs->chunkFd, 1, 1, F_RDLCK)) {
+			/* файл залочен, значит писатель ещё пишет */
+			return 0;
+		}
+
+		break;
 	}
 
 	return 1;
 }
 
-static char RStream__rootHasChunks(struct RStream *rs) {
+static char RStream__dirHasChunks(const char *dir) {
+	int found = RStream__findChunks(dir);
+
+	if(found == -1)
+		error("opendir(%s)", dir);
+
+	return (char)found;
+}
+
+/**
+ * @return 1 если в dir или его бакетах есть чанки, 0 если нет,
+ * -1 и errno, если какой-то из них не открылся
+ */
+static int RStream__findChunks(const char *dir) {
 	DIR *d;
 	struct dirent *e;
+	int found = 0;
+
+	debug("Checking '%s' for chunks", dir);
+
+	d = opendir(dir);
+	if(!d) {
+		/* поток уже удалил кто-то другой */
+		if(errno == ENOENT)
+			return 0;
 
-	debug("Checking '%s' for chunks", rs->rootDir);
+		warning("opendir('%s'): %s", dir, strerror(errno));
+		return -1;
+	}
 
-	d = opendir(rs->rootDir);
-	if(!d)
-		error("opendir(%s)", rs->rootDir);
+	while(!found && (e = readdir(d))) {
+		if(Bucket_isName(e->d_name)) {
+			char path[PATH_MAX + 64];
 
-	while((e = readdir(d))) {
-		if(e->d_name[0] == '.' || strstr(e->d_name, ".chunk") != e->d_name + (strlen(e->d_name) - 6))
-			continue;
+			snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+
+			found = RStream__findChunks(path);
+		} else if(e->d_name[0] != '.' && strstr(e->d_name, ".chunk") == e->d_name + (strlen(e->d_name) - 6)) {
+			found = 1;
+		}
+	}
+
+	if(found == -1) {
+		int err = errno;
 
 		closedir(d);
-		return 1;
+		errno = err;
+
+		return -1;
 	}
 
 	closedir(d);
 
-	return 0;
+	return found;
+}
+
+static void RStream__initNotifications(struct RStream *rs) {
+#ifdef RSTREAM_USE_INOTIFY
+	rs->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(rs->inotifyFd == -1) {
+		warning("inotify is not available, falling back to polling: %s", strerror(errno));
+		return;
+	}
+
+	/*
+	 * IN_CLOSE_WRITE на корне нужен чтобы заметить уход писателя,
+	 * который закрывает .writer.lock, так и не создав ни одного чанка.
+	 * IN_MOVED_FROM - перенос нового чанка из корня в бакет
+	 */
+	rs->rootWatch = inotify_add_watch(
+		rs->inotifyFd,
+		rs->rootDir,
+		IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF
+	);
+
+	if(rs->rootWatch == -1) {
+		warning("inotify_add_watch('%s'): %s, falling back to polling", rs->rootDir, strerror(errno));
+		close(rs->inotifyFd);
+		rs->inotifyFd = -1;
+	}
+#endif
+}
+
+static void RStream__watchChunk(struct RStream *rs) {
+	rs->chunkMayBeCompleted = 1;
+
+#ifdef RSTREAM_USE_INOTIFY
+	if(rs->inotifyFd == -1)
+		return;
+
+	/* watch на удалённый чанк ядро уже сняло само, EINVAL тут нормален */
+	if(rs->chunkWatch != -1)
+		inotify_rm_watch(rs->inotifyFd, rs->chunkWatch);
+
+	rs->chunkWatch = inotify_add_watch(rs->inotifyFd, rs->chunkPath, IN_MODIFY | IN_CLOSE_WRITE);
+	if(rs->chunkWatch == -1)
+		debug("inotify_add_watch('%s'): %s", rs->chunkPath, strerror(errno));
+#endif
+}
+
+/**
+ * Вычитывает накопившиеся события inotify
+ * @param rs
+ */
+static void RStream__drainNotifications(struct RStream *rs) {
+#ifdef RSTREAM_USE_INOTIFY
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while((len = read(rs->inotifyFd, buf, sizeof(buf))) > 0) {
+		char *ptr;
+
+		for(ptr = buf; ptr < buf + len; ) {
+			const struct inotify_event *ev = (const struct inotify_event *)ptr;
+
+			if(ev->mask & IN_Q_OVERFLOW) {
+				rs->chunkMayBeCompleted = 1;
+			} else if(ev->wd == rs->chunkWatch && (ev->mask & (IN_CLOSE_WRITE | IN_IGNORED))) {
+				rs->chunkMayBeCompleted = 1;
+			}
+
+			ptr += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	if(len == -1 && errno != EAGAIN && errno != EINTR)
+		error("read(inotify)");
+#endif
 }
 
-static void RStream__scheduleUpdateNotification(struct RStream *rs, useconds_t sleepUsec) {
+/**
+ * Ждёт изменений в корне или в текущем чанке. Без inotify просто спим sleepUsec
+ * @param rs
+ * @param sleepUsec
+ */
+static void RStream__waitForUpdate(struct RStream *rs, useconds_t sleepUsec) {
+	Stats_inc(STATS_WAITS);
+	Stats_maybePublish();
+
+	if(rs->inotifyFd >= 0) {
+		struct pollfd pfd;
+		int r;
+
+		pfd.fd = rs->inotifyFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		r = poll(&pfd, 1, RSTREAM_INOTIFY_SAFETY_TIMEOUT_MS);
+		if(r == -1 && errno != EINTR)
+			error("poll(inotify)");
+
+		if(r == 0)
+			rs->chunkMayBeCompleted = 1;
+		else
+			RStream__drainNotifications(rs);
+
+		return;
+	}
+
+	rs->chunkMayBeCompleted = 1;
+
 #ifdef F_NOTIFY
-	if(fcntl(rs->rootDirFd, F_NOTIFY, DN_MODIFY | DN_CREATE) == -1)
+	if(rs->rootDirFd >= 0 && fcntl(rs->rootDirFd, F_NOTIFY, DN_MODIFY | DN_CREATE) == -1)
 		error("fcntl('%s', F_NOTIFY, DN_MODIFY | DN_CREATE)", rs->rootDir);
 #endif
 
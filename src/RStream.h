@@ -3,11 +3,103 @@
 
 #include <limits.h>
 #include <inttypes.h>
+#include <sys/types.h>
+
+#include "ChunkIndex.h"
+#include "ChunkPool.h"
+#include "Markers.h"
+#include "WStream.h"
+
+/* способы выдачи данных из чанка, см. RStream_transfer() */
+#define RSTREAM_TRANSFER_READ 0
+#define RSTREAM_TRANSFER_SPLICE 1
+#define RSTREAM_TRANSFER_SENDFILE 2
+/* данные не копируются вовсе, см. RStream_map() */
+#define RSTREAM_TRANSFER_MAP 3
+
+/**
+ * Дописанный чанк больше одного сегмента можно читать в несколько читателей.
+ * Сегмент k начинается сразу после первого '\n' в окне
+ * [k * SIZE - 1, (k + 1) * SIZE - 1). Если в окне нет '\n', то сегмент пустой,
+ * а его данные достаются предыдущему. Так границы однозначно вычисляются
+ * каждым читателем и никогда не режут строку
+ */
+#define RSTREAM_SEGMENT_SIZE (1024 * 1024)
+
+/**
+ * лок сегмента k - байт RSTREAM_SEGMENT_LOCK_BASE + k в чанке
+ * (0 - лок читателя чанка, 1 - лок писателя), у групп - со сдвигом RStream.lockBase
+ */
+#define RSTREAM_SEGMENT_LOCK_BASE 2
+
+/**
+ * В <чанк>.segments на каждый сегмент uint64_t:
+ * 0 - не начат, RSTREAM_SEGMENT_DONE - прочитан, иначе - оффсет, с которого продолжать
+ */
+#define RSTREAM_SEGMENTS_SUFFIX ".segments"
+#define RSTREAM_SEGMENT_DONE UINT64_MAX
+
+/**
+ * путь чанка (RStream.chunkPath) с суффиксом служебного файла
+ */
+#define RSTREAM_SIDECAR_PATH_SIZE (PATH_MAX + 64 + 16)
+
+/**
+ * -R: чанк захватывается переименованием <время...>.chunk в <время...>.claimed.chunk.
+ * Проигравший узнаёт об этом по ENOENT одного renameat2() и дальше не идёт,
+ * а победитель так же берёт лок читателя, по которому захват чанка умершего
+ * читателя подбирают другие читатели (и читатели без -R)
+ */
+#define RSTREAM_CLAIMED_SUFFIX ".claimed.chunk"
+
+/**
+ * как часто по умолчанию сохранять прочитанное (см. RStream_checkpointEvery())
+ */
+#define RSTREAM_CHECKPOINT_BYTES (1024 * 1024)
+#define RSTREAM_CHECKPOINT_INTERVAL_MS 1000
+
+/**
+ * Список scandir() каталога, который сейчас сканируется
+ */
+struct RStreamScan {
+	struct dirent **list;
+	int length;
+};
+
+/**
+ * Чанк, который брокер (см. Broker.h) отдал читателю. Лок читателя держит брокер
+ */
+struct RStreamLease {
+	int fd;
+	char path[PATH_MAX + 64];
+
+	/**
+	 * с какого места читать и что уже сохранено в .offset
+	 */
+	off_t offset;
+	off_t savedOffset;
+};
 
 struct RStream {
+	/**
+	 * откуда берутся чанки: корень потока или каталог группы
+	 */
 	const char *rootDir;
 	int rootDirFd;
 
+	/**
+	 * корень потока, там лок писателя, пул и прочее общее для всех групп
+	 */
+	const char *streamDir;
+
+	/**
+	 * группа читателей (см. ConsumerGroup.h), NULL - группа по умолчанию.
+	 * Все локи на чанке группа берёт со сдвигом lockBase
+	 */
+	const char *group;
+	char groupDir[PATH_MAX + 64];
+	off_t lockBase;
+
 	char persistentMode;
 
 	/**
@@ -16,13 +108,153 @@ struct RStream {
 	unsigned long chunkNumber;
 
 	char chunkPath[PATH_MAX + 64];
-	char chunkOffsetPath[PATH_MAX + 64];
+	char chunkOffsetPath[RSTREAM_SIDECAR_PATH_SIZE];
 	int chunkFd;
+
+	/**
+	 * .offset текущего чанка, открывается при первом сохранении.
+	 * Оффсет всегда одной длины и пишется pwrite() поверх старого
+	 */
+	int offsetFd;
+
+	/**
+	 * текущая позиция в чанке
+	 */
+	off_t chunkOffset;
+
+	/**
+	 * Большой дописанный чанк читается несколькими читателями по сегментам.
+	 * segmentsFd - открытый файл состояний сегментов <чанк>.segments,
+	 * -1 если чанк читается целиком
+	 */
+	int segmentsFd;
+	unsigned long numSegments;
+	unsigned long segment;
+	off_t segmentEnd;
+	off_t chunkSize;
+
+	/**
+	 * сегменты перебираются с конца (так берут работу простаивающие читатели)
+	 */
+	char segmentFromTail;
+
+	/**
+	 * на каком оффсете проверить, не пора ли разбить чанк на сегменты.
+	 * -1 - больше не проверять
+	 */
+	off_t nextSplitCheck;
+
+	/**
+	 * inotify-дескриптор и watch-и на корень и текущий чанк.
+	 * -1 если inotify недоступен и работаем по старинке через поллинг
+	 */
+	int inotifyFd;
+	int rootWatch;
+	int chunkWatch;
+
+	/**
+	 * выставляется, когда есть смысл проверять лок писателя на текущем чанке:
+	 * чанк только что открыт, писатель закрыл файл или просто истёк таймаут
+	 */
+	char chunkMayBeCompleted;
+
+	struct ChunkIndex index;
+	struct ChunkPool pool;
+
+	/**
+	 * сканируемые корень и бакет. Списки держим здесь, а не на стеке:
+	 * если посреди сканирования случится ошибка, их освободит RStream_destroy()
+	 */
+	struct RStreamScan rootScan;
+	struct RStreamScan bucketScan;
+
+	/**
+	 * сколько из уже прочитанного ещё не дошло до получателя
+	 * (например, стоит в очереди io_uring). Вычитается из сохраняемого оффсета
+	 */
+	ssize_t unflushedBytes;
+
+	/**
+	 * если задан, вызывается перед удалением дочитанного чанка:
+	 * всё прочитанное из него к этому моменту должно быть выдано
+	 */
+	void (*flushOutput)(struct RStream *rs);
+
+	/**
+	 * Брокер: захваченные им чанки его собственным локам не мешают,
+	 * поэтому их он отсеивает сам. Если задан, чанки захватываются
+	 * целиком, без сегментов. См. RStream_lease()
+	 */
+	char (*chunkIsLeased)(struct RStream *rs, const char *path);
+
+	/**
+	 * поток помечен (см. MARKERS_FILENAME): RStream_read() вырезает из выдачи
+	 * метки времени писателя и считает по ним задержку, RStream_transfer()
+	 * отказывается, а после RStream_map() это делает RStream_removeMarkers().
+	 * Проверяется на каждом новом чанке
+	 */
+	char stripMarkers;
+	struct Markers markers;
+
+	/**
+	 * сколько байт чанка ушло на последний RStream_read(): с метками
+	 * выдано меньше, а сохраняемый оффсет считается по прочитанному
+	 */
+	ssize_t lastReadLength;
+
+	/**
+	 * -R: захват чанков переименованием, см. RSTREAM_CLAIMED_SUFFIX
+	 */
+	char renameClaims;
+
+	/**
+	 * задержка, мкс, после которой ругаться в stderr (не чаще раза в секунду).
+	 * 0 - не ругаться
+	 */
+	uint64_t latencyAlert;
+	uint64_t lastLatencyAlert;
+
+	/**
+	 * пока нечего читать, держим лок на WSTREAM_WAITING_FILENAME,
+	 * по нему адаптивный писатель понимает, что читатели простаивают
+	 */
+	int waitingFd;
+	char waiting;
+
+	/**
+	 * разбивка потока на записи (FRAMING_FILENAME), по ней ищутся
+	 * начала сегментов. Читается при разбиении чанка
+	 */
+	struct Framing framing;
+	char framingLoaded;
+
+	/**
+	 * Прочитанное периодически сохраняется (в .offset или состояние сегмента)
+	 * по границе записи, чтобы после kill -9 перечитывалось немного.
+	 * checkpointBytes/checkpointInterval (мкс) - как часто, 0 - не по этому признаку
+	 */
+	uint64_t checkpointBytes;
+	uint64_t checkpointInterval;
+	off_t lastCheckpointOffset;
+	off_t nextCheckpointOffset;
+	uint64_t nextCheckpointTime;
 };
 
 void RStream_init(struct RStream *ws, const char *rootDir, char persistentMode, char waitRootMode);
+void RStream_initGroup(struct RStream *rs, const char *rootDir, const char *group, char persistentMode, char waitRootMode);
 void RStream_destroy(struct RStream *ws);
+void RStream_abandon(struct RStream *rs);
+void RStream_claimByRename(struct RStream *rs);
+void RStream_alertLatency(struct RStream *rs, uint64_t usec);
+void RStream_checkpointEvery(struct RStream *rs, uint64_t bytes, uint64_t usec);
 ssize_t RStream_read(struct RStream *ws, char *buf, ssize_t size);
+ssize_t RStream_transfer(struct RStream *rs, int outFd, ssize_t size, int method);
+ssize_t RStream_map(struct RStream *rs, ssize_t size, int *fd, off_t *offset);
+ssize_t RStream_removeMarkers(struct RStream *rs, char *buf, ssize_t len);
+int RStream_lease(struct RStream *rs, struct RStreamLease *lease);
+void RStream_checkpointLease(struct RStream *rs, struct RStreamLease *lease, off_t delivered);
+void RStream_completeLease(struct RStream *rs, struct RStreamLease *lease);
+void RStream_drainNotifications(struct RStream *rs);
 
 #endif	/* RSTREAM_H */
 
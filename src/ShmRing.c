@@ -0,0 +1,712 @@
+#include "ShmRing.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+	#include <linux/futex.h>
+	#include <sys/syscall.h>
+	#define SHMRING_USE_FUTEX
+#endif
+
+#define SHMRING_MAGIC "PITRING1"
+#define SHMRING_HEADER_SIZE 4096
+#define SHMRING_SLOT_HEADER_SIZE 64
+#define SHMRING_SLOT_CAPACITY (SHMRING_SLOT_SIZE - SHMRING_SLOT_HEADER_SIZE)
+
+/**
+ * раз в столько мс ожидающие просыпаются и проверяют, живы ли остальные
+ */
+#define SHMRING_LIVENESS_TIMEOUT_MS 1000
+
+/* счётчики на отдельных кеш-линиях, чтобы писатели и читатели не мешали друг другу */
+struct ShmRing__header {
+	char magic[8];
+	uint32_t slotSize;
+	uint32_t numSlots;
+	char pad0[48];
+
+	uint64_t enqueuePos;
+	char pad1[56];
+
+	uint64_t dequeuePos;
+	char pad2[56];
+
+	uint32_t dataFutex;
+	uint32_t dataWaiters;
+	char pad3[56];
+
+	uint32_t spaceFutex;
+	uint32_t spaceWaiters;
+};
+
+/**
+ * seq == pos - слот свободен для записи на позицию pos,
+ * seq == pos + 1 - в слоте запись для позиции pos.
+ * writerTag/readerTag == pos + 1 означает, что writerPid/readerPid
+ * заполняет/читает слот именно на позиции pos, а не на прошлом круге
+ */
+struct ShmRing__slot {
+	uint64_t seq;
+	uint64_t writerTag;
+	uint64_t readerTag;
+	int32_t writerPid;
+	int32_t readerPid;
+
+	uint32_t len;
+
+	/**
+	 * сколько слотов занимает запись, задаётся только в первом
+	 */
+	uint32_t span;
+};
+
+static void ShmRing__open(struct ShmRing *r, char create);
+static char ShmRing__writersIsHere(struct ShmRing *r);
+static char ShmRing__push(struct ShmRing *r, const char *buf, size_t len, char wait);
+
+static struct ShmRing__slot *ShmRing__slot(struct ShmRing *r, uint64_t pos) {
+	return (struct ShmRing__slot *)(r->slots + (pos % SHMRING_SLOTS) * SHMRING_SLOT_SIZE);
+}
+
+static char *ShmRing__slotData(struct ShmRing__slot *slot) {
+	return (char *)slot + SHMRING_SLOT_HEADER_SIZE;
+}
+
+static int ShmRing__futexWait(uint32_t *addr, uint32_t val, int timeoutMs) {
+#ifdef SHMRING_USE_FUTEX
+	struct timespec ts;
+
+	ts.tv_sec = timeoutMs / 1000;
+	ts.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+
+	return (int)syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+		usleep(1000);
+
+	return 0;
+#endif
+}
+
+static void ShmRing__futexWake(uint32_t *addr, int count) {
+#ifdef SHMRING_USE_FUTEX
+	syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+#endif
+}
+
+/**
+ * Будит ждущих на futex, если такие есть
+ */
+static void ShmRing__notify(uint32_t *futex, uint32_t *waiters, int count) {
+	__atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+		ShmRing__futexWake(futex, count);
+}
+
+static int ShmRing__wait(uint32_t *futex, uint32_t *waiters, uint32_t seen) {
+	int ret;
+
+	__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+	ret = ShmRing__futexWait(futex, seen, SHMRING_LIVENESS_TIMEOUT_MS);
+	__atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+
+	return ret;
+}
+
+static char ShmRing__pidIsDead(int32_t pid) {
+	return kill((pid_t)pid, 0) == -1 && errno == ESRCH;
+}
+
+/**
+ * Умер ли писатель, занявший слот на позиции pos
+ */
+static char ShmRing__writerIsDead(struct ShmRing *r, struct ShmRing__slot *slot, uint64_t pos) {
+	if(__atomic_load_n(&slot->writerTag, __ATOMIC_ACQUIRE) == pos + 1)
+		return ShmRing__pidIsDead(slot->writerPid);
+
+	/* писатель не успел даже подписаться - судим по тому, остались ли писатели вообще */
+	return !ShmRing__writersIsHere(r);
+}
+
+void ShmRing_initWriter(struct ShmRing *r, const char *rootDir) {
+	memset(r, 0, sizeof(*r));
+
+	r->rootDir = rootDir;
+	r->fd = -1;
+	r->writerLockFd = -1;
+	r->pid = (int32_t)getpid();
+
+	snprintf(r->path, sizeof(r->path), "%s/" SHMRING_FILENAME, rootDir);
+
+	if(mkdir(rootDir, 0755) == -1) {
+		if(errno != EEXIST)
+			error("mkdir('%s')", rootDir);
+	}
+
+	/* как WStream__acquireWriterLock(): читатели по нему понимают, что писатели ещё есть */
+	{
+		char path[PATH_MAX + 64];
+
+		snprintf(path, sizeof(path), "%s/.writer.lock", rootDir);
+
+		r->writerLockFd = open(path, O_CREAT | O_WRONLY, 0644);
+		if(r->writerLockFd == -1)
+			error("unable to open/create lock-file '%s'", path);
+
+		if(flock(r->writerLockFd, LOCK_SH | LOCK_NB) == -1)
+			error("unable to acquire writer lock on '%s'. Maybe this stream currenly used", rootDir);
+	}
+
+	ShmRing__open(r, 1);
+}
+
+void ShmRing_initReader(struct ShmRing *r, const char *rootDir, char persistentMode, char waitRootMode) {
+	memset(r, 0, sizeof(*r));
+
+	r->rootDir = rootDir;
+	r->fd = -1;
+	r->writerLockFd = -1;
+	r->pid = (int32_t)getpid();
+	r->persistentMode = persistentMode;
+	r->checkWriters = 1;
+
+	snprintf(r->path, sizeof(r->path), "%s/" SHMRING_FILENAME, rootDir);
+
+	for(;;) {
+		ShmRing__open(r, 0);
+		if(r->fd >= 0)
+			break;
+
+		if(access(rootDir, F_OK) == -1) {
+			if(!waitRootMode || errno != ENOENT)
+				error("open('%s')", rootDir);
+		} else if(!waitRootMode && !ShmRing__writersIsHere(r)) {
+			/* кольца нет и не будет, ShmRing_read() сразу вернёт конец потока */
+			break;
+		}
+
+		usleep(100000);
+	}
+}
+
+void ShmRing_destroy(struct ShmRing *r) {
+	if(r->writerLockFd >= 0) {
+		close(r->writerLockFd);
+		r->writerLockFd = -1;
+
+		/* будим читателей, чтобы они сразу заметили уход писателя */
+		if(r->header)
+			ShmRing__notify(&r->header->dataFutex, &r->header->dataWaiters, INT32_MAX);
+	}
+
+	if(r->header) {
+		munmap(r->header, r->mapSize);
+		r->header = NULL;
+		r->slots = NULL;
+	}
+
+	if(r->fd >= 0) {
+		close(r->fd);
+		r->fd = -1;
+	}
+}
+
+/**
+ * Открывает кольцо, при create создаёт его, если его ещё нет.
+ * Без create r->fd остаётся -1, если кольца нет
+ * @param r
+ * @param create
+ */
+static void ShmRing__open(struct ShmRing *r, char create) {
+	struct stat st;
+	void *map;
+
+	r->mapSize = SHMRING_HEADER_SIZE + (size_t)SHMRING_SLOTS * SHMRING_SLOT_SIZE;
+
+	r->fd = open(r->path, O_RDWR);
+	if(r->fd == -1 && errno == ENOENT && create) {
+		/* готовим кольцо целиком под временным именем, чтобы никто не увидел его недоделанным */
+		char tmpPath[PATH_MAX + 80];
+		struct ShmRing__header *h;
+		int tmpFd;
+		uint64_t i;
+
+		snprintf(tmpPath, sizeof(tmpPath), "%s.%ld", r->path, (long)r->pid);
+
+		tmpFd = open(tmpPath, O_CREAT | O_RDWR | O_TRUNC, 0644);
+		if(tmpFd == -1)
+			error("open('%s')", tmpPath);
+
+		if(ftruncate(tmpFd, (off_t)r->mapSize) == -1)
+			error("ftruncate('%s')", tmpPath);
+
+		map = mmap(NULL, r->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, tmpFd, 0);
+		if(map == MAP_FAILED)
+			error("mmap('%s')", tmpPath);
+
+		h = map;
+		memcpy(h->magic, SHMRING_MAGIC, sizeof(h->magic));
+		h->slotSize = SHMRING_SLOT_SIZE;
+		h->numSlots = SHMRING_SLOTS;
+
+		for(i = 0; i < SHMRING_SLOTS; i++)
+			((struct ShmRing__slot *)((char *)map + SHMRING_HEADER_SIZE + i * SHMRING_SLOT_SIZE))->seq = i;
+
+		munmap(map, r->mapSize);
+
+		/* link() не перезапишет кольцо, которое успел создать кто-то другой */
+		if(link(tmpPath, r->path) == -1 && errno != EEXIST)
+			error("link('%s', '%s')", tmpPath, r->path);
+
+		unlink(tmpPath);
+		close(tmpFd);
+
+		debug("shared ring created: %s", r->path);
+
+		r->fd = open(r->path, O_RDWR);
+	}
+
+	if(r->fd == -1) {
+		if(errno == ENOENT && !create)
+			return;
+
+		error("open('%s')", r->path);
+	}
+
+	if(fstat(r->fd, &st) == -1)
+		error("fstat('%s')", r->path);
+
+	if((size_t)st.st_size != r->mapSize)
+		error("'%s' is not a shared ring or has a different geometry", r->path);
+
+	map = mmap(NULL, r->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if(map == MAP_FAILED)
+		error("mmap('%s')", r->path);
+
+	r->header = map;
+	r->slots = (char *)map + SHMRING_HEADER_SIZE;
+
+	if(memcmp(r->header->magic, SHMRING_MAGIC, sizeof(r->header->magic)) != 0 || r->header->slotSize != SHMRING_SLOT_SIZE || r->header->numSlots != SHMRING_SLOTS)
+		error("'%s' is not a shared ring or has a different geometry", r->path);
+}
+
+static char ShmRing__writersIsHere(struct ShmRing *r) {
+	/* копипаста из RStream__writersIsHere */
+	char path[PATH_MAX + 64];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/.writer.lock", r->rootDir);
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return 0;
+
+	if(flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		return errno == EWOULDBLOCK;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static void ShmRing__removeRootDir(struct ShmRing *r) {
+	char path[PATH_MAX + 64];
+
+	debug("removing root dir: %s", r->rootDir);
+
+	if(unlink(r->path) == -1 && errno != ENOENT)
+		warning("unable to unlink() shared ring '%s'", r->path);
+
+	snprintf(path, sizeof(path), "%s/.writer.lock", r->rootDir);
+	if(unlink(path) == -1 && errno != ENOENT)
+		warning("unable to unlink() write lock-file '%s'", path);
+
+	if(rmdir(r->rootDir) == -1) {
+		if(errno != ENOENT)
+			error("rmdir('%s')", r->rootDir);
+	}
+}
+
+void ShmRing_write(struct ShmRing *r, const char *buf, size_t len, char lineMode) {
+	while(len) {
+		size_t recordLen = len;
+
+		if(recordLen > SHMRING_SLOT_CAPACITY) {
+			if(lineMode) {
+				const char *lineEnd = memrchr(buf, '\n', SHMRING_SLOT_CAPACITY);
+
+				if(!lineEnd)
+					lineEnd = memchr(buf + SHMRING_SLOT_CAPACITY, '\n', len - SHMRING_SLOT_CAPACITY);
+
+				recordLen = lineEnd ? (size_t)(lineEnd - buf) + 1 : len;
+			} else {
+				recordLen = SHMRING_SLOT_CAPACITY;
+			}
+		}
+
+		if(recordLen > (size_t)SHMRING_SLOT_CAPACITY * SHMRING_SLOTS / 2) {
+			warning("line is too long for shared ring, splitting");
+			recordLen = (size_t)SHMRING_SLOT_CAPACITY * SHMRING_SLOTS / 2;
+		}
+
+		ShmRing__push(r, buf, recordLen, 1);
+
+		buf += recordLen;
+		len -= recordLen;
+	}
+}
+
+/**
+ * Ждёт, пока освободится слот для позиции pos. Если его держит умерший читатель - забирает
+ * @param r
+ * @param pos
+ */
+static void ShmRing__waitSpace(struct ShmRing *r, uint64_t pos) {
+	struct ShmRing__header *h = r->header;
+	struct ShmRing__slot *slot = ShmRing__slot(r, pos);
+	uint32_t seen = __atomic_load_n(&h->spaceFutex, __ATOMIC_SEQ_CST);
+	uint64_t readSeq = pos - SHMRING_SLOTS + 1;
+
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != readSeq)
+		return;
+
+	if(ShmRing__wait(&h->spaceFutex, &h->spaceWaiters, seen) == -1 && errno == ETIMEDOUT) {
+		/* читатель забрал запись, но так и не отпустил слот */
+		if(
+			__atomic_load_n(&slot->readerTag, __ATOMIC_ACQUIRE) == readSeq
+			&& ShmRing__pidIsDead(slot->readerPid)
+			&& __atomic_compare_exchange_n(&slot->seq, &readSeq, pos, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+		) {
+			warning("reader %ld died holding a record, slot reclaimed", (long)slot->readerPid);
+		}
+	}
+}
+
+/**
+ * Кладёт одну запись в кольцо (в один или несколько подряд идущих слотов)
+ * @param r
+ * @param buf
+ * @param len
+ * @param wait ждать, если места нет
+ * @return 1 если запись в кольце
+ */
+static char ShmRing__push(struct ShmRing *r, const char *buf, size_t len, char wait) {
+	struct ShmRing__header *h = r->header;
+	uint32_t span = len ? (uint32_t)((len + SHMRING_SLOT_CAPACITY - 1) / SHMRING_SLOT_CAPACITY) : 1;
+	uint64_t pos;
+	uint32_t i;
+
+	for(;;) {
+		int64_t diff = 0;
+
+		pos = __atomic_load_n(&h->enqueuePos, __ATOMIC_ACQUIRE);
+
+		for(i = 0; i < span; i++) {
+			diff = (int64_t)(__atomic_load_n(&ShmRing__slot(r, pos + i)->seq, __ATOMIC_ACQUIRE) - (pos + i));
+			if(diff)
+				break;
+		}
+
+		if(!diff) {
+			if(__atomic_compare_exchange_n(&h->enqueuePos, &pos, pos + span, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				break;
+
+			continue;
+		}
+
+		/* diff > 0 - позицию уже занял другой писатель */
+		if(diff < 0) {
+			if(!wait)
+				return 0;
+
+			ShmRing__waitSpace(r, pos + i);
+		}
+	}
+
+	for(i = 0; i < span; i++) {
+		struct ShmRing__slot *slot = ShmRing__slot(r, pos + i);
+
+		slot->writerPid = r->pid;
+		__atomic_store_n(&slot->writerTag, pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	for(i = 0; i < span; i++) {
+		struct ShmRing__slot *slot = ShmRing__slot(r, pos + i);
+		size_t slotLen = len > SHMRING_SLOT_CAPACITY ? SHMRING_SLOT_CAPACITY : len;
+
+		memcpy(ShmRing__slotData(slot), buf, slotLen);
+		slot->len = (uint32_t)slotLen;
+		slot->span = i ? 0 : span;
+
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+
+		buf += slotLen;
+		len -= slotLen;
+	}
+
+	ShmRing__notify(&h->dataFutex, &h->dataWaiters, 1);
+
+	return 1;
+}
+
+/**
+ * Слот на позиции pos занят, но не заполнен. Если его писатель умер,
+ * превращаем слот в пустую запись, чтобы очередь не встала
+ * @param r
+ * @param pos
+ */
+static void ShmRing__maySkipAbandoned(struct ShmRing *r, uint64_t pos) {
+	struct ShmRing__slot *slot = ShmRing__slot(r, pos);
+	uint64_t expected = pos;
+
+	if(!ShmRing__writerIsDead(r, slot, pos))
+		return;
+
+	slot->len = 0;
+	slot->span = 1;
+
+	if(__atomic_compare_exchange_n(&slot->seq, &expected, pos + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		warning("writer died while writing a record, skipping it");
+}
+
+/**
+ * Ждёт появления данных на позиции pos
+ * @param r
+ * @param pos
+ * @return 1 - можно пробовать снова, 0 - конец потока
+ */
+static char ShmRing__waitData(struct ShmRing *r, uint64_t pos) {
+	struct ShmRing__header *h = r->header;
+	uint32_t seen = __atomic_load_n(&h->dataFutex, __ATOMIC_SEQ_CST);
+	int ret;
+
+	if(__atomic_load_n(&ShmRing__slot(r, pos)->seq, __ATOMIC_ACQUIRE) == pos + 1)
+		return 1;
+
+	if(r->checkWriters && __atomic_load_n(&h->enqueuePos, __ATOMIC_ACQUIRE) == pos) {
+		/*
+		 * очередь пуста. Сначала писатели, потом очередь: всё, что ушедший
+		 * писатель успел занять, видно после снятия им лока
+		 */
+		if(!ShmRing__writersIsHere(r) && __atomic_load_n(&h->enqueuePos, __ATOMIC_ACQUIRE) == pos) {
+			if(!r->persistentMode) {
+				debug("end of stream detected");
+				ShmRing__removeRootDir(r);
+
+				return 0;
+			}
+
+			if(access(r->path, F_OK) == -1 && errno == ENOENT) {
+				debug("stream is removed");
+				return 0;
+			}
+		}
+	}
+
+	ret = ShmRing__wait(&h->dataFutex, &h->dataWaiters, seen);
+
+	if(ret == -1 && errno == ETIMEDOUT && __atomic_load_n(&h->enqueuePos, __ATOMIC_ACQUIRE) > pos)
+		ShmRing__maySkipAbandoned(r, pos);
+
+	/* проснулись, а данных нет - например, ушёл писатель. Тогда стоит проверить писателей */
+	r->checkWriters = __atomic_load_n(&h->enqueuePos, __ATOMIC_ACQUIRE) == pos;
+
+	return 1;
+}
+
+/**
+ * Ждёт, пока писатель дозаполнит слот pos многослотовой записи
+ * @return 0 если писатель умер
+ */
+static char ShmRing__waitPublished(struct ShmRing *r, uint64_t pos) {
+	struct ShmRing__slot *slot = ShmRing__slot(r, pos);
+	unsigned long spins = 0;
+
+	while(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+		if(++spins % 1024 == 0 && ShmRing__writerIsDead(r, slot, pos))
+			return 0;
+
+		sched_yield();
+	}
+
+	return 1;
+}
+
+static void ShmRing__release(struct ShmRing *r, uint64_t pos, uint32_t span) {
+	uint32_t i;
+
+	for(i = 0; i < span; i++)
+		__atomic_store_n(&ShmRing__slot(r, pos + i)->seq, pos + i + SHMRING_SLOTS, __ATOMIC_RELEASE);
+
+	ShmRing__notify(&r->header->spaceFutex, &r->header->spaceWaiters, INT32_MAX);
+}
+
+/**
+ * Выводит запись из слотов [pos, pos + span) в fd
+ * @return сколько записано, -1 если не записано ничего и запись можно вернуть в кольцо
+ */
+static ssize_t ShmRing__output(struct ShmRing *r, int fd, uint64_t pos, uint32_t span) {
+	ssize_t total = 0;
+	uint32_t i;
+
+	for(i = 0; i < span; i++) {
+		struct ShmRing__slot *slot = ShmRing__slot(r, pos + i);
+		const char *data = ShmRing__slotData(slot);
+		size_t left = slot->len;
+
+		while(left) {
+			ssize_t wr = write(fd, data, left);
+
+			if(wr == -1) {
+				if(errno == EINTR)
+					continue;
+
+				if(!total)
+					return -1;
+
+				error("write(#%d)", fd);
+			}
+
+			data += wr;
+			left -= (size_t)wr;
+			total += wr;
+		}
+	}
+
+	return total;
+}
+
+/**
+ * Возвращает в кольцо запись из слотов [pos, pos + span), которую мы забрали, но не выдали
+ * @param r
+ * @param pos
+ * @param span
+ */
+static void ShmRing__requeue(struct ShmRing *r, uint64_t pos, uint32_t span) {
+	struct ShmRing__header *h = r->header;
+	uint64_t nextLapPos = pos + SHMRING_SLOTS;
+	size_t len = 0;
+	char *copy;
+	uint32_t i;
+
+	/*
+	 * кольцо заполнено ровно до нашей записи (писатель ждёт наш слот):
+	 * занимаем позиции следующего круга, это те же самые слоты, и публикуем их как есть
+	 */
+	if(__atomic_compare_exchange_n(&h->enqueuePos, &nextLapPos, nextLapPos + span, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		for(i = 0; i < span; i++) {
+			struct ShmRing__slot *slot = ShmRing__slot(r, nextLapPos + i);
+
+			slot->writerPid = r->pid;
+			__atomic_store_n(&slot->writerTag, nextLapPos + i + 1, __ATOMIC_RELEASE);
+			__atomic_store_n(&slot->seq, nextLapPos + i + 1, __ATOMIC_RELEASE);
+		}
+
+		ShmRing__notify(&h->dataFutex, &h->dataWaiters, 1);
+
+		return;
+	}
+
+	copy = malloc((size_t)span * SHMRING_SLOT_CAPACITY);
+	if(!copy)
+		error("malloc(%llu)", (unsigned long long)span * SHMRING_SLOT_CAPACITY);
+
+	for(i = 0; i < span; i++) {
+		struct ShmRing__slot *slot = ShmRing__slot(r, pos + i);
+
+		memcpy(copy + len, ShmRing__slotData(slot), slot->len);
+		len += slot->len;
+	}
+
+	/* пока свои слоты не отпущены, писатели не займут место, которое нам нужно */
+	if(!ShmRing__push(r, copy, len, 0))
+		warning("unable to return a record into the full ring, %llu bytes lost", (unsigned long long)len);
+
+	ShmRing__release(r, pos, span);
+
+	free(copy);
+}
+
+ssize_t ShmRing_read(struct ShmRing *r, int fd) {
+	struct ShmRing__header *h = r->header;
+
+	if(!h) {
+		ShmRing__removeRootDir(r);
+		return 0;
+	}
+
+	while(!r->stopRequested) {
+		uint64_t pos = __atomic_load_n(&h->dequeuePos, __ATOMIC_ACQUIRE);
+		struct ShmRing__slot *slot = ShmRing__slot(r, pos);
+		int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		uint32_t span;
+		uint32_t i;
+		ssize_t written;
+
+		if(diff < 0) {
+			if(!ShmRing__waitData(r, pos))
+				return 0;
+
+			continue;
+		}
+
+		if(diff > 0)
+			continue;
+
+		/* валидность span подтверждается успешным CAS: до него слот никто не мог отпустить */
+		span = slot->span;
+		if(span < 1 || span > SHMRING_SLOTS)
+			span = 1;
+
+		if(!__atomic_compare_exchange_n(&h->dequeuePos, &pos, pos + span, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			continue;
+
+		for(i = 0; i < span; i++) {
+			struct ShmRing__slot *s = ShmRing__slot(r, pos + i);
+
+			s->readerPid = r->pid;
+			__atomic_store_n(&s->readerTag, pos + i + 1, __ATOMIC_RELEASE);
+		}
+
+		/* выдаём запись только целиком */
+		for(i = 1; i < span; i++) {
+			if(!ShmRing__waitPublished(r, pos + i))
+				break;
+		}
+
+		if(i < span) {
+			warning("writer died while writing a record, dropping it");
+
+			ShmRing__release(r, pos, span);
+			continue;
+		}
+
+		written = ShmRing__output(r, fd, pos, span);
+
+		if(written == -1) {
+			/* получатель пропал, так ничего и не получив: возвращаем запись в кольцо */
+			ShmRing__requeue(r, pos, span);
+			return 0;
+		}
+
+		ShmRing__release(r, pos, span);
+
+		if(written)
+			return written;
+	}
+
+	return 0;
+}
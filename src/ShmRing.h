@@ -0,0 +1,79 @@
+#ifndef SHMRING_H
+#define	SHMRING_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+
+/**
+ * Поток без чанков (-m): кольцевой буфер в разделяемой памяти - файл .shmring
+ * в каталоге потока, который все участники отображают в память.
+ * Писателей и читателей может быть сколько угодно, подключаться они могут
+ * в любой момент, каждая запись достаётся ровно одному читателю.
+ *
+ * Кольцо - это слоты фиксированного размера, запись занимает один или
+ * несколько подряд идущих слотов. Очередь - bounded MPMC Вьюкова: по seq слота
+ * видно, свободен он, заполнен или читается. Ждут друг друга через futex
+ * прямо в отображённом файле.
+ *
+ * В отличии от чанков, кольцо ограничено: если читатели не успевают,
+ * писатели ждут. Каталог потока лучше держать на tmpfs
+ */
+
+#define SHMRING_FILENAME ".shmring"
+
+#define SHMRING_SLOT_SIZE (64 * 1024)
+#define SHMRING_SLOTS 256
+
+struct ShmRing__header;
+
+struct ShmRing {
+	const char *rootDir;
+	char path[PATH_MAX + 64];
+
+	int fd;
+	int writerLockFd;
+
+	struct ShmRing__header *header;
+	char *slots;
+	size_t mapSize;
+
+	int32_t pid;
+
+	char persistentMode;
+
+	/**
+	 * проверять ли при пустом кольце, остались ли писатели
+	 */
+	char checkWriters;
+
+	/**
+	 * выставляется обработчиком сигнала: дописать текущую запись и выйти
+	 */
+	volatile sig_atomic_t stopRequested;
+};
+
+void ShmRing_initWriter(struct ShmRing *r, const char *rootDir);
+void ShmRing_initReader(struct ShmRing *r, const char *rootDir, char persistentMode, char waitRootMode);
+void ShmRing_destroy(struct ShmRing *r);
+
+/**
+ * Кладёт данные в кольцо. В построчном режиме записи режутся только по '\n',
+ * строка длиннее слота занимает несколько слотов, но всё равно достаётся одному читателю
+ * @param r
+ * @param buf
+ * @param len
+ * @param lineMode
+ */
+void ShmRing_write(struct ShmRing *r, const char *buf, size_t len, char lineMode);
+
+/**
+ * Забирает одну запись и пишет её в fd
+ * @param r
+ * @param fd
+ * @return сколько записано, 0 - конец потока или запрошена остановка
+ */
+ssize_t ShmRing_read(struct ShmRing *r, int fd);
+
+#endif	/* SHMRING_H */
@@ -0,0 +1,261 @@
+#include "Stats.h"
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct Stats STATS;
+
+static const char *STATS__COUNTER_NAMES[STATS_COUNTERS] = {
+	"chunks_created",
+	"chunks_from_pool",
+	"rotations_size",
+	"rotations_timer",
+	"chunk_writes",
+	"bytes_written",
+	"backlog_waits",
+	"chunks_dropped",
+	"chunks_spilled",
+	"scans",
+	"scan_entries",
+	"index_claims",
+	"rename_claims",
+	"claims_recovered",
+	"lock_busy",
+	"chunks_gone",
+	"segments_stolen",
+	"chunks_read",
+	"bytes_read",
+	"waits",
+	"checkpoints"
+};
+
+static const char *STATS__HISTOGRAM_NAMES[STATS_HISTOGRAMS] = {
+	"chunk_bytes",
+	"chunk_lines",
+	"chunk_write_us",
+	"scan_us",
+	"output_write_us",
+	"chunk_latency_us",
+	"record_latency_us"
+};
+
+/**
+ * Буфер для форматирования без stdio
+ */
+struct Stats__buf {
+	char data[8192];
+	size_t len;
+};
+
+void Stats_record(int histogram, uint64_t value) {
+	struct Stats__histogram *h = &STATS.histograms[histogram];
+	unsigned bucket = value ? 64 - (unsigned)__builtin_clzll(value) : 0;
+
+	h->count++;
+	h->sum += value;
+	h->buckets[bucket]++;
+
+	if(value > h->max)
+		h->max = value;
+}
+
+uint64_t Stats_countLines(const char *buf, size_t len) {
+	const char *end = buf + len;
+	uint64_t lines = 0;
+
+	while(buf < end && (buf = memchr(buf, '\n', (size_t)(end - buf)))) {
+		lines++;
+		buf++;
+	}
+
+	return lines;
+}
+
+static void Stats__appendStr(struct Stats__buf *b, const char *s) {
+	size_t len = strlen(s);
+
+	if(len > sizeof(b->data) - b->len)
+		len = sizeof(b->data) - b->len;
+
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+static void Stats__appendU64(struct Stats__buf *b, uint64_t v) {
+	char digits[24];
+	int i = (int)sizeof(digits) - 1;
+
+	digits[i] = 0;
+
+	do {
+		digits[--i] = (char)('0' + v % 10);
+		v /= 10;
+	} while(v);
+
+	Stats__appendStr(b, digits + i);
+}
+
+/**
+ * Верхняя граница корзины, в которую попадает квантиль q/1000
+ */
+static uint64_t Stats__percentile(const struct Stats__histogram *h, uint64_t q) {
+	uint64_t need = h->count * q / 1000;
+	uint64_t seen = 0;
+	unsigned i;
+
+	for(i = 0; i < STATS_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+
+		if(seen > need) {
+			if(!i)
+				return 0;
+
+			/* точнее границы корзины всё равно не знаем, но больше max быть не может */
+			return i == 64 || ((uint64_t)1 << i) - 1 > h->max ? h->max : ((uint64_t)1 << i) - 1;
+		}
+	}
+
+	return h->max;
+}
+
+static void Stats__format(struct Stats__buf *b) {
+	int i;
+
+	b->len = 0;
+
+	Stats__appendStr(b, "pid ");
+	Stats__appendU64(b, (uint64_t)getpid());
+	Stats__appendStr(b, "\n");
+
+	for(i = 0; i < STATS_COUNTERS; i++) {
+		Stats__appendStr(b, STATS__COUNTER_NAMES[i]);
+		Stats__appendStr(b, " ");
+		Stats__appendU64(b, STATS.counters[i]);
+		Stats__appendStr(b, "\n");
+	}
+
+	for(i = 0; i < STATS_HISTOGRAMS; i++) {
+		const struct Stats__histogram *h = &STATS.histograms[i];
+
+		Stats__appendStr(b, STATS__HISTOGRAM_NAMES[i]);
+		Stats__appendStr(b, " count=");
+		Stats__appendU64(b, h->count);
+		Stats__appendStr(b, " sum=");
+		Stats__appendU64(b, h->sum);
+		Stats__appendStr(b, " p50=");
+		Stats__appendU64(b, Stats__percentile(h, 500));
+		Stats__appendStr(b, " p99=");
+		Stats__appendU64(b, Stats__percentile(h, 990));
+		Stats__appendStr(b, " p999=");
+		Stats__appendU64(b, Stats__percentile(h, 999));
+		Stats__appendStr(b, " max=");
+		Stats__appendU64(b, h->max);
+		Stats__appendStr(b, "\n");
+	}
+}
+
+static void Stats__writeAll(int fd, const char *buf, size_t len) {
+	while(len) {
+		ssize_t wr = write(fd, buf, len);
+
+		if(wr <= 0) {
+			if(wr == -1 && errno == EINTR)
+				continue;
+
+			return;
+		}
+
+		buf += wr;
+		len -= (size_t)wr;
+	}
+}
+
+void Stats_dump(int fd) {
+	struct Stats__buf b;
+	int savedErrno = errno;
+
+	Stats__format(&b);
+	Stats__writeAll(fd, b.data, b.len);
+
+	errno = savedErrno;
+}
+
+void Stats_publishTo(const char *rootDir) {
+	snprintf(STATS.path, sizeof(STATS.path), "%s/" STATS_FILE_PREFIX "%lu", rootDir, (unsigned long)getpid());
+
+	STATS.countLines = 1;
+	STATS.lastPublished = 0;
+}
+
+void Stats_maybePublish() {
+	char tmpPath[PATH_MAX + 128];
+	struct Stats__buf b;
+	uint64_t now;
+	int fd;
+
+	if(!STATS.path[0])
+		return;
+
+	now = timemicro();
+	if(now - STATS.lastPublished < 1000000)
+		return;
+
+	STATS.lastPublished = now;
+
+	/* через rename(), чтобы читающий файл не увидел его наполовину записанным */
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", STATS.path);
+
+	fd = open(tmpPath, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if(fd == -1) {
+		/* каталог потока уже удалили */
+		if(errno != ENOENT)
+			debug("open('%s'): %s", tmpPath, strerror(errno));
+
+		return;
+	}
+
+	Stats__format(&b);
+	Stats__writeAll(fd, b.data, b.len);
+	close(fd);
+
+	if(rename(tmpPath, STATS.path) == -1) {
+		debug("rename('%s', '%s'): %s", tmpPath, STATS.path, strerror(errno));
+		unlink(tmpPath);
+	}
+}
+
+void Stats_unpublish() {
+	if(!STATS.path[0])
+		return;
+
+	if(unlink(STATS.path) == -1 && errno != ENOENT)
+		warning("unable to unlink() stats file '%s': %s", STATS.path, strerror(errno));
+
+	STATS.path[0] = 0;
+}
+
+void Stats_removePublished(const char *rootDir) {
+	char path[PATH_MAX + 256 + 2];
+	struct dirent *e;
+	DIR *d;
+
+	d = opendir(rootDir);
+	if(!d)
+		return;
+
+	while((e = readdir(d))) {
+		if(strncmp(e->d_name, STATS_FILE_PREFIX, strlen(STATS_FILE_PREFIX)) != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", rootDir, e->d_name);
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink() stats file '%s': %s", path, strerror(errno));
+	}
+
+	closedir(d);
+}
@@ -0,0 +1,115 @@
+#ifndef STATS_H
+#define	STATS_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include <stdint.h>
+
+/**
+ * Счётчики и гистограммы горячих путей WStream/RStream, по одному набору
+ * на процесс. pit однопоточный, так что это просто uint64_t без атомиков.
+ *
+ * Выводятся в stderr по SIGUSR1, с -v - ещё и при выходе. С -X процесс
+ * не чаще раза в секунду перезаписывает файл .stats.<pid> в каталоге потока
+ * и удаляет его при выходе
+ */
+
+enum {
+	/* писатель */
+	STATS_CHUNKS_CREATED,
+	STATS_CHUNKS_FROM_POOL,
+	STATS_ROTATIONS_SIZE,
+	STATS_ROTATIONS_TIMER,
+	STATS_CHUNK_WRITES,
+	STATS_BYTES_WRITTEN,
+	STATS_BACKLOG_WAITS,
+	STATS_CHUNKS_DROPPED,
+	STATS_CHUNKS_SPILLED,
+
+	/* читатель */
+	STATS_SCANS,
+	STATS_SCAN_ENTRIES,
+	STATS_INDEX_CLAIMS,
+	STATS_RENAME_CLAIMS,
+	STATS_CLAIMS_RECOVERED,
+	STATS_LOCK_BUSY,
+	STATS_CHUNKS_GONE,
+	STATS_SEGMENTS_STOLEN,
+	STATS_CHUNKS_READ,
+	STATS_BYTES_READ,
+	STATS_WAITS,
+	STATS_CHECKPOINTS,
+
+	STATS_COUNTERS
+};
+
+enum {
+	STATS_HIST_CHUNK_BYTES,
+	STATS_HIST_CHUNK_LINES,
+	STATS_HIST_CHUNK_WRITE_US,
+	STATS_HIST_SCAN_US,
+	STATS_HIST_OUTPUT_WRITE_US,
+	STATS_HIST_CHUNK_LATENCY_US,
+	STATS_HIST_RECORD_LATENCY_US,
+
+	STATS_HISTOGRAMS
+};
+
+/* корзина 0 - ноль, корзина k - [2^(k-1), 2^k) */
+#define STATS_HIST_BUCKETS 65
+
+#define STATS_FILE_PREFIX ".stats."
+
+struct Stats__histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+struct Stats {
+	uint64_t counters[STATS_COUNTERS];
+	struct Stats__histogram histograms[STATS_HISTOGRAMS];
+
+	/**
+	 * считать строки в чанках: это лишний проход по данным,
+	 * поэтому только если статистику кто-то будет смотреть (-v, -X)
+	 */
+	char countLines;
+
+	/**
+	 * файл для -X, пустая строка - не публиковать
+	 */
+	char path[PATH_MAX + 64];
+	uint64_t lastPublished;
+};
+
+extern struct Stats STATS;
+
+#define Stats_inc(counter) (STATS.counters[counter]++)
+#define Stats_add(counter, value) (STATS.counters[counter] += (uint64_t)(value))
+
+void Stats_record(int histogram, uint64_t value);
+uint64_t Stats_countLines(const char *buf, size_t len);
+
+/**
+ * Выводит всё в fd. Использует только write(), можно вызывать из обработчика сигнала
+ * @param fd
+ */
+void Stats_dump(int fd);
+
+/**
+ * Включает публикацию в <rootDir>/.stats.<pid>
+ * @param rootDir
+ */
+void Stats_publishTo(const char *rootDir);
+void Stats_maybePublish();
+void Stats_unpublish();
+
+/**
+ * Удаляет файлы статистики всех процессов, перед удалением каталога потока
+ * @param rootDir
+ */
+void Stats_removePublished(const char *rootDir);
+
+#endif	/* STATS_H */
@@ -0,0 +1,648 @@
+#include "StreamStatus.h"
+#include "RStream.h"
+#include "Bucket.h"
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#define STREAMSTATUS_CHUNK_SUFFIX ".chunk"
+#define STREAMSTATUS_OFFSET_SUFFIX ".chunk.offset"
+
+struct StreamStatus__chunk {
+	char name[64];
+	uint64_t timemicro;
+	ino_t ino;
+	uint64_t size;
+	uint64_t consumed;
+	char writing;
+	char reading;
+	char gone;
+};
+
+/**
+ * POSIX-лок на файле в каталоге потока из /proc/locks
+ */
+struct StreamStatus__lock {
+	ino_t ino;
+	long pid;
+	uint64_t start;
+	uint64_t end;
+};
+
+/**
+ * для поиска чанка по inode
+ */
+struct StreamStatus__inode {
+	ino_t ino;
+	size_t chunk;
+};
+
+static void StreamStatus__addChunk(struct StreamStatus *ss, const char *name);
+static struct StreamStatus__chunk *StreamStatus__findChunk(struct StreamStatus *ss, const char *name, size_t nameLen);
+static void StreamStatus__readOffset(struct StreamStatus *ss, int dirFd, const char *name, size_t chunkNameLen);
+static void StreamStatus__readSegments(struct StreamStatus *ss, int dirFd, const char *name, size_t chunkNameLen);
+static void StreamStatus__scanLocks(struct StreamStatus *ss, dev_t dev, ino_t writerLockIno, struct StreamStatusReport *r);
+static void StreamStatus__calcRates(struct StreamStatus *ss, struct StreamStatusReport *r);
+static char StreamStatus__hasSuffix(const char *name, size_t len, const char *suffix);
+static void StreamStatus__scanBucket(struct StreamStatus *ss, int dirFd, const char *bucket, char positions);
+
+void StreamStatus_init(struct StreamStatus *ss, const char *rootDir) {
+	ss->rootDir = rootDir;
+
+	ss->prev = NULL;
+	ss->prevCount = 0;
+	ss->prevSize = 0;
+	ss->prevTime = 0;
+
+	ss->chunks = NULL;
+	ss->chunksCount = 0;
+	ss->chunksSize = 0;
+}
+
+void StreamStatus_destroy(struct StreamStatus *ss) {
+	free(ss->prev);
+	ss->prev = NULL;
+	ss->prevCount = 0;
+	ss->prevSize = 0;
+
+	free(ss->chunks);
+	ss->chunks = NULL;
+	ss->chunksCount = 0;
+	ss->chunksSize = 0;
+}
+
+static int StreamStatus__cmpChunks(const void *a, const void *b) {
+	return strcmp(((const struct StreamStatus__chunk *)a)->name, ((const struct StreamStatus__chunk *)b)->name);
+}
+
+static int StreamStatus__cmpInodes(const void *a, const void *b) {
+	ino_t ia = ((const struct StreamStatus__inode *)a)->ino;
+	ino_t ib = ((const struct StreamStatus__inode *)b)->ino;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+static int StreamStatus__cmpPids(const void *a, const void *b) {
+	long pa = *(const long *)a;
+	long pb = *(const long *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+void StreamStatus_collect(struct StreamStatus *ss, struct StreamStatusReport *r) {
+	struct StreamStatus__chunk *tmp;
+	size_t tmpSize;
+	struct dirent *e;
+	struct stat st;
+	dev_t dev;
+	ino_t writerLockIno = 0;
+	uint64_t oldest = 0;
+	size_t i, j;
+	int dirFd;
+	DIR *d;
+
+	memset(r, 0, sizeof(*r));
+	r->time = timemicro();
+
+	/* текущий снимок становится предыдущим, его память переиспользуем */
+	tmp = ss->prev;
+	tmpSize = ss->prevSize;
+
+	ss->prev = ss->chunks;
+	ss->prevSize = ss->chunksSize;
+	ss->prevCount = ss->chunksCount;
+
+	ss->chunks = tmp;
+	ss->chunksSize = tmpSize;
+	ss->chunksCount = 0;
+
+	dirFd = open(ss->rootDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dirFd == -1) {
+		if(errno != ENOENT)
+			error("open('%s')", ss->rootDir);
+
+		/* поток удалён: скорости после его пересоздания считаем заново */
+		ss->prevCount = 0;
+		ss->prevTime = 0;
+
+		return;
+	}
+
+	if(fstat(dirFd, &st) == -1)
+		error("fstat('%s')", ss->rootDir);
+
+	dev = st.st_dev;
+
+	d = fdopendir(dirFd);
+	if(!d)
+		error("fdopendir('%s')", ss->rootDir);
+
+	r->exists = 1;
+
+	while((e = readdir(d))) {
+		size_t len = strlen(e->d_name);
+
+		if(e->d_name[0] == '.')
+			continue;
+
+		if(Bucket_isName(e->d_name))
+			StreamStatus__scanBucket(ss, dirFd, e->d_name, 0);
+		else if(StreamStatus__hasSuffix(e->d_name, len, STREAMSTATUS_CHUNK_SUFFIX))
+			StreamStatus__addChunk(ss, e->d_name);
+	}
+
+	qsort(ss->chunks, ss->chunksCount, sizeof(*ss->chunks), StreamStatus__cmpChunks);
+
+	for(i = 0; i < ss->chunksCount; i++) {
+		struct StreamStatus__chunk *c = &ss->chunks[i];
+		struct stat cst;
+
+		if(fstatat(dirFd, c->name, &cst, 0) == -1) {
+			if(errno != ENOENT)
+				error("stat('%s/%s')", ss->rootDir, c->name);
+
+			/* дочитан, пока мы сканировали */
+			c->gone = 1;
+			continue;
+		}
+
+		c->ino = cst.st_ino;
+		c->size = (uint64_t)cst.st_size;
+	}
+
+	/* второй проход: позиции читателей, их файлы лежат рядом с чанками */
+	rewinddir(d);
+
+	while((e = readdir(d))) {
+		size_t len = strlen(e->d_name);
+
+		if(e->d_name[0] == '.') {
+			if(!strcmp(e->d_name, ".writer.lock") && fstatat(dirFd, e->d_name, &st, 0) == 0)
+				writerLockIno = st.st_ino;
+
+			continue;
+		}
+
+		if(Bucket_isName(e->d_name))
+			StreamStatus__scanBucket(ss, dirFd, e->d_name, 1);
+		else if(StreamStatus__hasSuffix(e->d_name, len, STREAMSTATUS_OFFSET_SUFFIX))
+			StreamStatus__readOffset(ss, dirFd, e->d_name, len - strlen(".offset"));
+		else if(StreamStatus__hasSuffix(e->d_name, len, STREAMSTATUS_CHUNK_SUFFIX RSTREAM_SEGMENTS_SUFFIX))
+			StreamStatus__readSegments(ss, dirFd, e->d_name, len - strlen(RSTREAM_SEGMENTS_SUFFIX));
+	}
+
+	closedir(d);
+
+	for(i = 0, j = 0; i < ss->chunksCount; i++) {
+		if(!ss->chunks[i].gone)
+			ss->chunks[j++] = ss->chunks[i];
+	}
+
+	ss->chunksCount = j;
+
+	StreamStatus__scanLocks(ss, dev, writerLockIno, r);
+
+	for(i = 0; i < ss->chunksCount; i++) {
+		struct StreamStatus__chunk *c = &ss->chunks[i];
+
+		r->chunks++;
+
+		if(c->writing)
+			r->chunksWriting++;
+
+		if(c->reading)
+			r->chunksReading++;
+
+		if(c->consumed < c->size)
+			r->backlogBytes += c->size - c->consumed;
+
+		if(!oldest || c->timemicro < oldest)
+			oldest = c->timemicro;
+	}
+
+	if(oldest && oldest < r->time)
+		r->oldestChunkAge = r->time - oldest;
+
+	StreamStatus__calcRates(ss, r);
+
+	ss->prevTime = r->time;
+}
+
+static void StreamStatus__addChunk(struct StreamStatus *ss, const char *name) {
+	struct StreamStatus__chunk *c;
+
+	if(strlen(name) >= sizeof(c->name)) {
+		debug("too long chunk name: %s", name);
+		return;
+	}
+
+	if(ss->chunksCount == ss->chunksSize) {
+		size_t newSize = ss->chunksSize ? ss->chunksSize * 2 : 1024;
+
+		c = realloc(ss->chunks, newSize * sizeof(*c));
+		if(!c)
+			error("realloc(%llu)", (unsigned long long)(newSize * sizeof(*c)));
+
+		ss->chunks = c;
+		ss->chunksSize = newSize;
+	}
+
+	c = &ss->chunks[ss->chunksCount++];
+	memset(c, 0, sizeof(*c));
+
+	strcpy(c->name, name);
+
+	if(sscanf(strrchr(name, '/') ? strrchr(name, '/') + 1 : name, "%" SCNu64, &c->timemicro) != 1)
+		warning("unable to parse chunk filename: %s", name);
+}
+
+/**
+ * Чанки бакета (positions = 0) или позиции читателей в нём (positions = 1), имена - "бакет/имя"
+ * @param ss
+ * @param dirFd корень потока
+ * @param bucket
+ * @param positions
+ */
+static void StreamStatus__scanBucket(struct StreamStatus *ss, int dirFd, const char *bucket, char positions) {
+	char name[BUCKET_NAME_LENGTH + NAME_MAX + 2];
+	struct dirent *e;
+	int fd;
+	DIR *d;
+
+	fd = openat(dirFd, bucket, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1) {
+		/* опустевший бакет удалил читатель */
+		if(errno != ENOENT)
+			error("open('%s/%s')", ss->rootDir, bucket);
+
+		return;
+	}
+
+	d = fdopendir(fd);
+	if(!d)
+		error("fdopendir('%s/%s')", ss->rootDir, bucket);
+
+	while((e = readdir(d))) {
+		size_t len;
+
+		if(e->d_name[0] == '.')
+			continue;
+
+		len = (size_t)snprintf(name, sizeof(name), "%s/%s", bucket, e->d_name);
+
+		if(!positions) {
+			if(StreamStatus__hasSuffix(name, len, STREAMSTATUS_CHUNK_SUFFIX))
+				StreamStatus__addChunk(ss, name);
+		} else if(StreamStatus__hasSuffix(name, len, STREAMSTATUS_OFFSET_SUFFIX)) {
+			StreamStatus__readOffset(ss, dirFd, name, len - strlen(".offset"));
+		} else if(StreamStatus__hasSuffix(name, len, STREAMSTATUS_CHUNK_SUFFIX RSTREAM_SEGMENTS_SUFFIX)) {
+			StreamStatus__readSegments(ss, dirFd, name, len - strlen(RSTREAM_SEGMENTS_SUFFIX));
+		}
+	}
+
+	closedir(d);
+}
+
+static struct StreamStatus__chunk *StreamStatus__findChunk(struct StreamStatus *ss, const char *name, size_t nameLen) {
+	struct StreamStatus__chunk key;
+
+	if(nameLen >= sizeof(key.name))
+		return NULL;
+
+	memcpy(key.name, name, nameLen);
+	key.name[nameLen] = 0;
+
+	return bsearch(&key, ss->chunks, ss->chunksCount, sizeof(key), StreamStatus__cmpChunks);
+}
+
+/**
+ * <чанк>.offset - позиция, на которой остановился читатель
+ */
+static void StreamStatus__readOffset(struct StreamStatus *ss, int dirFd, const char *name, size_t chunkNameLen) {
+	struct StreamStatus__chunk *c = StreamStatus__findChunk(ss, name, chunkNameLen);
+	char buf[64];
+	ssize_t len;
+	int fd;
+
+	if(!c)
+		return;
+
+	fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if(len <= 0)
+		return;
+
+	buf[len] = 0;
+
+	c->consumed = strtoull(buf, NULL, 10);
+}
+
+/**
+ * <чанк>.segments: прочитанные сегменты считаем целиком,
+ * а начатые - как непрочитанные, их границы без чтения чанка не узнать
+ */
+static void StreamStatus__readSegments(struct StreamStatus *ss, int dirFd, const char *name, size_t chunkNameLen) {
+	struct StreamStatus__chunk *c = StreamStatus__findChunk(ss, name, chunkNameLen);
+	uint64_t states[256];
+	uint64_t done = 0;
+	off_t offset = 0;
+	ssize_t len;
+	int fd;
+
+	if(!c)
+		return;
+
+	fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return;
+
+	while((len = pread(fd, states, sizeof(states), offset)) > 0) {
+		size_t i;
+
+		for(i = 0; i < (size_t)len / sizeof(states[0]); i++) {
+			if(states[i] == RSTREAM_SEGMENT_DONE)
+				done++;
+		}
+
+		offset += len;
+	}
+
+	close(fd);
+
+	c->consumed = done * RSTREAM_SEGMENT_SIZE;
+	if(c->consumed > c->size)
+		c->consumed = c->size;
+}
+
+/**
+ * Разбирает /proc/locks. Писатели - те, кто держит flock() на .writer.lock,
+ * лок на байте 1 чанка от них означает, что чанк ещё пишется.
+ * Любой другой лок на чанке держит читатель: байт 0 - весь чанк,
+ * байты от RSTREAM_SEGMENT_LOCK_BASE - сегменты, а байт 1 читатель
+ * берёт, когда проверяет, дописан ли чанк
+ */
+static void StreamStatus__scanLocks(struct StreamStatus *ss, dev_t dev, ino_t writerLockIno, struct StreamStatusReport *r) {
+	struct StreamStatus__lock *locks = NULL;
+	size_t locksCount = 0;
+	size_t locksSize = 0;
+	long *writers = NULL;
+	size_t writersCount = 0;
+	size_t writersSize = 0;
+	long *readers = NULL;
+	size_t readersCount = 0;
+	struct StreamStatus__inode *inodes = NULL;
+	char line[256];
+	size_t i;
+	FILE *f;
+
+	f = fopen("/proc/locks", "r");
+	if(!f) {
+		warning("unable to open /proc/locks, writers and readers are not counted: %s", strerror(errno));
+		return;
+	}
+
+	while(fgets(line, sizeof(line), f)) {
+		char type[16];
+		char end[32];
+		unsigned int maj, min;
+		unsigned long long ino;
+		unsigned long long start;
+		long pid;
+
+		/* строки с "->" - ожидающие локи, их пропускаем */
+		if(sscanf(line, "%*[^:]: %15s %*s %*s %ld %x:%x:%llu %llu %31s", type, &pid, &maj, &min, &ino, &start, end) != 7)
+			continue;
+
+		if(maj != major(dev) || min != minor(dev))
+			continue;
+
+		if(!strcmp(type, "FLOCK")) {
+			if(writerLockIno && (ino_t)ino == writerLockIno) {
+				if(writersCount == writersSize) {
+					writersSize = writersSize ? writersSize * 2 : 16;
+					writers = realloc(writers, writersSize * sizeof(*writers));
+					if(!writers)
+						error("realloc()");
+				}
+
+				writers[writersCount++] = pid;
+			}
+
+			continue;
+		}
+
+		if(strcmp(type, "POSIX"))
+			continue;
+
+		if(locksCount == locksSize) {
+			locksSize = locksSize ? locksSize * 2 : 64;
+			locks = realloc(locks, locksSize * sizeof(*locks));
+			if(!locks)
+				error("realloc()");
+		}
+
+		locks[locksCount].ino = (ino_t)ino;
+		locks[locksCount].pid = pid;
+		locks[locksCount].start = start;
+		locks[locksCount].end = strcmp(end, "EOF") ? strtoull(end, NULL, 10) : UINT64_MAX;
+		locksCount++;
+	}
+
+	fclose(f);
+
+	r->writers = writersCount;
+
+	qsort(writers, writersCount, sizeof(*writers), StreamStatus__cmpPids);
+
+	if(ss->chunksCount && locksCount) {
+		inodes = malloc(ss->chunksCount * sizeof(*inodes));
+		readers = malloc(locksCount * sizeof(*readers));
+		if(!inodes || !readers)
+			error("malloc()");
+
+		for(i = 0; i < ss->chunksCount; i++) {
+			inodes[i].ino = ss->chunks[i].ino;
+			inodes[i].chunk = i;
+		}
+
+		qsort(inodes, ss->chunksCount, sizeof(*inodes), StreamStatus__cmpInodes);
+
+		for(i = 0; i < locksCount; i++) {
+			struct StreamStatus__lock *l = &locks[i];
+			struct StreamStatus__inode key;
+			struct StreamStatus__inode *found;
+			struct StreamStatus__chunk *c;
+
+			key.ino = l->ino;
+
+			found = bsearch(&key, inodes, ss->chunksCount, sizeof(key), StreamStatus__cmpInodes);
+			if(!found)
+				continue;
+
+			c = &ss->chunks[found->chunk];
+
+			if(bsearch(&l->pid, writers, writersCount, sizeof(*writers), StreamStatus__cmpPids)) {
+				if(l->start <= 1 && l->end >= 1)
+					c->writing = 1;
+			} else {
+				c->reading = 1;
+				readers[readersCount++] = l->pid;
+			}
+		}
+
+		qsort(readers, readersCount, sizeof(*readers), StreamStatus__cmpPids);
+
+		for(i = 0; i < readersCount; i++) {
+			if(!i || readers[i] != readers[i - 1])
+				r->readers++;
+		}
+	}
+
+	free(inodes);
+	free(readers);
+	free(writers);
+	free(locks);
+}
+
+/**
+ * Скорости по разнице с предыдущим снимком. Исчезнувший чанк считается
+ * дочитанным целиком, а то, что в него успели дописать после предыдущего
+ * снимка, не учитывается
+ */
+static void StreamStatus__calcRates(struct StreamStatus *ss, struct StreamStatusReport *r) {
+	uint64_t ingest = 0;
+	uint64_t drain = 0;
+	double seconds;
+	size_t i = 0;
+	size_t j = 0;
+
+	if(!ss->prevTime || r->time <= ss->prevTime)
+		return;
+
+	while(i < ss->prevCount || j < ss->chunksCount) {
+		struct StreamStatus__chunk *p = i < ss->prevCount ? &ss->prev[i] : NULL;
+		struct StreamStatus__chunk *c = j < ss->chunksCount ? &ss->chunks[j] : NULL;
+		int cmp;
+
+		if(!p)
+			cmp = 1;
+		else if(!c)
+			cmp = -1;
+		else
+			cmp = strcmp(p->name, c->name);
+
+		if(cmp == 0) {
+			if(c->size > p->size)
+				ingest += c->size - p->size;
+
+			if(c->consumed > p->consumed)
+				drain += c->consumed - p->consumed;
+
+			i++;
+			j++;
+		} else if(cmp < 0) {
+			if(p->size > p->consumed)
+				drain += p->size - p->consumed;
+
+			i++;
+		} else {
+			ingest += c->size;
+			drain += c->consumed;
+
+			j++;
+		}
+	}
+
+	seconds = (double)(r->time - ss->prevTime) / 1e6;
+
+	r->hasRates = 1;
+	r->ingestRate = (double)ingest / seconds;
+	r->drainRate = (double)drain / seconds;
+}
+
+static char StreamStatus__hasSuffix(const char *name, size_t len, const char *suffix) {
+	size_t suffixLen = strlen(suffix);
+
+	return len > suffixLen && !memcmp(name + len - suffixLen, suffix, suffixLen);
+}
+
+static void StreamStatus__printJsonString(const char *s, FILE *f) {
+	fputc('"', f);
+
+	for(; *s; s++) {
+		unsigned char ch = (unsigned char)*s;
+
+		if(ch == '"' || ch == '\\')
+			fprintf(f, "\\%c", ch);
+		else if(ch < 0x20)
+			fprintf(f, "\\u%04x", ch);
+		else
+			fputc(ch, f);
+	}
+
+	fputc('"', f);
+}
+
+void StreamStatus_print(struct StreamStatus *ss, const struct StreamStatusReport *r, FILE *f) {
+	fprintf(f, "stream:       %s\n", ss->rootDir);
+
+	if(!r->exists) {
+		fprintf(f, "              does not exist\n");
+		return;
+	}
+
+	fprintf(f, "writers:      %lu\n", r->writers);
+	fprintf(f, "readers:      %lu\n", r->readers);
+	fprintf(f, "chunks:       %" PRIu64 " (writing %" PRIu64 ", reading %" PRIu64 ")\n", r->chunks, r->chunksWriting, r->chunksReading);
+	fprintf(f, "backlog:      %" PRIu64 " bytes\n", r->backlogBytes);
+	fprintf(f, "oldest chunk: %.3f s\n", (double)r->oldestChunkAge / 1e6);
+
+	if(r->hasRates) {
+		fprintf(f, "ingest:       %.0f bytes/s\n", r->ingestRate);
+		fprintf(f, "drain:        %.0f bytes/s\n", r->drainRate);
+	}
+}
+
+void StreamStatus_printJson(struct StreamStatus *ss, const struct StreamStatusReport *r, FILE *f) {
+	fprintf(f, "{\"time\":%" PRIu64 ",\"stream\":", r->time);
+	StreamStatus__printJsonString(ss->rootDir, f);
+
+	if(!r->exists) {
+		fprintf(f, ",\"exists\":false}\n");
+		return;
+	}
+
+	fprintf(
+		f,
+		",\"exists\":true,\"writers\":%lu,\"readers\":%lu"
+		",\"chunks\":%" PRIu64 ",\"chunks_writing\":%" PRIu64 ",\"chunks_reading\":%" PRIu64
+		",\"backlog_bytes\":%" PRIu64 ",\"oldest_chunk_age_us\":%" PRIu64,
+		r->writers,
+		r->readers,
+		r->chunks,
+		r->chunksWriting,
+		r->chunksReading,
+		r->backlogBytes,
+		r->oldestChunkAge
+	);
+
+	if(r->hasRates)
+		fprintf(f, ",\"ingest_bytes_per_sec\":%.0f,\"drain_bytes_per_sec\":%.0f", r->ingestRate, r->drainRate);
+	else
+		fprintf(f, ",\"ingest_bytes_per_sec\":null,\"drain_bytes_per_sec\":null");
+
+	fprintf(f, "}\n");
+}
@@ -0,0 +1,87 @@
+#ifndef STREAMSTATUS_H
+#define	STREAMSTATUS_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Состояние потока для pit -S: сколько данных и чанков ждёт читателей,
+ * сколько писателей и читателей работает сейчас и с какой скоростью
+ * поток пополняется и разбирается.
+ *
+ * Ничего в потоке не трогаем: локи не берём, а смотрим в /proc/locks,
+ * поэтому статус можно снимать хоть каждую секунду под нагрузкой.
+ * Одно сканирование - это readdir() корня и fstatat() на каждый чанк
+ */
+
+struct StreamStatus__chunk;
+
+struct StreamStatusReport {
+	/**
+	 * время снимка, мкс
+	 */
+	uint64_t time;
+
+	/**
+	 * 0 если каталога потока нет, остальные поля тогда не заполнены
+	 */
+	char exists;
+
+	unsigned long writers;
+
+	/**
+	 * читатели, которые держат лок на каком-нибудь чанке.
+	 * Читатель, ждущий новых данных, локов не держит и здесь не виден
+	 */
+	unsigned long readers;
+
+	uint64_t chunks;
+	uint64_t chunksWriting;
+	uint64_t chunksReading;
+
+	/**
+	 * сколько байт ещё не прочитано. Позиция читателя внутри чанка,
+	 * который он читает прямо сейчас, снаружи не видна: такой чанк
+	 * учитывается с позиции из .offset/.segments
+	 */
+	uint64_t backlogBytes;
+
+	/**
+	 * возраст самого старого чанка по таймстемпу в имени, мкс
+	 */
+	uint64_t oldestChunkAge;
+
+	/**
+	 * байт в секунду, считаются по разнице с предыдущим снимком
+	 */
+	char hasRates;
+	double ingestRate;
+	double drainRate;
+};
+
+struct StreamStatus {
+	const char *rootDir;
+
+	/**
+	 * чанки предыдущего снимка, отсортированные по имени
+	 */
+	struct StreamStatus__chunk *prev;
+	size_t prevCount;
+	size_t prevSize;
+	uint64_t prevTime;
+
+	struct StreamStatus__chunk *chunks;
+	size_t chunksCount;
+	size_t chunksSize;
+};
+
+void StreamStatus_init(struct StreamStatus *ss, const char *rootDir);
+void StreamStatus_destroy(struct StreamStatus *ss);
+
+void StreamStatus_collect(struct StreamStatus *ss, struct StreamStatusReport *r);
+
+void StreamStatus_print(struct StreamStatus *ss, const struct StreamStatusReport *r, FILE *f);
+void StreamStatus_printJson(struct StreamStatus *ss, const struct StreamStatusReport *r, FILE *f);
+
+#endif	/* STREAMSTATUS_H */
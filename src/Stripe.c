@@ -0,0 +1,111 @@
+#include "Stripe.h"
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void Stripe_register(const char *rootDir, const char *dir, char *resolved) {
+	char rootResolved[PATH_MAX];
+	char slotPath[PATH_MAX + 64];
+	char target[PATH_MAX];
+	unsigned long slot;
+
+	if(mkdir(dir, 0755) == -1 && errno != EEXIST)
+		error("mkdir('%s')", dir);
+
+	if(!realpath(dir, resolved))
+		error("realpath('%s')", dir);
+
+	if(realpath(rootDir, rootResolved) && strcmp(resolved, rootResolved) == 0) {
+		errno = 0;
+		error("stripe '%s' is the stream root itself", dir);
+	}
+
+	/* писатели с одинаковым набором каталогов сойдутся на тех же слотах */
+	for(slot = 0;; slot++) {
+		ssize_t len;
+
+		snprintf(slotPath, sizeof(slotPath), "%s/" STRIPE_SLOT_PREFIX "%lu", rootDir, slot);
+
+		if(symlink(resolved, slotPath) == 0)
+			break;
+
+		if(errno != EEXIST)
+			error("symlink('%s', '%s')", resolved, slotPath);
+
+		len = readlink(slotPath, target, sizeof(target) - 1);
+		if(len == -1)
+			continue;
+
+		target[len] = 0;
+
+		if(strcmp(target, resolved) == 0)
+			break;
+	}
+
+	debug("stripe '%s' registered in slot %lu", resolved, slot);
+}
+
+int Stripe_unlinkChunk(const char *path) {
+	char target[PATH_MAX];
+	struct stat st;
+	ssize_t len = -1;
+
+	/* цель узнаём до удаления ссылки, а удаляем после: упавший на полпути оставит только файл в страйпе */
+	if(lstat(path, &st) == 0 && S_ISLNK(st.st_mode) && st.st_nlink == 1)
+		len = readlink(path, target, sizeof(target) - 1);
+
+	if(unlink(path) == -1)
+		return -1;
+
+	if(len > 0) {
+		target[len] = 0;
+
+		if(unlink(target) == -1 && errno != ENOENT)
+			warning("unable to unlink() '%s': %s", target, strerror(errno));
+	}
+
+	return 0;
+}
+
+void Stripe_removeAll(const char *rootDir) {
+	char path[PATH_MAX + NAME_MAX + 2];
+	char target[PATH_MAX];
+	struct dirent *e;
+	DIR *d;
+
+	d = opendir(rootDir);
+	if(!d) {
+		if(errno != ENOENT)
+			warning("opendir('%s'): %s", rootDir, strerror(errno));
+
+		return;
+	}
+
+	while((e = readdir(d))) {
+		ssize_t len;
+
+		if(strncmp(e->d_name, STRIPE_SLOT_PREFIX, strlen(STRIPE_SLOT_PREFIX)) != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", rootDir, e->d_name);
+
+		len = readlink(path, target, sizeof(target) - 1);
+		if(len > 0) {
+			target[len] = 0;
+
+			if(rmdir(target) == -1 && errno != ENOENT)
+				warning("unable to remove stripe '%s': %s", target, strerror(errno));
+		}
+
+		if(unlink(path) == -1 && errno != ENOENT)
+			warning("unable to unlink() '%s': %s", path, strerror(errno));
+	}
+
+	closedir(d);
+}
@@ -0,0 +1,47 @@
+#ifndef STRIPE_H
+#define	STRIPE_H
+
+#include <limits.h>
+#include <stddef.h>
+
+/**
+ * Поток на нескольких дисках: кроме корня, писатель создаёт чанки в
+ * каталогах-страйпах, а в корень кладёт на них симлинки с обычными именами.
+ * Имена, индекс, группы, .offset и .segments остаются в корне, поэтому
+ * читатели ничего про страйпы не знают: они так же выбирают самые старые
+ * чанки по всему потоку, а open() идёт по симлинку на нужный диск.
+ *
+ * Файл чанка удаляет тот, кто удаляет последнюю ссылку на симлинк
+ * (симлинк, как и обычный чанк, может быть в нескольких группах).
+ * Каталоги-страйпы записаны в корне симлинками .stripe.N -> каталог
+ * и удаляются вместе с потоком
+ */
+
+#define STRIPE_SLOT_PREFIX ".stripe."
+
+/* как писатель выбирает каталог для нового чанка */
+#define STRIPE_ROUND_ROBIN 0
+#define STRIPE_MOST_FREE 1
+
+/**
+ * Создаёт каталог-страйп, если его нет, и записывает его в корень потока
+ * @param rootDir
+ * @param dir
+ * @param resolved сюда пишется абсолютный путь к каталогу, PATH_MAX байт
+ */
+void Stripe_register(const char *rootDir, const char *dir, char *resolved);
+
+/**
+ * Удаляет ссылку на чанк, а если она была последней и ведёт в страйп - и сам файл
+ * @param path
+ * @return как у unlink()
+ */
+int Stripe_unlinkChunk(const char *path);
+
+/**
+ * Удаляет опустевшие каталоги-страйпы, вызывается при удалении каталога потока
+ * @param rootDir
+ */
+void Stripe_removeAll(const char *rootDir);
+
+#endif	/* STRIPE_H */
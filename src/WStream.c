@@ -1,4 +1,5 @@
 #include "WStream.h"
+#include "Stats.h"
 #include "common.h"
 
 #include <stdlib.h>
@@ -13,29 +14,83 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/statvfs.h>
 
 static void WStream__createChunk(struct WStream *ws);
-static void WStream__acquireWriterLock(struct WStream *ws);
+static int WStream__acquireWriterLock(const char *dir);
 static void WStream__write(struct WStream *ws, const char *buf, ssize_t len, char writeInOneChunk);
 static void WStream__findLastTimemicro(struct WStream *ws);
+static void WStream__scanLastTimemicro(struct WStream *ws, const char *dir, char *lastBucket);
+static uint64_t WStream__readHighWaterMark(struct WStream *ws);
+static void WStream__saveHighWaterMark(struct WStream *ws, uint64_t timemicro);
 static void WStream__mayCloseChunk(struct WStream *ws);
 static void WStream__needChunk(struct WStream *ws);
 static void WStream__closeChunk(struct WStream *ws);
+static void WStream__writeChunk(struct WStream *ws, int fd, const char *buf, ssize_t len, off_t offset);
+static void WStream__releaseChunkFd(struct WStream *ws, int fd, ssize_t size);
+static void WStream__preallocateChunk(struct WStream *ws, int fd);
+static void WStream__lineBufferWritten(struct WStream *ws);
+static void WStream__growLineBuffer(struct WStream *ws, ssize_t size);
+static void WStream__writeWholeLines(struct WStream *ws, const char *buf, ssize_t len);
+static void WStream__mayWriteMarker(struct WStream *ws);
+static const char *WStream__escapeMarkers(struct WStream *ws, const char *buf, ssize_t *len);
+static char WStream__readersAreWaiting(struct WStream *ws);
+static void WStream__enforceBacklog(struct WStream *ws);
+static size_t WStream__pickStripe(struct WStream *ws);
 
 void WStream_init(struct WStream *ws, const char *rootDir, ssize_t chunkSize) {
+	char path[PATH_MAX + 64];
+
 	ws->rootDir = rootDir;
 
 	ws->chunkFd = -1;
 	ws->writerLockFd = -1;
+	ws->hwmFd = -1;
 	ws->timestampChunkNumber = 0;
 	ws->chunkMaxSize = chunkSize;
 	ws->lineBuffer = NULL;
 	ws->lineBufferSize = 0;
 	ws->lineBufferMaxSize = 0;
+	ws->spareLineBuffer = NULL;
+	ws->spareLineBufferMaxSize = 0;
+	ws->spareLineBufferSeq = 0;
+	ws->recordMaxLength = WSTREAM_LINE_MAX_LENGTH;
+	ws->ring = NULL;
 	ws->lastChunkTimemicro = 0;
 	ws->denyChunkClose = 0;
 	ws->chunkCloseScheduled = 0;
+	ws->lineTailWritten = 0;
 	ws->lastCreatedChunkTimemicro = 0;
+	ws->preallocate = 1;
+	ws->chunkLines = 0;
+	ws->markerInterval = 0;
+	ws->lastMarkerTimemicro = 0;
+	ws->markerSeq = 0;
+	ws->escapeMarkers = 0;
+	ws->escapeBuffer = NULL;
+	ws->escapeBufferSize = 0;
+	ws->escapeSeq = 0;
+	ws->adaptive = 0;
+	ws->baseChunkSize = chunkSize;
+	ws->nextChunkMaxSize = chunkSize;
+	ws->maxChunkAge = 0;
+	ws->ingestRate = 0;
+	ws->lastAdaptTimemicro = 0;
+	ws->lastAdaptBytes = 0;
+	ws->waitingFd = -1;
+	ws->limitBacklog = 0;
+	ws->spilling = 0;
+	ws->spillLockFd = -1;
+	ws->framingRegistered = 0;
+	ws->stripes = NULL;
+	ws->stripesCount = 0;
+	ws->nextStripe = 0;
+	ws->stripePolicy = STRIPE_ROUND_ROBIN;
+	ws->buckets = 0;
+
+	Framing_init(&ws->framing);
+	Framing_resetState(&ws->framingState);
 
 	ws->pid = (unsigned long)getpid();
 	ws->startTime = (uint32_t)time(NULL);
@@ -45,14 +100,28 @@ void WStream_init(struct WStream *ws, const char *rootDir, ssize_t chunkSize) {
 			error("mkdir('%s')", rootDir);
 	}
 
-	WStream__acquireWriterLock(ws);
+	ws->writerLockFd = WStream__acquireWriterLock(rootDir);
+	ws->escapeMarkers = Markers_areUsed(rootDir);
+
+	snprintf(path, sizeof(path), "%s/" WSTREAM_HWM_FILENAME, rootDir);
+
+	ws->hwmFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(ws->hwmFd == -1)
+		warning("open('%s'): %s", path, strerror(errno));
+
+	ChunkIndex_init(&ws->index);
+	ChunkIndex_init(&ws->spillIndex);
+	ChunkIndex_open(&ws->index, rootDir, 1);
+
 	WStream__findLastTimemicro(ws);
+
+	ChunkPool_init(&ws->pool, rootDir, 1);
+	ConsumerGroup_initList(&ws->groups, rootDir);
 	/*WStream__createNextChunk(ws);*/
 }
 
 void WStream_destroy(struct WStream *ws) {
-	if(ws->chunkFd >= 0)
-		close(ws->chunkFd);
+	WStream__closeChunk(ws);
 
 	if(ws->lineBuffer) {
 		free(ws->lineBuffer);
@@ -61,7 +130,39 @@ void WStream_destroy(struct WStream *ws) {
 		ws->lineBufferMaxSize = 0;
 	}
 
-	ws->chunkFd = -1;
+	if(ws->spareLineBuffer) {
+		free(ws->spareLineBuffer);
+		ws->spareLineBuffer = NULL;
+		ws->spareLineBufferMaxSize = 0;
+	}
+
+	free(ws->escapeBuffer);
+	ws->escapeBuffer = NULL;
+	ws->escapeBufferSize = 0;
+
+	ChunkIndex_close(&ws->index);
+	ChunkIndex_close(&ws->spillIndex);
+	ChunkPool_close(&ws->pool);
+	ConsumerGroup_freeList(&ws->groups);
+
+	if(ws->spillLockFd >= 0) {
+		close(ws->spillLockFd);
+		ws->spillLockFd = -1;
+	}
+
+	free(ws->stripes);
+	ws->stripes = NULL;
+	ws->stripesCount = 0;
+
+	if(ws->waitingFd >= 0) {
+		close(ws->waitingFd);
+		ws->waitingFd = -1;
+	}
+
+	if(ws->hwmFd >= 0) {
+		close(ws->hwmFd);
+		ws->hwmFd = -1;
+	}
 
 	if(ws->writerLockFd >= 0)
 		close(ws->writerLockFd);
@@ -69,25 +170,369 @@ void WStream_destroy(struct WStream *ws) {
 	ws->writerLockFd = -1;
 }
 
+/**
+ * Закрыть дескрипторы после ошибки посреди записи: чанк не обрезается
+ * и закрывается как есть, как если бы писатель упал
+ * @param ws
+ */
+void WStream_abandon(struct WStream *ws) {
+	if(ws->chunkFd != -1) {
+		close(ws->chunkFd);
+		ws->chunkFd = -1;
+	}
+
+	WStream_destroy(ws);
+}
+
+/**
+ * Включает асинхронную запись в чанки через io_uring.
+ * После этого буферы, переданные в WStream_write()/WStream_writeLines(),
+ * нельзя переиспользовать, пока не завершится WStream_waitWritten()
+ * с номером, полученным от WStream_lastWriteSeq()
+ * @param ws
+ * @param ring
+ */
+void WStream_useRing(struct WStream *ws, struct IoRing *ring) {
+	ws->ring = ring;
+}
+
+/**
+ * Разбивка потока на записи для WStream_writeLines() и её сверка с
+ * другими писателями через FRAMING_FILENAME
+ * @param ws
+ * @param framing
+ * @param recordMaxLength сколько записи можно держать в буфере
+ */
+void WStream_useFraming(struct WStream *ws, const struct Framing *framing, ssize_t recordMaxLength) {
+	ws->framing = *framing;
+	ws->recordMaxLength = recordMaxLength;
+
+	Framing_resetState(&ws->framingState);
+	Framing_register(framing, ws->rootDir);
+
+	ws->framingRegistered = 1;
+}
+
+/**
+ * Вставлять между строками метки времени (см. Markers.h)
+ * не чаще, чем раз в intervalUsec. Только для WStream_writeLines().
+ * Поток помечается до первой метки, чтобы читатели их вырезали
+ * @param ws
+ * @param intervalUsec
+ */
+void WStream_useMarkers(struct WStream *ws, uint64_t intervalUsec) {
+	Markers_register(ws->rootDir);
+
+	ws->markerInterval = intervalUsec;
+	ws->escapeMarkers = 1;
+}
+
+/**
+ * Размер чанка и момент ротации подбираются по читателям: пока кто-то
+ * ждёт, чанки режутся часто и мелко, при большом бэклоге - растут.
+ * Дальше раз в WSTREAM_ADAPTIVE_TICK_MS нужно вызывать WStream_adapt()
+ * @param ws
+ * @param maxChunkAgeUsec чанк старше закрывается в любом случае, 0 - без ограничения
+ */
+void WStream_useAdaptiveChunks(struct WStream *ws, uint64_t maxChunkAgeUsec) {
+	char path[PATH_MAX + 64];
+
+	snprintf(path, sizeof(path), "%s/" WSTREAM_WAITING_FILENAME, ws->rootDir);
+
+	ws->waitingFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(ws->waitingFd == -1)
+		error("open('%s')", path);
+
+	ws->adaptive = 1;
+	ws->maxChunkAge = maxChunkAgeUsec;
+	ws->lastAdaptTimemicro = timemicro();
+}
+
+/**
+ * Класть чанки в бакеты по времени, а не прямо в корень
+ * @param ws
+ */
+void WStream_useBuckets(struct WStream *ws) {
+	ws->buckets = 1;
+}
+
+/**
+ * Создавать чанки не только в корне, но и в каталогах dirs (см. Stripe.h)
+ * @param ws
+ * @param dirs
+ * @param count
+ * @param policy STRIPE_*
+ */
+void WStream_useStripes(struct WStream *ws, char * const *dirs, size_t count, int policy) {
+	size_t i;
+
+	ws->stripes = calloc(count, sizeof(*ws->stripes));
+	if(!ws->stripes)
+		error("calloc(%lu)", (unsigned long)count);
+
+	for(i = 0; i < count; i++)
+		Stripe_register(ws->rootDir, dirs[i], ws->stripes[i]);
+
+	ws->stripesCount = count;
+	ws->stripePolicy = policy;
+	ws->nextStripe = 0;
+}
+
+/**
+ * Перед созданием каждого чанка проверять бэклог потока (см. Backlog.h)
+ * и, если он за пределом, действовать по limits->policy
+ * @param ws
+ * @param limits
+ */
+void WStream_limitBacklog(struct WStream *ws, const struct BacklogLimits *limits) {
+	ws->limitBacklog = 1;
+
+	Backlog_init(&ws->backlog, ws->rootDir, limits, &ws->groups);
+}
+
+/**
+ * Тик адаптивного режима. Вызывается из обработчика SIGALRM, поэтому
+ * chunkMaxSize не трогает: новый размер применится к следующему чанку
+ * @param ws
+ */
+void WStream_adapt(struct WStream *ws) {
+	uint64_t now = timemicro();
+	/* счётчик ведётся всегда, заодно пригодится и тут */
+	uint64_t bytes = STATS.counters[STATS_BYTES_WRITTEN];
+	uint64_t pending = ChunkIndex_pending(&ws->index);
+	char waiting = WStream__readersAreWaiting(ws);
+	ssize_t size = ws->nextChunkMaxSize;
+	uint64_t age;
+
+	if(now > ws->lastAdaptTimemicro) {
+		uint64_t rate = (bytes - ws->lastAdaptBytes) * 1000000 / (now - ws->lastAdaptTimemicro);
+
+		ws->ingestRate = (ws->ingestRate * 3 + rate) / 4;
+	}
+
+	ws->lastAdaptTimemicro = now;
+	ws->lastAdaptBytes = bytes;
+
+	if(waiting) {
+		/* читатели простаивают: чанк примерно на тик записи, чтобы раздать работу всем */
+		size = (ssize_t)(ws->ingestRate * WSTREAM_ADAPTIVE_TICK_MS / 1000);
+
+		if(size > ws->baseChunkSize)
+			size = ws->baseChunkSize;
+	} else if(pending >= WSTREAM_ADAPTIVE_DEEP_BACKLOG) {
+		/* читатели не успевают: меньше чанков - меньше накладных расходов на каждый */
+		if(size < ws->baseChunkSize * WSTREAM_ADAPTIVE_MAX_GROWTH / 2)
+			size *= 2;
+		else
+			size = ws->baseChunkSize * WSTREAM_ADAPTIVE_MAX_GROWTH;
+	} else {
+		size = ws->baseChunkSize;
+	}
+
+	if(size < WSTREAM_ADAPTIVE_MIN_CHUNK_SIZE)
+		size = WSTREAM_ADAPTIVE_MIN_CHUNK_SIZE < ws->baseChunkSize ? WSTREAM_ADAPTIVE_MIN_CHUNK_SIZE : ws->baseChunkSize;
+
+	ws->nextChunkMaxSize = size;
+
+	if(ws->chunkFd == -1 || !ws->chunkSize)
+		return;
+
+	age = now - ws->lastCreatedChunkTimemicro;
+
+	/*
+	 * ждущим читателям отдаём текущий чанк, как только он набрал
+	 * свой новый размер. При слабом потоке - не чаще раза в секунду,
+	 * чтобы не наплодить чанков по строке
+	 */
+	if(waiting && (ws->chunkSize >= size || age >= WSTREAM_ADAPTIVE_STARVED_MAX_AGE_MS * 1000))
+		WStream_scheduleCloseChunk(ws);
+	else if(ws->maxChunkAge && age >= ws->maxChunkAge)
+		WStream_scheduleCloseChunk(ws);
+}
+
+/**
+ * Есть ли читатели, которым нечего читать
+ * @param ws
+ * @return
+ */
+static char WStream__readersAreWaiting(struct WStream *ws) {
+	struct flock l;
+
+	l.l_start = 0;
+	l.l_len = 1;
+	l.l_type = F_WRLCK;
+	l.l_whence = SEEK_SET;
+
+	if(fcntl(ws->waitingFd, F_GETLK, &l) == -1)
+		return 0;
+
+	return l.l_type != F_UNLCK;
+}
+
+uint64_t WStream_lastWriteSeq(struct WStream *ws) {
+	return ws->ring ? ws->ring->queuedSeq : 0;
+}
+
+void WStream_waitWritten(struct WStream *ws, uint64_t seq) {
+	if(!ws->ring)
+		return;
+
+	/* обработчик SIGALRM тоже ходит в кольцо при закрытии чанка */
+	ws->denyChunkClose = 1;
+
+	IoRing_wait(ws->ring, seq);
+
+	ws->denyChunkClose = 0;
+
+	WStream__mayCloseChunk(ws);
+}
+
 void WStream_write(struct WStream *ws, const char *buf, ssize_t len) {
 	ws->denyChunkClose = 1;
 
 	WStream__write(ws, buf, len, 0);
 
+	if(ws->ring)
+		IoRing_submit(ws->ring);
+
+	ws->denyChunkClose = 0;
+
+	WStream__mayCloseChunk(ws);
+	Stats_maybePublish();
+}
+
+/**
+ * Бинарный режим без копирования: перекладывает до maxLen байт
+ * из пайпа fd прямо в текущий чанк через splice().
+ * Границы чанков по chunkMaxSize соблюдаются так же, как в WStream_write()
+ *
+ * @param ws
+ * @param fd пайп
+ * @param maxLen
+ * @return сколько байт записано, 0 - EOF на fd, -1 если splice() для fd не поддерживается
+ */
+ssize_t WStream_splice(struct WStream *ws, int fd, ssize_t maxLen) {
+#ifdef SPLICE_F_MOVE
+	struct pollfd pfd;
+	ssize_t moved;
+	ssize_t toMove;
+
+	/*
+	 * чанк создаём только когда в пайпе что-то появилось, иначе на каждый
+	 * тик таймера и на EOF будет оставаться пустой чанк.
+	 * Пока ждём, закрыть чанк по таймеру можно
+	 */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for(;;) {
+		pfd.revents = 0;
+
+		if(poll(&pfd, 1, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+
+			error("poll(#%d)", fd);
+		}
+
+		if(pfd.revents & POLLIN)
+			break;
+
+		if(pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+			return 0;
+	}
+
+	ws->denyChunkClose = 1;
+
+	WStream__needChunk(ws);
+
+	if(ws->chunkSize >= ws->chunkMaxSize) {
+		Stats_inc(STATS_ROTATIONS_SIZE);
+		WStream__closeChunk(ws);
+		WStream__createChunk(ws);
+	}
+
+	toMove = ws->chunkMaxSize - ws->chunkSize;
+	if(toMove > maxLen)
+		toMove = maxLen;
+
+	do {
+		moved = splice(fd, NULL, ws->chunkFd, NULL, (size_t)toMove, SPLICE_F_MOVE | SPLICE_F_MORE);
+	} while(moved == -1 && errno == EINTR);
+
+	if(moved == -1) {
+		ws->denyChunkClose = 0;
+
+		if(errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+			return -1;
+
+		error("splice(#%d, #%d)", fd, ws->chunkFd);
+	}
+
+	ws->chunkSize += moved;
+
+	Stats_inc(STATS_CHUNK_WRITES);
+	Stats_add(STATS_BYTES_WRITTEN, moved);
+
+	if(ws->chunkSize >= ws->chunkMaxSize) {
+		/*
+		 * чанк заполнен, заранее создаём новый,
+		 * чтобы читателю гарантированно было куда переключиться
+		 */
+		int fullChunkFd = ws->chunkFd;
+		ssize_t fullChunkSize = ws->chunkSize;
+
+		debug("chunk size overflow (%llu bytes)", (unsigned long long)ws->chunkMaxSize);
+
+		Stats_inc(STATS_ROTATIONS_SIZE);
+		WStream__createChunk(ws);
+		WStream__releaseChunkFd(ws, fullChunkFd, fullChunkSize);
+	}
+
 	ws->denyChunkClose = 0;
+
+	WStream__mayCloseChunk(ws);
+	Stats_maybePublish();
+
+	return moved;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
 }
 
 void WStream_flush(struct WStream *ws) {
 	if(ws->lineBuffer && ws->lineBufferSize) {
 		debug("flush line tail");
+
+		ws->denyChunkClose = 1;
+
+		if(!ws->lineTailWritten)
+			WStream__write(ws, NULL, 0, 0);
+
 		WStream__write(ws, ws->lineBuffer, ws->lineBufferSize, 1);
-		ws->lineBufferSize = 0;
+		WStream__lineBufferWritten(ws);
+
+		ws->lineTailWritten = 0;
+		ws->denyChunkClose = 0;
+	}
+
+	/* недописанная запись ушла как есть, дальше разбор с нуля */
+	Framing_resetState(&ws->framingState);
+
+	if(ws->ring) {
+		ws->denyChunkClose = 1;
+
+		IoRing_submit(ws->ring);
+		IoRing_waitAll(ws->ring);
+
+		ws->denyChunkClose = 0;
 	}
 }
 
 /**
- * В отличии от WStream_write() эта функция гарантирует, что строка будет
- * целиком записана в один чанк без разбивки.
+ * В отличии от WStream_write() эта функция гарантирует, что строка (запись,
+ * см. WStream_useFraming()) будет целиком записана в один чанк без разбивки.
  * Допускается передавать неполные строки. В этом случае функцию бедуте ждать
  * окончания строки перед фактической записью
  *
@@ -96,32 +541,64 @@ void WStream_flush(struct WStream *ws) {
  * @param len
  */
 void WStream_writeLines(struct WStream *ws, const char *buf, ssize_t len) {
-	char *lastLineEnd;
+	ssize_t firstLineLen = 0;
 	ssize_t toWrite;
 	ssize_t toBuffer;
 
 	ws->denyChunkClose = 1;
 
-	if(!ws->lineBuffer) {
-		ws->lineBuffer = malloc(WSTREAM_LINE_MAX_LENGTH);
-		ws->lineBufferMaxSize = WSTREAM_LINE_MAX_LENGTH;
-		ws->lineBufferSize = 0;
+	if(ws->escapeMarkers)
+		buf = WStream__escapeMarkers(ws, buf, &len);
+
+	if(!ws->lineBuffer)
+		WStream__growLineBuffer(ws, WSTREAM_LINE_BUFFER_INITIAL_SIZE);
+
+	if(ws->lineBufferSize || ws->lineTailWritten) {
+		/* первая строка - продолжение уже начатой, она идёт в тот же чанк */
+		firstLineLen = (ssize_t)Framing_next(&ws->framing, &ws->framingState, buf, (size_t)len);
+		toWrite = firstLineLen;
+
+		if(firstLineLen)
+			toWrite += (ssize_t)Framing_last(&ws->framing, &ws->framingState, buf + firstLineLen, (size_t)(len - firstLineLen));
+	} else {
+		toWrite = (ssize_t)Framing_last(&ws->framing, &ws->framingState, buf, (size_t)len);
 	}
 
-	lastLineEnd = memrchr(buf, '\n', (size_t)len);
-	toWrite = lastLineEnd ? (ssize_t)(lastLineEnd - buf) + 1 : 0;
 	toBuffer = len - toWrite;
 
 	if(toWrite) {
-		if(ws->lineBufferSize) {
-			WStream__write(ws, ws->lineBuffer, ws->lineBufferSize, 1);
-			ws->lineBufferSize = 0;
+		if(firstLineLen) {
+			if(!ws->lineTailWritten) {
+				WStream__write(ws, NULL, 0, 0);
+
+				/* собранная запись не влезает в остаток: начинаем с неё новый чанк, см. WStream__writeWholeLines() */
+				if(ws->chunkSize && ws->lineBufferSize + firstLineLen > ws->chunkMaxSize - ws->chunkSize) {
+					Stats_inc(STATS_ROTATIONS_SIZE);
+					WStream__closeChunk(ws);
+					WStream__createChunk(ws);
+				}
+			}
+
+			if(ws->lineBufferSize) {
+				WStream__write(ws, ws->lineBuffer, ws->lineBufferSize, 1);
+				WStream__lineBufferWritten(ws);
+			}
+
+			WStream__write(ws, buf, firstLineLen, 1);
+			ws->lineTailWritten = 0;
 		}
 
-		WStream__write(ws, buf, toWrite, 1);
+		WStream__writeWholeLines(ws, buf + firstLineLen, toWrite - firstLineLen);
+
+		/* тут мы точно на границе строк */
+		if(ws->markerInterval)
+			WStream__mayWriteMarker(ws);
 	}
 
 	if(toBuffer) {
+		if(ws->lineBufferSize + toBuffer > ws->lineBufferMaxSize)
+			WStream__growLineBuffer(ws, ws->lineBufferSize + toBuffer);
+
 		if(ws->lineBufferSize + toBuffer <= ws->lineBufferMaxSize) {
 			memcpy(ws->lineBuffer + ws->lineBufferSize, buf + toWrite, (size_t)toBuffer);
 			ws->lineBufferSize += toBuffer;
@@ -135,18 +612,131 @@ void WStream_writeLines(struct WStream *ws, const char *buf, ssize_t len) {
 			 * но на буферизации мы сэкономим на одном вызове WStream__write() со
 			 * сложной логикой и несколько io-вызовов на каждый вызов WStream_writeLines()
 			 */
-			warning("line is too long, flushing with split supression '\\n'");
+			warning("record is longer than %lld bytes, flushing with split supression", (long long)ws->recordMaxLength);
+
+			if(!ws->lineTailWritten)
+				WStream__write(ws, NULL, 0, 0);
 
 			WStream__write(ws, ws->lineBuffer, ws->lineBufferSize, 1);
-			ws->lineBufferSize = 0;
+			WStream__lineBufferWritten(ws);
 
 			WStream__write(ws, buf + toWrite, toBuffer, 1);
+			ws->lineTailWritten = 1;
 		}
 	}
 
+	if(buf == ws->escapeBuffer)
+		ws->escapeSeq = WStream_lastWriteSeq(ws);
+
+	if(ws->ring)
+		IoRing_submit(ws->ring);
+
 	ws->denyChunkClose = 0;
 
 	WStream__mayCloseChunk(ws);
+	Stats_maybePublish();
+}
+
+/**
+ * Пишет целые строки, разрезая их между чанками по концу последней записи,
+ * который помещается в chunkMaxSize. Строка, которая сама не влезает
+ * в остаток чанка, дописывается в текущий чанк целиком
+ *
+ * @param ws
+ * @param buf
+ * @param len буфер должен начинаться и заканчиваться на границе записей
+ */
+static void WStream__writeWholeLines(struct WStream *ws, const char *buf, ssize_t len) {
+	while(len) {
+		ssize_t toWrite = len;
+		ssize_t room;
+
+		WStream__write(ws, NULL, 0, 0);
+
+		room = ws->chunkMaxSize - ws->chunkSize;
+
+		if(len > room) {
+			struct FramingState st;
+
+			Framing_resetState(&st);
+			toWrite = room > 0 ? (ssize_t)Framing_last(&ws->framing, &st, buf, (size_t)room) : 0;
+
+			/* запись не влезает в остаток: начинаем с неё новый чанк, в пустой она идёт целиком */
+			if(!toWrite && ws->chunkSize) {
+				Stats_inc(STATS_ROTATIONS_SIZE);
+				WStream__closeChunk(ws);
+				WStream__createChunk(ws);
+
+				continue;
+			}
+
+			if(!toWrite) {
+				Framing_resetState(&st);
+				toWrite = (ssize_t)Framing_next(&ws->framing, &st, buf, (size_t)len);
+			}
+		}
+
+		WStream__write(ws, buf, toWrite, 1);
+
+		buf += toWrite;
+		len -= toWrite;
+	}
+}
+
+static void WStream__mayWriteMarker(struct WStream *ws) {
+	uint64_t now = timemicro();
+
+	if(now - ws->lastMarkerTimemicro < ws->markerInterval)
+		return;
+
+	ws->lastMarkerTimemicro = now;
+
+	/* с io_uring предыдущая метка может быть ещё не записана из этого буфера */
+	if(ws->ring)
+		IoRing_wait(ws->ring, ws->markerSeq);
+
+	snprintf(ws->marker, sizeof(ws->marker), "%c%016" PRIu64 "\n", MARKERS_CHAR, now);
+	WStream__writeWholeLines(ws, ws->marker, MARKERS_LENGTH);
+
+	ws->markerSeq = WStream_lastWriteSeq(ws);
+}
+
+/**
+ * В помеченном потоке строка, которая начинается с MARKERS_CHAR,
+ * пишется с удвоенным символом, чтобы читатель не принял её за метку
+ * @param ws
+ * @param buf
+ * @param len на выходе - длина того, что писать
+ * @return buf или escapeBuffer с экранированными строками
+ */
+static const char *WStream__escapeMarkers(struct WStream *ws, const char *buf, ssize_t *len) {
+	/* в начале буфера строка, только если от предыдущего ничего не осталось */
+	char atLineStart = !ws->lineBufferSize && !ws->lineTailWritten;
+	size_t escapes = Markers_countEscapes(buf, (size_t)*len, atLineStart);
+	size_t size;
+
+	if(!escapes)
+		return buf;
+
+	size = (size_t)*len + escapes;
+
+	/* с io_uring прошлый экранированный буфер может быть ещё не записан */
+	if(ws->ring)
+		IoRing_wait(ws->ring, ws->escapeSeq);
+
+	if(size > ws->escapeBufferSize) {
+		char *p = realloc(ws->escapeBuffer, size);
+
+		if(!p)
+			error("realloc(%lu)", (unsigned long)size);
+
+		ws->escapeBuffer = p;
+		ws->escapeBufferSize = size;
+	}
+
+	*len = (ssize_t)Markers_escape(ws->escapeBuffer, buf, (size_t)*len, atLineStart);
+
+	return ws->escapeBuffer;
 }
 
 /**
@@ -161,6 +751,7 @@ static void WStream__write(struct WStream *ws, const char *buf, ssize_t len, cha
 	WStream__needChunk(ws);
 
 	if(!disableSplit && ws->chunkSize >= ws->chunkMaxSize) {
+		Stats_inc(STATS_ROTATIONS_SIZE);
 		WStream__closeChunk(ws);
 		WStream__createChunk(ws);
 	}
@@ -172,7 +763,7 @@ static void WStream__write(struct WStream *ws, const char *buf, ssize_t len, cha
 	do {
 		while(written != len && (disableSplit || ws->chunkSize < ws->chunkMaxSize)) {
 			ssize_t toWriteInThisChunk = len - written;
-			ssize_t wr;
+			off_t offset = (off_t)ws->chunkSize;
 			int fd = ws->chunkFd;
 			int fdMustBeClosed = 0;
 
@@ -186,31 +777,178 @@ static void WStream__write(struct WStream *ws, const char *buf, ssize_t len, cha
 
 				debug("chunk size overflow (%llu bytes)", (unsigned long long)ws->chunkMaxSize);
 
+				Stats_inc(STATS_ROTATIONS_SIZE);
 				WStream__createChunk(ws);
 				fdMustBeClosed = 1;
 			} else {
 				ws->chunkSize += toWriteInThisChunk;
 			}
 
-			/* пишем этот кусок с учётом возможных прерываний по сигналам */
-			do {
-				wr = write(fd, buf + written, (size_t)toWriteInThisChunk);
-
-				if(wr <= 0) {
-					if(errno != EINTR)
-						error("write(#%d)", fd);
-				}
-
-				written += wr;
-				toWriteInThisChunk -= wr;
-			} while(toWriteInThisChunk);
+			WStream__writeChunk(ws, fd, buf + written, toWriteInThisChunk, offset);
+			written += toWriteInThisChunk;
 
 			if(fdMustBeClosed)
-				close(fd);
+				WStream__releaseChunkFd(ws, fd, offset + toWriteInThisChunk);
 		}
 	} while(written < len);
 }
 
+/**
+ * Пишет кусок в чанк: синхронно или ставит в очередь io_uring
+ * @param ws
+ * @param fd
+ * @param buf
+ * @param len
+ * @param offset смещение куска в чанке, нужно только для io_uring
+ */
+static void WStream__writeChunk(struct WStream *ws, int fd, const char *buf, ssize_t len, off_t offset) {
+	/*
+	 * fd может быть и предыдущим чанком, если новый уже создан,
+	 * но в новый до закрытия предыдущего ничего не пишется
+	 */
+	if(STATS.countLines && ws->framing.type == FRAMING_LINES)
+		ws->chunkLines += Stats_countLines(buf, (size_t)len);
+
+	Stats_add(STATS_BYTES_WRITTEN, len);
+
+	if(ws->ring) {
+		Stats_inc(STATS_CHUNK_WRITES);
+		IoRing_write(ws->ring, fd, buf, (size_t)len, offset);
+		return;
+	}
+
+	/* пишем этот кусок с учётом возможных прерываний по сигналам */
+	while(len) {
+		uint64_t startTime = timemicro();
+		ssize_t wr = write(fd, buf, (size_t)len);
+
+		Stats_inc(STATS_CHUNK_WRITES);
+		Stats_record(STATS_HIST_CHUNK_WRITE_US, timemicro() - startTime);
+
+		if(wr <= 0) {
+			if(wr == -1 && errno == EINTR)
+				continue;
+
+			error("write(#%d)", fd);
+		}
+
+		buf += wr;
+		len -= wr;
+	}
+}
+
+/**
+ * Закрывает дописанный чанк. Закрытие снимает лок писателя,
+ * а значит всё, что стоит в очереди io_uring, должно быть уже на месте
+ * @param ws
+ * @param fd
+ * @param size итоговый размер чанка, место за ним, выделенное заранее, освобождается
+ */
+static void WStream__releaseChunkFd(struct WStream *ws, int fd, ssize_t size) {
+	if(ws->ring)
+		IoRing_waitAll(ws->ring);
+
+	if(ws->preallocate && size < ws->chunkMaxSize) {
+		if(ftruncate(fd, (off_t)size) == -1)
+			warning("ftruncate(#%d, %lld): %s", fd, (long long)size, strerror(errno));
+	}
+
+	close(fd);
+
+	Stats_record(STATS_HIST_CHUNK_BYTES, (uint64_t)size);
+
+	if(STATS.countLines) {
+		Stats_record(STATS_HIST_CHUNK_LINES, ws->chunkLines);
+		ws->chunkLines = 0;
+	}
+}
+
+/**
+ * Выделяет место под весь чанк сразу, не меняя размер файла:
+ * читатели по-прежнему видят только записанное
+ * @param ws
+ * @param fd
+ */
+static void WStream__preallocateChunk(struct WStream *ws, int fd) {
+#ifdef FALLOC_FL_KEEP_SIZE
+	if(!ws->preallocate)
+		return;
+
+	if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)ws->chunkMaxSize) == 0)
+		return;
+
+	if(errno == EOPNOTSUPP || errno == ENOSYS) {
+		debug("fallocate() is not supported, preallocation disabled");
+		ws->preallocate = 0;
+		return;
+	}
+
+	/* например ENOSPC: чанк просто будет расти по мере записи */
+	debug("fallocate(#%d, %lld): %s", fd, (long long)ws->chunkMaxSize, strerror(errno));
+#else
+	ws->preallocate = 0;
+#endif
+}
+
+/**
+ * Буфер строки только что отправлен на запись. С io_uring он может быть
+ * ещё не записан, поэтому дальше копим хвост во втором буфере
+ * @param ws
+ */
+static void WStream__lineBufferWritten(struct WStream *ws) {
+	char *written = ws->lineBuffer;
+	ssize_t writtenMaxSize = ws->lineBufferMaxSize;
+	uint64_t spareSeq = ws->spareLineBufferSeq;
+
+	ws->lineBufferSize = 0;
+
+	if(!ws->ring)
+		return;
+
+	if(!ws->spareLineBuffer) {
+		ws->spareLineBuffer = malloc((size_t)ws->lineBufferMaxSize);
+		if(!ws->spareLineBuffer)
+			error("malloc(%llu)", (unsigned long long)ws->lineBufferMaxSize);
+
+		ws->spareLineBufferMaxSize = ws->lineBufferMaxSize;
+	}
+
+	ws->lineBuffer = ws->spareLineBuffer;
+	ws->lineBufferMaxSize = ws->spareLineBufferMaxSize;
+	ws->spareLineBuffer = written;
+	ws->spareLineBufferMaxSize = writtenMaxSize;
+	ws->spareLineBufferSeq = ws->ring->queuedSeq;
+
+	IoRing_wait(ws->ring, spareSeq);
+}
+
+/**
+ * Растит буфер строки хотя бы до size, но не больше recordMaxLength.
+ * Буфер не должен быть в очереди io_uring
+ * @param ws
+ * @param size
+ */
+static void WStream__growLineBuffer(struct WStream *ws, ssize_t size) {
+	ssize_t newSize = ws->lineBufferMaxSize ? ws->lineBufferMaxSize : size;
+	char *buf;
+
+	while(newSize < size)
+		newSize *= 2;
+
+	if(newSize > ws->recordMaxLength)
+		newSize = ws->recordMaxLength;
+
+	if(newSize <= ws->lineBufferMaxSize)
+		return;
+
+	buf = realloc(ws->lineBuffer, (size_t)newSize);
+	if(!buf)
+		error("realloc(%llu)", (unsigned long long)newSize);
+
+	ws->lineBuffer = buf;
+	ws->lineBufferMaxSize = newSize;
+}
+
 void WStream_scheduleCloseChunk(struct WStream *ws) {
 	ws->chunkCloseScheduled = 1;
 	WStream__mayCloseChunk(ws);
@@ -222,40 +960,179 @@ static void WStream__needChunk(struct WStream *ws) {
 }
 
 static void WStream__mayCloseChunk(struct WStream *ws) {
-	if(ws->chunkCloseScheduled)
+	/*
+	 * вызывается в том числе из обработчика SIGALRM, поэтому
+	 * не трогаем чанк, пока в него идёт запись
+	 */
+	if(ws->chunkCloseScheduled && !ws->denyChunkClose && !ws->lineTailWritten) {
+		if(ws->chunkFd != -1)
+			Stats_inc(STATS_ROTATIONS_TIMER);
+
 		WStream__closeChunk(ws);
+	}
 }
 
 static void WStream__closeChunk(struct WStream *ws) {
 	if(ws->chunkFd != -1) {
 		debug("chunk closed");
-		close(ws->chunkFd);
+		WStream__releaseChunkFd(ws, ws->chunkFd, ws->chunkSize);
 		ws->chunkFd = -1;
 	}
 
 	ws->chunkCloseScheduled = 0;
 }
 
-static void WStream__acquireWriterLock(struct WStream *ws) {
+static int WStream__acquireWriterLock(const char *dir) {
 	char path[PATH_MAX];
+	int fd;
 
-	snprintf(path, sizeof(path), "%s/.writer.lock", ws->rootDir);
+	snprintf(path, sizeof(path), "%s/.writer.lock", dir);
 
 	debug("acquiring writer lock: %s", path);
-	ws->writerLockFd = open(path, O_CREAT | O_WRONLY, 0644);
-	if(ws->writerLockFd == -1)
+	fd = open(path, O_CREAT | O_WRONLY, 0644);
+	if(fd == -1)
 		error("unable to open/create lock-file '%s'", path);
 
-	if(flock(ws->writerLockFd, LOCK_SH | LOCK_NB) == -1)
-		error("unable to acquire writer lock on '%s'. Maybe this stream currenly used", ws->rootDir);
+	if(flock(fd, LOCK_SH | LOCK_NB) == -1)
+		error("unable to acquire writer lock on '%s'. Maybe this stream currenly used", dir);
+
+	return fd;
+}
+
+/**
+ * Бэклог за пределом, новые чанки идут в spillDir
+ * @param ws
+ */
+static void WStream__startSpill(struct WStream *ws) {
+	const char *dir = ws->backlog.limits.spillDir;
+
+	if(ws->spillLockFd == -1) {
+		if(mkdir(dir, 0755) == -1 && errno != EEXIST)
+			error("mkdir('%s')", dir);
+
+		/* это обычный поток: его читатели ждут, пока мы держим лок */
+		ws->spillLockFd = WStream__acquireWriterLock(dir);
+		ChunkIndex_open(&ws->spillIndex, dir, 1);
+
+		if(ws->framingRegistered)
+			Framing_register(&ws->framing, dir);
+
+		if(ws->markerInterval)
+			Markers_register(dir);
+	}
+
+	debug("backlog of '%s' exceeds limits, spilling to '%s'", ws->rootDir, dir);
+	ws->spilling = 1;
+}
+
+/**
+ * @param ws
+ * @return 0 - корень, иначе номер страйпа + 1
+ */
+static size_t WStream__pickStripe(struct WStream *ws) {
+	size_t count = ws->stripesCount + 1;
+	size_t best = ws->nextStripe;
+	uint64_t bestFree = 0;
+	size_t i;
+
+	if(ws->stripePolicy == STRIPE_MOST_FREE) {
+		/* при равенстве - по кругу, иначе страйпы на одной ФС всегда будут проигрывать корню */
+		for(i = 0; i < count; i++) {
+			size_t k = (ws->nextStripe + i) % count;
+			struct statvfs st;
+			uint64_t freeBytes;
+
+			if(statvfs(k ? ws->stripes[k - 1] : ws->rootDir, &st) == -1) {
+				warning("statvfs('%s'): %s", k ? ws->stripes[k - 1] : ws->rootDir, strerror(errno));
+				continue;
+			}
+
+			freeBytes = (uint64_t)st.f_bavail * st.f_frsize;
+
+			if(freeBytes > bestFree) {
+				bestFree = freeBytes;
+				best = k;
+			}
+		}
+	}
+
+	ws->nextStripe = (best + 1) % count;
+
+	return best;
+}
+
+/**
+ * Вызывается перед созданием чанка. Открытым может быть только наш
+ * предыдущий чанк, в бэклог он не входит
+ * @param ws
+ */
+static void WStream__enforceBacklog(struct WStream *ws) {
+	struct Backlog *bl = &ws->backlog;
+	char blocked = 0;
+
+	while(Backlog_isExceeded(bl, ws->chunkFd)) {
+		if(bl->limits.policy == BACKLOG_SPILL) {
+			if(!ws->spilling)
+				WStream__startSpill(ws);
+
+			return;
+		}
+
+		if(bl->limits.policy == BACKLOG_DROP) {
+			if(Backlog_dropOldest(bl, ws->chunkFd) == -1) {
+				/* удалять нечего, остаётся только писать дальше */
+				debug("backlog of '%s' exceeds limits, but there is nothing to drop", ws->rootDir);
+				return;
+			}
+
+			Stats_inc(STATS_CHUNKS_DROPPED);
+			continue;
+		}
+
+		/* BACKLOG_BLOCK: пока ждём, stdin не читается и встаёт тот, кто в него пишет */
+		if(!blocked) {
+			debug("backlog of '%s' exceeds limits, waiting for readers", ws->rootDir);
+			Stats_inc(STATS_BACKLOG_WAITS);
+			blocked = 1;
+		}
+
+		usleep(BACKLOG_RESCAN_INTERVAL_MS * 1000);
+	}
+
+	if(ws->spilling) {
+		debug("backlog of '%s' is within limits, spilling stopped", ws->rootDir);
+		ws->spilling = 0;
+	}
 }
 
 static void WStream__createChunk(struct WStream *ws) {
 	char tmpPathBuf[PATH_MAX + 64];
 	char pathBuf[PATH_MAX + 64];
+	char stripePathBuf[PATH_MAX + 64];
+	char bucket[32] = "";
+	int nameOffset = 0;
+	int bucketLength = 0;
+	int attempt;
+	const char *dir;
+	size_t stripe = 0;
 
 	int fd;
-	uint64_t currentTimemicro = timemicro();
+	uint64_t currentTimemicro;
+
+	/* может надолго заблокировать, так что время для имени берём после */
+	if(ws->limitBacklog)
+		WStream__enforceBacklog(ws);
+
+	dir = ws->spilling ? ws->backlog.limits.spillDir : ws->rootDir;
+
+	/* поток мог пометить писатель с -M, запущенный после нас */
+	if(!ws->escapeMarkers)
+		ws->escapeMarkers = Markers_areUsed(ws->rootDir);
+
+	currentTimemicro = timemicro();
+
+	if(!ws->spilling && ws->stripesCount)
+		stripe = WStream__pickStripe(ws);
 
 	if(currentTimemicro == ws->lastChunkTimemicro) {
 		ws->timestampChunkNumber++;
@@ -264,30 +1141,115 @@ static void WStream__createChunk(struct WStream *ws) {
 		ws->lastChunkTimemicro = currentTimemicro;
 	}
 
+	/* в поток для перелива бакеты не нужны, его читают отдельно */
+	if(ws->buckets && !ws->spilling)
+		bucketLength = snprintf(bucket, sizeof(bucket), "%0*" PRIu64 "/", BUCKET_NAME_LENGTH, Bucket_of(ws->lastChunkTimemicro));
+
 	snprintf(
 		pathBuf,
 		sizeof(pathBuf),
-		"%s/%016" PRIu64 ".%03lu.%05lu-%08" PRIx32 ".chunk",
-		ws->rootDir,
+		"%s/%n%s%016" PRIu64 ".%03lu.%05lu-%08" PRIx32 ".chunk",
+		dir,
+		&nameOffset,
+		bucket,
 		ws->lastChunkTimemicro,
 		ws->timestampChunkNumber,
 		ws->pid & 0xffffl,
 		ws->startTime
 	);
 
-	snprintf(tmpPathBuf, sizeof(tmpPathBuf), "%s.tmp", pathBuf);
+	/* временный файл - всегда в корне: читатели узнают о новом чанке по переносу из корня в бакет */
+	snprintf(tmpPathBuf, sizeof(tmpPathBuf), "%s/%s.tmp", dir, pathBuf + nameOffset + bucketLength);
 
 	debug("creating new chunk: %s -> %s", tmpPathBuf, pathBuf);
 
-	fd = open(tmpPathBuf, O_CREAT | O_WRONLY | O_EXCL, 0644);
-	if(fd < 0)
-		error("open('%s')", tmpPathBuf);
+	fd = -1;
+
+	if(stripe) {
+		/* сам файл - на диске страйпа, в корне будет только симлинк на него */
+		snprintf(stripePathBuf, sizeof(stripePathBuf), "%s/%s", ws->stripes[stripe - 1], pathBuf + nameOffset + bucketLength);
+
+		fd = open(stripePathBuf, O_CREAT | O_WRONLY | O_EXCL, 0644);
+		if(fd < 0)
+			error("open('%s')", stripePathBuf);
+
+		if(!flockRangeNB(fd, 1, 1, F_WRLCK))
+			error("file '%s' already locked", stripePathBuf);
+	} else if(!ws->spilling && ChunkPool_take(&ws->pool, tmpPathBuf) == 0) {
+		/* пул лежит в корне потока, а spillDir может быть на другой ФС */
+		fd = open(tmpPathBuf, O_WRONLY);
+		if(fd < 0)
+			error("open('%s')", tmpPathBuf);
+
+		/*
+		 * файл из пула ещё может держать открытым читатель, который
+		 * не успел понять, что чанк уже дочитан. Такой файл не берём
+		 */
+		if(!flockRangeNB(fd, 1, 1, F_WRLCK)) {
+			debug("pooled chunk file is still locked, creating new one");
+
+			if(unlink(tmpPathBuf) == -1)
+				error("unlink('%s')", tmpPathBuf);
+
+			close(fd);
+			fd = -1;
+		} else if(ftruncate(fd, 0) == -1) {
+			/* в пул файлы попадают уже обрезанными, но пустой файл обрезать ничего не стоит */
+			error("ftruncate('%s')", tmpPathBuf);
+		} else {
+			Stats_inc(STATS_CHUNKS_FROM_POOL);
+		}
+	}
+
+	if(fd < 0) {
+		fd = open(tmpPathBuf, O_CREAT | O_WRONLY | O_EXCL, 0644);
+		if(fd < 0)
+			error("open('%s')", tmpPathBuf);
+
+		if(!flockRangeNB(fd, 1, 1, F_WRLCK))
+			error("file '%s' already locked", tmpPathBuf);
+	}
+
+	if(ws->adaptive)
+		ws->chunkMaxSize = ws->nextChunkMaxSize;
 
-	if(!flockRangeNB(fd, 1, 1, F_WRLCK))
-		error("file '%s' already locked", tmpPathBuf);
+	WStream__preallocateChunk(ws, fd);
+
+	if(stripe && symlink(stripePathBuf, tmpPathBuf) == -1)
+		error("symlink('%s', '%s')", stripePathBuf, tmpPathBuf);
+
+	/* метка - до появления чанка: упавший между ними писатель оставит её новее чанков, а не старее */
+	if(!ws->spilling) {
+		WStream__saveHighWaterMark(ws, ws->lastChunkTimemicro);
+
+		/* в группы - тоже до появления в корне: читатель с -R успел бы переименовать чанк раньше link() */
+		ConsumerGroup_linkChunk(&ws->groups, tmpPathBuf, pathBuf + nameOffset);
+	}
+
+	for(attempt = 0; rename(tmpPathBuf, pathBuf) == -1; attempt++) {
+		char bucketPath[PATH_MAX + 64];
+
+		/* бакета ещё нет, или его только что удалил читатель */
+		if(!bucketLength || errno != ENOENT || attempt == 2)
+			error("rename('%s', '%s')", tmpPathBuf, pathBuf);
+
+		snprintf(bucketPath, sizeof(bucketPath), "%.*s", nameOffset + bucketLength - 1, pathBuf);
+
+		if(mkdir(bucketPath, 0755) == -1 && errno != EEXIST)
+			error("mkdir('%s')", bucketPath);
+	}
+
+	if(ws->spilling) {
+		ChunkIndex_append(&ws->spillIndex, pathBuf + nameOffset);
+		Stats_inc(STATS_CHUNKS_SPILLED);
+	} else {
+		ChunkIndex_append(&ws->index, pathBuf + nameOffset);
+
+		if(ws->limitBacklog)
+			Backlog_addChunk(&ws->backlog, (uint64_t)ws->chunkMaxSize);
+	}
 
-	if(rename(tmpPathBuf, pathBuf) == -1)
-		error("rename('%s', '%s')", tmpPathBuf, pathBuf);
+	Stats_inc(STATS_CHUNKS_CREATED);
 
 	ws->chunkFd = fd;
 	ws->chunkSize = 0;
@@ -296,19 +1258,31 @@ static void WStream__createChunk(struct WStream *ws) {
 	ws->lastCreatedChunkTimemicro = timemicro();
 }
 
-static void WStream__findLastTimemicro(struct WStream *ws) {
+/**
+ * @param ws
+ * @param dir корень или бакет
+ * @param lastBucket сюда - самый новый бакет в dir, NULL - бакеты не ищем
+ */
+static void WStream__scanLastTimemicro(struct WStream *ws, const char *dir, char *lastBucket) {
 	/* копипаста из RStream__findFirstChunk */
 	DIR *d;
 	struct dirent *e;
 	uint64_t mts;
 
-	debug("Scanning '%s' for last chunk", ws->rootDir);
+	debug("Scanning '%s' for last chunk", dir);
 
-	d = opendir(ws->rootDir);
+	d = opendir(dir);
 	if(!d)
-		error("opendir(%s)", ws->rootDir);
+		error("opendir(%s)", dir);
 
 	while((e = readdir(d))) {
+		if(lastBucket && Bucket_isName(e->d_name)) {
+			if(strcmp(e->d_name, lastBucket) > 0)
+				strcpy(lastBucket, e->d_name);
+
+			continue;
+		}
+
 		if(e->d_name[0] == '.' || strstr(e->d_name, ".chunk") != e->d_name + (strlen(e->d_name) - 6))
 			continue;
 
@@ -321,7 +1295,100 @@ static void WStream__findLastTimemicro(struct WStream *ws) {
 			ws->lastChunkTimemicro = mts;
 	}
 
-	debug("Last microtimestamp: %" PRIu64, ws->lastChunkTimemicro);
-
 	closedir(d);
 }
+
+/**
+ * @param ws
+ * @return метка из WSTREAM_HWM_FILENAME или 0, если её нет или она битая
+ */
+static uint64_t WStream__readHighWaterMark(struct WStream *ws) {
+	char buf[WSTREAM_HWM_LENGTH + 1];
+	ssize_t len;
+	int i;
+
+	if(ws->hwmFd == -1)
+		return 0;
+
+	len = pread(ws->hwmFd, buf, WSTREAM_HWM_LENGTH, 0);
+	if(len != WSTREAM_HWM_LENGTH || buf[WSTREAM_HWM_LENGTH - 1] != '\n')
+		return 0;
+
+	for(i = 0; i < WSTREAM_HWM_LENGTH - 1; i++) {
+		if(buf[i] < '0' || buf[i] > '9')
+			return 0;
+	}
+
+	buf[WSTREAM_HWM_LENGTH] = 0;
+
+	return strtoull(buf, NULL, 10);
+}
+
+/**
+ * Записывает метку времени создаваемого чанка, если она новее записанной.
+ * Файл всегда одной длины и пишется одним pwrite(), так что стартующий
+ * писатель видит либо старую метку, либо новую
+ * @param ws
+ * @param timemicro
+ */
+static void WStream__saveHighWaterMark(struct WStream *ws, uint64_t timemicro) {
+	char buf[32];
+
+	if(ws->hwmFd == -1)
+		return;
+
+	/* метка уже не старше - не трогаем файл; двигаем - перепроверяем под локом */
+	if(WStream__readHighWaterMark(ws) >= timemicro)
+		return;
+
+	/* другой писатель мог успеть записать метку новее */
+	while(flock(ws->hwmFd, LOCK_EX) == -1) {
+		if(errno != EINTR)
+			error("flock('%s/" WSTREAM_HWM_FILENAME "', LOCK_EX)", ws->rootDir);
+	}
+
+	if(WStream__readHighWaterMark(ws) < timemicro) {
+		snprintf(buf, sizeof(buf), "%016" PRIu64 "\n", timemicro);
+
+		if(pwrite(ws->hwmFd, buf, WSTREAM_HWM_LENGTH, 0) != WSTREAM_HWM_LENGTH)
+			warning("unable to write '%s/" WSTREAM_HWM_FILENAME "': %s", ws->rootDir, strerror(errno));
+	}
+
+	flock(ws->hwmFd, LOCK_UN);
+}
+
+static void WStream__findLastTimemicro(struct WStream *ws) {
+	char lastBucket[BUCKET_NAME_LENGTH + 1] = "";
+	char path[PATH_MAX + 64];
+	char name[CHUNKINDEX_RECORD_SIZE];
+	uint64_t hwm = WStream__readHighWaterMark(ws);
+	uint64_t indexed = 0;
+
+	if(ChunkIndex_last(&ws->index, name) == 0) {
+		const char *base = strrchr(name, '/');
+
+		indexed = strtoull(base ? base + 1 : name, NULL, 10);
+	}
+
+	/*
+	 * метка из будущего - часы ушли назад или файл испорчен, метка старше
+	 * последнего чанка в индексе - её оставил старый pit или файл подменили.
+	 * Тогда верим только каталогу
+	 */
+	if(hwm && hwm <= timemicro() && hwm >= indexed) {
+		ws->lastChunkTimemicro = hwm;
+		debug("Last microtimestamp from '%s/" WSTREAM_HWM_FILENAME "': %" PRIu64, ws->rootDir, hwm);
+
+		return;
+	}
+
+	WStream__scanLastTimemicro(ws, ws->rootDir, lastBucket);
+
+	/* чанки в старых бакетах не новее, чем в самом новом */
+	if(lastBucket[0]) {
+		snprintf(path, sizeof(path), "%s/%s", ws->rootDir, lastBucket);
+		WStream__scanLastTimemicro(ws, path, NULL);
+	}
+
+	debug("Last microtimestamp: %" PRIu64, ws->lastChunkTimemicro);
+}
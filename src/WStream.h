@@ -5,6 +5,16 @@
 #include <stdint.h>
 #include <time.h>
 
+#include "Backlog.h"
+#include "Bucket.h"
+#include "ChunkIndex.h"
+#include "Framing.h"
+#include "ChunkPool.h"
+#include "ConsumerGroup.h"
+#include "IoRing.h"
+#include "Markers.h"
+#include "Stripe.h"
+
 /**
  * длина фиксированная, завязана на реализацию
  * генератора идентификатора в WriteableStream_init().
@@ -13,17 +23,91 @@
  */
 #define WSTREAM_LINE_MAX_LENGTH (1*1024*1024)
 
+/**
+ * буфер незаконченной записи растёт от этого размера
+ * до WStream.recordMaxLength
+ */
+#define WSTREAM_LINE_BUFFER_INITIAL_SIZE (64*1024)
+
+/**
+ * Читатели, которым нечего читать, держат F_RDLCK на первом байте
+ * этого файла, пока ждут новый чанк
+ */
+#define WSTREAM_WAITING_FILENAME ".waiting"
+
+/**
+ * Метка времени самого нового чанка потока: 16 цифр и перевод строки.
+ * Писатели обновляют её при создании чанка, а при старте берут из неё
+ * вместо сканирования каталога. Сканирование остаётся на случай,
+ * если файла нет или в нём мусор
+ */
+#define WSTREAM_HWM_FILENAME ".hwm"
+#define WSTREAM_HWM_LENGTH 17
+
+/**
+ * Адаптивный режим (-a), см. WStream_adapt(). Вызывать его нужно раз в тик
+ */
+#define WSTREAM_ADAPTIVE_TICK_MS 100
+#define WSTREAM_ADAPTIVE_MIN_CHUNK_SIZE (64 * 1024)
+/* во сколько раз чанк может вырасти при большом бэклоге */
+#define WSTREAM_ADAPTIVE_MAX_GROWTH 16
+/* сколько непрочитанных чанков считаем большим бэклогом */
+#define WSTREAM_ADAPTIVE_DEEP_BACKLOG 8
+/* максимальный возраст чанка, если -t не задан */
+#define WSTREAM_ADAPTIVE_MAX_AGE 10
+/* а пока читатели ждут - не больше этого, мс */
+#define WSTREAM_ADAPTIVE_STARVED_MAX_AGE_MS 1000
+
 struct WStream {
 	const char *rootDir;
 	int writerLockFd;
+	int hwmFd;
+
+	struct ChunkIndex index;
+	struct ChunkPool pool;
+
+	/**
+	 * группы читателей, в которые ссылками добавляются новые чанки
+	 */
+	struct ConsumerGroupList groups;
 
 	char *lineBuffer;
 	ssize_t lineBufferMaxSize;
 	ssize_t lineBufferSize;
 
+	/**
+	 * второй буфер строки для io_uring: пока один пишется, копим хвост в другом
+	 */
+	char *spareLineBuffer;
+	ssize_t spareLineBufferMaxSize;
+	uint64_t spareLineBufferSeq;
+
+	/**
+	 * как WStream_writeLines() режет поток на записи, по умолчанию строки.
+	 * framingState - разбор хвоста, который ещё не закончился
+	 */
+	struct Framing framing;
+	struct FramingState framingState;
+
+	/**
+	 * запись длиннее этого пишется в чанк кусками с запретом смены чанка
+	 */
+	ssize_t recordMaxLength;
+
+	/**
+	 * если не NULL, то запись в чанки идёт через io_uring
+	 */
+	struct IoRing *ring;
+
 	char denyChunkClose;
 	char chunkCloseScheduled;
 
+	/**
+	 * в чанк уже записано начало строки без '\n' (строка длиннее буфера),
+	 * менять чанк до конца этой строки нельзя
+	 */
+	char lineTailWritten;
+
 	/*
 	 * эти два свойства используются для уникальной идентификации потока
 	 */
@@ -49,14 +133,111 @@ struct WStream {
 	 * максимальный размер
 	 */
 	ssize_t chunkMaxSize;
+
+	/**
+	 * строк в текущем чанке, считаются только для статистики
+	 */
+	uint64_t chunkLines;
+
+	/**
+	 * выделять ли место под чанк заранее через fallocate(),
+	 * сбрасывается, если ФС этого не умеет
+	 */
+	char preallocate;
+
+	/**
+	 * как часто вставлять метки времени, мкс. 0 - не вставлять
+	 */
+	uint64_t markerInterval;
+	uint64_t lastMarkerTimemicro;
+	char marker[MARKERS_LENGTH + 1];
+	uint64_t markerSeq;
+
+	/**
+	 * поток помечен (см. MARKERS_FILENAME): строки, начинающиеся
+	 * с MARKERS_CHAR, пишутся через escapeBuffer с удвоенным символом
+	 */
+	char escapeMarkers;
+	char *escapeBuffer;
+	size_t escapeBufferSize;
+	uint64_t escapeSeq;
+
+	/**
+	 * адаптивный режим: chunkMaxSize меняется на nextChunkMaxSize
+	 * при создании следующего чанка, baseChunkSize - заданный через -s
+	 */
+	char adaptive;
+	ssize_t baseChunkSize;
+	ssize_t nextChunkMaxSize;
+
+	/**
+	 * мкс, 0 - без ограничения
+	 */
+	uint64_t maxChunkAge;
+
+	/**
+	 * сглаженная скорость записи, байт/с
+	 */
+	uint64_t ingestRate;
+	uint64_t lastAdaptTimemicro;
+	uint64_t lastAdaptBytes;
+
+	int waitingFd;
+
+	/**
+	 * ограничение бэклога, см. WStream_limitBacklog()
+	 */
+	char limitBacklog;
+	struct Backlog backlog;
+
+	/**
+	 * BACKLOG_SPILL: пока бэклог за пределом, новые чанки создаются в
+	 * отдельном потоке backlog.limits.spillDir, его лок писателя и индекс
+	 * открываются при первом переполнении
+	 */
+	char spilling;
+	int spillLockFd;
+	struct ChunkIndex spillIndex;
+
+	/**
+	 * разбивка задана через WStream_useFraming() и должна попасть и в spillDir
+	 */
+	char framingRegistered;
+
+	/**
+	 * каталоги-страйпы (абсолютные пути), см. WStream_useStripes().
+	 * Новый чанк создаётся в корне или в одном из них
+	 */
+	char (*stripes)[PATH_MAX];
+	size_t stripesCount;
+	size_t nextStripe;
+	int stripePolicy;
+
+	/**
+	 * класть чанки в бакеты по времени, см. Bucket.h
+	 */
+	char buckets;
 };
 
 void WStream_init(struct WStream *ws, const char *rootDir, ssize_t chunkSize);
 void WStream_destroy(struct WStream *ws);
+void WStream_abandon(struct WStream *ws);
 
 void WStream_scheduleCloseChunk(struct WStream *ws);
 
+void WStream_useRing(struct WStream *ws, struct IoRing *ring);
+void WStream_useFraming(struct WStream *ws, const struct Framing *framing, ssize_t recordMaxLength);
+void WStream_useMarkers(struct WStream *ws, uint64_t intervalUsec);
+void WStream_useAdaptiveChunks(struct WStream *ws, uint64_t maxChunkAgeUsec);
+void WStream_limitBacklog(struct WStream *ws, const struct BacklogLimits *limits);
+void WStream_useBuckets(struct WStream *ws);
+void WStream_useStripes(struct WStream *ws, char * const *dirs, size_t count, int policy);
+void WStream_adapt(struct WStream *ws);
+uint64_t WStream_lastWriteSeq(struct WStream *ws);
+void WStream_waitWritten(struct WStream *ws, uint64_t seq);
+
 void WStream_write(struct WStream *ws, const char *buf, ssize_t len);
+ssize_t WStream_splice(struct WStream *ws, int fd, ssize_t maxLen);
 void WStream_writeLines(struct WStream *ws, const char *buf, ssize_t len);
 void WStream_flush(struct WStream *ws);
 
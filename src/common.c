@@ -8,6 +8,15 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static __thread void (*ERROR_HOOK)(int err, const char *message) = NULL;
+
+void setErrorHook(void (*hook)(int err, const char *message)) {
+	ERROR_HOOK = hook;
+}
 
 void _buf_debug(const char *fmt, ...) {
 	va_list argp;
@@ -36,6 +45,21 @@ void warning(const char *fmt, ...) {
 void error(const char *fmt, ...) {
 	va_list argp;
 
+	if(ERROR_HOOK) {
+		char message[1024];
+		int err = errno;
+		int len;
+
+		len = snprintf(message, sizeof(message), "%s. ", strerror(err));
+
+		va_start(argp, fmt);
+		vsnprintf(message + len, sizeof(message) - (size_t)len, fmt, argp);
+		va_end(argp);
+
+		ERROR_HOOK(err, message);
+		errno = err;
+	}
+
 	fprintf(stderr, "ERROR! %s. ", strerror(errno));
 
 	va_start(argp, fmt);
@@ -71,3 +95,49 @@ char flockRangeNB(int fd, off_t start, off_t len, short int type) {
 
 	return 1;
 }
+
+int listenUnix(const char *path, int type) {
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		error("socket path '%s'", path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* сокет упавшего процесса не даст сделать bind(), а живой - удалять нельзя */
+	if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+		if(fd == -1)
+			error("socket(AF_UNIX)");
+
+		if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			close(fd);
+
+			errno = EADDRINUSE;
+			error("another process is listening on '%s'", path);
+		}
+
+		if(errno == ECONNREFUSED && unlink(path) == -1 && errno != ENOENT)
+			error("unlink('%s')", path);
+
+		close(fd);
+	}
+
+	fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd == -1)
+		error("socket(AF_UNIX)");
+
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		error("bind('%s')", path);
+
+	if(listen(fd, SOMAXCONN) == -1)
+		error("listen('%s')", path);
+
+	return fd;
+}
@@ -5,11 +5,29 @@
 #include <stdint.h>
 
 void error(const char *fmt, ...);
+
+/**
+ * Если задан hook, error() вместо выхода из процесса отдаёт ему errno
+ * и текст ошибки. hook не должен возвращаться (libpit делает longjmp()),
+ * а если вернётся - процесс всё равно завершится. NULL - как обычно.
+ * hook ставится только для вызывающего потока
+ */
+void setErrorHook(void (*hook)(int err, const char *message));
+
 void warning(const char *fmt, ...);
 void _buf_debug(const char *fmt, ...);
 uint64_t timemicro();
 char flockRangeNB(int fd, off_t start, off_t len, short int type);
 
+/**
+ * Неблокирующий слушающий unix-сокет. Оставшийся от упавшего процесса
+ * сокет удаляется, а если на path кто-то слушает - error()
+ * @param path
+ * @param type SOCK_STREAM, SOCK_SEQPACKET
+ * @return дескриптор
+ */
+int listenUnix(const char *path, int type);
+
 #ifdef DEBUG
 	#define debug(format, ...) _buf_debug(format, ##__VA_ARGS__)
 #else
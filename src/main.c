@@ -6,14 +6,53 @@
 #include "common.h"
 #include "WStream.h"
 #include "RStream.h"
+#include "IoRing.h"
+#include "ShmRing.h"
+#include "StreamStatus.h"
+#include "Stats.h"
+#include "Framing.h"
+#include "Backlog.h"
+#include "Stripe.h"
+#include "Listener.h"
+#include "Broker.h"
 
 #include <signal.h>
 #include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/**
+ * до скольки пытаемся увеличить буфер пайпа на STDOUT/STDIN
+ */
+#define READ_PIPE_SIZE (1024 * 1024)
+#define WRITE_PIPE_SIZE (1024 * 1024)
+
+/**
+ * параметры режима io_uring (-u): пока одни буферы пишутся ядром,
+ * в остальные читаем следующую порцию
+ */
+#define IO_RING_ENTRIES 64
+#define IO_RING_BUFFERS 8
+#define IO_RING_BUFFER_SIZE (256 * 1024)
 
 unsigned int ALARM_INTERVAL = 1;
 
 struct WStream WSTREAM;
 struct RStream RSTREAM;
+struct IoRing RING;
+struct ShmRing SHM_RING;
+struct Listener LISTENER;
+struct Broker BROKER;
+int SHM_RING_STOP_SIGNAL = 0;
+
+static char RING_BUFFERS[IO_RING_BUFFERS][IO_RING_BUFFER_SIZE];
+
+/**
+ * -v: выводить статистику в stderr при выходе
+ */
+char STATS_DUMP_AT_EXIT = 0;
 
 static void _alarmSignalHandler(int sig) {
 	uint64_t now = timemicro();
@@ -24,14 +63,133 @@ static void _alarmSignalHandler(int sig) {
 	alarm(ALARM_INTERVAL);
 }
 
-static void writeMode(const char *rootDir, ssize_t chunkSize, unsigned int chunkTimeout, char binaryMode) {
+static void _adaptiveSignalHandler(int sig) {
+	WStream_adapt(&WSTREAM);
+}
+
+static void _statsSignalHandler(int sig) {
+	Stats_dump(STDERR_FILENO);
+}
+
+static void _statsAtExit() {
+	if(STATS_DUMP_AT_EXIT)
+		Stats_dump(STDERR_FILENO);
+
+	Stats_unpublish();
+}
+
+static char stdinIsPipe() {
+	struct stat st;
+
+	if(fstat(STDIN_FILENO, &st) == -1 || !S_ISFIFO(st.st_mode))
+		return 0;
+
+#ifdef F_SETPIPE_SZ
+	if(fcntl(STDIN_FILENO, F_SETPIPE_SZ, WRITE_PIPE_SIZE) == -1)
+		debug("fcntl(F_SETPIPE_SZ, %d): %s", WRITE_PIPE_SIZE, strerror(errno));
+#endif
+
+	return 1;
+}
+
+static void writeModeRing(void (*writerFunc)(struct WStream *, const char *, ssize_t)) {
+	uint64_t bufferSeq[IO_RING_BUFFERS] = {0};
+	unsigned int i;
+
+	for(i = 0;; i = (i + 1) % IO_RING_BUFFERS) {
+		ssize_t wr;
+
+		WStream_waitWritten(&WSTREAM, bufferSeq[i]);
+
+		do {
+			wr = read(STDIN_FILENO, RING_BUFFERS[i], IO_RING_BUFFER_SIZE);
+		} while(wr == -1 && errno == EINTR);
+
+		if(wr == -1)
+			error("error reading stdin");
+
+		if(wr == 0)
+			break;
+
+		writerFunc(&WSTREAM, RING_BUFFERS[i], wr);
+		bufferSeq[i] = WStream_lastWriteSeq(&WSTREAM);
+	}
+}
+
+static void _listenerStopSignalHandler(int sig) {
+	LISTENER.stopRequested = 1;
+}
+
+/**
+ * Записи из соединений с unix-сокетом (-l) вместо stdin
+ * @param path
+ * @param framing
+ * @param recordMaxLength
+ */
+static void writeModeListen(const char *path, const struct Framing *framing, ssize_t recordMaxLength) {
+	struct sigaction sa;
+
+	/* без SA_RESTART, чтобы epoll_wait() прерывался сразу */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _listenerStopSignalHandler;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	Listener_init(&LISTENER, path, framing, recordMaxLength);
+	Listener_run(&LISTENER, &WSTREAM);
+	Listener_destroy(&LISTENER);
+}
+
+static void writeMode(const char *rootDir, ssize_t chunkSize, unsigned int chunkTimeout, char binaryMode, char useRing, unsigned long markerInterval, char adaptive, char buckets, const struct Framing *framing, ssize_t recordMaxLength, const struct BacklogLimits *backlog, char * const *stripes, size_t stripesCount, int stripePolicy, const char *listenPath) {
 	char buf[64 * 1024];
 	ssize_t wr;
 	void (*writerFunc)(struct WStream *, const char *, ssize_t);
 
 	debug("Write mode: '%s'. Options:", rootDir);
 
-	if(chunkTimeout) {
+	WStream_init(&WSTREAM, rootDir, chunkSize);
+
+	if(backlog) {
+		debug(
+			"\tbacklog limits: %llu bytes, %llu chunks, %llu bytes free, policy: %d",
+			(unsigned long long)backlog->maxBytes,
+			(unsigned long long)backlog->maxChunks,
+			(unsigned long long)backlog->minFreeBytes,
+			backlog->policy
+		);
+
+		WStream_limitBacklog(&WSTREAM, backlog);
+	}
+
+	if(buckets) {
+		debug("\tbuckets: enabled");
+		WStream_useBuckets(&WSTREAM);
+	}
+
+	if(stripesCount) {
+		debug("\tstripes: %lu, policy: %d", (unsigned long)stripesCount, stripePolicy);
+		WStream_useStripes(&WSTREAM, stripes, stripesCount, stripePolicy);
+	}
+
+	if(adaptive) {
+		struct itimerval tick;
+
+		debug("\tadaptive chunks: enabled, max chunk age: %u", chunkTimeout);
+		WStream_useAdaptiveChunks(&WSTREAM, (uint64_t)chunkTimeout * 1000000);
+
+		tick.it_interval.tv_sec = 0;
+		tick.it_interval.tv_usec = WSTREAM_ADAPTIVE_TICK_MS * 1000;
+		tick.it_value = tick.it_interval;
+
+		signal(SIGALRM, _adaptiveSignalHandler);
+		if(setitimer(ITIMER_REAL, &tick, NULL) == -1)
+			error("setitimer()");
+	} else if(chunkTimeout) {
 		debug("\tchunk timeout: %u", chunkTimeout);
 		ALARM_INTERVAL = chunkTimeout;
 
@@ -44,12 +202,56 @@ static void writeMode(const char *rootDir, ssize_t chunkSize, unsigned int chunk
 	debug("\tbinary mode: %s", binaryMode ? "enabled" : "disabled");
 	debug("\tchunk size: %llu", (unsigned long long)chunkSize);
 
-	WStream_init(&WSTREAM, rootDir, chunkSize);
+	if(markerInterval) {
+		debug("\tlatency markers: every %lu ms", markerInterval);
+		WStream_useMarkers(&WSTREAM, (uint64_t)markerInterval * 1000);
+	}
 
-	if(binaryMode)
+	if(binaryMode) {
 		writerFunc = WStream_write;
-	else
+	} else {
+		debug("\tframing: %d, max record length: %llu", framing->type, (unsigned long long)recordMaxLength);
+		WStream_useFraming(&WSTREAM, framing, recordMaxLength);
+
 		writerFunc = WStream_writeLines;
+	}
+
+	if(listenPath) {
+		debug("\tlisten: '%s'", listenPath);
+
+		writeModeListen(listenPath, framing, recordMaxLength);
+		WStream_flush(&WSTREAM);
+
+		return;
+	}
+
+	if(useRing) {
+		if(IoRing_init(&RING, IO_RING_ENTRIES) == 0) {
+			debug("\tio_uring: enabled");
+
+			WStream_useRing(&WSTREAM, &RING);
+			writeModeRing(writerFunc);
+			WStream_flush(&WSTREAM);
+
+			return;
+		}
+
+		warning("io_uring is not available, using synchronous I/O: %s", strerror(errno));
+	}
+
+	if(binaryMode && stdinIsPipe()) {
+		debug("\tzero-copy input: enabled");
+
+		while((wr = WStream_splice(&WSTREAM, STDIN_FILENO, WRITE_PIPE_SIZE)) > 0)
+			;
+
+		if(wr == 0) {
+			WStream_flush(&WSTREAM);
+			return;
+		}
+
+		debug("splice() from STDIN is not supported (%s), falling back to read()/write()", strerror(errno));
+	}
 
 	for(;;) {
 		wr = read(STDIN_FILENO, buf, sizeof(buf));
@@ -71,22 +273,205 @@ static void writeMode(const char *rootDir, ssize_t chunkSize, unsigned int chunk
 	WStream_flush(&WSTREAM);
 }
 
+/**
+ * Запись в кольцо в разделяемой памяти (-m)
+ * @param rootDir
+ * @param binaryMode
+ */
+static void writeModeShm(const char *rootDir, char binaryMode) {
+	static char buf[WSTREAM_LINE_MAX_LENGTH];
+	size_t bufSize = 0;
+
+	debug("Write mode: '%s' via shared ring", rootDir);
+
+	ShmRing_initWriter(&SHM_RING, rootDir);
+
+	for(;;) {
+		ssize_t rd = read(STDIN_FILENO, buf + bufSize, sizeof(buf) - bufSize);
+		char *lastLineEnd;
+		size_t toWrite;
+
+		if(rd == -1) {
+			if(errno == EINTR)
+				continue;
+
+			error("error reading stdin");
+		}
+
+		if(rd == 0)
+			break;
+
+		bufSize += (size_t)rd;
+
+		if(binaryMode) {
+			ShmRing_write(&SHM_RING, buf, bufSize, 0);
+			bufSize = 0;
+
+			continue;
+		}
+
+		/* в кольцо уходят только целые строки, хвост ждёт продолжения */
+		lastLineEnd = memrchr(buf + bufSize - rd, '\n', (size_t)rd);
+		if(!lastLineEnd) {
+			if(bufSize == sizeof(buf)) {
+				warning("line is too long, flushing with split supression '\\n'");
+
+				ShmRing_write(&SHM_RING, buf, bufSize, 1);
+				bufSize = 0;
+			}
+
+			continue;
+		}
+
+		toWrite = (size_t)(lastLineEnd - buf) + 1;
+
+		ShmRing_write(&SHM_RING, buf, toWrite, 1);
+
+		memmove(buf, buf + toWrite, bufSize - toWrite);
+		bufSize -= toWrite;
+	}
+
+	if(bufSize)
+		ShmRing_write(&SHM_RING, buf, bufSize, !binaryMode);
+
+	ShmRing_destroy(&SHM_RING);
+}
+
 static void _ioSignalHandler(int sig) {
 }
 
+static void _shmRingStopSignalHandler(int sig) {
+	SHM_RING_STOP_SIGNAL = sig;
+	SHM_RING.stopRequested = 1;
+}
+
+/**
+ * Чтение из кольца в разделяемой памяти (-m)
+ * @param rootDir
+ * @param persistentMode
+ * @param waitRootMode
+ */
+static void readModeShm(const char *rootDir, char persistentMode, char waitRootMode) {
+	struct sigaction sa;
+
+	debug("Read mode: '%s' via shared ring", rootDir);
+
+	/*
+	 * без SA_RESTART, чтобы ожидание на futex прерывалось сразу.
+	 * Запись, которую уже начали выдавать, дописывается до конца
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _shmRingStopSignalHandler;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGPIPE, &sa, NULL);
+
+	ShmRing_initReader(&SHM_RING, rootDir, persistentMode, waitRootMode);
+
+	while(ShmRing_read(&SHM_RING, STDOUT_FILENO) > 0)
+		;
+
+	ShmRing_destroy(&SHM_RING);
+
+	if(SHM_RING_STOP_SIGNAL)
+		exit(SHM_RING_STOP_SIGNAL + 128);
+}
+
 static void _rstreamDestroySignalHandler(int sig) {
 	RStream_destroy(&RSTREAM);
 
 	exit(sig + 128);
 }
 
-static void readMode(const char *rootDir, char persistentMode, char waitRootMode) {
+/**
+ * Выбирает способ, которым данные из чанков будут отдаваться в fd
+ * @param fd
+ * @return RSTREAM_TRANSFER_*
+ */
+static int detectTransferMethod(int fd) {
+	struct stat st;
+	int flags;
+
+	if(fstat(fd, &st) == -1)
+		return RSTREAM_TRANSFER_READ;
+
+	flags = fcntl(fd, F_GETFL);
+	if(flags == -1 || (flags & (O_NONBLOCK | O_APPEND)))
+		return RSTREAM_TRANSFER_READ;
+
+	if(S_ISFIFO(st.st_mode)) {
+#ifdef F_SETPIPE_SZ
+		if(fcntl(fd, F_SETPIPE_SZ, READ_PIPE_SIZE) == -1)
+			debug("fcntl(F_SETPIPE_SZ, %d): %s", READ_PIPE_SIZE, strerror(errno));
+#endif
+		return RSTREAM_TRANSFER_SPLICE;
+	}
+
+	if(S_ISSOCK(st.st_mode) || S_ISREG(st.st_mode))
+		return RSTREAM_TRANSFER_SENDFILE;
+
+	return RSTREAM_TRANSFER_READ;
+}
+
+/**
+ * Вызывается RStream перед удалением дочитанного чанка
+ * @param rs
+ */
+static void _ringFlushOutput(struct RStream *rs) {
+	IoRing_waitAll(&RING);
+	rs->unflushedBytes = 0;
+}
+
+static void readModeRing() {
+	uint64_t bufferSeq[IO_RING_BUFFERS] = {0};
+	ssize_t bufferLen[IO_RING_BUFFERS] = {0};
+	unsigned int i;
+	unsigned int j;
+
+	RSTREAM.flushOutput = _ringFlushOutput;
+
+	for(i = 0;; i = (i + 1) % IO_RING_BUFFERS) {
+		ssize_t rd;
+		ssize_t unflushed = 0;
+
+		IoRing_wait(&RING, bufferSeq[i]);
+
+		for(j = 0; j < IO_RING_BUFFERS; j++) {
+			if(bufferSeq[j] > RING.completedSeq)
+				unflushed += bufferLen[j];
+		}
+
+		RSTREAM.unflushedBytes = unflushed;
+
+		rd = RStream_read(&RSTREAM, RING_BUFFERS[i], IO_RING_BUFFER_SIZE);
+		if(rd <= 0)
+			break;
+
+		/* в оффсет идёт прочитанное из чанка, а с метками его больше, чем выдано */
+		bufferLen[i] = RSTREAM.lastReadLength;
+		bufferSeq[i] = IoRing_write(&RING, STDOUT_FILENO, RING_BUFFERS[i], (size_t)rd, -1);
+		RSTREAM.unflushedBytes += bufferLen[i];
+
+		IoRing_submit(&RING);
+	}
+
+	IoRing_waitAll(&RING);
+	RSTREAM.unflushedBytes = 0;
+}
+
+static void readMode(const char *rootDir, const char *group, char persistentMode, char waitRootMode, char useRing, char renameClaims, unsigned long latencyAlert, unsigned long checkpointBytes, unsigned long checkpointInterval) {
 	char buf[64 * 1024];
 	ssize_t rd;
+	/* из помеченного потока RStream_transfer() не выдаёт, тогда дальше через read() */
+	int method = detectTransferMethod(STDOUT_FILENO);
 
 	debug("Read mode: '%s'. Options:", rootDir);
 	debug("\tpersistent mode: %s", persistentMode ? "enabled" : "disabled");
 	debug("\twait root mode: %s", waitRootMode ? "enabled" : "disabled");
+	debug("\tconsumer group: %s", group ? group : "default");
 
 	signal(SIGIO, _ioSignalHandler);
 
@@ -95,18 +480,156 @@ static void readMode(const char *rootDir, char persistentMode, char waitRootMode
 	signal(SIGTERM, _rstreamDestroySignalHandler);
 	signal(SIGPIPE, _rstreamDestroySignalHandler);
 
-	RStream_init(&RSTREAM, rootDir, persistentMode, waitRootMode);
+	RStream_initGroup(&RSTREAM, rootDir, group, persistentMode, waitRootMode);
+
+	if(renameClaims) {
+		debug("\tclaims: by rename");
+		RStream_claimByRename(&RSTREAM);
+	}
+
+	if(latencyAlert)
+		RStream_alertLatency(&RSTREAM, (uint64_t)latencyAlert * 1000);
+
+	RStream_checkpointEvery(&RSTREAM, checkpointBytes, (uint64_t)checkpointInterval * 1000);
+	debug("\tcheckpoints: every %lu bytes or %lu ms", checkpointBytes, checkpointInterval);
+
+	if(useRing) {
+		if(IoRing_init(&RING, IO_RING_ENTRIES) == 0) {
+			debug("\tio_uring: enabled");
+
+			readModeRing();
+			return;
+		}
+
+		warning("io_uring is not available, using synchronous I/O: %s", strerror(errno));
+	}
+
+	debug("\ttransfer method: %d", method);
+
+	if(method != RSTREAM_TRANSFER_READ) {
+		while((rd = RStream_transfer(&RSTREAM, STDOUT_FILENO, READ_PIPE_SIZE, method)) > 0)
+			;
+
+		if(rd == 0)
+			return;
+
+		debug("zero-copy output is not supported (%s), falling back to read()/write()", strerror(errno));
+	}
 
 	while((rd = RStream_read(&RSTREAM, buf, sizeof(buf))) > 0) {
+		uint64_t startTime = timemicro();
+
 		if(write(STDOUT_FILENO, buf, (size_t)rd) == -1)
 			error("write(STDOUT)");
+
+		Stats_record(STATS_HIST_OUTPUT_WRITE_US, timemicro() - startTime);
+	}
+}
+
+static void _brokerStopSignalHandler(int sig) {
+	BROKER.stopRequested = 1;
+}
+
+/**
+ * Брокер (-D): раздаёт чанки rootDir читателям pit -r -D
+ * @param path
+ * @param rootDir
+ * @param group
+ * @param persistentMode
+ * @param waitRootMode
+ */
+static void brokerMode(const char *path, const char *rootDir, const char *group, char persistentMode, char waitRootMode) {
+	struct sigaction sa;
+
+	debug("Broker mode: '%s' on '%s'", rootDir, path);
+
+	/* без SA_RESTART, чтобы epoll_wait() прерывался сразу */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _brokerStopSignalHandler;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	Broker_initServer(&BROKER, path, rootDir, group, persistentMode, waitRootMode);
+	Broker_run(&BROKER);
+	Broker_destroy(&BROKER);
+}
+
+static void _brokerReaderDestroySignalHandler(int sig) {
+	Broker_destroy(&BROKER);
+
+	exit(sig + 128);
+}
+
+/**
+ * Читатель через брокер (-r -D): каталог потока ему не нужен
+ * @param path
+ */
+static void readModeBroker(const char *path) {
+	debug("Read mode via broker '%s'", path);
+
+	signal(SIGHUP, _brokerReaderDestroySignalHandler);
+	signal(SIGINT, _brokerReaderDestroySignalHandler);
+	signal(SIGTERM, _brokerReaderDestroySignalHandler);
+	signal(SIGPIPE, _brokerReaderDestroySignalHandler);
+
+	Broker_initReader(&BROKER, path);
+
+	while(Broker_read(&BROKER, STDOUT_FILENO) > 0)
+		;
+
+	Broker_destroy(&BROKER);
+}
+
+/**
+ * Состояние потока (-S). С интервалом повторяется, пока не прервут
+ * @param rootDir
+ * @param json
+ * @param interval секунд, 0 - один раз
+ * @return код выхода
+ */
+static int statusMode(const char *rootDir, char json, unsigned int interval) {
+	struct StreamStatus ss;
+	struct StreamStatusReport report;
+
+	StreamStatus_init(&ss, rootDir);
+
+	for(;;) {
+		StreamStatus_collect(&ss, &report);
+
+		if(json)
+			StreamStatus_printJson(&ss, &report, stdout);
+		else
+			StreamStatus_print(&ss, &report, stdout);
+
+		if(!interval)
+			break;
+
+		if(!json)
+			printf("\n");
+
+		fflush(stdout);
+		sleep(interval);
 	}
+
+	StreamStatus_destroy(&ss);
+
+	return report.exists ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 static void printUsage(const char *cmd) {
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "\t%s -r [-pW] /path/to/storage/dir\n", cmd);
-	fprintf(stderr, "\t%s -w [ -s chunkSize ][ -t chunkTimeout ][-b] /path/to/storage/dir\n", cmd);
+	fprintf(stderr, "\t%s -r [-pWuvXER][ -A latencyMs ][ -G group ][ -c checkpointBytes ][ -C checkpointMs ] /path/to/storage/dir\n", cmd);
+	fprintf(stderr, "\t%s -w [ -s chunkSize ][ -t chunkTimeout ][ -M markerIntervalMs ][ -f lines|nul|u32|varint | -d delimiter ][ -L recordMaxLength ][ -q maxBytes ][ -n maxChunks ][ -F minFreeBytes ][ -o block|drop | -o spill -O spillDir ][ -z rr|free ][ -l /path/to/socket ][-abuvHX] /path/to/storage/dir [ /path/to/stripe/dir ... ]\n", cmd);
+	fprintf(stderr, "\t%s -D /path/to/socket [-pWvX][ -G group ] /path/to/storage/dir\n", cmd);
+	fprintf(stderr, "\t%s -r -D /path/to/socket [-v]\n", cmd);
+	fprintf(stderr, "\t%s -m -r [-pW] /path/to/storage/dir\n", cmd);
+	fprintf(stderr, "\t%s -m -w [-b] /path/to/storage/dir\n", cmd);
+	fprintf(stderr, "\t%s -S [-j][ -i interval ] /path/to/storage/dir\n", cmd);
 	fprintf(stderr, "Additional info available at https://github.com/avz/buf/\n");
 }
 
@@ -121,15 +644,49 @@ int main(int argc, char *argv[]) {
 	char binaryMode = 0;
 	char persistentMode = 0;
 	char waitRootMode = 0;
+	char useRing = 0;
+	char shmMode = 0;
+	char statusModeEnabled = 0;
+	char jsonOutput = 0;
+	char publishStats = 0;
+	char stripMarkers = 0;
+	char renameClaims = 0;
+	char adaptive = 0;
+	char buckets = 0;
+	char framingIsSet = 0;
+	char limitBacklog = 0;
+	char backlogPolicyIsSet = 0;
+	char stripePolicyIsSet = 0;
+	int stripePolicy = STRIPE_ROUND_ROBIN;
+
+	struct Framing framing;
+	struct BacklogLimits backlog;
 
 	unsigned long chunkSize = ULONG_MAX;
+	unsigned long statusInterval = ULONG_MAX;
 	unsigned long chunkTimeout = ULONG_MAX;
+	unsigned long markerInterval = 0;
+	unsigned long latencyAlert = 0;
+	unsigned long recordMaxLength = ULONG_MAX;
+	unsigned long checkpointBytes = ULONG_MAX;
+	unsigned long checkpointInterval = ULONG_MAX;
 
 	const char *rootDir = NULL;
+	const char *group = NULL;
+	const char *listenPath = NULL;
+	const char *brokerPath = NULL;
 
 	int opt;
 
-	while((opt = getopt(argc, argv, "hbwWprs:t:")) != -1) {
+	Framing_init(&framing);
+
+	backlog.maxBytes = 0;
+	backlog.maxChunks = 0;
+	backlog.minFreeBytes = 0;
+	backlog.policy = BACKLOG_BLOCK;
+	backlog.spillDir = NULL;
+
+	while((opt = getopt(argc, argv, "hbmwWprujSvXEaHRs:t:i:M:A:f:d:L:G:c:C:q:n:F:o:O:z:l:D:")) != -1) {
 		switch(opt) {
 			case 'w':
 				writeModeEnabled = 1;
@@ -157,6 +714,130 @@ int main(int argc, char *argv[]) {
 			case 'W':
 				waitRootMode = 1;
 			break;
+			case 'u':
+				useRing = 1;
+			break;
+			case 'm':
+				shmMode = 1;
+			break;
+			case 'S':
+				statusModeEnabled = 1;
+			break;
+			case 'j':
+				jsonOutput = 1;
+			break;
+			case 'v':
+				STATS_DUMP_AT_EXIT = 1;
+			break;
+			case 'X':
+				publishStats = 1;
+			break;
+			case 'E':
+				/* метки вырезаются сами, см. Markers.h; ключ остался от старых версий */
+				stripMarkers = 1;
+			break;
+			case 'R':
+				renameClaims = 1;
+			break;
+			case 'a':
+				adaptive = 1;
+			break;
+			case 'H':
+				buckets = 1;
+			break;
+			case 'M':
+				markerInterval = strtoul(optarg, NULL, 10);
+				if(markerInterval == ULONG_MAX || markerInterval == 0 || markerInterval >= UINT_MAX)
+					error("invalid value: %s", optarg);
+			break;
+			case 'A':
+				latencyAlert = strtoul(optarg, NULL, 10);
+				if(latencyAlert == ULONG_MAX || latencyAlert == 0 || latencyAlert >= UINT_MAX)
+					error("invalid value: %s", optarg);
+			break;
+			case 'f':
+				if(framingIsSet++ || Framing_setType(&framing, optarg) == -1)
+					error("invalid value: %s", optarg);
+			break;
+			case 'd':
+				if(framingIsSet++ || Framing_setDelimiter(&framing, optarg) == -1)
+					error("invalid value: %s", optarg);
+			break;
+			case 'L':
+				recordMaxLength = strtoul(optarg, NULL, 10);
+				if(recordMaxLength == ULONG_MAX || recordMaxLength == 0 || recordMaxLength >= SSIZE_MAX)
+					error("invalid value: %s", optarg);
+			break;
+			case 'G':
+				group = optarg;
+			break;
+			case 'c':
+				checkpointBytes = strtoul(optarg, NULL, 10);
+				if(checkpointBytes == ULONG_MAX || checkpointBytes >= SSIZE_MAX)
+					error("invalid value: %s", optarg);
+			break;
+			case 'q':
+				backlog.maxBytes = strtoul(optarg, NULL, 10);
+				if(backlog.maxBytes == ULONG_MAX || backlog.maxBytes == 0)
+					error("invalid value: %s", optarg);
+
+				limitBacklog = 1;
+			break;
+			case 'n':
+				backlog.maxChunks = strtoul(optarg, NULL, 10);
+				if(backlog.maxChunks == ULONG_MAX || backlog.maxChunks == 0)
+					error("invalid value: %s", optarg);
+
+				limitBacklog = 1;
+			break;
+			case 'F':
+				backlog.minFreeBytes = strtoul(optarg, NULL, 10);
+				if(backlog.minFreeBytes == ULONG_MAX || backlog.minFreeBytes == 0)
+					error("invalid value: %s", optarg);
+
+				limitBacklog = 1;
+			break;
+			case 'o':
+				backlogPolicyIsSet = 1;
+
+				if(strcmp(optarg, "block") == 0)
+					backlog.policy = BACKLOG_BLOCK;
+				else if(strcmp(optarg, "drop") == 0)
+					backlog.policy = BACKLOG_DROP;
+				else if(strcmp(optarg, "spill") == 0)
+					backlog.policy = BACKLOG_SPILL;
+				else
+					error("invalid value: %s", optarg);
+			break;
+			case 'O':
+				backlog.spillDir = optarg;
+			break;
+			case 'z':
+				stripePolicyIsSet = 1;
+
+				if(strcmp(optarg, "rr") == 0)
+					stripePolicy = STRIPE_ROUND_ROBIN;
+				else if(strcmp(optarg, "free") == 0)
+					stripePolicy = STRIPE_MOST_FREE;
+				else
+					error("invalid value: %s", optarg);
+			break;
+			case 'l':
+				listenPath = optarg;
+			break;
+			case 'D':
+				brokerPath = optarg;
+			break;
+			case 'C':
+				checkpointInterval = strtoul(optarg, NULL, 10);
+				if(checkpointInterval == ULONG_MAX || checkpointInterval >= UINT_MAX)
+					error("invalid value: %s", optarg);
+			break;
+			case 'i':
+				statusInterval = strtoul(optarg, NULL, 10);
+				if(statusInterval == ULONG_MAX || statusInterval == 0 || statusInterval >= UINT_MAX)
+					error("invalid value: %s", optarg);
+			break;
 			case 'h':
 				printUsage(argv[0]);
 				exit(0);
@@ -167,12 +848,90 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if(statusModeEnabled) {
+		if(writeModeEnabled || readModeEnabled || optind + 1 != argc)
+			usage(argv[0]);
+
+		if(binaryMode || persistentMode || waitRootMode || useRing || shmMode || STATS_DUMP_AT_EXIT || publishStats)
+			usage(argv[0]);
+
+		if(markerInterval || stripMarkers || renameClaims || latencyAlert || adaptive || buckets)
+			usage(argv[0]);
+
+		if(framingIsSet || recordMaxLength != ULONG_MAX || group)
+			usage(argv[0]);
+
+		if(checkpointBytes != ULONG_MAX || checkpointInterval != ULONG_MAX)
+			usage(argv[0]);
+
+		if(limitBacklog || backlogPolicyIsSet || backlog.spillDir || stripePolicyIsSet || listenPath || brokerPath)
+			usage(argv[0]);
+
+		if(chunkSize != ULONG_MAX || chunkTimeout != ULONG_MAX)
+			usage(argv[0]);
+
+		return statusMode(argv[optind], jsonOutput, statusInterval == ULONG_MAX ? 0 : (unsigned int)statusInterval);
+	}
+
+	if(jsonOutput || statusInterval != ULONG_MAX)
+		usage(argv[0]);
+
+	/* каталогом владеет брокер: у его читателей ни каталога, ни своих настроек */
+	if(brokerPath) {
+		if(writeModeEnabled || binaryMode || useRing || shmMode || markerInterval || (stripMarkers && !readModeEnabled) || renameClaims || latencyAlert)
+			usage(argv[0]);
+
+		if(adaptive || buckets || framingIsSet || recordMaxLength != ULONG_MAX || chunkSize != ULONG_MAX || chunkTimeout != ULONG_MAX)
+			usage(argv[0]);
+
+		if(checkpointBytes != ULONG_MAX || checkpointInterval != ULONG_MAX)
+			usage(argv[0]);
+
+		if(limitBacklog || backlogPolicyIsSet || backlog.spillDir || stripePolicyIsSet || listenPath)
+			usage(argv[0]);
+
+		if(readModeEnabled) {
+			if(optind != argc || persistentMode || waitRootMode || group || publishStats)
+				usage(argv[0]);
+
+			signal(SIGUSR1, _statsSignalHandler);
+			atexit(_statsAtExit);
+
+			readModeBroker(brokerPath);
+
+			return EXIT_SUCCESS;
+		}
+
+		if(optind + 1 != argc)
+			usage(argv[0]);
+
+		rootDir = argv[optind];
+
+		signal(SIGUSR1, _statsSignalHandler);
+
+		if(publishStats)
+			Stats_publishTo(rootDir);
+
+		atexit(_statsAtExit);
+
+		brokerMode(brokerPath, rootDir, group, persistentMode, waitRootMode);
+
+		return EXIT_SUCCESS;
+	}
+
 	if((writeModeEnabled && readModeEnabled) || (!writeModeEnabled && !readModeEnabled))
 		usage(argv[0]);
 
 	if(optind >= argc)
 		usage(argv[0]);
 
+	/* страйпы знает только писатель: читателям хватает корня, в нём все имена */
+	if(optind + 1 < argc && (!writeModeEnabled || shmMode))
+		usage(argv[0]);
+
+	if(stripePolicyIsSet && optind + 1 == argc)
+		usage(argv[0]);
+
 	if(readModeEnabled && chunkSize != ULONG_MAX)
 		usage(argv[0]);
 
@@ -188,20 +947,95 @@ int main(int argc, char *argv[]) {
 	if(!readModeEnabled && waitRootMode)
 		usage(argv[0]);
 
+	/* метки ставятся между строками */
+	if(markerInterval && (!writeModeEnabled || binaryMode))
+		usage(argv[0]);
+
+	if(!readModeEnabled && (stripMarkers || renameClaims || latencyAlert))
+		usage(argv[0]);
+
+	if(!writeModeEnabled && adaptive)
+		usage(argv[0]);
+
+	/* читатели находят бакеты сами */
+	if(buckets && (!writeModeEnabled || shmMode))
+		usage(argv[0]);
+
+	/* кольцо в разделяемой памяти оффсетов не сохраняет */
+	if((checkpointBytes != ULONG_MAX || checkpointInterval != ULONG_MAX) && (!readModeEnabled || shmMode))
+		usage(argv[0]);
+
+	/* ограничивает бэклог писатель, кольцо в разделяемой памяти ограничено и так */
+	if((limitBacklog || backlogPolicyIsSet || backlog.spillDir) && (!writeModeEnabled || shmMode))
+		usage(argv[0]);
+
+	/* политика без ограничений бессмысленна, а спилить есть куда только с -O */
+	if(backlogPolicyIsSet && !limitBacklog)
+		usage(argv[0]);
+
+	if((backlog.policy == BACKLOG_SPILL) != (backlog.spillDir != NULL))
+		usage(argv[0]);
+
+	/* писатель раздаёт чанки во все группы сам */
+	if(group && (!readModeEnabled || shmMode))
+		usage(argv[0]);
+
+	/* в бинарном режиме записей нет, читатели берут разбивку из потока */
+	if((framingIsSet || recordMaxLength != ULONG_MAX) && (!writeModeEnabled || binaryMode || shmMode))
+		usage(argv[0]);
+
+	if(markerInterval && framing.type != FRAMING_LINES)
+		usage(argv[0]);
+
+	/* записи разных соединений делят чанки, а в бинарном режиме записей нет */
+	if(listenPath && (!writeModeEnabled || binaryMode || useRing || shmMode))
+		usage(argv[0]);
+
+	if(shmMode && (useRing || chunkSize != ULONG_MAX || chunkTimeout != ULONG_MAX))
+		usage(argv[0]);
+
+	/* у кольца в разделяемой памяти своя механика: ни счётчиков, ни меток */
+	if(shmMode && (adaptive || STATS_DUMP_AT_EXIT || publishStats || markerInterval || stripMarkers || renameClaims || latencyAlert))
+		usage(argv[0]);
+
 	/* defaults */
 
 	if(chunkSize == ULONG_MAX)
 		chunkSize = 1 * 1024 * 1024;
 
+	if(recordMaxLength == ULONG_MAX)
+		recordMaxLength = WSTREAM_LINE_MAX_LENGTH;
+
+	if(checkpointBytes == ULONG_MAX)
+		checkpointBytes = RSTREAM_CHECKPOINT_BYTES;
+
+	if(checkpointInterval == ULONG_MAX)
+		checkpointInterval = RSTREAM_CHECKPOINT_INTERVAL_MS;
+
+	/* в адаптивном режиме это только верхний предел, обычно чанки режут читатели */
 	if(chunkTimeout == ULONG_MAX)
-		chunkTimeout = 1;
+		chunkTimeout = adaptive ? WSTREAM_ADAPTIVE_MAX_AGE : 1;
 
 	rootDir = argv[optind];
 
-	if(writeModeEnabled)
-		writeMode(rootDir, (ssize_t)chunkSize, (unsigned int)chunkTimeout, binaryMode);
+	if(!shmMode) {
+		signal(SIGUSR1, _statsSignalHandler);
+
+		if(publishStats)
+			Stats_publishTo(rootDir);
+
+		STATS.countLines = STATS_DUMP_AT_EXIT || publishStats;
+		atexit(_statsAtExit);
+	}
+
+	if(shmMode && writeModeEnabled)
+		writeModeShm(rootDir, binaryMode);
+	else if(shmMode && readModeEnabled)
+		readModeShm(rootDir, persistentMode, waitRootMode);
+	else if(writeModeEnabled)
+		writeMode(rootDir, (ssize_t)chunkSize, (unsigned int)chunkTimeout, binaryMode, useRing, markerInterval, adaptive, buckets, &framing, (ssize_t)recordMaxLength, limitBacklog ? &backlog : NULL, argv + optind + 1, (size_t)(argc - optind - 1), stripePolicy, listenPath);
 	else if(readModeEnabled)
-		readMode(rootDir, persistentMode, waitRootMode);
+		readMode(rootDir, group, persistentMode, waitRootMode, useRing, renameClaims, latencyAlert, checkpointBytes, checkpointInterval);
 
 	return EXIT_SUCCESS;
 }
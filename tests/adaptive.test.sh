@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# -a: без ждущих читателей чанк живёт дольше секунды, с ждущими - режется
+
+root=/tmp/___adaptiveTest
+err=/tmp/___adaptiveTest.err
+
+rm -rf "$root" "$err"
+
+fail=0
+
+(echo 1; sleep 1.6; echo 2; sleep 0.5; echo 3) | $CMD -a -v -w "$root" 2> "$err" &
+
+sleep 1.3
+
+# с -t 1 чанк был бы уже закрыт
+if ! $CMD -S -j "$root" | grep -q '"chunks_writing":1'; then
+	echo "chunk must not be closed by timer"
+	$CMD -S -j "$root"
+	fail=1
+fi
+
+# первый читатель держит чанк, который пишется, второй ждёт
+$CMD -r "$root" > "$root.out1" &
+sleep 0.3
+$CMD -r "$root" > "$root.out2" &
+
+wait
+
+if [ "$(cat "$root.out1" "$root.out2" | sort | tr -d '\n')" != "123" ]; then
+	echo "data lost"
+	fail=1
+fi
+
+if ! grep -q '^rotations_timer 1$' "$err" || ! grep -q '^chunks_created 2$' "$err"; then
+	echo "chunk must be closed for waiting reader"
+	cat "$err"
+	fail=1
+fi
+
+rm -f "$root.out1" "$root.out2" "$err"
+
+exit "$fail"
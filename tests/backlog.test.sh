@@ -0,0 +1,72 @@
+#!/bin/sh
+
+# -n/-o: писатель не даёт бэклогу расти - ждёт, удаляет старое или пишет в другой поток
+
+root=/tmp/___backlogTest
+spill=/tmp/___backlogTest.spill
+
+rm -rf "$root" "$spill"
+
+fail=0
+
+hash=$(seq 1 100000 | $MD5)
+
+countChunks() {
+	ls "$1" | grep -c '\.chunk$'
+}
+
+# block: без читателей писатель встаёт
+seq 1 100000 | $CMD -s 10000 -n 3 -w "$root" &
+writer=$!
+
+sleep 0.5
+
+if [ "$(countChunks "$root")" -gt 3 ]; then
+	echo "block: backlog exceeds the limit"
+	fail=1
+fi
+
+if ! kill -0 "$writer" 2> /dev/null; then
+	echo "block: writer is not blocked"
+	fail=1
+fi
+
+if [ "$($CMD -r "$root" | $MD5)" != "$hash" ]; then
+	echo "block: data corrupted"
+	fail=1
+fi
+
+wait "$writer"
+
+# drop: остаётся непрерывный хвост потока
+seq 1 100000 | $CMD -s 10000 -n 3 -o drop -w "$root" 2> /dev/null
+
+if [ "$(countChunks "$root")" -gt 3 ]; then
+	echo "drop: backlog exceeds the limit"
+	fail=1
+fi
+
+if [ "$($CMD -r "$root" | awk 'NR == 1 { first = $1 } $1 != first + NR - 1 { bad = 1 } END { print bad ? "gap" : $1 }')" != 100000 ]; then
+	echo "drop: stream tail is corrupted"
+	fail=1
+fi
+
+# spill: не влезшее в бэклог - в отдельном потоке
+seq 1 100000 | $CMD -s 10000 -n 3 -o spill -O "$spill" -w "$root"
+
+if [ "$(countChunks "$root")" -gt 3 ] || [ "$(countChunks "$spill")" = 0 ]; then
+	echo "spill: chunks are not spilled"
+	fail=1
+fi
+
+if [ "$({ $CMD -r "$root"; $CMD -r "$spill"; } | sort -n | $MD5)" != "$hash" ]; then
+	echo "spill: data corrupted"
+	fail=1
+fi
+
+if [ -e "$root" ] || [ -e "$spill" ]; then
+	echo "streams must be removed"
+	fail=1
+fi
+
+exit "$fail"
@@ -0,0 +1,65 @@
+#!/bin/sh
+
+# -D: каталогом владеет брокер, читатели получают чанки через unix-сокет
+
+root=/tmp/___brokerTest
+sock=/tmp/___brokerTest.sock
+fifo=/tmp/___brokerTest.fifo
+
+rm -rf "$root" "$sock" "$fifo" "$root".out.*
+
+fail=0
+
+seq 1 200000 | $CMD -s 100000 -w "$root"
+
+$CMD -D "$sock" "$root" &
+pid=$!
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ -S "$sock" ] && break
+	sleep 0.1
+done
+
+# читатель застревает на полном пайпе посреди чанка и умирает:
+# чанк должен достаться другим с сохранённого места
+mkfifo "$fifo"
+(exec 3<"$fifo"; sleep 2) &
+blocker=$!
+
+$CMD -r -D "$sock" > "$fifo" &
+victim=$!
+
+sleep 0.5
+kill -9 $victim
+wait $victim 2>/dev/null
+kill $blocker
+wait $blocker 2>/dev/null
+
+readers=""
+
+for i in 1 2 3 4; do
+	$CMD -r -D "$sock" > "$root.out.$i" &
+	readers="$readers $!"
+done
+
+wait $readers
+wait $pid
+
+if [ -e "$sock" ]; then
+	echo "socket must be removed"
+	fail=1
+fi
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+if [ "$(cat "$root".out.* | sort -n | uniq | $MD5)" != "$(seq 1 200000 | $MD5)" ]; then
+	echo "data lost"
+	fail=1
+fi
+
+rm -rf "$root" "$sock" "$fifo" "$root".out.*
+
+exit "$fail"
@@ -0,0 +1,58 @@
+#!/bin/sh
+
+# -H: чанки в бакетах по времени, читатели находят их сами
+
+root=/tmp/___bucketsTest
+
+rm -rf "$root"
+mkdir "$root"
+
+fail=0
+
+# регистрируем группу, чтобы проверить ссылки на чанки в бакетах
+$CMD -r -p -G second "$root" > /dev/null &
+sleep 0.3
+kill $!
+wait
+
+seq 1 100000 | $CMD -s 10000 -H -w "$root"
+
+if [ -n "$(find "$root" -maxdepth 1 -name '*.chunk')" ]; then
+	echo "chunks must not be in stream root"
+	fail=1
+fi
+
+chunks=$(find "$root" -mindepth 2 -maxdepth 2 -path "$root/[0-9]*/*.chunk" | wc -l)
+if [ "$chunks" -lt 2 ]; then
+	echo "no chunks in buckets"
+	fail=1
+fi
+
+if [ "$(find "$root/.groups/second" -mindepth 2 -name '*.chunk' | wc -l)" != "$chunks" ]; then
+	echo "chunks are not shared with group"
+	fail=1
+fi
+
+if [ "$($CMD -S -j "$root" | grep -o '"chunks": *[0-9]*' | grep -o '[0-9]*$')" != "$chunks" ]; then
+	echo "status does not see chunks in buckets"
+	fail=1
+fi
+
+hash=$(seq 1 100000 | $MD5)
+
+if [ "$($CMD -r "$root" | $MD5)" != "$hash" ]; then
+	echo "default group: data corrupted"
+	fail=1
+fi
+
+if [ "$($CMD -r -G second "$root" | $MD5)" != "$hash" ]; then
+	echo "group: data corrupted"
+	fail=1
+fi
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+exit "$fail"
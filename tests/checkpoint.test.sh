@@ -0,0 +1,59 @@
+#!/bin/sh
+
+# -c: упавший читатель оставляет оффсет по границе строки не дальше выданного
+
+root=/tmp/___checkpointTest
+fifo=/tmp/___checkpointTest.fifo
+
+rm -rf "$root" "$fifo" "$root.out1" "$root.out2"
+mkfifo "$fifo"
+
+fail=0
+
+# писатель держит чанк открытым, чтобы читатель не разбил его на сегменты
+{ seq 1 1000000; sleep 2; } | $CMD -s 100000000 -t 100 -w "$root" &
+writer=$!
+sleep 0.3
+
+# получатель не успевает, и читатель ждёт на записи в пайп
+{ sleep 1.5; cat; } < "$fifo" > "$root.out1" &
+consumer=$!
+
+$CMD -r -c 10000 "$root" > "$fifo" &
+reader=$!
+
+sleep 0.5
+kill -9 "$reader"
+wait "$consumer"
+wait "$writer"
+
+offset=$(cat "$root"/*.chunk.offset 2> /dev/null)
+offset=$(expr "$offset" + 0)
+delivered=$(wc -c < "$root.out1")
+
+if [ "$offset" -le 0 ] || [ "$offset" -gt "$delivered" ]; then
+	echo "offset $offset is not within delivered $delivered bytes"
+	fail=1
+elif [ "$(head -c "$offset" "$root.out1" | tail -c 1 | od -An -c | tr -d ' ')" != '\n' ]; then
+	echo "offset $offset is not line-aligned"
+	fail=1
+elif [ $((delivered - offset)) -gt 1200000 ]; then
+	echo "too much data to replay: $((delivered - offset)) bytes"
+	fail=1
+fi
+
+$CMD -r "$root" > "$root.out2"
+
+if [ "$({ head -c "$offset" "$root.out1"; cat "$root.out2"; } | $MD5)" != "$(seq 1 1000000 | $MD5)" ]; then
+	echo "data corrupted"
+	fail=1
+fi
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+rm -f "$fifo" "$root.out1" "$root.out2"
+
+exit "$fail"
@@ -0,0 +1,47 @@
+#!/bin/sh
+
+# дочитанные чанки уходят в пул и забираются из него писателем
+
+root=/tmp/___chunkPoolTest
+tmp=/tmp/___chunkPoolTest.tmp
+
+rm -rf "$root" "$tmp"
+mkdir "$tmp"
+
+fail=0
+
+seq 1 2000 > "$tmp/payload"
+split -l 1000 "$tmp/payload" "$tmp/part."
+
+(cat "$tmp/part.aa"; sleep 1; cat "$tmp/part.ab") | $CMD -s 500 -w "$root" &
+
+sleep 0.2
+
+$CMD -r "$root" > "$tmp/out" &
+
+# первая половина прочитана, писатель ждёт
+sleep 0.6
+
+pooled=$(ls "$root/.pool" | wc -l | awk '{print $1}')
+if [ "$pooled" = "0" ]; then
+	echo "no chunks in pool"
+	ls -a "$root"
+	fail=1
+fi
+
+wait
+
+if [ -e "$root" ]; then
+	echo "stream is not removed"
+	ls -aR "$root"
+	fail=1
+fi
+
+if ! cmp -s "$tmp/out" "$tmp/payload"; then
+	echo "payload mismatch"
+	fail=1
+fi
+
+rm -rf "$tmp"
+
+exit "$fail"
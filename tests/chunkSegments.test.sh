@@ -0,0 +1,48 @@
+#!/bin/sh
+
+# большой дописанный чанк читают сразу несколько читателей по сегментам
+
+root=/tmp/___segmentsTest
+tmp=/tmp/___segmentsTest.tmp
+
+rm -rf "$root" "$tmp"
+mkdir "$tmp"
+
+fail=0
+
+seq 1 3000000 > "$tmp/payload" # ~20MiB
+
+$CMD -t 1000 -s 100000000 -w "$root" < "$tmp/payload"
+
+for i in 1 2 3 4; do
+	$CMD -r "$root" > "$tmp/out.$i" &
+done
+
+wait
+
+if [ -e "$root" ]; then
+	echo "stream is not fully read"
+	ls -a "$root"
+	fail=1
+fi
+
+if ! sort -n "$tmp"/out.* | cmp -s - "$tmp/payload"; then
+	echo "payload mismatch"
+	fail=1
+fi
+
+busyReaders=0
+for i in 1 2 3 4; do
+	if [ -s "$tmp/out.$i" ]; then
+		busyReaders=$(($busyReaders + 1))
+	fi
+done
+
+if [ "$busyReaders" -lt 2 ]; then
+	echo "only $busyReaders reader(s) got data"
+	fail=1
+fi
+
+rm -rf "$tmp"
+
+exit "$fail"
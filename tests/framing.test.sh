@@ -0,0 +1,73 @@
+#!/bin/sh
+
+# -f/-d: записи не разрываются между чанками при любой разбивке
+
+root=/tmp/___framingTest
+
+rm -rf "$root"
+
+fail=0
+
+# каждый чанк должен заканчиваться на $1
+checkChunksEndWith() {
+	for chunk in "$root"/*.chunk; do
+		if [ "$(tail -c ${#1} "$chunk" | od -An -c | tr -d ' ')" != "$2" ]; then
+			echo "$3: record is split in $chunk"
+			fail=1
+			return
+		fi
+	done
+}
+
+seq 1 3000 | tr '\n' '\0' | $CMD -s 100 -f nul -w "$root"
+
+checkChunksEndWith x '\0' nul
+
+if [ "$($CMD -r "$root" | $MD5)" != "$(seq 1 3000 | tr '\n' '\0' | $MD5)" ]; then
+	echo "nul: data corrupted"
+	fail=1
+fi
+
+seq 1 3000 | awk '{ printf "%s<>", $0 }' | $CMD -s 100 -d '<>' -w "$root"
+
+checkChunksEndWith xx '<>' delimiter
+
+if [ "$($CMD -r "$root" | $MD5)" != "$(seq 1 3000 | awk '{ printf "%s<>", $0 }' | $MD5)" ]; then
+	echo "delimiter: data corrupted"
+	fail=1
+fi
+
+# записи по 14 байт: 4 байта длины и 10 цифр
+u32() {
+	for i in $(seq 1 500); do
+		printf '\000\000\000\012%010d' "$i"
+	done
+}
+
+u32 | $CMD -s 100 -f u32 -w "$root"
+
+for chunk in "$root"/*.chunk; do
+	if [ $(($(wc -c < "$chunk") % 14)) != 0 ]; then
+		echo "u32: record is split in $chunk"
+		fail=1
+		break
+	fi
+done
+
+# другая разбивка в том же потоке
+if echo 1 | $CMD -w "$root" 2> /dev/null; then
+	echo "framing mismatch is not detected"
+	fail=1
+fi
+
+if [ "$($CMD -r "$root" | $MD5)" != "$(u32 | $MD5)" ]; then
+	echo "u32: data corrupted"
+	fail=1
+fi
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+exit "$fail"
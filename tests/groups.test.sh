@@ -0,0 +1,85 @@
+#!/bin/sh
+
+# -G: каждая группа читает поток целиком, чанки на диске общие
+
+root=/tmp/___groupsTest
+
+rm -rf "$root"
+mkdir "$root"
+
+fail=0
+
+# регистрируем группу: читатель с -p сам не выходит
+$CMD -r -p -G second "$root" > /dev/null &
+sleep 0.3
+kill $!
+wait
+
+seq 1 100000 | $CMD -s 10000 -w "$root"
+
+for chunk in "$root"/*.chunk; do
+	if [ "$(stat -c %h "$chunk")" != 2 ] || [ ! "$root/.groups/second/${chunk##*/}" -ef "$chunk" ]; then
+		echo "chunk $chunk is not shared with group"
+		fail=1
+		break
+	fi
+done
+
+hash=$(seq 1 100000 | $MD5)
+
+if [ "$($CMD -r "$root" | $MD5)" != "$hash" ]; then
+	echo "default group: data corrupted"
+	fail=1
+fi
+
+if [ ! -d "$root" ]; then
+	echo "stream must not be removed while group is reading"
+	fail=1
+fi
+
+$CMD -r -G second "$root" > "$root.out1" &
+$CMD -r -G second "$root" > "$root.out2" &
+wait
+
+if [ "$(sort -n "$root.out1" "$root.out2" | $MD5)" != "$hash" ]; then
+	echo "group: data corrupted"
+	fail=1
+fi
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+# читатели корня с -R переименовывают чанк сразу, как он появился: в группу он должен попасть раньше
+mkdir "$root"
+
+$CMD -r -p -G second "$root" > /dev/null &
+sleep 0.3
+kill $!
+wait
+
+readers=""
+
+for i in 1 2 3 4; do
+	$CMD -r -R -W "$root" > "$root.out.$i" &
+	readers="$readers $!"
+done
+
+seq 1 200000 | $CMD -s 2000 -w "$root"
+wait $readers
+
+if [ "$(cat "$root".out.* | sort -n | $MD5)" != "$(seq 1 200000 | $MD5)" ]; then
+	echo "-R readers: data corrupted"
+	fail=1
+fi
+
+if [ "$($CMD -r -G second "$root" | $MD5)" != "$(seq 1 200000 | $MD5)" ]; then
+	echo "group lost chunks claimed by -R readers"
+	fail=1
+fi
+
+rm -f "$root.out1" "$root.out2" "$root".out.*
+rm -rf "$root"
+
+exit "$fail"
@@ -0,0 +1,54 @@
+#!/bin/sh
+
+# .hwm: метка самого нового чанка, писатель берёт её при старте вместо сканирования
+
+root=/tmp/___hwmTest
+
+rm -rf "$root"
+
+fail=0
+
+seq 1 50000 | $CMD -s 10000 -w "$root"
+
+last=$(ls "$root" | grep '\.chunk$' | sort | tail -n 1 | cut -c1-16)
+
+if [ "$(cat "$root/.hwm")" != "$last" ]; then
+	echo "high-water mark does not match last chunk"
+	fail=1
+fi
+
+# битая метка: писатель должен пересканировать каталог
+echo garbage > "$root/.hwm"
+
+seq 50001 100000 | $CMD -s 10000 -w "$root"
+
+last=$(ls "$root" | grep '\.chunk$' | sort | tail -n 1 | cut -c1-16)
+
+if [ "$(cat "$root/.hwm")" != "$last" ]; then
+	echo "high-water mark is not restored"
+	fail=1
+fi
+
+# метка старше последнего чанка в индексе: тоже пересканировать
+echo 0000000000000001 > "$root/.hwm"
+
+seq 100001 150000 | $CMD -s 10000 -w "$root"
+
+last=$(ls "$root" | grep '\.chunk$' | sort | tail -n 1 | cut -c1-16)
+
+if [ "$(cat "$root/.hwm")" != "$last" ]; then
+	echo "stale high-water mark is not replaced"
+	fail=1
+fi
+
+if [ "$($CMD -r "$root" | $MD5)" != "$(seq 1 150000 | $MD5)" ]; then
+	echo "data corrupted"
+	fail=1
+fi
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+exit "$fail"
@@ -0,0 +1,27 @@
+#!/bin/sh
+
+# запись и чтение через io_uring (-u) не должны терять и переставлять данные
+
+root=/tmp/___ioUringTest
+
+rm -rf "$root"
+
+payload=$(seq 1 200000)
+
+echo "$payload" | $CMD -u -s 100000 -w "$root"
+echo "$payload" | $CMD -u -b -s 77777 -w "$root"
+
+readedPayload=$($CMD -u -r "$root")
+retCode=$?
+
+if [ "$retCode" != "0" ]; then
+	echo 'unable to read stream'
+	exit $retCode
+fi
+
+if [ "$payload
+$payload" != "$readedPayload" ]; then
+	echo "payload mismatch"
+
+	exit 1
+fi
@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# -M/-E: метки времени между строками вырезаются читателем и дают задержку
+
+root=/tmp/___latencyTest
+err=/tmp/___latencyTest.err
+
+rm -rf "$root" "$err"
+
+fail=0
+
+(seq 1 1000; sleep 0.3; seq 1001 2000) | $CMD -M 100 -w "$root"
+
+if ! cat "$root"/*.chunk | grep -q "$(printf '^\036[0-9]\{16\}$')"; then
+	echo "no markers in chunks"
+	fail=1
+fi
+
+# читатель приходит через ~0.5с после первой записи
+sleep 0.2
+
+hash=$($CMD -r -E -v -A 100 "$root" 2> "$err" | $MD5)
+
+if [ "$hash" != "$(seq 1 2000 | $MD5)" ]; then
+	echo "markers are not stripped"
+	fail=1
+fi
+
+if ! grep -q '^record_latency_us count=2 ' "$err"; then
+	echo "record latency is not recorded"
+	cat "$err"
+	fail=1
+fi
+
+if ! grep -q '^WARN .* latency [0-9]* ms exceeds 100 ms' "$err"; then
+	echo "latency alert not fired"
+	cat "$err"
+	fail=1
+fi
+
+rm -f "$err"
+
+exit "$fail"
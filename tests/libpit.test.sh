@@ -0,0 +1,214 @@
+#!/bin/sh
+
+# libpit: писатель и читатель внутри процесса, читатель отдаёт записи пачками из mmap()
+
+root=/tmp/___libpitTest
+prog=/tmp/___libpitTest.bin
+
+rm -rf "$root" "$prog"
+
+fail=0
+
+make -s libpit.a > /dev/null || exit 1
+
+# w - stdin в поток кусками по 1000 байт, записи режутся между кусками;
+# r - поток в stdout пачками через writev()
+cat > "$prog.c" <<'SRC'
+#include <dirent.h>
+#include <error.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "Pit.h"
+
+static int openFds(void) {
+	DIR *d = opendir("/proc/self/fd");
+	int n = 0;
+
+	while(d && readdir(d))
+		n++;
+
+	if(d)
+		closedir(d);
+
+	return n;
+}
+
+int main(int argc, char **argv) {
+	char buf[1000];
+	ssize_t rd;
+
+	if(argv[1][0] == 'w') {
+		struct PitWriter *w = PitWriter_open(argv[2], 10000);
+
+		if(!w)
+			return 1;
+
+		while((rd = read(0, buf, sizeof(buf))) > 0) {
+			if(PitWriter_write(w, buf, (size_t)rd) == -1)
+				return 1;
+		}
+
+		return PitWriter_close(w) == -1;
+	}
+
+	if(argv[1][0] == 'r') {
+		struct PitReader *r = PitReader_open(argv[2], NULL, 0);
+		struct PitBatch b;
+		int ret;
+
+		if(!r)
+			return 1;
+
+		while((ret = PitReader_next(r, &b, 4096)) > 0) {
+			/* пачка - только целые строки */
+			if(((char *)b.iov[b.iovcnt - 1].iov_base)[b.iov[b.iovcnt - 1].iov_len - 1] != '\n')
+				return 2;
+
+			if(writev(1, b.iov, b.iovcnt) != (ssize_t)b.length)
+				return 1;
+		}
+
+		return PitReader_close(r) == -1 || ret == -1;
+	}
+
+	/* b - после ошибки посреди чтения close() отпускает дескрипторы и локи */
+	if(argv[1][0] == 'b') {
+		int fds = openFds();
+		struct PitReader *r = PitReader_open(argv[2], argc > 3 ? argv[3] : NULL, 0);
+		struct PitBatch b;
+		int ret;
+
+		if(!r)
+			return 1;
+
+		while((ret = PitReader_next(r, &b, 4096)) > 0)
+			;
+
+		if(ret != -1)
+			return 1;
+
+		PitReader_close(r);
+
+		if(openFds() != fds)
+			return 3;
+
+		printf("closed\n");
+
+		return 0;
+	}
+
+	/* g - внутренности libpit не подменяют одноимённые функции программы */
+	if(argv[1][0] == 'g') {
+		error(0, 0, "hello %d", 42);
+		printf("returned\n");
+
+		return 0;
+	}
+
+	/* e - ошибка возвращается, а не завершает процесс */
+	if(PitReader_open("/dev/null/stream", NULL, 0) || !*Pit_lastError())
+		return 1;
+
+	printf("alive\n");
+
+	return 0;
+}
+SRC
+
+if ! cc -D_GNU_SOURCE -Isrc "$prog.c" libpit.a -o "$prog"; then
+	echo "unable to build program with libpit.a"
+	exit 1
+fi
+
+hash=$(seq 1 100000 | $MD5)
+
+seq 1 100000 | "$prog" w "$root"
+
+if [ "$(ls "$root" | grep -c '\.chunk$')" -lt 2 ]; then
+	echo "writer must rotate chunks"
+	fail=1
+fi
+
+if [ "$("$prog" r "$root" | $MD5)" != "$hash" ]; then
+	echo "library reader: data corrupted"
+	fail=1
+fi
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+# поток от pit -w, одновременно с писателем
+seq 1 100000 | $CMD -s 20000 -w "$root" &
+sleep 0.1
+
+if [ "$("$prog" r "$root" | $MD5)" != "$hash" ]; then
+	echo "library reader of live stream: data corrupted"
+	fail=1
+fi
+
+wait
+
+# поток pit -w -M: метки из пачек вырезаются
+(seq 1 50000; sleep 0.3; seq 50001 100000) | $CMD -M 100 -s 20000 -w "$root"
+
+if [ "$("$prog" r "$root" | $MD5)" != "$hash" ]; then
+	echo "library reader: markers are not stripped"
+	fail=1
+fi
+
+# каталог вместо файла сегментов: читатель ломается на первом же чанке
+seq 1 1000 | $CMD -w "$root"
+mkdir "$root/$(ls "$root" | grep '\.chunk$' | head -n 1).segments"
+
+if [ "$("$prog" b "$root" 2> /dev/null)" != "closed" ]; then
+	echo "broken reader must release its descriptors"
+	fail=1
+fi
+
+rmdir "$root"/*.segments
+
+if [ "$($CMD -r "$root" | $MD5)" != "$(seq 1 1000 | $MD5)" ]; then
+	echo "data lost after broken reader"
+	fail=1
+fi
+
+# файл с именем бакета: группа дочитывает, и проверка корня на чанки падает на нём,
+# уже открыв корень. Открытый на стеке каталог тоже должен закрыться
+mkdir "$root"
+$CMD -r -p -G g "$root" > /dev/null &
+sleep 0.3
+kill $!
+wait $!
+seq 1 1000 | $CMD -w "$root"
+$CMD -r "$root" > /dev/null
+touch "$root/12345678"
+
+if [ "$("$prog" b "$root" g 2> /dev/null)" != "closed" ]; then
+	echo "broken group reader must release its descriptors"
+	fail=1
+fi
+
+rm -rf "$root"
+
+if [ "$("$prog" g 2> /dev/null)" != "returned" ]; then
+	echo "libpit.a must not override error(3) of the program"
+	fail=1
+fi
+
+if nm -g --defined-only libpit.a | awk 'NF == 3 && $3 !~ /^Pit/ { found = 1; print "exported internal symbol: " $3 } END { exit !found }'; then
+	fail=1
+fi
+
+if [ "$("$prog" e 2> /dev/null)" != "alive" ]; then
+	echo "error must be returned to the caller"
+	fail=1
+fi
+
+rm -rf "$root" "$prog" "$prog.c"
+
+exit "$fail"
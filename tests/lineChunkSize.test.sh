@@ -0,0 +1,114 @@
+#!/bin/sh
+
+# в построчном режиме чанк режется по '\n' и не больше -s (если строка влезает)
+
+root=/tmp/___lineChunkTest
+
+rm -rf "$root"
+
+fail=0
+
+payload=$(seq 100000 100999; echo 0123456789012345678901234567890123456789; seq 1 10)
+
+echo "$payload" | $CMD -t 100 -s 35 -w "$root"
+
+for chunk in "$root"/*.chunk; do
+	size=$(wc -c < "$chunk" | awk '{print $1}')
+	lastChar=$(tail -c 1 "$chunk" | od -An -c | tr -d ' ')
+
+	if [ "$lastChar" != '\n' ]; then
+		echo "chunk $chunk is not line-aligned"
+		fail=1
+	fi
+
+	if [ "$size" -gt 35 ] && [ "$(wc -l < "$chunk" | awk '{print $1}')" != "1" ]; then
+		echo "chunk $chunk is too big: $size bytes"
+		fail=1
+	fi
+done
+
+numChunks=$(ls "$root" | wc -l | awk '{print $1}')
+if [ "$numChunks" -lt 200 ]; then
+	echo "too few chunks: $numChunks"
+	fail=1
+fi
+
+readedPayload=$($CMD -r "$root")
+
+if [ "$payload" != "$readedPayload" ]; then
+	echo "payload mismatch"
+	fail=1
+fi
+
+# предел посреди строки: чанк кончается последним '\n', который влезает в -s,
+# следующая строка начинает новый чанк, а строка длиннее -s лежит в своём чанке целиком
+
+rm -rf "$root"
+
+payload=$(seq 1 3000; echo 0123456789012345678901234567890123456789; seq 3001 3500)
+
+echo "$payload" | $CMD -t 100 -s 40 -w "$root"
+
+prevSize=""
+
+for chunk in "$root"/*.chunk; do
+	size=$(wc -c < "$chunk" | awk '{print $1}')
+	lines=$(wc -l < "$chunk" | awk '{print $1}')
+	firstLine=$(head -n 1 "$chunk" | wc -c | awk '{print $1}')
+	lastChar=$(tail -c 1 "$chunk" | od -An -c | tr -d ' ')
+
+	if [ "$lastChar" != '\n' ]; then
+		echo "chunk $chunk is not line-aligned"
+		fail=1
+	fi
+
+	if [ "$size" -gt 40 ] && [ "$lines" != "1" ]; then
+		echo "chunk $chunk is too big: $size bytes"
+		fail=1
+	fi
+
+	if [ -n "$prevSize" ] && [ $((prevSize + firstLine)) -le 40 ]; then
+		echo "chunk before $chunk is cut too early: $prevSize bytes, next line $firstLine bytes"
+		fail=1
+	fi
+
+	prevSize=$size
+done
+
+if [ "$(ls "$root" | grep -c '\.chunk$')" -lt 300 ]; then
+	echo "too few chunks with -s 40"
+	fail=1
+fi
+
+if [ "$payload" != "$($CMD -r "$root")" ]; then
+	echo "payload mismatch with -s 40"
+	fail=1
+fi
+
+# строки приходят разрезанными между read(): собранная из буфера строка тоже не должна переполнять чанк
+
+rm -rf "$root"
+
+for i in $(seq 1000000001 1000000030); do
+	printf '%s' "${i%?????}"
+	sleep 0.02
+	printf '%s\n' "${i#?????}"
+done | $CMD -t 100 -s 40 -w "$root"
+
+for chunk in "$root"/*.chunk; do
+	size=$(wc -c < "$chunk" | awk '{print $1}')
+
+	if [ "$size" -gt 40 ]; then
+		echo "chunk $chunk is too big with split lines: $size bytes"
+		fail=1
+	fi
+done
+
+if [ "$(seq 1000000001 1000000030)" != "$($CMD -r "$root")" ]; then
+	echo "payload mismatch with split lines"
+	fail=1
+fi
+
+rm -rf "$root"
+
+exit "$fail"
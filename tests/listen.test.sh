@@ -0,0 +1,64 @@
+#!/bin/sh
+
+# -l: один писатель принимает записи от многих производителей через unix-сокет
+
+root=/tmp/___listenTest
+sock=/tmp/___listenTest.sock
+
+rm -rf "$root" "$sock"
+
+fail=0
+
+# производитель: stdin в сокет кусками, которые режут строки
+produce() {
+	perl -MIO::Socket::UNIX -e '
+		my $s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "connect: $!";
+		my $buf;
+		while(sysread(STDIN, $buf, 777)) { syswrite($s, $buf) }
+	' "$sock"
+}
+
+$CMD -s 50000 -t 1 -w -l "$sock" "$root" &
+pid=$!
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ -S "$sock" ] && break
+	sleep 0.1
+done
+
+producers=""
+
+for i in 1 2 3 4 5 6 7 8; do
+	seq $((i * 100000)) $((i * 100000 + 20000)) | produce &
+	producers="$producers $!"
+done
+
+wait $producers
+
+# незаконченная запись отброшенного соединения не должна попасть в поток
+printf 'incomplete' | produce
+
+sleep 0.3
+kill $pid
+wait $pid
+
+if [ -e "$sock" ]; then
+	echo "socket must be removed"
+	fail=1
+fi
+
+if [ "$(ls "$root" | grep -c '\.chunk$')" -lt 2 ]; then
+	echo "producers must share rotated chunks"
+	fail=1
+fi
+
+hash=$(for i in 1 2 3 4 5 6 7 8; do seq $((i * 100000)) $((i * 100000 + 20000)); done | sort | $MD5)
+
+if [ "$($CMD -r "$root" | sort | $MD5)" != "$hash" ]; then
+	echo "data corrupted"
+	fail=1
+fi
+
+rm -rf "$root"
+
+exit "$fail"
@@ -0,0 +1,83 @@
+#!/bin/sh
+
+# -M помечает поток: метки вырезают все читатели, в том числе через брокер,
+# а строки данных, начинающиеся с \036, доходят как были
+
+root=/tmp/___markersTest
+sock=/tmp/___markersTest.sock
+input=/tmp/___markersTest.in
+
+rm -rf "$root" "$root".copy.* "$sock" "$input" "$root".out
+
+fail=0
+
+for i in $(seq 1 2000); do
+	echo "line $i"
+	printf '\036user %d\n' "$i"
+	printf '\036\036double %d\n' "$i"
+	printf '\036%016d\n' "$i"
+done > "$input"
+
+(cat "$input"; sleep 0.3; cat "$input") | $CMD -M 100 -s 50000 -w "$root"
+
+expected=$( (cat "$input"; cat "$input") | $MD5)
+
+if [ ! -e "$root/.markers" ]; then
+	echo "stream is not marked"
+	fail=1
+fi
+
+if ! cat "$root"/*.chunk | grep -q "$(printf '^\036[0-9]\{16\}$')"; then
+	echo "no markers in chunks"
+	fail=1
+fi
+
+for copy in pipe file ring broker; do
+	cp -r "$root" "$root.copy.$copy"
+done
+
+rm -rf "$root"
+
+# в пайп - splice(), в файл - sendfile(): из помеченного потока только через read()
+if [ "$($CMD -r "$root.copy.pipe" | $MD5)" != "$expected" ]; then
+	echo "reader to pipe: markers are not stripped"
+	fail=1
+fi
+
+$CMD -r "$root.copy.file" > "$root.out"
+
+if [ "$($MD5 < "$root.out")" != "$expected" ]; then
+	echo "reader to file: markers are not stripped"
+	fail=1
+fi
+
+if [ "$($CMD -r -u "$root.copy.ring" 2> /dev/null | $MD5)" != "$expected" ]; then
+	echo "io_uring reader: markers are not stripped"
+	fail=1
+fi
+
+$CMD -D "$sock" "$root.copy.broker" &
+pid=$!
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ -S "$sock" ] && break
+	sleep 0.1
+done
+
+if [ "$($CMD -r -D "$sock" | $MD5)" != "$expected" ]; then
+	echo "broker reader: markers are not stripped"
+	fail=1
+fi
+
+wait $pid
+
+for copy in pipe file ring broker; do
+	if [ -e "$root.copy.$copy" ]; then
+		echo "stream must be removed after $copy reader"
+		fail=1
+	fi
+done
+
+rm -rf "$root" "$root".copy.* "$sock" "$input" "$root".out
+
+exit "$fail"
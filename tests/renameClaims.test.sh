@@ -0,0 +1,63 @@
+#!/bin/sh
+
+# -R: захват переименованием, захват убитого читателя подбирают другие
+
+root=/tmp/___renameClaimsTest
+fifo=/tmp/___renameClaimsTest.fifo
+
+rm -rf "$root" "$fifo" "$root".out*
+mkfifo "$fifo"
+
+fail=0
+
+seq 1 200000 | $CMD -s 10000 -w "$root"
+
+$CMD -R -r "$root" > "$root.out1" &
+$CMD -R -r "$root" > "$root.out2" &
+wait
+
+if [ "$(sort -n "$root.out1" "$root.out2" | $MD5)" != "$(seq 1 200000 | $MD5)" ]; then
+	echo "parallel readers: data corrupted"
+	fail=1
+fi
+
+# читатель застревает на записи в пайп с захваченным чанком и умирает
+{ seq 1 1000000; sleep 2; } | $CMD -s 100000000 -t 100 -w "$root" &
+writer=$!
+sleep 0.3
+
+{ sleep 1.5; cat; } < "$fifo" > "$root.out1" &
+consumer=$!
+
+$CMD -R -r -c 10000 "$root" > "$fifo" &
+reader=$!
+
+sleep 0.5
+
+if [ -z "$(ls "$root" | grep '\.claimed\.chunk$')" ]; then
+	echo "chunk is not renamed on claim"
+	fail=1
+fi
+
+kill -9 "$reader"
+wait "$consumer"
+wait "$writer"
+
+offset=$(cat "$root"/*.claimed.chunk.offset 2> /dev/null)
+offset=$(expr "$offset" + 0)
+
+$CMD -R -r "$root" > "$root.out2"
+
+if [ "$({ head -c "$offset" "$root.out1"; cat "$root.out2"; } | $MD5)" != "$(seq 1 1000000 | $MD5)" ]; then
+	echo "recovered claim: data corrupted"
+	fail=1
+fi
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+rm -f "$fifo" "$root".out*
+
+exit "$fail"
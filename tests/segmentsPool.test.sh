@@ -0,0 +1,62 @@
+#!/bin/sh
+
+# сегменты одного чанка дочитываются одновременно, а писатель тут же берёт файлы из пула:
+# в пул чанк переносит только один из читателей, и новый чанк писателя никто не обрезает
+
+root=/tmp/___segmentsPoolTest
+tmp=/tmp/___segmentsPoolTest.tmp
+
+rm -rf "$root" "$tmp"
+mkdir "$tmp"
+
+fail=0
+
+seq 1 4000000 > "$tmp/payload" # ~30MiB
+split -l 400000 "$tmp/payload" "$tmp/part."
+
+# чанки по ~8MiB - несколько сегментов. Первая половина дописана до прихода читателей,
+# остальное писатель пишет в файлы из пула, пока читатели дочитывают сегменты
+(cat "$tmp"/part.a[a-e]; for part in "$tmp"/part.a[f-z]; do sleep 0.8; cat "$part"; done) | $CMD -v -s 8000000 -w "$root" 2> "$tmp/writer.err" &
+writer=$!
+
+sleep 0.5
+
+readers=""
+
+for i in 1 2 3 4; do
+	# медленные читатели: пока один дочитывает чанк, другие успевают взять его сегменты
+	($CMD -v -W -r "$root" 2> "$tmp/err.$i" | cstream -t 5000000 > "$tmp/out.$i") &
+	readers="$readers $!"
+done
+
+wait $writer
+wait $readers
+
+if [ -e "$root" ]; then
+	echo "stream is not fully read"
+	ls -a "$root"
+	fail=1
+fi
+
+if grep -h ERROR "$tmp"/err.* "$tmp/writer.err"; then
+	fail=1
+fi
+
+if ! cat "$tmp"/err.* | awk '$1 == "segments_stolen" && $2 > 0 { found = 1 } END { exit !found }'; then
+	echo "no segments were stolen"
+	fail=1
+fi
+
+if ! awk '$1 == "chunks_from_pool" && $2 > 0 { found = 1 } END { exit !found }' "$tmp/writer.err"; then
+	echo "writer did not reuse pooled chunks"
+	fail=1
+fi
+
+if ! sort -n "$tmp"/out.* | cmp -s - "$tmp/payload"; then
+	echo "payload mismatch: $(cat "$tmp"/out.* | wc -l | awk '{print $1}') lines of 4000000"
+	fail=1
+fi
+
+rm -rf "$tmp"
+
+exit "$fail"
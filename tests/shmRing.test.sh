@@ -0,0 +1,41 @@
+#!/bin/sh
+
+# поток через кольцо в разделяемой памяти: два писателя, три читателя
+
+root=/tmp/___shmRingTest
+tmp=/tmp/___shmRingTest.tmp
+
+rm -rf "$root" "$tmp"
+mkdir "$tmp"
+
+fail=0
+
+seq 1 500000 > "$tmp/payload"
+split -l 250000 "$tmp/payload" "$tmp/part."
+
+# писатели не уходят, пока не подключатся читатели
+(cat "$tmp/part.aa"; sleep 1) | $CMD -m -w "$root" &
+(cat "$tmp/part.ab"; sleep 1) | $CMD -m -w "$root" &
+
+sleep 0.3
+
+for i in 1 2 3; do
+	$CMD -m -r "$root" > "$tmp/out.$i" &
+done
+
+wait
+
+if [ -e "$root" ]; then
+	echo "stream is not removed"
+	ls -a "$root"
+	fail=1
+fi
+
+if ! sort -n "$tmp"/out.* | cmp -s - "$tmp/payload"; then
+	echo "payload mismatch"
+	fail=1
+fi
+
+rm -rf "$tmp"
+
+exit "$fail"
@@ -0,0 +1,57 @@
+#!/bin/sh
+
+# -v/-X: счётчики при выходе, файл .stats.<pid> пока процесс работает
+
+root=/tmp/___statsTest
+err=/tmp/___statsTest.err
+
+rm -rf "$root" "$err"
+
+fail=0
+
+expect() {
+	if ! grep -q "$1" "$err"; then
+		echo "'$1' not found in:"
+		cat "$err"
+		fail=1
+	fi
+}
+
+# 10 строк по 100 байт, чанки по 300 байт: 3 переполнения по размеру
+yes "$(printf '%099d' 0)" | head -n 10 | $CMD -s 300 -v -w "$root" 2> "$err"
+
+expect '^chunks_created 4$'
+expect '^rotations_size 3$'
+expect '^bytes_written 1000$'
+expect '^chunk_lines count=3 sum=9 '
+
+(echo 1; sleep 1.5) | $CMD -X -w "$root" &
+
+sleep 1
+
+if ! grep -q '^bytes_written 2$' "$root"/.stats.*; then
+	echo "published stats file not found"
+	ls -a "$root"
+	fail=1
+fi
+
+wait
+
+if ls -a "$root" | grep -q '^\.stats\.'; then
+	echo "stats file must be removed at exit"
+	fail=1
+fi
+
+$CMD -r -v "$root" > /dev/null 2> "$err"
+
+expect '^chunks_read 5$'
+expect '^bytes_read 1002$'
+
+if [ -e "$root" ]; then
+	echo "stream must be removed"
+	fail=1
+fi
+
+rm -f "$err"
+
+exit "$fail"
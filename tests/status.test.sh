@@ -0,0 +1,44 @@
+#!/bin/sh
+
+# pit -S: backlog и писатели видны снаружи, после чтения поток пропадает
+
+root=/tmp/___statusTest
+
+rm -rf "$root"
+
+fail=0
+
+# 10 строк по 100 байт, чанки по 300 байт
+(yes "$(printf '%099d' 0)" | head -n 10; sleep 1) | $CMD -s 300 -w "$root" &
+
+sleep 0.5
+
+status=$($CMD -S -j "$root")
+
+for field in '"writers":1' '"chunks":4' '"backlog_bytes":1000' '"exists":true'; do
+	case "$status" in
+		*"$field"*)
+		;;
+		*)
+			echo "'$field' not found in: $status"
+			fail=1
+		;;
+	esac
+done
+
+if ! $CMD -S "$root" | grep -q '^backlog: *1000 bytes$'; then
+	echo "text status is broken:"
+	$CMD -S "$root"
+	fail=1
+fi
+
+wait
+
+$CMD -r "$root" > /dev/null
+
+if $CMD -S "$root" > /dev/null; then
+	echo "status of removed stream must fail"
+	fail=1
+fi
+
+exit "$fail"
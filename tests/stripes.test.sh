@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# поток на нескольких каталогах: чанки в страйпах, в корне симлинки на них
+
+root=/tmp/___stripesTest
+stripe1=/tmp/___stripesTest1
+stripe2=/tmp/___stripesTest2
+
+rm -rf "$root" "$stripe1" "$stripe2"
+
+fail=0
+hash=$(seq 1 100000 | $MD5)
+
+for policy in rr free; do
+	seq 1 100000 | $CMD -s 10000 -z $policy -w "$root" "$stripe1" "$stripe2"
+
+	for stripe in "$stripe1" "$stripe2"; do
+		if [ -z "$(ls "$stripe")" ]; then
+			echo "$policy: no chunks in stripe $stripe"
+			fail=1
+		fi
+
+		for chunk in "$stripe"/*.chunk; do
+			if [ ! -L "$root/${chunk##*/}" ] || [ ! "$root/${chunk##*/}" -ef "$chunk" ]; then
+				echo "$policy: no link to $chunk in stream root"
+				fail=1
+				break
+			fi
+		done
+	done
+
+	if [ "$($CMD -r "$root" | $MD5)" != "$hash" ]; then
+		echo "$policy: data corrupted"
+		fail=1
+	fi
+
+	if [ -e "$root" ] || [ -e "$stripe1" ] || [ -e "$stripe2" ]; then
+		echo "$policy: stream and stripes must be removed"
+		fail=1
+	fi
+done
+
+exit "$fail"